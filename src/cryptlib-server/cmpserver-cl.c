@@ -83,6 +83,12 @@
 #include <stdlib.h>
 
 #include <getopt.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
 
 /* set by CLA */
 static int verbose_flag;
@@ -96,6 +102,7 @@ static int opt_actionSet=0;
 static int opt_doCreateCert=0;
 static int opt_doCreateUser=0;
 static int opt_doRunDeamon=0;
+static int opt_workers=MY_CA_WORKERS;
 
 static char* opt_commonname=NULL;
 static char* opt_country=NULL;
@@ -325,56 +332,203 @@ int createPKIuser (const CRYPT_KEYSET *myCertStore_p,
 	return status;
 }
 
+/* ##########################################################################
+ * State shared between the listener and the worker threads of the daemon.
+ *
+ * The CA's private key context and the cert store are opened once and handed
+ * to every session; cryptlib does its own object locking, so the workers can
+ * use them concurrently. Accepted sockets are put into a ring buffer from
+ * which idle workers take them.
+ * ########################################################################## */
+typedef struct {
+	CRYPT_KEYSET certStore;
+	CRYPT_CONTEXT privKey;
+
+	int *fds;
+	int size;
+	int head;
+	int count;
+	pthread_mutex_t lock;
+	pthread_cond_t notEmpty;
+	pthread_cond_t notFull;
+} CMP_SERVER_POOL;
+
 /* ########################################################################## */
 /* ########################################################################## */
-int startCMPServer ( CRYPT_KEYSET *myCertStore_p,
-		     CRYPT_KEYSET *myKeyset_p,
-		     const char *serverName,
-		     const int serverPort
-		) {
-	int status;
-	CRYPT_SESSION myCryptSession;
-	CRYPT_CONTEXT myPrivKey;
+static void poolPutSocket( CMP_SERVER_POOL *pool, int fd) {
+	pthread_mutex_lock( &pool->lock);
+	while (pool->count == pool->size)
+		pthread_cond_wait( &pool->notFull, &pool->lock);
+	pool->fds[(pool->head + pool->count) % pool->size] = fd;
+	pool->count++;
+	pthread_cond_signal( &pool->notEmpty);
+	pthread_mutex_unlock( &pool->lock);
+}
 
-	printf("INFO: Starting CMP Server, serverName=%s, serverPort=%d\n", serverName, serverPort);
+/* ########################################################################## */
+/* ########################################################################## */
+static int poolGetSocket( CMP_SERVER_POOL *pool) {
+	int fd;
+
+	pthread_mutex_lock( &pool->lock);
+	while (pool->count == 0)
+		pthread_cond_wait( &pool->notEmpty, &pool->lock);
+	fd = pool->fds[pool->head];
+	pool->head = (pool->head + 1) % pool->size;
+	pool->count--;
+	pthread_cond_signal( &pool->notFull);
+	pthread_mutex_unlock( &pool->lock);
+
+	return fd;
+}
 
-	/* get the private Key from the Keyset */
-	status = cryptGetPrivateKey( *myKeyset_p, &myPrivKey, CRYPT_KEYID_NAME, MY_CA_KEY_LABEL, MY_CA_KEYSET_PASSWORD );
-	STAT(get the private Key);
+/* ########################################################################## */
+/* serves one CMP transaction on an already accepted socket                    */
+/* ########################################################################## */
+int serveCMPClient ( CMP_SERVER_POOL *pool, int fd) {
+	int status;
+	CRYPT_SESSION myCryptSession;
 
 	/* Create the session */
 	status = cryptCreateSession( &myCryptSession, CRYPT_UNUSED, CRYPT_SESSION_CMP_SERVER );
 	STAT(create CMP Server);
+	if( status != CRYPT_OK) return status;
 
-	/* Add the CA certificate store and CA server key and activate session */
-	status = cryptSetAttribute( myCryptSession, CRYPT_SESSINFO_KEYSET, *myCertStore_p );
+	/* Add the CA certificate store and CA server key */
+	status = cryptSetAttribute( myCryptSession, CRYPT_SESSINFO_KEYSET, pool->certStore );
 	STAT(set attribute for certStore);
-
-	/* Add the private Key */
-	status = cryptSetAttribute( myCryptSession, CRYPT_SESSINFO_PRIVATEKEY, myPrivKey);
+	status = cryptSetAttribute( myCryptSession, CRYPT_SESSINFO_PRIVATEKEY, pool->privKey);
 	STAT(set attribute for private Key);
 
-	/* Address of the CMP Server */
-	status = cryptSetAttributeString( myCryptSession, CRYPT_SESSINFO_SERVER_NAME, serverName, strlen(serverName) );
-	STAT(set attribute for server Address);
-	status = cryptSetAttribute( myCryptSession, CRYPT_SESSINFO_SERVER_PORT, serverPort );
-	STAT(set attribute for server Port);
+	/* the listener already accepted the connection */
+	status = cryptSetAttribute( myCryptSession, CRYPT_SESSINFO_NETWORKSOCKET, fd );
+	STAT(set attribute for network socket);
 
 	/* START the CMP Server */
 	status = cryptSetAttribute( myCryptSession, CRYPT_SESSINFO_ACTIVE, 1 );
 	STAT(set attribute CMP session active);
+	if( status != CRYPT_OK)
+		printErrorString( status, myCryptSession);
 
-	/* XXX */
-	printErrorString( status, myCryptSession);
-
-	/* clean up */
-	status = cryptDestroyContext( myPrivKey);
-	STAT(destroy private Key);
-	status = cryptDestroySession( myCryptSession);
-	STAT(destroy session);
+	/* clean up, cryptlib does not close sockets it was given */
+	cryptDestroySession( myCryptSession);
+	close( fd);
 	return status;
 }
 
+/* ########################################################################## */
+/* ########################################################################## */
+static void *cmpWorker( void *arg) {
+	CMP_SERVER_POOL *pool = (CMP_SERVER_POOL*) arg;
+
+	while (1)
+		serveCMPClient( pool, poolGetSocket( pool));
+
+	return NULL;
+}
+
+/* ########################################################################## */
+/* ########################################################################## */
+static int openListenSocket( const char *serverName, const int serverPort) {
+	struct addrinfo hints, *res, *ai;
+	char port[16];
+	int fd = -1, on = 1, err;
+
+	memset( &hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE;
+	snprintf( port, sizeof(port), "%d", serverPort);
+
+	if( (err = getaddrinfo( serverName, port, &hints, &res)) != 0) {
+		fprintf( stderr, "ERROR: cannot resolve %s: %s\n", serverName, gai_strerror(err));
+		return -1;
+	}
+
+	for (ai = res; ai; ai = ai->ai_next) {
+		if( (fd = socket( ai->ai_family, ai->ai_socktype, ai->ai_protocol)) < 0)
+			continue;
+		setsockopt( fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+		if( bind( fd, ai->ai_addr, ai->ai_addrlen) == 0 && listen( fd, MY_CA_LISTEN_BACKLOG) == 0)
+			break;
+		close( fd);
+		fd = -1;
+	}
+	freeaddrinfo( res);
+
+	if( fd < 0)
+		perror("ERROR: cannot listen");
+	return fd;
+}
+
+/* ########################################################################## */
+/* runs the listener and a pool of workers, each serving one client at a time */
+/* ########################################################################## */
+int startCMPServer ( CRYPT_KEYSET *myCertStore_p,
+		     CRYPT_KEYSET *myKeyset_p,
+		     const char *serverName,
+		     const int serverPort,
+		     const int workers
+		) {
+	int status, i, listenFd, fd;
+	CMP_SERVER_POOL pool;
+	pthread_t thread;
+
+	printf("INFO: Starting CMP Server, serverName=%s, serverPort=%d, workers=%d\n", serverName, serverPort, workers);
+
+	memset( &pool, 0, sizeof(pool));
+	pool.certStore = *myCertStore_p;
+
+	/* get the private Key from the Keyset once for all sessions */
+	status = cryptGetPrivateKey( *myKeyset_p, &pool.privKey, CRYPT_KEYID_NAME, MY_CA_KEY_LABEL, MY_CA_KEYSET_PASSWORD );
+	STAT(get the private Key);
+	if( status != CRYPT_OK) return status;
+
+	if( (listenFd = openListenSocket( serverName, serverPort)) < 0) {
+		cryptDestroyContext( pool.privKey);
+		return CRYPT_ERROR_OPEN;
+	}
+
+	/* a client dropping the connection must not kill the daemon */
+	signal( SIGPIPE, SIG_IGN);
+
+	pool.size = workers * 4;
+	if( !(pool.fds = (int*) malloc( pool.size * sizeof(int)))) {
+		fprintf( stderr, "ERROR: cannot allocate the connection queue\n");
+		close( listenFd);
+		cryptDestroyContext( pool.privKey);
+		return CRYPT_ERROR_MEMORY;
+	}
+	pthread_mutex_init( &pool.lock, NULL);
+	pthread_cond_init( &pool.notEmpty, NULL);
+	pthread_cond_init( &pool.notFull, NULL);
+
+	for (i = 0; i < workers; i++) {
+		if( pthread_create( &thread, NULL, cmpWorker, &pool) != 0) {
+			fprintf( stderr, "ERROR: cannot start worker %d\n", i);
+			break;
+		}
+		pthread_detach( thread);
+	}
+	if( i == 0) {
+		close( listenFd);
+		free( pool.fds);
+		cryptDestroyContext( pool.privKey);
+		return CRYPT_ERROR_MEMORY;
+	}
+
+	while (1) {
+		if( (fd = accept( listenFd, NULL, NULL)) < 0) {
+			perror("WARNING: accept");
+			continue;
+		}
+		poolPutSocket( &pool, fd);
+	}
+
+	/* not reached, the workers never return */
+	return CRYPT_OK;
+}
+
 /* ############################################################################ */
 /* ############################################################################ */
 void printUsage( const char* cmdName) {
@@ -399,6 +553,8 @@ void printUsage( const char* cmdName) {
 	printf(" --commonname NAME  the \"commonname\" to set for the CA cert or PKI user\n");
 	printf(" --key FILE         location of the CA's key storage\n");
 	printf("                    this is overwritten at CREATECERT\n");
+	printf(" --workers NUM      number of clients served in parallel at DAEMON\n");
+	printf("                    default is %d\n", MY_CA_WORKERS);
 	printf("\n");
 	printf("Other options are:\n");
 	printf(" --verbose  ignored so far\n");
@@ -432,12 +588,13 @@ void parseCLA( int argc, char **argv) {
 		{"help",         no_argument,       0, 'j'},
 		{"daemon",       no_argument,       0, 'k'},
 		{"server",       required_argument, 0, 'l'},
+		{"workers",      required_argument, 0, 'm'},
 		{0, 0, 0, 0}
 	};
 
 	while (1)
 	{
-		c = getopt_long (argc, argv, "a:bcd:e:f:g:h:i:jkl:", long_options, &option_index);
+		c = getopt_long (argc, argv, "a:bcd:e:f:g:h:i:jkl:m:", long_options, &option_index);
 
 		/* Detect the end of the options. */
 		if (c == -1)
@@ -528,6 +685,13 @@ void parseCLA( int argc, char **argv) {
 				opt_serverName = (char*) malloc(strlen(optarg)+1);
 				strcpy(opt_serverName, optarg);
 				break;
+			case 'm':
+				opt_workers = atoi(optarg);
+				if( opt_workers <= 0) {
+					fprintf( stderr, "ERROR: --workers must be at least 1\n");
+					exit(1);
+				}
+				break;
 			case '?':
 				/* getopt_long already printed an error message. */
 				break;
@@ -624,9 +788,7 @@ int main (int argc, char **argv) {
 		status = cryptKeysetOpen( &myKeyset, CRYPT_UNUSED, CRYPT_KEYSET_FILE, opt_caKeyFile, CRYPT_KEYOPT_READONLY );
 		STAT(open keyset);
 
-		while (1) {
-			startCMPServer( &myCertStore, &myKeyset, opt_serverName, opt_serverPort);
-		}
+		startCMPServer( &myCertStore, &myKeyset, opt_serverName, opt_serverPort, opt_workers);
 
 		status = cryptKeysetClose( myCertStore);
 		STAT(close certstore);
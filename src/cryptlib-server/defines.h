@@ -44,6 +44,8 @@
 /* SERVER */
 #define MY_CA_KEYSET_PASSWORD "password"
 #define MY_CA_KEY_LABEL "CA Key Label"
+#define MY_CA_WORKERS 8		/* default number of worker threads in daemon mode */
+#define MY_CA_LISTEN_BACKLOG 64	/* pending connections the kernel may queue */
 
 /* CLIENT */
 #define MY_CL_PRIVKEY_PASSWORD "verySecure"
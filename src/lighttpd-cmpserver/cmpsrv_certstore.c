@@ -8,6 +8,8 @@
 
 #include "sqlite3.h"
 
+#include <unistd.h>
+
 
 static IMPLEMENT_ASN1_DUP_FUNCTION(X509_PUBKEY)
 
@@ -28,9 +30,18 @@ X509 *cert_create(cmpsrv_ctx *ctx, CRMF_CERTTEMPLATE *tpl)
   cert->cert_info->key = X509_PUBKEY_dup(tpl->publicKey);
   // X509_set_pubkey(cert, tpl->publicKey->pkey);
 
+  /* clients put it into senderKID, see find_sender_key() */
+  X509V3_CTX v3;
+  X509V3_set_ctx(&v3, NULL, cert, NULL, NULL, 0);
+  X509_EXTENSION *skid = X509V3_EXT_conf_nid(NULL, &v3, NID_subject_key_identifier, "hash");
+  if (skid) {
+    X509_add_ext(cert, skid, -1);
+    X509_EXTENSION_free(skid);
+  }
+
   X509_ALGOR_set0(cert->sig_alg, OBJ_nid2obj(NID_sha1WithRSAEncryption), V_ASN1_NULL, NULL);
   const EVP_MD *md = EVP_get_digestbynid(NID_sha1WithRSAEncryption);
-  X509_sign(cert, ctx->caKey, md);
+  X509_sign(cert, ctx->ca->caKey, md);
 
   return cert;
 }
@@ -55,127 +66,728 @@ static int get_name_digest(X509_NAME *name, char **digest, unsigned int *len)
   return 1;
 }
 
-sqlite3 *open_db(cmpsrv_ctx *ctx)
+/* hex encodes a subjectKeyIdentifier for the kid column */
+static char *get_kid_hex(const ASN1_OCTET_STRING *kid)
 {
-  sqlite3 *db = NULL;
-  char dbfile[1024];
-  sprintf(dbfile, "%s/certs.db", ctx->certPath);
-  int rc = sqlite3_open(dbfile, &db);
-  if (rc != SQLITE_OK) return NULL;
-  return db;
+  char *hex = calloc(1, kid->length*2 + 1);
+  if (!hex) return NULL;
+  for (int i = 0; i < kid->length; i++)
+    sprintf(&hex[2*i], "%02X", kid->data[i]);
+  return hex;
 }
 
-X509 *cert_find_by_name(cmpsrv_ctx *ctx, X509_NAME *name)
+/* ############################################################################ *
+ * Certificate database
+ *
+ * Each worker process keeps one connection to certs.db open, with all
+ * statements prepared once. The database runs in WAL mode so that readers
+ * in other workers are not blocked by a writer. A connection inherited over
+ * fork() is never used; the first call in a new process opens its own.
+ * ############################################################################ */
+
+enum {
+  STMT_FIND_SERIAL,
+  STMT_FIND_NAME,
+  STMT_FIND_KID_NAME,
+  STMT_FIND_ISSUER_SERIAL,
+  STMT_CURRENT,
+  STMT_INSERT,
+  STMT_DELETE,
+  STMT_DELETE_ISSUER_SERIAL,
+  STMT_REVOKE,
+  STMT_REVOKED_SINCE,
+  STMT_TXN_FIND,
+  STMT_TXN_CLEAR,
+  STMT_TXN_INSERT,
+  STMT_TXN_UPDATE,
+  STMT_TXN_DELETE,
+  STMT_TXN_EXPIRE,
+  STMT_BEGIN,
+  STMT_COMMIT,
+  STMT_ROLLBACK,
+  STMT_LAST
+};
+
+static const char *stmt_sql[STMT_LAST] = {
+  "select cert from certs where serial = ?",
+  /* at most two rows are needed to tell that a lookup is ambiguous */
+  "select cert from certs where name = ? limit 2",
+  "select cert from certs where kid = ? and name = ? limit 2",
+  "select cert from certs where issuer = ? and serial = ?",
+  "select 1 from certs where serial = ? and serial not in (select serial from revoked)",
+  "insert into certs (serial, name, cert, issuer, kid) values (?, ?, ?, ?, ?)",
+  "delete from certs where serial = ?",
+  /* rows stored before the issuer column existed have none */
+  "delete from certs where serial = ? and (issuer = ? or issuer is null)",
+  "insert or replace into revoked (serial, revoked, reason) values (?, ?, ?)",
+  "select rowid, serial, revoked, reason from revoked where rowid > ? order by rowid",
+  "select state, bodyType, readyAt, senderNonce, recipNonce, senderKey, certs, reqIds from txns where tid = ? and expires > ?",
+  /* only a transaction that is still open or has expired may be replaced */
+  "delete from txns where tid = ? and (state = 0 or expires <= ?)",
+  "insert or ignore into txns (tid, state, bodyType, expires) values (?, 0, 0, ?)",
+  /* fails if another worker has moved the transaction on meanwhile */
+  "update txns set state = ?, bodyType = ?, readyAt = ?, expires = ?, senderNonce = ?, recipNonce = ?, senderKey = ?, certs = ?, reqIds = ? where tid = ? and state = ?",
+  "delete from txns where tid = ?",
+  "delete from txns where expires <= ?",
+  "begin immediate",
+  "commit",
+  "rollback",
+};
+
+struct cmpsrv_certstore {
+  char *dbfile;
+  pid_t pid;
+  sqlite3 *db;
+  sqlite3_stmt *stmt[STMT_LAST];
+};
+
+/* creates the table and indexes if they do not exist yet */
+static int create_schema(sqlite3 *db)
 {
-  UNUSED(ctx);
-  UNUSED(name);
-  //TODO implement ?
+  sqlite3_exec(db, "create table if not exists certs (serial int not null primary key, name varchar not null, cert blob not null, issuer varchar);", 0, 0, 0);
+  /* databases created before the issuer and kid columns existed */
+  sqlite3_exec(db, "alter table certs add column issuer varchar;", 0, 0, 0);
+  sqlite3_exec(db, "alter table certs add column kid varchar;", 0, 0, 0);
+
+  /* revoked certificates for the CRLs, see cmpsrv_crl.c; rowid grows with
+   * every revocation so that workers can pick up the new ones */
+  if (sqlite3_exec(db, "create table if not exists revoked (serial int not null primary key, revoked int not null, reason int);", 0, 0, 0) != SQLITE_OK)
+    return 0;
 
-  // char *nameDigest;
-  // unsigned int mdlen;
-  // get_name_digest(X509_get_subject_name(cert), &nameDigest, &mdlen);
-  return NULL;
+  /* open CMP transactions, see cmpsrv_txn.c; certs holds the DER of the
+   * issued certificates one after the other, reqIds their certReqIds */
+  if (sqlite3_exec(db, "create table if not exists txns (tid blob not null primary key, state int not null, bodyType int not null, readyAt int, expires int not null, senderNonce blob, recipNonce blob, senderKey blob, certs blob, reqIds varchar);", 0, 0, 0) != SQLITE_OK)
+    return 0;
+
+  if (sqlite3_exec(db, "create index if not exists certs_name on certs (name);", 0, 0, 0) != SQLITE_OK)
+    return 0;
+  if (sqlite3_exec(db, "create index if not exists certs_issuer_serial on certs (issuer, serial);", 0, 0, 0) != SQLITE_OK)
+    return 0;
+  if (sqlite3_exec(db, "create index if not exists certs_kid on certs (kid);", 0, 0, 0) != SQLITE_OK)
+    return 0;
+  if (sqlite3_exec(db, "create index if not exists txns_expires on txns (expires);", 0, 0, 0) != SQLITE_OK)
+    return 0;
+  return 1;
 }
 
-X509 *cert_find_by_serial(cmpsrv_ctx *ctx, int serialNo)
+static void store_close(cmpsrv_certstore *store)
+{
+  for (int i = 0; i < STMT_LAST; i++) {
+    if (store->stmt[i]) sqlite3_finalize(store->stmt[i]);
+    store->stmt[i] = NULL;
+  }
+  if (store->db) sqlite3_close(store->db);
+  store->db = NULL;
+}
+
+static int store_open(cmpsrv_certstore *store)
+{
+  if (store->db && store->pid == getpid())
+    return 1;
+
+  if (store->db) {
+    /* inherited from the parent process, must not be touched here */
+    memset(store->stmt, 0, sizeof(store->stmt));
+    store->db = NULL;
+  }
+
+  if (sqlite3_open(store->dbfile, &store->db) != SQLITE_OK)
+    goto err;
+  store->pid = getpid();
+
+  sqlite3_busy_timeout(store->db, 5000);
+  sqlite3_exec(store->db, "pragma journal_mode=WAL;", 0, 0, 0);
+  sqlite3_exec(store->db, "pragma synchronous=NORMAL;", 0, 0, 0);
+
+  if (!create_schema(store->db)) goto err;
+
+  for (int i = 0; i < STMT_LAST; i++)
+    if (sqlite3_prepare_v2(store->db, stmt_sql[i], -1, &store->stmt[i], NULL) != SQLITE_OK)
+      goto err;
+
+  return 1;
+
+err:
+  store_close(store);
+  return 0;
+}
+
+/* returns the prepared statement, reset and ready for binding */
+static sqlite3_stmt *store_stmt(cmpsrv_certstore *store, int idx)
+{
+  if (!store || !store_open(store)) return NULL;
+
+  sqlite3_stmt *q = store->stmt[idx];
+  sqlite3_reset(q);
+  sqlite3_clear_bindings(q);
+  return q;
+}
+
+static int store_exec(cmpsrv_certstore *store, int idx)
+{
+  sqlite3_stmt *q = store_stmt(store, idx);
+  if (!q) return SQLITE_ERROR;
+
+  int rc = sqlite3_step(q);
+  sqlite3_reset(q);
+  return rc == SQLITE_DONE ? SQLITE_OK : rc;
+}
+
+cmpsrv_certstore *certstore_new(const char *certPath)
+{
+  cmpsrv_certstore *store = calloc(1, sizeof(cmpsrv_certstore));
+  if (!store) return NULL;
+
+  store->dbfile = malloc(strlen(certPath) + sizeof("/certs.db"));
+  if (!store->dbfile) {
+    free(store);
+    return NULL;
+  }
+  sprintf(store->dbfile, "%s/certs.db", certPath);
+
+  /* check that the database can be used, then close it again so that forked
+   * workers open their own connection */
+  if (!store_open(store)) {
+    certstore_free(store);
+    return NULL;
+  }
+  store_close(store);
+
+  return store;
+}
+
+void certstore_free(cmpsrv_certstore *store)
+{
+  if (!store) return;
+  if (store->pid == getpid()) store_close(store);
+  free(store->dbfile);
+  free(store);
+}
+
+/* runs the query and returns the first certificate found */
+static X509 *find_cert(sqlite3_stmt *q)
 {
   X509 *cert = NULL;
-  sqlite3 *db = open_db(ctx);
-  if (!db) return NULL;
 
-  const char *select_sql = "select cert from certs where serial = ?";
-  sqlite3_stmt *q;
-  int rc;
+  if (sqlite3_step(q) == SQLITE_ROW) {
+    const unsigned char *p = sqlite3_column_blob(q, 0);
+    int len = sqlite3_column_bytes(q, 0);
+    cert = d2i_X509(NULL, &p, len);
+    dbgprintf("cert = %08x", cert);
+  }
+  sqlite3_reset(q);
 
-  rc = sqlite3_prepare(db, select_sql, -1, &q, NULL);
-  if (rc != SQLITE_OK) return NULL; //TODO report error
+  return cert;
+}
 
-  rc = sqlite3_bind_int(q, 1, serialNo);
-  if (rc != SQLITE_OK) return NULL; //TODO report error
-
-  while (1) {
-    int s = sqlite3_step(q);
-    if (s == SQLITE_ROW) {
-      const unsigned char *derCert = sqlite3_column_blob(q, 0);
-      const unsigned char *p = derCert;
-      int len = sqlite3_column_bytes(q, 0);
-      cert = d2i_X509(NULL, &p, len);
-      dbgprintf("cert = %08x", cert);
-    }
-    else if (s == SQLITE_DONE)
-      break;
-    else  {
-      //TODO report error
+/* runs the query and returns the certificate found if there is exactly one */
+static X509 *find_unique_cert(sqlite3_stmt *q)
+{
+  X509 *cert = NULL;
+
+  if (sqlite3_step(q) == SQLITE_ROW) {
+    const unsigned char *p = sqlite3_column_blob(q, 0);
+    int len = sqlite3_column_bytes(q, 0);
+    /* the blob is only valid until the next step */
+    cert = d2i_X509(NULL, &p, len);
+    if (sqlite3_step(q) != SQLITE_DONE) {
+      X509_free(cert);
+      cert = NULL;
     }
   }
+  sqlite3_reset(q);
+
+  return cert;
+}
+
+/* returns the only certificate issued to name, NULL if there is none or
+ * more than one. Since a subject may hold several certificates, this is
+ * only for certificates without subjectKeyIdentifier */
+X509 *cert_find_by_name(cmpsrv_ctx *ctx, X509_NAME *name)
+{
+  sqlite3_stmt *q = store_stmt(ctx->store, STMT_FIND_NAME);
+  if (!q) return NULL;
+
+  char *nameDigest;
+  unsigned int mdlen;
+  if (!get_name_digest(name, &nameDigest, &mdlen)) return NULL;
+
+  X509 *cert = NULL;
+  if (sqlite3_bind_text(q, 1, nameDigest, mdlen*2, SQLITE_STATIC) == SQLITE_OK)
+    cert = find_unique_cert(q);
+
+  free(nameDigest);
+  return cert;
+}
+
+/* returns the only certificate issued to name with the subjectKeyIdentifier
+ * kid, NULL if there is none or more than one */
+X509 *cert_find_by_kid(cmpsrv_ctx *ctx, const ASN1_OCTET_STRING *kid, X509_NAME *name)
+{
+  sqlite3_stmt *q = store_stmt(ctx->store, STMT_FIND_KID_NAME);
+  if (!q) return NULL;
+
+  char *kidHex = get_kid_hex(kid), *nameDigest = NULL;
+  unsigned int mdlen;
+  X509 *cert = NULL;
+  if (kidHex && get_name_digest(name, &nameDigest, &mdlen)
+      && sqlite3_bind_text(q, 1, kidHex, -1, SQLITE_STATIC) == SQLITE_OK
+      && sqlite3_bind_text(q, 2, nameDigest, mdlen*2, SQLITE_STATIC) == SQLITE_OK)
+    cert = find_unique_cert(q);
 
-  sqlite3_close(db);
+  sqlite3_reset(q);
+  free(kidHex);
+  free(nameDigest);
+  return cert;
+}
+
+/* returns 1 if the certificate with the serial is still in the database and
+ * was not revoked, i.e. neither replaced by a kur nor revoked by an rr in
+ * any worker */
+int cert_is_current(cmpsrv_ctx *ctx, long serialNo)
+{
+  sqlite3_stmt *q = store_stmt(ctx->store, STMT_CURRENT);
+  if (!q || sqlite3_bind_int(q, 1, serialNo) != SQLITE_OK) return 0;
+
+  int current = sqlite3_step(q) == SQLITE_ROW;
+  sqlite3_reset(q);
+  return current;
+}
+
+X509 *cert_find_by_serial(cmpsrv_ctx *ctx, int serialNo)
+{
+  sqlite3_stmt *q = store_stmt(ctx->store, STMT_FIND_SERIAL);
+  if (!q) return NULL;
+
+  if (sqlite3_bind_int(q, 1, serialNo) != SQLITE_OK) return NULL;
+
+  return find_cert(q);
+}
+
+X509 *cert_find_by_issuer_serial(cmpsrv_ctx *ctx, X509_NAME *issuer, int serialNo)
+{
+  sqlite3_stmt *q = store_stmt(ctx->store, STMT_FIND_ISSUER_SERIAL);
+  if (!q) return NULL;
+
+  char *issuerDigest;
+  unsigned int mdlen;
+  if (!get_name_digest(issuer, &issuerDigest, &mdlen)) return NULL;
+
+  X509 *cert = NULL;
+  if (sqlite3_bind_text(q, 1, issuerDigest, mdlen*2, SQLITE_STATIC) == SQLITE_OK
+      && sqlite3_bind_int(q, 2, serialNo) == SQLITE_OK)
+    cert = find_cert(q);
+
+  free(issuerDigest);
   return cert;
 }
 
 int cert_remove(cmpsrv_ctx *ctx, int serialNo)
 {
-  const char *sql = "delete from certs where serial = ?";
-  sqlite3 *db = open_db(ctx);
-  sqlite3_stmt *q;
+  sqlite3_stmt *q = store_stmt(ctx->store, STMT_DELETE);
   int rc;
 
-  rc = sqlite3_prepare(db, sql, -1, &q, NULL);
-  if (rc != SQLITE_OK) return rc;
+  if (!q) return SQLITE_ERROR;
 
   rc = sqlite3_bind_int(q, 1, serialNo);
   if (rc != SQLITE_OK) return rc;
 
   rc = sqlite3_step(q);
-  if (rc != SQLITE_OK) return rc;
+  sqlite3_reset(q);
+  if (rc != SQLITE_DONE) return rc;
 
   return SQLITE_OK;
 }
 
-int cert_save(cmpsrv_ctx *ctx, X509 *cert)
+/* removes one certificate, inside or outside of a transaction, and sets
+ * *removed if it was found */
+static int delete_cert(cmpsrv_certstore *store, X509_NAME *issuer, int serialNo, int *removed)
 {
-  UNUSED(cert);
-  int rc = -1;
-
-  char *nameDigest;
+  int rc = SQLITE_ERROR;
+  char *issuerDigest = NULL;
   unsigned int mdlen;
-  get_name_digest(X509_get_subject_name(cert), &nameDigest, &mdlen);
 
+  *removed = 0;
+  sqlite3_stmt *q = store_stmt(store, issuer ? STMT_DELETE_ISSUER_SERIAL : STMT_DELETE);
+  if (!q) return rc;
+
+  rc = sqlite3_bind_int(q, 1, serialNo);
+  if (rc != SQLITE_OK) goto err;
+
+  if (issuer) {
+    rc = SQLITE_ERROR;
+    if (!get_name_digest(issuer, &issuerDigest, &mdlen)) goto err;
+    rc = sqlite3_bind_text(q, 2, issuerDigest, mdlen*2, SQLITE_STATIC);
+    if (rc != SQLITE_OK) goto err;
+  }
+
+  rc = sqlite3_step(q);
+  if (rc == SQLITE_DONE) {
+    rc = SQLITE_OK;
+    *removed = sqlite3_changes(store->db) > 0;
+  }
+
+err:
+  sqlite3_reset(q);
+  free(issuerDigest);
+  return rc;
+}
+
+/* records the revocation of a certificate for the CRLs */
+static int insert_revoked(cmpsrv_certstore *store, int serialNo, time_t when, int reason)
+{
+  sqlite3_stmt *q = store_stmt(store, STMT_REVOKE);
+  if (!q) return SQLITE_ERROR;
+
+  int rc = sqlite3_bind_int(q, 1, serialNo);
+  if (rc == SQLITE_OK) rc = sqlite3_bind_int64(q, 2, when);
+  if (rc == SQLITE_OK)
+    rc = reason < 0 ? sqlite3_bind_null(q, 3) : sqlite3_bind_int(q, 3, reason);
+  if (rc == SQLITE_OK) {
+    rc = sqlite3_step(q);
+    if (rc == SQLITE_DONE) rc = SQLITE_OK;
+  }
+
+  sqlite3_reset(q);
+  return rc;
+}
+
+/* revokes the n certificates given by serial number and, if not NULL,
+ * issuer in a single database transaction, so either all or none of them
+ * are revoked. The certificates are removed and their revocation, with
+ * reasons[i] unless it is -1, is recorded for the CRLs. revoked[i] is set
+ * if the i'th certificate was found. */
+int cert_revoke_all(cmpsrv_ctx *ctx, X509_NAME **issuers, const int *serials, const int *reasons, int n, int *revoked)
+{
+  time_t now = time(0);
+  int rc = store_exec(ctx->store, STMT_BEGIN);
+  if (rc != SQLITE_OK) return rc;
+
+  for (int i = 0; i < n; i++) {
+    rc = delete_cert(ctx->store, issuers[i], serials[i], &revoked[i]);
+    if (rc == SQLITE_OK && revoked[i])
+      rc = insert_revoked(ctx->store, serials[i], now, reasons[i]);
+    if (rc != SQLITE_OK) {
+      store_exec(ctx->store, STMT_ROLLBACK);
+      return rc;
+    }
+  }
+
+  return store_exec(ctx->store, STMT_COMMIT);
+}
+
+/* returns the revocations recorded after *lastRowid in a new array *entries,
+ * in the order they were recorded, and advances *lastRowid past them.
+ * returns the number of entries, -1 on error */
+int cert_revoked_since(cmpsrv_certstore *store, sqlite3_int64 *lastRowid, cmpsrv_revoked **entries)
+{
+  sqlite3_int64 last = *lastRowid;
+  int num = 0, max = 0, rc;
+
+  *entries = NULL;
+  sqlite3_stmt *q = store_stmt(store, STMT_REVOKED_SINCE);
+  if (!q || sqlite3_bind_int64(q, 1, *lastRowid) != SQLITE_OK) return -1;
+
+  while ((rc = sqlite3_step(q)) == SQLITE_ROW) {
+    if (num == max) {
+      max = max ? 2*max : 64;
+      cmpsrv_revoked *e = realloc(*entries, max * sizeof(cmpsrv_revoked));
+      if (!e) break;
+      *entries = e;
+    }
+    (*entries)[num].serial = sqlite3_column_int(q, 1);
+    (*entries)[num].date = sqlite3_column_int64(q, 2);
+    (*entries)[num].reason = sqlite3_column_type(q, 3) == SQLITE_NULL ? -1 : sqlite3_column_int(q, 3);
+    last = sqlite3_column_int64(q, 0);
+    num++;
+  }
+  sqlite3_reset(q);
+
+  if (rc != SQLITE_DONE) {
+    free(*entries);
+    *entries = NULL;
+    return -1;
+  }
+  *lastRowid = last;
+  return num;
+}
+
+/* inserts one certificate, inside or outside of a transaction */
+static int insert_cert(cmpsrv_certstore *store, X509 *cert)
+{
+  int rc = SQLITE_ERROR;
+  char *nameDigest = NULL, *issuerDigest = NULL, *kidHex = NULL;
+  unsigned int mdlen;
   unsigned char *derCert = NULL;
-  int derLen = i2d_X509(cert, &derCert);
 
-  sqlite3 *db = open_db(ctx);
-  if (!db) goto err;
+  sqlite3_stmt *q = store_stmt(store, STMT_INSERT);
+  if (!q) return rc;
 
-  sqlite3_stmt *q;
-  const char *insert_sql = "insert into certs values (?, ?, ?)";
+  ASN1_OCTET_STRING *kid = X509_get_ext_d2i(cert, NID_subject_key_identifier, NULL, NULL);
+  if (kid) {
+    kidHex = get_kid_hex(kid);
+    ASN1_OCTET_STRING_free(kid);
+    if (!kidHex) goto err;
+  }
+  if (!get_name_digest(X509_get_subject_name(cert), &nameDigest, &mdlen)) goto err;
+  if (!get_name_digest(X509_get_issuer_name(cert), &issuerDigest, &mdlen)) goto err;
 
-  rc = sqlite3_prepare(db, insert_sql, -1, &q, NULL);
-  if (rc != SQLITE_OK) goto err;
+  int derLen = i2d_X509(cert, &derCert);
+  if (derLen <= 0) goto err;
 
   rc = sqlite3_bind_int(q, 1, ASN1_INTEGER_get(cert->cert_info->serialNumber));
   if (rc != SQLITE_OK) goto err;
 
-  rc = sqlite3_bind_text(q, 2, nameDigest, mdlen*2, NULL);
+  rc = sqlite3_bind_text(q, 2, nameDigest, mdlen*2, SQLITE_STATIC);
   if (rc != SQLITE_OK) goto err;
 
-  rc = sqlite3_bind_blob(q, 3, derCert, derLen, NULL);
+  rc = sqlite3_bind_blob(q, 3, derCert, derLen, SQLITE_STATIC);
   if (rc != SQLITE_OK) goto err;
 
-  rc = sqlite3_step(q);
+  rc = sqlite3_bind_text(q, 4, issuerDigest, mdlen*2, SQLITE_STATIC);
   if (rc != SQLITE_OK) goto err;
 
-  rc = sqlite3_finalize(q);
+  rc = kidHex ? sqlite3_bind_text(q, 5, kidHex, -1, SQLITE_STATIC) : sqlite3_bind_null(q, 5);
   if (rc != SQLITE_OK) goto err;
 
-  sqlite3_close(db);
+  rc = sqlite3_step(q);
+  if (rc == SQLITE_DONE) rc = SQLITE_OK;
 
+err:
+  sqlite3_reset(q);
   free(nameDigest);
+  free(issuerDigest);
+  free(kidHex);
+  OPENSSL_free(derCert);
+  return rc;
+}
+
+int cert_save(cmpsrv_ctx *ctx, X509 *cert)
+{
+  return insert_cert(ctx->store, cert);
+}
+
+/* saves all certificates in a single database transaction, so either all or
+ * none of them are stored */
+int cert_save_all(cmpsrv_ctx *ctx, STACK_OF(X509) *certs)
+{
+  int rc = store_exec(ctx->store, STMT_BEGIN);
+  if (rc != SQLITE_OK) return rc;
+
+  for (int i = 0; i < sk_X509_num(certs); i++) {
+    rc = insert_cert(ctx->store, sk_X509_value(certs, i));
+    if (rc != SQLITE_OK) {
+      store_exec(ctx->store, STMT_ROLLBACK);
+      return rc;
+    }
+  }
+
+  return store_exec(ctx->store, STMT_COMMIT);
+}
+
+/* ############################################################################ *
+ * Open transactions
+ * ############################################################################ */
+
+/* binds an octet string, or NULL if there is none */
+static int bind_octets(sqlite3_stmt *q, int col, const ASN1_OCTET_STRING *os)
+{
+  if (!os) return sqlite3_bind_null(q, col);
+  return sqlite3_bind_blob(q, col, os->data, os->length, SQLITE_STATIC);
+}
+
+static ASN1_OCTET_STRING *column_octets(sqlite3_stmt *q, int col)
+{
+  if (sqlite3_column_type(q, col) == SQLITE_NULL) return NULL;
+
+  ASN1_OCTET_STRING *os = ASN1_OCTET_STRING_new();
+  if (os && !ASN1_OCTET_STRING_set(os, sqlite3_column_blob(q, col), sqlite3_column_bytes(q, col))) {
+    ASN1_OCTET_STRING_free(os);
+    os = NULL;
+  }
+  return os;
+}
+
+/* reads the issued certificates and their certReqIds of a transaction */
+static int column_certs(sqlite3_stmt *q, int certCol, int idCol, cmpsrv_txn *txn)
+{
+  if (sqlite3_column_type(q, certCol) == SQLITE_NULL) return 1;
+
+  const unsigned char *p = sqlite3_column_blob(q, certCol);
+  const unsigned char *end = p + sqlite3_column_bytes(q, certCol);
+  const char *ids = (const char *) sqlite3_column_text(q, idCol);
+
+  if (!(txn->certs = sk_X509_new_null())) return 0;
+  while (p < end) {
+    X509 *cert = d2i_X509(NULL, &p, end - p);
+    if (!cert || !sk_X509_push(txn->certs, cert)) {
+      X509_free(cert);
+      return 0;
+    }
+  }
+
+  int n = sk_X509_num(txn->certs);
+  if (!ids || !(txn->certReqIds = calloc(n > 0 ? n : 1, sizeof(long)))) return 0;
+  for (int i = 0; i < n; i++) {
+    char *next;
+    txn->certReqIds[i] = strtol(ids, &next, 10);
+    if (next == ids) return 0;
+    ids = next;
+  }
+  return 1;
+}
+
+/* the issued certificates as one blob of DER, and their certReqIds as a
+ * string of numbers */
+static int encode_certs(cmpsrv_txn *txn, unsigned char **der, int *derLen, char **ids)
+{
+  int n = txn->certs ? sk_X509_num(txn->certs) : 0;
+
+  *der = NULL;
+  *derLen = 0;
+  *ids = NULL;
+  if (n <= 0) return 1;
+
+  for (int i = 0; i < n; i++)
+    *derLen += i2d_X509(sk_X509_value(txn->certs, i), NULL);
+  if (!(*der = malloc(*derLen)) || !(*ids = malloc(n * 21 + 1))) goto err;
+
+  unsigned char *p = *der;
+  char *s = *ids;
+  for (int i = 0; i < n; i++) {
+    i2d_X509(sk_X509_value(txn->certs, i), &p);
+    s += sprintf(s, "%ld ", txn->certReqIds[i]);
+  }
+  return 1;
+
+err:
+  free(*der);
+  free(*ids);
+  *der = NULL;
+  *ids = NULL;
+  return 0;
+}
+
+/* returns the transaction with the given ID unless it has expired */
+cmpsrv_txn *txn_store_find(cmpsrv_certstore *store, const ASN1_OCTET_STRING *tid, time_t now)
+{
+  cmpsrv_txn *txn = NULL;
+
+  sqlite3_stmt *q = store_stmt(store, STMT_TXN_FIND);
+  if (!q) return NULL;
+
+  if (bind_octets(q, 1, tid) != SQLITE_OK || sqlite3_bind_int64(q, 2, now) != SQLITE_OK)
+    goto err;
+  if (sqlite3_step(q) != SQLITE_ROW) goto err;
+
+  if (!(txn = calloc(1, sizeof(cmpsrv_txn)))) goto err;
+  if (!(txn->transactionID = ASN1_OCTET_STRING_dup((ASN1_OCTET_STRING *) tid))) goto err;
+  txn->state = txn->savedState = sqlite3_column_int(q, 0);
+  txn->bodyType = sqlite3_column_int(q, 1);
+  txn->readyAt = sqlite3_column_int64(q, 2);
+  txn->senderNonce = column_octets(q, 3);
+  txn->recipNonce = column_octets(q, 4);
+  if (sqlite3_column_type(q, 5) != SQLITE_NULL) {
+    const unsigned char *p = sqlite3_column_blob(q, 5);
+    if (!(txn->senderKey = d2i_PUBKEY(NULL, &p, sqlite3_column_bytes(q, 5)))) goto err;
+  }
+  if (!column_certs(q, 6, 7, txn)) goto err;
+
+  sqlite3_reset(q);
+  return txn;
+
+err:
+  sqlite3_reset(q);
+  cmpsrv_txn_free(txn);
+  return NULL;
+}
+
+/* stores a new transaction. returns 0 if its ID is taken by a transaction
+ * that has got beyond the open state and has not expired */
+int txn_store_insert(cmpsrv_certstore *store, cmpsrv_txn *txn, time_t now)
+{
+  sqlite3_stmt *q = store_stmt(store, STMT_TXN_CLEAR);
+  if (!q) return 0;
+
+  if (bind_octets(q, 1, txn->transactionID) != SQLITE_OK || sqlite3_bind_int64(q, 2, now) != SQLITE_OK)
+    goto err;
+  if (sqlite3_step(q) != SQLITE_DONE) goto err;
+
+  if (!(q = store_stmt(store, STMT_TXN_INSERT))) return 0;
+  if (bind_octets(q, 1, txn->transactionID) != SQLITE_OK || sqlite3_bind_int64(q, 2, txn->expires) != SQLITE_OK)
+    goto err;
+  if (sqlite3_step(q) != SQLITE_DONE) goto err;
+
+  /* a row that was left in place is in use by another request */
+  int inserted = sqlite3_changes(store->db) > 0;
+  sqlite3_reset(q);
+  return inserted;
+
+err:
+  sqlite3_reset(q);
   return 0;
+}
+
+/* writes back a transaction, provided that its row is still in the state in
+ * which it was loaded */
+int txn_store_update(cmpsrv_certstore *store, cmpsrv_txn *txn)
+{
+  int updated = 0;
+  unsigned char *key = NULL, *certs = NULL;
+  int keyLen = 0, certsLen;
+  char *ids = NULL;
+
+  sqlite3_stmt *q = store_stmt(store, STMT_TXN_UPDATE);
+  if (!q) return 0;
+
+  if (txn->senderKey && (keyLen = i2d_PUBKEY(txn->senderKey, &key)) <= 0) goto err;
+  if (!encode_certs(txn, &certs, &certsLen, &ids)) goto err;
+
+  if (sqlite3_bind_int(q, 1, txn->state) != SQLITE_OK
+      || sqlite3_bind_int(q, 2, txn->bodyType) != SQLITE_OK
+      || sqlite3_bind_int64(q, 3, txn->readyAt) != SQLITE_OK
+      || sqlite3_bind_int64(q, 4, txn->expires) != SQLITE_OK
+      || bind_octets(q, 5, txn->senderNonce) != SQLITE_OK
+      || bind_octets(q, 6, txn->recipNonce) != SQLITE_OK
+      || (key ? sqlite3_bind_blob(q, 7, key, keyLen, SQLITE_STATIC) : sqlite3_bind_null(q, 7)) != SQLITE_OK
+      || (certs ? sqlite3_bind_blob(q, 8, certs, certsLen, SQLITE_STATIC) : sqlite3_bind_null(q, 8)) != SQLITE_OK
+      || (ids ? sqlite3_bind_text(q, 9, ids, -1, SQLITE_STATIC) : sqlite3_bind_null(q, 9)) != SQLITE_OK
+      || bind_octets(q, 10, txn->transactionID) != SQLITE_OK
+      || sqlite3_bind_int(q, 11, txn->savedState) != SQLITE_OK)
+    goto err;
+
+  if (sqlite3_step(q) == SQLITE_DONE)
+    updated = sqlite3_changes(store->db) > 0;
 
 err:
-  if (db) sqlite3_close(db);
-  free(nameDigest);
-  return rc;
+  sqlite3_reset(q);
+  OPENSSL_free(key);
+  free(certs);
+  free(ids);
+  return updated;
 }
 
+int txn_store_delete(cmpsrv_certstore *store, const ASN1_OCTET_STRING *tid)
+{
+  sqlite3_stmt *q = store_stmt(store, STMT_TXN_DELETE);
+  if (!q) return SQLITE_ERROR;
+
+  int rc = bind_octets(q, 1, tid);
+  if (rc == SQLITE_OK) rc = sqlite3_step(q);
+  sqlite3_reset(q);
+  return rc == SQLITE_DONE ? SQLITE_OK : rc;
+}
+
+/* deletes the expired transactions, returns their number */
+int txn_store_expire(cmpsrv_certstore *store, time_t now)
+{
+  int n = 0;
+
+  sqlite3_stmt *q = store_stmt(store, STMT_TXN_EXPIRE);
+  if (!q || sqlite3_bind_int64(q, 1, now) != SQLITE_OK) return 0;
+
+  if (sqlite3_step(q) == SQLITE_DONE)
+    n = sqlite3_changes(store->db);
+  sqlite3_reset(q);
+  return n;
+}
@@ -0,0 +1,225 @@
+  /***********************************************************************/
+  /* Copyright 2010-2011 Nokia Siemens Networks Oy. ALL RIGHTS RESERVED. */
+  /* Written by Miikka Viljanen <mviljane@users.sourceforge.net>         */
+  /***********************************************************************/
+
+#include "mod_cmpsrv.h"
+
+/* ############################################################################ *
+ * CRLs of the certificates revoked by rr.
+ *
+ * Signing one full CRL per revocation would make every rr as expensive as
+ * the whole revocation list. Instead a base CRL is signed once per INTERVAL
+ * seconds, covering everything revoked before the start of the interval,
+ * and a delta CRL lists what was revoked since. The delta is only signed
+ * when it is asked for after a change.
+ *
+ * The revocations are kept in memory sorted by serial number. Each update
+ * loads only the rows added to the revoked table since the last one and
+ * merges them in, so no worker ever reads the whole table twice.
+ *
+ * Base CRLs start at multiples of INTERVAL and their CRL number is derived
+ * from the start time, so every worker process builds the same base CRL
+ * with the same number. A delta CRL is numbered after its base plus the
+ * number of revocations it holds.
+ * ############################################################################ */
+
+static int serial_cmp(const void *a, const void *b)
+{
+  long x = ((const cmpsrv_revoked *) a)->serial;
+  long y = ((const cmpsrv_revoked *) b)->serial;
+  return x < y ? -1 : x > y;
+}
+
+/* merges the n new revocations into the sorted entries, back to front */
+static int entries_merge(cmpsrv_crl *crl, cmpsrv_revoked *add, size_t n)
+{
+  if (crl->num + n > crl->max) {
+    size_t max = crl->max ? crl->max : 64;
+    while (max < crl->num + n) max *= 2;
+    cmpsrv_revoked *e = realloc(crl->entries, max * sizeof(cmpsrv_revoked));
+    if (!e) return 0;
+    crl->entries = e;
+    crl->max = max;
+  }
+
+  qsort(add, n, sizeof(cmpsrv_revoked), serial_cmp);
+
+  size_t i = crl->num, j = n, k = crl->num + n;
+  while (j > 0) {
+    if (i > 0 && crl->entries[i-1].serial > add[j-1].serial)
+      crl->entries[--k] = crl->entries[--i];
+    else
+      crl->entries[--k] = add[--j];
+  }
+  crl->num += n;
+
+  for (j = 0; j < n; j++)
+    if (add[j].date >= crl->baseTime) crl->numDelta++;
+  return 1;
+}
+
+/* CRL number of the base CRL starting at baseTime, plus offset */
+static ASN1_INTEGER *crl_number(time_t baseTime, unsigned long offset)
+{
+  ASN1_INTEGER *number = NULL;
+  BIGNUM *bn = BN_new();
+
+  if (bn && BN_set_word(bn, (unsigned long) baseTime) && BN_lshift(bn, bn, 32)
+      && BN_add_word(bn, offset))
+    number = BN_to_ASN1_INTEGER(bn, NULL);
+
+  BN_free(bn);
+  return number;
+}
+
+static int crl_add_entry(X509_CRL *c, const cmpsrv_revoked *e)
+{
+  X509_REVOKED *r = X509_REVOKED_new();
+  ASN1_INTEGER *serial = ASN1_INTEGER_new();
+  ASN1_TIME *date = ASN1_TIME_set(NULL, e->date);
+  ASN1_ENUMERATED *reason = NULL;
+  int ok = 0;
+
+  if (!r || !serial || !date) goto err;
+  if (!ASN1_INTEGER_set(serial, e->serial)) goto err;
+  if (!X509_REVOKED_set_serialNumber(r, serial)) goto err;
+  if (!X509_REVOKED_set_revocationDate(r, date)) goto err;
+  if (e->reason >= 0) {
+    if (!(reason = ASN1_ENUMERATED_new())) goto err;
+    if (!ASN1_ENUMERATED_set(reason, e->reason)) goto err;
+    if (!X509_REVOKED_add1_ext_i2d(r, NID_crl_reason, reason, 0, 0)) goto err;
+  }
+  if (!X509_CRL_add0_revoked(c, r)) goto err;
+  r = NULL;
+  ok = 1;
+
+err:
+  ASN1_ENUMERATED_free(reason);
+  ASN1_TIME_free(date);
+  ASN1_INTEGER_free(serial);
+  X509_REVOKED_free(r);
+  return ok;
+}
+
+/* builds and signs the base CRL, or the delta CRL if delta is set */
+static X509_CRL *crl_build(cmpsrv_crl *crl, cmpsrv_ca *ca, int delta, time_t now)
+{
+  X509_CRL *c = X509_CRL_new();
+  ASN1_TIME *tm = NULL;
+  ASN1_INTEGER *baseNumber = NULL, *number = NULL;
+
+  if (!c) goto err;
+  /* v2, extensions are needed */
+  if (!X509_CRL_set_version(c, 1)) goto err;
+  if (!X509_CRL_set_issuer_name(c, X509_get_subject_name(ca->caCert))) goto err;
+
+  if (!(tm = ASN1_TIME_set(NULL, delta ? now : crl->baseTime))) goto err;
+  if (!X509_CRL_set_lastUpdate(c, tm)) goto err;
+  if (!ASN1_TIME_set(tm, crl->baseTime + crl->interval)) goto err;
+  if (!X509_CRL_set_nextUpdate(c, tm)) goto err;
+
+  /* the entries are sorted already, no need for X509_CRL_sort() */
+  for (size_t i = 0; i < crl->num; i++) {
+    const cmpsrv_revoked *e = &crl->entries[i];
+    if ((e->date >= crl->baseTime) != !!delta) continue;
+    if (!crl_add_entry(c, e)) goto err;
+  }
+
+  if (!(baseNumber = crl_number(crl->baseTime, 0))) goto err;
+  if (delta) {
+    if (!X509_CRL_add1_ext_i2d(c, NID_delta_crl, baseNumber, 1, 0)) goto err;
+    if (!(number = crl_number(crl->baseTime, 1 + crl->numDelta))) goto err;
+  }
+  if (!X509_CRL_add1_ext_i2d(c, NID_crl_number, number ? number : baseNumber, 0, 0)) goto err;
+
+  if (!X509_CRL_sign(c, ca->caKey, EVP_sha1())) goto err;
+
+  ASN1_INTEGER_free(number);
+  ASN1_INTEGER_free(baseNumber);
+  ASN1_TIME_free(tm);
+  return c;
+
+err:
+  ASN1_INTEGER_free(number);
+  ASN1_INTEGER_free(baseNumber);
+  ASN1_TIME_free(tm);
+  X509_CRL_free(c);
+  return NULL;
+}
+
+cmpsrv_crl *cmpsrv_crl_new(int interval)
+{
+  cmpsrv_crl *crl = calloc(1, sizeof(cmpsrv_crl));
+  if (!crl) return NULL;
+
+  crl->interval = interval > 0 ? interval : CMPSRV_CRL_INTERVAL;
+  return crl;
+}
+
+void cmpsrv_crl_free(cmpsrv_crl *crl)
+{
+  if (!crl) return;
+
+  X509_CRL_free(crl->base);
+  X509_CRL_free(crl->delta);
+  free(crl->entries);
+  free(crl);
+}
+
+/* loads the revocations recorded since the last call and signs a new base
+ * CRL if the interval is over. Cheap if nothing changed, so it can be
+ * called once a second. returns 1 on success, 0 on error */
+int cmpsrv_crl_update(cmpsrv_crl *crl, cmpsrv_ca *ca, cmpsrv_certstore *store, time_t now)
+{
+  cmpsrv_revoked *add = NULL;
+  int n = cert_revoked_since(store, &crl->lastRowid, &add);
+  if (n < 0) return 0;
+
+  if (n > 0) {
+    int ok = entries_merge(crl, add, n);
+    free(add);
+    if (!ok) return 0;
+    X509_CRL_free(crl->delta);
+    crl->delta = NULL;
+  }
+
+  time_t baseTime = now - now % crl->interval;
+  if (crl->base && baseTime == crl->baseTime)
+    return 1;
+
+  crl->baseTime = baseTime;
+  crl->numDelta = 0;
+  for (size_t i = 0; i < crl->num; i++)
+    if (crl->entries[i].date >= baseTime) crl->numDelta++;
+
+  X509_CRL *base = crl_build(crl, ca, 0, now);
+  if (!base) return 0;
+  X509_CRL_free(crl->base);
+  crl->base = base;
+  X509_CRL_free(crl->delta);
+  crl->delta = NULL;
+  return 1;
+}
+
+/* returns the current base CRL with its reference count incremented,
+ * NULL if cmpsrv_crl_update() never succeeded */
+X509_CRL *cmpsrv_crl_get1_base(cmpsrv_crl *crl)
+{
+  if (!crl->base) return NULL;
+  CRYPTO_add(&crl->base->references, 1, CRYPTO_LOCK_X509_CRL);
+  return crl->base;
+}
+
+/* returns the delta CRL to the current base with its reference count
+ * incremented, signing it first if there were revocations since it was
+ * last signed. NULL if nothing was revoked since the base CRL or on error */
+X509_CRL *cmpsrv_crl_get1_delta(cmpsrv_crl *crl, cmpsrv_ca *ca, time_t now)
+{
+  if (!crl->base || crl->numDelta == 0) return NULL;
+
+  if (!crl->delta && !(crl->delta = crl_build(crl, ca, 1, now)))
+    return NULL;
+  CRYPTO_add(&crl->delta->references, 1, CRYPTO_LOCK_X509_CRL);
+  return crl->delta;
+}
@@ -18,78 +18,78 @@ static size_t str2hex(char *str, unsigned char *out, size_t outlen)
 }
 
 
-void cmpsrv_ctx_delete(cmpsrv_ctx *ctx)
+/* ############################################################################ *
+ * CA state, built once at SETDEFAULTS time and shared by all requests. It is
+ * not modified after cmpsrv_ca_new() returns, the per-request contexts only
+ * take references to the objects in it.
+ * ############################################################################ */
+
+void cmpsrv_ca_free(cmpsrv_ca *ca)
 {
-  CMP_CTX_delete(ctx->cmp_ctx);
-  EVP_PKEY_free(ctx->caKey);
-  free(ctx->certPath);
-  free(ctx);
+  if (!ca) return;
+  if (--ca->references > 0) return;
+
+  X509_free(ca->caCert);
+  EVP_PKEY_free(ca->caKey);
+  if (ca->untrusted_store) X509_STORE_free(ca->untrusted_store);
+  if (ca->trusted_store) X509_STORE_free(ca->trusted_store);
+  if (ca->ra_store) X509_STORE_free(ca->ra_store);
+  if (ca->extraCerts) sk_X509_pop_free(ca->extraCerts, X509_free);
+  if (ca->caPubs) sk_X509_pop_free(ca->caPubs, X509_free);
+  if (ca->extraCertsDer) OPENSSL_free(ca->extraCertsDer);
+  if (ca->cmp_tmpl) CMP_CTX_delete(ca->cmp_tmpl);
+  free(ca->userID);
+  free(ca->secretKey);
+  free(ca->certPath);
+  free(ca);
 }
 
-cmpsrv_ctx *cmpsrv_ctx_new(plugin_data *p)
+cmpsrv_ca *cmpsrv_ca_new(plugin_data *p)
 {
-  cmpsrv_ctx *ctx = calloc(1, sizeof(cmpsrv_ctx));
-  ctx->certPath = strdup(p->certPath->ptr);
-
-  CMP_CTX *cmp_ctx = CMP_CTX_create();
-  // unsigned char referenceVal[32], secretVal[32];
-  // size_t refLen, secLen;
-
-  // refLen = str2hex(p->userID->ptr, referenceVal, sizeof(referenceVal));
-  // secLen = str2hex(p->secretKey->ptr, secretVal, sizeof(secretVal));
-
-  // CMP_CTX_set1_serverName( cmp_ctx, opt_serverName);
-  // CMP_CTX_set1_serverPath( cmp_ctx, opt_serverPath);
-  // CMP_CTX_set1_serverPort( cmp_ctx, opt_serverPort);
-  // CMP_CTX_set1_referenceValue( cmp_ctx, referenceVal, refLen);
-  // CMP_CTX_set1_secretValue( cmp_ctx, secretVal, secLen);
-  CMP_CTX_set1_referenceValue( cmp_ctx, (const unsigned char*)p->userID->ptr, strlen(p->userID->ptr));
-  CMP_CTX_set1_secretValue( cmp_ctx, (const unsigned char*)p->secretKey->ptr, strlen(p->secretKey->ptr));
-  // CMP_CTX_set0_pkey( cmp_ctx, initialPkey);
-  // CMP_CTX_set1_srvCert( cmp_ctx, caCert);
-  // CMP_CTX_set_compatibility( cmp_ctx, opt_compatibility);
-
-  X509 *caCert = HELP_read_der_cert(p->caCert->ptr);
-  if (!caCert) goto err;
-  CMP_CTX_set1_srvCert( cmp_ctx, caCert);
-  cmp_ctx->clCert = caCert;
-
-  EVP_PKEY *caKey = HELP_readPrivKey(p->caKey->ptr, "");
-  if (!caKey) goto err;
-  ctx->caKey = caKey;
-  cmp_ctx->pkey = caKey;
+  cmpsrv_ca *ca = calloc(1, sizeof(cmpsrv_ca));
+  if (!ca) return NULL;
+  ca->references = 1;
+
+  ca->certPath = strdup(p->certPath->ptr);
+  ca->userID = strdup(p->userID->ptr);
+  ca->secretKey = strdup(p->secretKey->ptr);
+
+  ca->caCert = HELP_read_der_cert(p->caCert->ptr);
+  if (!ca->caCert) goto err;
+
+  ca->caKey = HELP_readPrivKey(p->caKey->ptr, "");
+  if (!ca->caKey) goto err;
 
 #if 0
-  ctx->extraCerts = sk_X509_new_null();
+  ca->extraCerts = sk_X509_new_null();
   for (unsigned int i=0; i < p->extraCerts->used; i++) {
     data_string *ds = (data_string*) p->extraCerts->data[i];
     X509 *ec = HELP_read_der_cert(ds->value->ptr);
-    if (ec) sk_X509_push(ctx->extraCerts, ec);
+    if (ec) sk_X509_push(ca->extraCerts, ec);
   }
 #endif
 
-  if (p->extraCertPath) {
-    X509_STORE *untrusted_store = HELP_create_cert_store(p->extraCertPath->ptr);
-    CMP_CTX_set0_untrustedStore(cmp_ctx, untrusted_store);
-  }
-  if (p->rootCertPath) {
-    X509_STORE *trusted_store = HELP_create_cert_store(p->rootCertPath->ptr);
-    CMP_CTX_set0_trustedStore(cmp_ctx, trusted_store);
-  }
+  if (p->extraCertPath)
+    ca->untrusted_store = HELP_create_cert_store(p->extraCertPath->ptr);
+  if (p->rootCertPath)
+    ca->trusted_store = HELP_create_cert_store(p->rootCertPath->ptr);
+  if (p->raCertPath && p->raCertPath->used > 1)
+    ca->ra_store = HELP_create_cert_store(p->raCertPath->ptr);
+  ca->raSecret = p->raSecret;
 
-  if (cmp_ctx->untrusted_store) {
+  if (ca->untrusted_store) {
     int n=0;
-    ctx->extraCerts = CMP_build_cert_chain( cmp_ctx->untrusted_store, cmp_ctx->srvCert);
-    n = sk_X509_num(ctx->extraCerts);
-    if (n > 0 && cmp_ctx->trusted_store) {
-      X509 *last = sk_X509_value(ctx->extraCerts, n-1);
+    ca->extraCerts = CMP_build_cert_chain( ca->untrusted_store, ca->caCert);
+    n = sk_X509_num(ca->extraCerts);
+    if (n > 0 && ca->trusted_store) {
+      X509 *last = sk_X509_value(ca->extraCerts, n-1);
       int i = 0;
-      ctx->caPubs = CMP_build_cert_chain( cmp_ctx->trusted_store, last);
-      for (i = sk_X509_num(ctx->caPubs)-1; i >= 0; i--) {
-        X509 *cert = sk_X509_value(ctx->caPubs, i);
+      ca->caPubs = CMP_build_cert_chain( ca->trusted_store, last);
+      for (i = sk_X509_num(ca->caPubs)-1; i >= 0; i--) {
+        X509 *cert = sk_X509_value(ca->caPubs, i);
         EVP_PKEY *pk = X509_get_pubkey(cert);
         if (!X509_verify(cert, pk)) {
-          sk_X509_delete(ctx->caPubs, i);
+          sk_X509_delete(ca->caPubs, i);
           X509_free(cert);
         }
         EVP_PKEY_free(pk);
@@ -97,29 +97,71 @@ cmpsrv_ctx *cmpsrv_ctx_new(plugin_data *p)
 
 #if 1
       /* put everything in extraCerts, including root certs (3GPP) */
-      sk_X509_pop(ctx->caPubs);
-      sk_X509_push( ctx->extraCerts, sk_X509_pop(ctx->caPubs));
+      X509 *root = NULL;
+      while ((root = sk_X509_pop(ca->caPubs))) {
+        for (i = 0; i < sk_X509_num(ca->extraCerts); i++)
+          if (!X509_cmp(root, sk_X509_value(ca->extraCerts, i))) break;
+        if (i < sk_X509_num(ca->extraCerts)) X509_free(root);
+        else sk_X509_push( ca->extraCerts, root);
+      }
 #endif
     }
   }
 
-  ctx->cmp_ctx = cmp_ctx;
-  ctx->p_d = p;
-
-  sqlite3 *db = open_db(ctx);
-  if (db) {
-    sqlite3_exec(db, "create table certs (serial int not null primary key, name varchar not null, cert blob not null);", 0, 0, 0);
-    sqlite3_close(db);
-  }
-  else {
-    free(ctx);
-    return NULL;
+  /* the chain is the same in every response, so it is encoded only once */
+  if (sk_X509_num(ca->extraCerts) > 0) {
+    ca->extraCertsDerLen = CMP_encode_extraCerts(ca->extraCerts, &ca->extraCertsDer);
+    if (ca->extraCertsDerLen <= 0) goto err;
   }
 
+  if (!(ca->cmp_tmpl = CMP_CTX_create())) goto err;
+  CMP_CTX_set1_referenceValue( ca->cmp_tmpl, (const unsigned char*)ca->userID, strlen(ca->userID));
+  CMP_CTX_set1_secretValue( ca->cmp_tmpl, (const unsigned char*)ca->secretKey, strlen(ca->secretKey));
+  /* the CA certificate serves as both srvCert and clCert */
+  CMP_CTX_set1_srvCert( ca->cmp_tmpl, ca->caCert);
+  CMP_CTX_set1_clCert( ca->cmp_tmpl, ca->caCert);
+  CMP_CTX_set1_pkey( ca->cmp_tmpl, ca->caKey);
+  if (ca->untrusted_store)
+    CMP_CTX_set1_untrustedStore( ca->cmp_tmpl, ca->untrusted_store);
+  if (ca->trusted_store)
+    CMP_CTX_set1_trustedStore( ca->cmp_tmpl, ca->trusted_store);
+
+  return ca;
+
+err:
+  cmpsrv_ca_free(ca);
+  return NULL;
+}
+
+/* ############################################################################ *
+ * Per-request context. The CMP_CTX only holds references to the CA objects,
+ * so creating it does no I/O, no public key operations and no copying.
+ * ############################################################################ */
+
+void cmpsrv_ctx_delete(cmpsrv_ctx *ctx)
+{
+  if (!ctx) return;
+  cmpsrv_txn_free(ctx->txn);
+  CMP_CTX_delete(ctx->cmp_ctx);
+  cmpsrv_ca_free(ctx->ca);
+  free(ctx);
+}
+
+cmpsrv_ctx *cmpsrv_ctx_new(cmpsrv_ca *ca)
+{
+  if (!ca) return NULL;
+
+  cmpsrv_ctx *ctx = calloc(1, sizeof(cmpsrv_ctx));
+  if (!ctx) return NULL;
+  ctx->ca = ca;
+  ca->references++;
+
+  /* the CMP_CTX shares everything with the CA's template */
+  if (!(ctx->cmp_ctx = CMP_CTX_create_child(ca->cmp_tmpl))) goto err;
+
   return ctx;
 
 err:
   cmpsrv_ctx_delete( ctx);
   return NULL;
 }
-
@@ -4,8 +4,6 @@
   /* Written by Miikka Viljanen <mviljane@users.sourceforge.net>         */
   /***********************************************************************/
 
-#undef TEST_POLLREQ
-
 #include "mod_cmpsrv.h"
 
 #define CMPHANDLER_ARGS server *srv, cmpsrv_ctx *srv_ctx, CMP_PKIMESSAGE *msg, CMP_PKIMESSAGE **out
@@ -15,139 +13,342 @@ typedef int (*cmp_messageHandler_t)(CMPHANDLER_ARGS);
 #define V_CMP_PKIBODY_LAST (V_CMP_PKIBODY_POLLREP+1)
 cmp_messageHandler_t msg_handlers[V_CMP_PKIBODY_LAST];
 
-static STACK_OF(X509)* X509_stack_dup(const STACK_OF(X509)* stack)
+static void certs_up_ref(STACK_OF(X509) *certs)
 {
-  STACK_OF(X509) *newsk = NULL;
-  int i;
+  for (int i = 0; i < sk_X509_num(certs); i++)
+    CRYPTO_add(&sk_X509_value(certs, i)->references, 1, CRYPTO_LOCK_X509);
+}
 
-  if (!stack) goto err;
-  if (!(newsk = sk_X509_new_null())) goto err;
+/* returns a new stack with references to the same certificates */
+static STACK_OF(X509) *X509_stack_share(STACK_OF(X509) *stack)
+{
+  STACK_OF(X509) *newsk = NULL;
 
-  for (i = 0; i < sk_X509_num(stack); i++)
-    sk_X509_push(newsk, X509_dup(sk_X509_value(stack, i)));
+  if (!stack) return NULL;
+  if (!(newsk = sk_X509_dup(stack))) return NULL;
+  certs_up_ref(newsk);
 
   return newsk;
-err:
-  return 0;
 }
 
-#ifdef TEST_POLLREQ
-/* This is pretty dumb but it's only meant for testing the polling stuff. */
-CMP_PKIMESSAGE *waiting_msg = NULL;
-#endif
+/* returns the response body type for the given request body type */
+static int certrep_type(int reqType)
+{
+  switch (reqType) {
+    case V_CMP_PKIBODY_CR:  return V_CMP_PKIBODY_CP;
+    case V_CMP_PKIBODY_KUR: return V_CMP_PKIBODY_KUP;
+    default:                return V_CMP_PKIBODY_IP;
+  }
+}
 
-CMPHANDLER_FUNC(handlemsg_ir)
+/* builds the ip, cp or kup delivering certs, answering certReqId reqIds[i]
+ * with certs[i]. Takes ownership of the certs but not of the stack. */
+static CMP_PKIMESSAGE *certrep_new(cmpsrv_ctx *srv_ctx, int reqType, STACK_OF(X509) *certs, const long *reqIds)
 {
   CMP_CTX *ctx = srv_ctx->cmp_ctx;
+  CMP_PKIMESSAGE *resp = NULL;
 
-  int numCertRequests = sk_CRMF_CERTREQMSG_num(msg->body->value.ir);
-  dbgmsg("sd", "number of cert requests:", numCertRequests);
-
-  /* TODO handle multiple CERTREQMSGS? */
-  // CRMF_CERTREQMSG *crm = sk_CRMF_CERTREQMSG_pop(msg->body->value.ir);
-  // int reqId = ASN1_INTEGER_get(crm->certReq->certReqId);
-
-  // TODO verify proof-of-posession
-
-  CRMF_CERTREQMSG *reqmsg = sk_CRMF_CERTREQMSG_value( msg->body->value.ir, 0);
-  CRMF_CERTREQUEST *req = reqmsg->certReq;
-  CRMF_CERTTEMPLATE *tpl = req->certTemplate;
-
-  X509 *cert = cert_create(srv_ctx, tpl);
-  CRMF_CERTTEMPLATE_free(tpl);
+  if (reqType == V_CMP_PKIBODY_KUR) {
+    resp = CMP_kup_new(ctx, certs, reqIds);
+    if (!resp) return NULL;
+  }
+  else {
+    resp = CMP_ip_new(ctx, certs, reqIds);
+    if (!resp) return NULL;
+    CMP_PKIMESSAGE_set_bodytype(resp, certrep_type(reqType));
+    resp->body->value.ip->caPubs = X509_stack_share(srv_ctx->ca->caPubs);
+  }
+  srv_ctx->withExtraCerts = 1;
 
-#ifdef TEST_POLLREQ
+  return resp;
+}
 
-  {
-    CMP_PKIMESSAGE *msg = CMP_PKIMESSAGE_new();
-    CMP_PKIHEADER_init(ctx, msg->header);
-    CMP_PKIMESSAGE_set_bodytype( msg, V_CMP_PKIBODY_IP);
-    CMP_PKIHEADER_set1_sender( msg->header, X509_get_subject_name( (X509*)ctx->srvCert));
+/* builds an ip, cp or kup telling the client to poll for its certificates */
+static CMP_PKIMESSAGE *certrep_waiting_new(cmpsrv_ctx *srv_ctx, int reqType, const long *reqIds, int n)
+{
+  CMP_CTX *ctx = srv_ctx->cmp_ctx;
+  CMP_PKIMESSAGE *msg = CMP_PKIMESSAGE_new();
+  CMP_PKIHEADER_init(ctx, msg->header);
+  CMP_PKIMESSAGE_set_bodytype( msg, certrep_type(reqType));
+  CMP_PKIHEADER_set1_sender( msg->header, X509_get_subject_name( (X509*)ctx->srvCert));
 
-    CMP_CERTREPMESSAGE *resp = CMP_CERTREPMESSAGE_new();
+  CMP_CERTREPMESSAGE *resp = CMP_CERTREPMESSAGE_new();
+  resp->response = sk_CMP_CERTRESPONSE_new_null();
 
+  for (int i = 0; i < n; i++) {
     CMP_CERTRESPONSE *cr = CMP_CERTRESPONSE_new();
-    ASN1_INTEGER_set(cr->certReqId, 0);
+    ASN1_INTEGER_set(cr->certReqId, reqIds[i]);
     ASN1_INTEGER_set(cr->status->status, CMP_PKISTATUS_waiting);
-
-    resp->response = sk_CMP_CERTRESPONSE_new_null();
     sk_CMP_CERTRESPONSE_push(resp->response, cr);
+  }
 
-    msg->body->value.ip = resp;
+  msg->body->value.ip = resp;
+  srv_ctx->withExtraCerts = 1;
 
-    *out = msg;
-    (*out)->extraCerts = X509_stack_dup(srv_ctx->extraCerts);
+  return msg;
+}
 
-    waiting_msg = CMP_ip_new(ctx, cert);
-    waiting_msg->extraCerts = X509_stack_dup(srv_ctx->extraCerts);
-  }
+/* Issues a certificate for every CertReqMsg in reqs, all signed with the CA
+ * key in one go, and stores them in a single DB transaction. Returns the
+ * certificates and, in *reqIds, the certReqId each one answers. */
+static STACK_OF(X509) *issue_certs(server *srv, cmpsrv_ctx *srv_ctx, STACK_OF(CRMF_CERTREQMSG) *reqs, long **reqIds)
+{
+  int n = sk_CRMF_CERTREQMSG_num(reqs);
+  dbgmsg("sd", "number of cert requests:", n);
 
-#else
+  STACK_OF(X509) *certs = sk_X509_new_null();
+  *reqIds = calloc(n > 0 ? n : 1, sizeof(long));
+  if (!certs || !*reqIds || n <= 0) goto err;
 
-  *out = CMP_ip_new(ctx, cert);
+  // TODO verify proof-of-posession
 
-  if (!*out) return -1;
-  (*out)->extraCerts = X509_stack_dup(srv_ctx->extraCerts);
-  (*out)->body->value.ip->caPubs = X509_stack_dup(srv_ctx->caPubs);
+  for (int i = 0; i < n; i++) {
+    CRMF_CERTREQMSG *reqmsg = sk_CRMF_CERTREQMSG_value( reqs, i);
+    CRMF_CERTREQUEST *req = reqmsg->certReq;
+    CRMF_CERTTEMPLATE *tpl = req->certTemplate;
 
-#endif
+    X509 *cert = cert_create(srv_ctx, tpl);
+    if (!cert) goto err;
+    (*reqIds)[i] = ASN1_INTEGER_get(req->certReqId);
+    sk_X509_push(certs, cert);
+
+    CRMF_CERTTEMPLATE_free(tpl);
+    req->certTemplate = NULL;
+  }
 
   // char filename[1024];
   // EVP_PKEY *p = X509_PUBKEY_get(cert->cert_info->key);
   // dbgmsg("d", p);
   // int keyid = EVP_PKEY_base_id(p);
-  // sprintf(filename, "%s/%d.der", srv_ctx->certPath, keyid);
+  // sprintf(filename, "%s/%d.der", srv_ctx->ca->certPath, keyid);
   // dbgmsg("ss", "saving cert to", filename);
-  int r = cert_save(srv_ctx, cert);
-  dbgmsg("sd", "cert_save:", r);
+  int r = cert_save_all(srv_ctx, certs);
+  dbgmsg("sd", "cert_save_all:", r);
+
+  /* the client will sign its next requests with these */
+  if (r == SQLITE_OK) {
+    time_t now = time(0);
+    for (int i = 0; i < sk_X509_num(certs); i++)
+      cmpsrv_keycache_add(srv_ctx->keys, sk_X509_value(certs, i), now);
+  }
 
-  // dbgmsg("s", "done");
+  return certs;
+
+err:
+  if (certs) sk_X509_pop_free(certs, X509_free);
+  free(*reqIds);
+  *reqIds = NULL;
+  return NULL;
+}
+
+/* Answers an ir, cr or kur with the issued certs, or with 'waiting' if
+ * cmpsrv.pollDelay is set. The certs are kept in the transaction until they
+ * have been delivered and confirmed. Takes ownership of certs and reqIds. */
+static int respond_certs(server *srv, cmpsrv_ctx *srv_ctx, int reqType, STACK_OF(X509) *certs, long *reqIds, CMP_PKIMESSAGE **out)
+{
+  cmpsrv_txn *txn = srv_ctx->txn;
+
+  if (!txn) {
+    *out = certrep_new(srv_ctx, reqType, certs, reqIds);
+    sk_X509_free(certs);
+    free(reqIds);
+    return *out ? 0 : -1;
+  }
+
+  if (txn->certs) sk_X509_pop_free(txn->certs, X509_free);
+  free(txn->certReqIds);
+  txn->certs = certs;
+  txn->certReqIds = reqIds;
+
+  if (srv_ctx->ca->pollDelay > 0) {
+    dbgmsg("sd", "delaying certificate delivery by seconds:", srv_ctx->ca->pollDelay);
+    txn->state = CMPSRV_TXN_WAITING;
+    txn->readyAt = time(0) + srv_ctx->ca->pollDelay;
+    *out = certrep_waiting_new(srv_ctx, reqType, reqIds, sk_X509_num(certs));
+  }
+  else {
+    txn->state = CMPSRV_TXN_CONFIRM;
+    certs_up_ref(certs);
+    *out = certrep_new(srv_ctx, reqType, certs, reqIds);
+  }
+
+  if (!*out) return -1;
   return 0;
 }
 
-CMPHANDLER_FUNC(handlemsg_rr)
+CMPHANDLER_FUNC(handlemsg_ir)
 {
-  UNUSED(srv);
-  UNUSED(srv_ctx);
-  UNUSED(msg);
+  int reqType = CMP_PKIMESSAGE_get_bodytype(msg);
+  long *reqIds = NULL;
+
+  /* the body of ir and cr is the same CertReqMessages type */
+  STACK_OF(X509) *certs = issue_certs(srv, srv_ctx, msg->body->value.ir, &reqIds);
+  if (!certs) return -1;
 
+  return respond_certs(srv, srv_ctx, reqType, certs, reqIds, out);
+}
+
+/* builds the PKIStatusInfo answering one RevDetails, rejected with the
+ * given failInfo bit unless revoked */
+static CMP_PKISTATUSINFO *rev_status_new(int revoked, int failInfo)
+{
+  CMP_PKISTATUSINFO *s = CMP_PKISTATUSINFO_new();
+  if (!s) return NULL;
+
+  if (revoked) {
+    ASN1_INTEGER_set(s->status, CMP_PKISTATUS_accepted);
+    return s;
+  }
+
+  ASN1_INTEGER_set(s->status, CMP_PKISTATUS_rejection);
+  if (!(s->failInfo = ASN1_BIT_STRING_new())
+      || !ASN1_BIT_STRING_set_bit(s->failInfo, failInfo, 1)) {
+    CMP_PKISTATUSINFO_free(s);
+    return NULL;
+  }
+  return s;
+}
+
+/* returns 1 if cert is one of the RA certificates (cmpsrv.raCertPath) */
+static int is_ra_cert(cmpsrv_ca *ca, X509 *cert)
+{
+  X509_STORE_CTX *csc = NULL;
+  X509_OBJECT obj;
+  int ra = 0;
+
+  if (!ca->ra_store || !cert) return 0;
+  if (!(csc = X509_STORE_CTX_new())) return 0;
+  if (X509_STORE_CTX_init(csc, ca->ra_store, NULL, NULL) &&
+      X509_STORE_get_by_subject(csc, X509_LU_X509, X509_get_subject_name(cert), &obj) > 0) {
+    ra = !X509_cmp(obj.data.x509, cert);
+    X509_OBJECT_free_contents(&obj);
+  }
+  X509_STORE_CTX_free(csc);
+  return ra;
+}
+
+/* returns 1 if the certificate with issuer and serial was issued to the
+ * subject of signer */
+static int issued_to_signer(cmpsrv_ctx *srv_ctx, X509 *signer, X509_NAME *issuer, int serial)
+{
+  if (!signer) return 0;
+
+  X509 *cert = issuer ? cert_find_by_issuer_serial(srv_ctx, issuer, serial)
+                      : cert_find_by_serial(srv_ctx, serial);
+  int ok = cert && !X509_NAME_cmp(X509_get_subject_name(cert), X509_get_subject_name(signer));
+  X509_free(cert);
+  return ok;
+}
+
+/* Revokes all certificates listed in the rr in a single DB transaction and
+ * answers every RevDetails with its own PKIStatusInfo, in the same order.
+ * Unknown certificates and RevDetails without serialNumber are rejected
+ * with badCertId. Unless the sender is an RA, see is_ra_cert() and
+ * cmpsrv.raSecret, it may only revoke certificates issued to the subject
+ * of the certificate it signed the rr with; others are rejected with
+ * notAuthorized. */
+CMPHANDLER_FUNC(handlemsg_rr)
+{
   CMP_CTX *ctx = srv_ctx->cmp_ctx;
+  CMP_REVREQCONTENT *rr = msg->body->value.rr;
+  CMP_PKIMESSAGE *resp = NULL;
+  int ret = -1;
+
+  int n = sk_CMP_REVDETAILS_num(rr);
+  dbgmsg("sd", "number of revocation requests:", n);
+  if (n <= 0) return -1;
+
+  /* the RevDetails which name a certificate, map[k] is the index of the
+   * k'th of them in rr */
+  X509_NAME **issuers = calloc(n, sizeof(X509_NAME*));
+  int *serials = calloc(n, sizeof(int));
+  int *reasons = calloc(n, sizeof(int));
+  int *map = calloc(n, sizeof(int));
+  int *found = calloc(n, sizeof(int));
+  int *revoked = calloc(n, sizeof(int));
+  int *denied = calloc(n, sizeof(int));
+  X509 *signer = NULL;
+  int m = 0;
+  if (!issuers || !serials || !reasons || !map || !found || !revoked || !denied) goto err;
+
+  int ra = 0;
+  if (OBJ_obj2nid(msg->header->protectionAlg->algorithm) == NID_id_PasswordBasedMAC)
+    ra = srv_ctx->ca->raSecret;
+  else if ((signer = cert_find_by_serial(srv_ctx, srv_ctx->senderSerial)))
+    ra = is_ra_cert(srv_ctx->ca, signer);
+  dbgmsg("sd", "rr sender is RA:", ra);
 
-  CMP_PKIMESSAGE *resp = CMP_PKIMESSAGE_new();
+  for (int i = 0; i < n; i++) {
+    CMP_REVDETAILS *rd = sk_CMP_REVDETAILS_value(rr, i);
+    CRMF_CERTTEMPLATE *tpl = rd->certDetails;
+    if (!tpl || !tpl->serialNumber) continue;
+    int serial = ASN1_INTEGER_get(tpl->serialNumber);
+    if (!ra && !issued_to_signer(srv_ctx, signer, tpl->issuer, serial)) {
+      denied[i] = 1;
+      continue;
+    }
+    issuers[m] = tpl->issuer;
+    serials[m] = serial;
+    /* the CRL entry gets the reason code the client asked for, if any */
+    ASN1_ENUMERATED *reason = X509V3_get_d2i(rd->crlEntryDetails, NID_crl_reason, NULL, NULL);
+    reasons[m] = reason ? ASN1_ENUMERATED_get(reason) : -1;
+    ASN1_ENUMERATED_free(reason);
+    map[m++] = i;
+  }
+
+  int rc = cert_revoke_all(srv_ctx, issuers, serials, reasons, m, found);
+  dbgmsg("sd", "cert_revoke_all:", rc);
+  if (rc != SQLITE_OK) goto err;
+
+  for (int k = 0; k < m; k++) {
+    if (!found[k]) continue;
+    revoked[map[k]] = 1;
+    /* the certificate must not be accepted for protection any more */
+    cmpsrv_keycache_remove(srv_ctx->keys, serials[k]);
+  }
+
+  resp = CMP_PKIMESSAGE_new();
   CMP_PKIMESSAGE_set_bodytype( resp, V_CMP_PKIBODY_RP);
   CMP_PKIHEADER_init(ctx, resp->header);
 
   CMP_REVREPCONTENT *rp = CMP_REVREPCONTENT_new();
-  rp->status = sk_CMP_PKISTATUSINFO_new_null();
-  CMP_PKISTATUSINFO *s = CMP_PKISTATUSINFO_new();
-  // s->status = ASN1_INTEGER_new();
-  ASN1_INTEGER_set(s->status, 0);
-  // rp->status = s;
-  sk_CMP_PKISTATUSINFO_push(rp->status, s);
-
   resp->body->value.rp = rp;
+  if (!(rp->status = sk_CMP_PKISTATUSINFO_new_null())) goto err;
+
+  int numRevoked = 0;
+  for (int i = 0; i < n; i++) {
+    CMP_PKISTATUSINFO *s = rev_status_new(revoked[i],
+        denied[i] ? CMP_PKIFAILUREINFO_notAuthorized : CMP_PKIFAILUREINFO_badCertId);
+    if (!s) goto err;
+    sk_CMP_PKISTATUSINFO_push(rp->status, s);
+    numRevoked += revoked[i];
+  }
 
-  dbgmsg("s", "rr done");
+  dbgmsg("sdsd", "rr done, revoked", numRevoked, "of", n);
   *out = resp;
+  resp = NULL;
+  ret = 0;
 
-  return 0;
+err:
+  if (resp) CMP_PKIMESSAGE_free(resp);
+  free(issuers);
+  free(serials);
+  free(reasons);
+  free(map);
+  free(found);
+  free(revoked);
+  free(denied);
+  X509_free(signer);
+  return ret;
 }
 
-CMPHANDLER_FUNC(handlemsg_kur)
+/* returns the oldCertID serial number of a CertReqMsg of a kur, 0 if none */
+static long certreq_old_serial(CRMF_CERTREQMSG *reqmsg)
 {
-  UNUSED(srv);
-  UNUSED(srv_ctx);
-  UNUSED(msg);
-  UNUSED(out);
-
-  CMP_CTX *ctx = srv_ctx->cmp_ctx;
-
-  CRMF_CERTREQMSG *reqmsg = sk_CRMF_CERTREQMSG_value( msg->body->value.kur, 0);
   CRMF_CERTREQUEST *req = reqmsg->certReq;
-  CRMF_CERTTEMPLATE *tpl = req->certTemplate;
 
   int n = sk_CRMF_ATTRIBUTETYPEANDVALUE_num(req->controls);
-  int oldserial = 0;
+  long oldserial = 0;
   for (int i = 0; i < n; i++) {
     CRMF_ATTRIBUTETYPEANDVALUE *atav = sk_CRMF_ATTRIBUTETYPEANDVALUE_value(req->controls,i);
     if (OBJ_obj2nid(atav->type) == NID_id_regCtrl_oldCertID) {
@@ -155,33 +356,56 @@ CMPHANDLER_FUNC(handlemsg_kur)
       oldserial = ASN1_INTEGER_get(cid->serialNumber);
     }
   }
+  return oldserial;
+}
 
-  dbgprintf("removing %x", oldserial);
-  int rc=cert_remove(srv_ctx, oldserial);
-  if (rc != 0) dbgprintf("success");
-  else dbgprintf("failure (%d)", rc);
-
-  X509 *cert = cert_create(srv_ctx, tpl);
-  CRMF_CERTTEMPLATE_free(tpl);
+/* returns the oldCertID serial number of the first CertReqMsg in a kur,
+ * whose certificate's key the kur is verified with */
+static long kur_old_serial(CMP_PKIMESSAGE *msg)
+{
+  CRMF_CERTREQMSG *reqmsg = sk_CRMF_CERTREQMSG_value( msg->body->value.kur, 0);
+  return reqmsg ? certreq_old_serial(reqmsg) : 0;
+}
 
-  *out = CMP_kup_new(ctx, cert);
-  if (!*out) {
-    X509_free(cert);
-    return -1;
+CMPHANDLER_FUNC(handlemsg_kur)
+{
+  long *reqIds = NULL;
+
+  /* the kur was verified with the key of the first oldCertID, a client may
+   * only update that certificate */
+  long signerSerial = kur_old_serial(msg);
+  for (int j = 0; j < sk_CRMF_CERTREQMSG_num(msg->body->value.kur); j++) {
+    CRMF_CERTREQMSG *reqmsg = sk_CRMF_CERTREQMSG_value( msg->body->value.kur, j);
+    if (signerSerial == 0 || certreq_old_serial(reqmsg) != signerSerial) {
+      dbgmsg("sd", "ERROR: oldCertID does not name the signing certificate, CertReqMsg", j);
+      return -1;
+    }
   }
-  (*out)->extraCerts = X509_stack_dup(srv_ctx->extraCerts);
 
-  int r = cert_save(srv_ctx, cert);
-  dbgmsg("sd", "cert_save:", r);
+  /* remove the certificate being replaced */
+  dbgprintf("removing %x", signerSerial);
+  int rc=cert_remove(srv_ctx, signerSerial);
+  cmpsrv_keycache_remove(srv_ctx->keys, signerSerial);
+  if (rc == 0) dbgprintf("success");
+  else dbgprintf("failure (%d)", rc);
 
-  return 0;
+  STACK_OF(X509) *certs = issue_certs(srv, srv_ctx, msg->body->value.kur, &reqIds);
+  if (!certs) return -1;
+
+  return respond_certs(srv, srv_ctx, V_CMP_PKIBODY_KUR, certs, reqIds, out);
 }
 
 CMPHANDLER_FUNC(handlemsg_certConf)
 {
-  UNUSED(srv);
   UNUSED(msg);
 
+  cmpsrv_txn *txn = srv_ctx->txn;
+  if (!txn || txn->state != CMPSRV_TXN_CONFIRM) {
+    dbgmsg("s", "ERROR: certConf for a transaction without delivered certificates");
+    return -1;
+  }
+  txn->state = CMPSRV_TXN_DONE;
+
   CMP_CTX *ctx = srv_ctx->cmp_ctx;
   CMP_PKIMESSAGE *resp = CMP_PKIMESSAGE_new();
   CMP_PKIHEADER_init(ctx, resp->header);
@@ -191,7 +415,7 @@ CMPHANDLER_FUNC(handlemsg_certConf)
   resp->body->value.pkiconf = t;
 
   *out = resp;
-  (*out)->extraCerts = X509_stack_dup(srv_ctx->extraCerts);
+  srv_ctx->withExtraCerts = 1;
 
   return 0;
 }
@@ -218,14 +442,39 @@ static int create_ckuann_certs(EVP_PKEY *oldkey, X509 *old, X509 **oldwithnew, X
   *newwithnew = new;
 
   *oldwithnew = X509_dup(old);
-  X509_sign(old, newkey, md);
+  X509_sign(*oldwithnew, newkey, md);
 
   *newwithold = X509_dup(new);
-  X509_sign(new, oldkey, md);
+  X509_sign(*newwithold, oldkey, md);
 
   return 0;
 }
 
+/* returns a new stack with the base CRL and, if anything was revoked since
+ * it was signed, the delta CRL, after picking up revocations made by other
+ * workers. NULL if there is no CRL. */
+static STACK_OF(X509_CRL) *current_crls(cmpsrv_ctx *srv_ctx)
+{
+  time_t now = time(0);
+  STACK_OF(X509_CRL) *crls = NULL;
+  X509_CRL *crl = NULL;
+
+  if (!srv_ctx->crls) return NULL;
+  /* on a database error the CRLs already signed are still good */
+  cmpsrv_crl_update(srv_ctx->crls, srv_ctx->ca, srv_ctx->store, now);
+
+  if (!(crl = cmpsrv_crl_get1_base(srv_ctx->crls))) return NULL;
+  if (!(crls = sk_X509_CRL_new_null()) || !sk_X509_CRL_push(crls, crl)) goto err;
+  if ((crl = cmpsrv_crl_get1_delta(srv_ctx->crls, srv_ctx->ca, now)) && !sk_X509_CRL_push(crls, crl))
+    goto err;
+  return crls;
+
+err:
+  X509_CRL_free(crl);
+  sk_X509_CRL_pop_free(crls, X509_CRL_free);
+  return NULL;
+}
+
 CMPHANDLER_FUNC(handlemsg_genm)
 {
   CMP_INFOTYPEANDVALUE *msg_itav = sk_CMP_INFOTYPEANDVALUE_pop(msg->body->value.genm);
@@ -254,17 +503,17 @@ CMPHANDLER_FUNC(handlemsg_genm)
     // ASN1_TIME_set(cert->cert_info->validity->notAfter, time(0)+60*60*24*365);
 #if 0
     char certfn[1024];
-    sprintf(certfn, "%s/ca_cert_oldwithnew.der", srv_ctx->certPath);
+    sprintf(certfn, "%s/ca_cert_oldwithnew.der", srv_ctx->ca->certPath);
     ckuann->oldWithNew = HELP_read_der_cert(certfn);
 
-    sprintf(certfn, "%s/ca_cert_newwithold.der", srv_ctx->certPath);
+    sprintf(certfn, "%s/ca_cert_newwithold.der", srv_ctx->ca->certPath);
     ckuann->newWithOld = HELP_read_der_cert(certfn);
 
-    sprintf(certfn, "%s/ca_cert_newwithnew.der", srv_ctx->certPath);
+    sprintf(certfn, "%s/ca_cert_newwithnew.der", srv_ctx->ca->certPath);
     ckuann->newWithNew = HELP_read_der_cert(certfn);
 #endif
 
-    create_ckuann_certs(srv_ctx->caKey, ctx->srvCert, &ckuann->oldWithNew, &ckuann->newWithOld, &ckuann->newWithNew);
+    create_ckuann_certs(srv_ctx->ca->caKey, ctx->srvCert, &ckuann->oldWithNew, &ckuann->newWithOld, &ckuann->newWithNew);
 
 
     itav->infoValue.caKeyUpdateInfo = ckuann;
@@ -273,15 +522,22 @@ CMPHANDLER_FUNC(handlemsg_genm)
   }
   else if (infoType == NID_id_it_currentCRL) {
     dbgmsg("s", "genm type is currentCRL");
-    //TODO return an actual CRL instead of just an empty structure
-    CMP_INFOTYPEANDVALUE *itav = CMP_INFOTYPEANDVALUE_new();
-    X509_CRL *curcrl = X509_CRL_new();
-    curcrl->crl = X509_CRL_INFO_new();
-    ASN1_TIME_set(curcrl->crl->lastUpdate, time(0));
-
-    itav->infoType = OBJ_nid2obj(NID_id_it_currentCRL);
-    itav->infoValue.currentCRL = curcrl;
-    CMP_ITAV_stack_item_push0( &resp->body->value.genp, itav);
+    /* one itav with the base CRL and, if anything was revoked since, one
+     * with the delta CRL */
+    STACK_OF(X509_CRL) *crls = current_crls(srv_ctx);
+    X509_CRL *crl;
+    if (!crls) {
+      dbgmsg("s", "ERROR: no CRL available");
+      CMP_PKIMESSAGE_free(resp);
+      resp = NULL;
+    }
+    else while ((crl = sk_X509_CRL_shift(crls))) {
+      CMP_INFOTYPEANDVALUE *itav = CMP_INFOTYPEANDVALUE_new();
+      itav->infoType = OBJ_nid2obj(NID_id_it_currentCRL);
+      itav->infoValue.currentCRL = crl;
+      CMP_ITAV_stack_item_push0( &resp->body->value.genp, itav);
+    }
+    sk_X509_CRL_free(crls);
   }
   else {
     dbgmsg("sd", "Unknown info type received in GeneralMessage: ", infoType);
@@ -296,28 +552,28 @@ CMPHANDLER_FUNC(handlemsg_genm)
 
 CMPHANDLER_FUNC(handlemsg_pollReq)
 {
-  UNUSED(srv);
-  UNUSED(srv_ctx);
-  UNUSED(msg);
-  UNUSED(out);
-#ifdef TEST_POLLREQ
-  static int n = 0;
-
-  CMP_PKIMESSAGE *resp=NULL;
+  cmpsrv_txn *txn = srv_ctx->txn;
   CMP_CTX *ctx = srv_ctx->cmp_ctx;
+  time_t now = time(0);
 
-  if (!n) {
-    resp = CMP_pollRep_new(ctx);
-    *out = resp;
-  } else if (waiting_msg) {
-    *out = waiting_msg;
-    waiting_msg = NULL;
+  if (!txn || txn->state != CMPSRV_TXN_WAITING) {
+    dbgmsg("s", "ERROR: pollReq for a transaction that is not waiting");
+    return -1;
   }
 
-  n = !n;
-#endif
+  if (now < txn->readyAt) {
+    *out = CMP_pollRep_new(ctx, msg->body->value.pollReq, txn->readyAt - now);
+    return *out ? 0 : -1;
+  }
 
-  return 0;
+  /* the certificates are ready, deliver them in the ip/cp/kup */
+  if (sk_X509_num(txn->certs) <= 0) return -1;
+  certs_up_ref(txn->certs);
+  txn->state = CMPSRV_TXN_CONFIRM;
+  dbgmsg("sd", "delivering waiting certificates:", sk_X509_num(txn->certs));
+
+  *out = certrep_new(srv_ctx, txn->bodyType, txn->certs, txn->certReqIds);
+  return *out ? 0 : -1;
 }
 
 void init_handler_table(void)
@@ -326,6 +582,7 @@ void init_handler_table(void)
     msg_handlers[i] = NULL;
 
   msg_handlers[V_CMP_PKIBODY_IR]       = handlemsg_ir;
+  msg_handlers[V_CMP_PKIBODY_CR]       = handlemsg_ir;
   msg_handlers[V_CMP_PKIBODY_RR]       = handlemsg_rr;
   msg_handlers[V_CMP_PKIBODY_KUR]      = handlemsg_kur;
   msg_handlers[V_CMP_PKIBODY_CERTCONF] = handlemsg_certConf;
@@ -340,16 +597,24 @@ int CMPSRV_PKIMESSAGE_protect(cmpsrv_ctx *ctx, CMP_PKIMESSAGE *msg) {
   ASN1_OBJECT *algorOID=NULL;
   X509_ALGOR_get0(&algorOID, NULL, NULL, msg->header->protectionAlg);
 
+  /* the CA chain goes into the encoding as it was encoded once at startup */
+  const unsigned char *extraCertsDer = NULL;
+  int extraCertsDerLen = 0;
+  if (ctx->withExtraCerts && !msg->extraCerts) {
+    extraCertsDer = ctx->ca->extraCertsDer;
+    extraCertsDerLen = ctx->ca->extraCertsDerLen;
+  }
+
   /* use PasswordBasedMac according to 5.1.3.1 if secretValue is given */
   if (OBJ_obj2nid(algorOID) == NID_id_PasswordBasedMAC && ctx->cmp_ctx->secretValue) {
     if (!msg->header->protectionAlg)
       if(!(msg->header->protectionAlg = CMP_create_pbmac_algor())) goto err;
     CMP_PKIHEADER_set1_senderKID(msg->header, ctx->cmp_ctx->referenceValue);
-    if(!(msg->protection = CMP_calc_protection_pbmac( msg, ctx->cmp_ctx->secretValue))) 
+    if (!CMP_PKIMESSAGE_set_protection_ex(msg, NULL, ctx->cmp_ctx->secretValue, extraCertsDer, extraCertsDerLen))
       goto err;
   } else {
     /* use MSG_SIG_ALG according to 5.1.3.3 if client Certificate and private key is given */
-    if (ctx->cmp_ctx->srvCert && ctx->caKey) {
+    if (ctx->cmp_ctx->srvCert && ctx->ca->caKey) {
       ASN1_OCTET_STRING *subjKeyIDStr = NULL;
       int algNID = 0;
 
@@ -358,7 +623,7 @@ int CMPSRV_PKIMESSAGE_protect(cmpsrv_ctx *ctx, CMP_PKIMESSAGE *msg) {
 
       /* DSA/SHA1 is mandatory for MSG_SIG_ALG (appendix D.2) so SHA-1 is hardcoded here for now */
       /* This could be made configurable via ctx to include SHA-256 etc */
-      switch (EVP_PKEY_type(ctx->caKey->type)) {
+      switch (EVP_PKEY_type(ctx->ca->caKey->type)) {
         case EVP_PKEY_DSA: 
           algNID = NID_dsaWithSHA1;
           break;
@@ -379,7 +644,7 @@ int CMPSRV_PKIMESSAGE_protect(cmpsrv_ctx *ctx, CMP_PKIMESSAGE *msg) {
         ASN1_OCTET_STRING_free(subjKeyIDStr);
       }
 
-      if (!(msg->protection = CMP_calc_protection_sig( msg, ctx->caKey))) 
+      if (!CMP_PKIMESSAGE_set_protection_ex(msg, ctx->ca->caKey, NULL, extraCertsDer, extraCertsDerLen))
         goto err;
     } else {
       CMPerr(CMP_F_CMP_PKIMESSAGE_PROTECT, CMP_R_MISSING_KEY_INPUT_FOR_CREATING_PROTECTION);
@@ -431,86 +696,254 @@ char *V_CMP_TABLE[] = {
   (((unsigned int) (type) < sizeof(V_CMP_TABLE)/sizeof(V_CMP_TABLE[0])) \
    ? V_CMP_TABLE[(unsigned int)(type)] : "unknown")
 
-EVP_PKEY *clkey = NULL;
-int handleMessage(server *srv, connection *con, cmpsrv_ctx *ctx, CMP_PKIMESSAGE *msg, CMP_PKIMESSAGE **out)
+/* returns 1 if cert, taken from the extraCerts of a signed ir, is one we
+ * issued and have not revoked, or if it chains up to the configured root
+ * certificates (cmpsrv.rootCertPath) */
+static int sender_cert_trusted(cmpsrv_ctx *ctx, X509 *cert)
 {
-  UNUSED(con);
+  cmpsrv_ca *ca = ctx->ca;
+
+  if (ca->trusted_store && CMP_validate_cert_path(ca->trusted_store, ca->untrusted_store, cert))
+    return 1;
+
+  if (X509_check_issued(ca->caCert, cert) != X509_V_OK) return 0;
+  EVP_PKEY *caPub = X509_get_pubkey(ca->caCert);
+  int ok = caPub && X509_verify(cert, caPub) > 0
+    && X509_cmp_current_time(X509_get_notBefore(cert)) < 0
+    && X509_cmp_current_time(X509_get_notAfter(cert)) > 0;
+  EVP_PKEY_free(caPub);
+  if (!ok) return 0;
+
+  X509 *stored = cert_find_by_serial(ctx, ASN1_INTEGER_get(X509_get_serialNumber(cert)));
+  ok = stored && !X509_cmp(stored, cert);
+  X509_free(stored);
+  return ok;
+}
 
-  CMP_PKIMESSAGE *resp = 0;
-  int result = 0;
-  // EVP_PKEY *clkey = NULL;
+/* returns the certificate in extraCerts that names the sender and matches
+ * senderKID, as clients put their own certificate there, NULL if none does */
+static X509 *extracerts_signer(CMP_PKIMESSAGE *msg)
+{
+  if (msg->header->sender->type != GEN_DIRNAME) return NULL;
+
+  for (int i = 0; i < sk_X509_num(msg->extraCerts); i++) {
+    X509 *xc = sk_X509_value(msg->extraCerts, i);
+    if (X509_NAME_cmp(X509_get_subject_name(xc), msg->header->sender->d.directoryName)) continue;
+    if (msg->header->senderKID) {
+      ASN1_OCTET_STRING *kid = X509_get_ext_d2i(xc, NID_subject_key_identifier, NULL, NULL);
+      int match = kid && !ASN1_OCTET_STRING_cmp(kid, msg->header->senderKID);
+      ASN1_OCTET_STRING_free(kid);
+      if (!match) continue;
+    }
+    return xc;
+  }
+  return NULL;
+}
+
+/* returns the cached key if its certificate is still current, dropping the
+ * entry if it is not */
+static cmpsrv_key *find_current_key(cmpsrv_ctx *ctx, cmpsrv_key *key)
+{
+  if (key && !cert_is_current(ctx, key->serial)) {
+    cmpsrv_keycache_remove(ctx->keys, key->serial);
+    key = NULL;
+  }
+  return key;
+}
 
+/* Finds the public key for checking the signature of msg and, if it comes
+ * from the key cache, the verification context kept with it. As one subject
+ * may hold several certificates, the certificates we issued are looked up
+ * by issuer and serial of the sender's certificate in extraCerts, for a kur
+ * only by the serial of the old certificate, in the cache first and in the
+ * database on a miss. Without one in extraCerts, a certificate is only taken
+ * if it is the only one matching senderKID and sender name, or, for
+ * certificates without subjectKeyIdentifier, sender name alone. A cached key
+ * is only used while its certificate is current in the database, as a kur or
+ * rr in another worker does not reach this worker's cache. Returns a new
+ * reference to the key, NULL if none was found. */
+static EVP_PKEY *find_sender_key(server *srv, cmpsrv_ctx *ctx, CMP_PKIMESSAGE *msg, time_t now, EVP_PKEY_CTX **vctx)
+{
   int bodyType = CMP_PKIMESSAGE_get_bodytype(msg);
-  int protectionAlg = OBJ_obj2nid(msg->header->protectionAlg->algorithm);
+  cmpsrv_key *key = NULL;
+  EVP_PKEY *pkey = NULL;
+  X509 *c = NULL, *xc = NULL;
 
-  if (ctx->cmp_ctx->transactionID != NULL)
-    ASN1_OCTET_STRING_free(ctx->transactionID);
-  ctx->cmp_ctx->transactionID = ASN1_STRING_dup(msg->header->transactionID);
+  *vctx = NULL;
 
-  // check username if using pbmac
-  if (protectionAlg == NID_id_PasswordBasedMAC &&
-      ASN1_OCTET_STRING_cmp(msg->header->senderKID, ctx->cmp_ctx->referenceValue)) {
-    dbgmsg("s", "ERROR: invalid user ID");
-    /* TODO send back error message */
-    log_cmperrors(srv);
-    return 0;
+  /* later messages of a transaction use the key of the request */
+  if (ctx->txn && ctx->txn->senderKey &&
+      bodyType != V_CMP_PKIBODY_IR && bodyType != V_CMP_PKIBODY_CR && bodyType != V_CMP_PKIBODY_KUR) {
+    CRYPTO_add(&ctx->txn->senderKey->references, 1, CRYPTO_LOCK_EVP_PKEY);
+    return ctx->txn->senderKey;
   }
 
-  if (bodyType == V_CMP_PKIBODY_IR && protectionAlg != NID_id_PasswordBasedMAC) {
+  if (bodyType == V_CMP_PKIBODY_IR) {
     // IR using factory certificate (E.7)
-    // TODO really should check here that the certificate is actually signed by this CA...
+    if (msg->header->sender->type != GEN_DIRNAME) return NULL;
 
     // find the clients cert in extracerts by looking for a certificate that
     // has a subject name matching the sender field in pkiheader
     int ncerts = sk_X509_num(msg->extraCerts);
     for (int i = 0; i < ncerts; i++) {
-      X509 *c = sk_X509_value(msg->extraCerts, i);
-      if (!X509_NAME_cmp(c->cert_info->subject, msg->header->sender->d.directoryName)) {
-        // clkey = c->cert_info->key->pkey;
-        clkey = X509_get_pubkey(c);
-        break;
+      X509 *xc = sk_X509_value(msg->extraCerts, i);
+      if (X509_NAME_cmp(xc->cert_info->subject, msg->header->sender->d.directoryName)) continue;
+      if (!sender_cert_trusted(ctx, xc)) {
+        dbgmsg("s", "ERROR: sender certificate in extraCerts is not trusted");
+        return NULL;
       }
+      return X509_get_pubkey(xc);
     }
-    if (clkey == NULL) {
-      dbgmsg("s", "ERROR: could not find client public key in database");
-    }
+    return NULL;
   }
 
   if (bodyType == V_CMP_PKIBODY_KUR) {
-    // CMP_CTX_set_protectionAlgor( ctx->cmp_ctx, CMP_ALG_SIG);
+    /* a kur must be signed with the key of the certificate it updates, so
+     * never take the key the client points to with senderKID */
+    long oldserial = kur_old_serial(msg);
+    if (!(key = find_current_key(ctx, cmpsrv_keycache_find_serial(ctx->keys, oldserial, now)))) {
+      dbgmsg("s", "client key not cached, looking up certificate by serial");
+      c = cert_find_by_serial(ctx, oldserial);
+    }
+  }
+  else if ((xc = extracerts_signer(msg))) {
+    long serial = ASN1_INTEGER_get(X509_get_serialNumber(xc));
+    if (!(key = find_current_key(ctx, cmpsrv_keycache_find_serial(ctx->keys, serial, now)))) {
+      dbgmsg("s", "client key not cached, looking up certificate by issuer and serial");
+      c = cert_find_by_issuer_serial(ctx, X509_get_issuer_name(xc), serial);
+      if (c && X509_cmp(c, xc)) {
+        X509_free(c);
+        c = NULL;
+      }
+    }
+  }
+  else if (msg->header->sender->type == GEN_DIRNAME) {
+    X509_NAME *sender = msg->header->sender->d.directoryName;
+    ASN1_OCTET_STRING *kid = msg->header->senderKID;
+    key = find_current_key(ctx, cmpsrv_keycache_find_kid(ctx->keys, kid, sender, now));
+    if (!key && kid) {
+      dbgmsg("s", "client key not cached, looking up certificate by senderKID");
+      c = cert_find_by_kid(ctx, kid, sender);
+    }
+    if (!key && !c) {
+      dbgmsg("s", "looking up certificate by name");
+      c = cert_find_by_name(ctx, sender);
+    }
+  }
 
-    // get private key for verifying protection
-    CRMF_CERTREQMSG *reqmsg = sk_CRMF_CERTREQMSG_value( msg->body->value.kur, 0);
-    CRMF_CERTREQUEST *req = reqmsg->certReq;
+  if (c) {
+    ctx->senderSerial = ASN1_INTEGER_get(X509_get_serialNumber(c));
+    if (!(key = cmpsrv_keycache_add(ctx->keys, c, now)))
+      pkey = X509_get_pubkey(c);
+    X509_free(c);
+  }
+
+  if (key) {
+    ctx->senderSerial = key->serial;
+    pkey = key->pkey;
+    CRYPTO_add(&pkey->references, 1, CRYPTO_LOCK_EVP_PKEY);
+    *vctx = key->vctx;
+  }
+
+  return pkey;
+}
+
+int handleMessage(server *srv, connection *con, cmpsrv_ctx *ctx, CMP_PKIMESSAGE *msg, CMP_PKIMESSAGE **out)
+{
+  UNUSED(con);
+
+  CMP_PKIMESSAGE *resp = 0;
+  int result = 0;
+  EVP_PKEY *clkey = NULL;
+  EVP_PKEY_CTX *clctx = NULL;
 
-    int n = sk_CRMF_ATTRIBUTETYPEANDVALUE_num(req->controls);
-    int oldserial = 0;
-    for (int i = 0; i < n; i++) {
-      CRMF_ATTRIBUTETYPEANDVALUE *atav = sk_CRMF_ATTRIBUTETYPEANDVALUE_value(req->controls,i);
-      if (OBJ_obj2nid(atav->type) == NID_id_regCtrl_oldCertID) {
-        CRMF_CERTID *cid = atav->value.oldCertId;
-        oldserial = ASN1_INTEGER_get(cid->serialNumber);
+  int bodyType = CMP_PKIMESSAGE_get_bodytype(msg);
+  if (!msg->header->protectionAlg || !msg->protection) {
+    dbgmsg("s", "ERROR: message is not protected");
+    return 0;
+  }
+  int protectionAlg = OBJ_obj2nid(msg->header->protectionAlg->algorithm);
+
+  if (ctx->cmp_ctx->transactionID != NULL)
+    ASN1_OCTET_STRING_free(ctx->transactionID);
+  ctx->cmp_ctx->transactionID = ASN1_STRING_dup(msg->header->transactionID);
+
+  /* certConf and pollReq continue an open transaction, whose sender key
+   * their protection is checked with */
+  time_t now = time(0);
+  switch (bodyType) {
+    case V_CMP_PKIBODY_CERTCONF:
+    case V_CMP_PKIBODY_POLLREQ:
+      ctx->txn = cmpsrv_txn_find(ctx->txns, msg->header->transactionID, now);
+      if (!ctx->txn) {
+        dbgmsg("s", "ERROR: unknown or expired transaction");
+        return 0;
       }
-    }
+      if (ctx->txn->senderNonce &&
+          (!msg->header->recipNonce || ASN1_OCTET_STRING_cmp(msg->header->recipNonce, ctx->txn->senderNonce))) {
+        dbgmsg("s", "ERROR: recipNonce does not match our last senderNonce");
+        return 0;
+      }
+      break;
+  }
 
-    X509 *c = cert_find_by_serial(ctx, oldserial);
-    if (c != NULL) {
-      // clkey = c->cert_info->key->pkey;
-      clkey = X509_get_pubkey(c);
-    }
-    else
-      dbgmsg("s", "ERROR: could not find client public key in database");
+  /* echo the client's senderNonce in our response */
+  CMP_CTX_set1_recipNonce(ctx->cmp_ctx, msg->header->senderNonce);
+
+  /* only the holder of the certificate being updated may send a kur */
+  if (bodyType == V_CMP_PKIBODY_KUR && protectionAlg == NID_id_PasswordBasedMAC) {
+    dbgmsg("s", "ERROR: kur must be signed with the key of the old certificate");
+    return 0;
   }
 
-#if 0
-  if (!CMP_validate_msg(ctx->cmp_ctx, msg)) {
+  // check username if using pbmac
+  if (protectionAlg == NID_id_PasswordBasedMAC &&
+      ASN1_OCTET_STRING_cmp(msg->header->senderKID, ctx->cmp_ctx->referenceValue)) {
+    dbgmsg("s", "ERROR: invalid user ID");
+    /* TODO send back error message */
+    log_cmperrors(srv);
+    return 0;
+  }
+
+  /* check the protection: PBM with the shared secret, a signature with the
+   * key of the sender's certificate */
+  int valid = 0;
+  ctx->senderSerial = 0;
+  if (protectionAlg == NID_id_PasswordBasedMAC)
+    valid = CMP_validate_msg(ctx->cmp_ctx, msg);
+  else if (!(clkey = find_sender_key(srv, ctx, msg, now, &clctx)))
+    dbgmsg("s", "ERROR: could not find client public key in database");
+  else
+    valid = cmpsrv_verify_signature(clkey, clctx, msg);
+
+  if (!valid) {
     dbgmsg("s", "ERROR: protection not valid!");
     /* TODO send back error message */
     log_cmperrors(srv);
+    EVP_PKEY_free(clkey);
     return 0;
   }
   else dbgmsg("s", "protection validated successfully");
-#endif
+
+  /* requests starting a transaction open a new entry, but only once their
+   * protection was checked, and never in place of one that is under way */
+  if (bodyType == V_CMP_PKIBODY_IR || bodyType == V_CMP_PKIBODY_CR || bodyType == V_CMP_PKIBODY_KUR) {
+    if (!(ctx->txn = cmpsrv_txn_add(ctx->txns, msg->header->transactionID, now))) {
+      dbgmsg("s", "ERROR: transactionID is already in use");
+      EVP_PKEY_free(clkey);
+      return 0;
+    }
+    ctx->txn->bodyType = bodyType;
+  }
+
+  /* remember the sender's key for the rest of the transaction, so later
+   * messages need no lookup in extraCerts, the key cache or the cert DB */
+  if (ctx->txn && clkey && !ctx->txn->senderKey &&
+      (bodyType == V_CMP_PKIBODY_IR || bodyType == V_CMP_PKIBODY_CR || bodyType == V_CMP_PKIBODY_KUR)) {
+    CRYPTO_add(&clkey->references, 1, CRYPTO_LOCK_EVP_PKEY);
+    ctx->txn->senderKey = clkey;
+  }
+  EVP_PKEY_free(clkey);
 
   if (msg_handlers[bodyType] != 0) {
     if (msg_handlers[bodyType](srv, ctx, msg, &resp) == 0) {
@@ -538,8 +971,56 @@ int handleMessage(server *srv, connection *con, cmpsrv_ctx *ctx, CMP_PKIMESSAGE
   else
     dbgmsg("s", "ERROR: unsupported message: ", MSG_TYPE_STR(bodyType));
 
+  if (ctx->txn) {
+    if (!result || ctx->txn->state == CMPSRV_TXN_DONE || ctx->txn->state == CMPSRV_TXN_OPEN) {
+      /* finished, failed, or nothing to wait for */
+      cmpsrv_txn_remove(ctx->txns, ctx->txn);
+    }
+    else {
+      ASN1_OCTET_STRING_free(ctx->txn->senderNonce);
+      ctx->txn->senderNonce = ASN1_OCTET_STRING_dup(resp->header->senderNonce);
+      ASN1_OCTET_STRING_free(ctx->txn->recipNonce);
+      ctx->txn->recipNonce = ASN1_OCTET_STRING_dup(msg->header->senderNonce);
+      /* another worker may have answered the same message meanwhile */
+      if (!cmpsrv_txn_save(ctx->txns, ctx->txn)) {
+        dbgmsg("s", "ERROR: could not save the transaction");
+        result = 0;
+      }
+      cmpsrv_txn_free(ctx->txn);
+    }
+    ctx->txn = NULL;
+  }
+
   *out = resp;
 
   return result;
 }
 
+/* Builds a CRLAnn with the current base and delta CRL, signed by the CA. An
+ * announcement cannot be pushed over HTTP, so it is sent in answer to a
+ * plain GET of the responder's URL. */
+int handleCrlAnn(server *srv, cmpsrv_ctx *ctx, CMP_PKIMESSAGE **out)
+{
+  STACK_OF(X509_CRL) *crls = current_crls(ctx);
+  CMP_PKIMESSAGE *resp = NULL;
+
+  if (!crls) {
+    dbgmsg("s", "ERROR: no CRL available");
+    return 0;
+  }
+  resp = CMP_crlAnn_new(ctx->cmp_ctx, crls);
+  sk_X509_CRL_free(crls);
+  if (!resp) return 0;
+
+  CMP_PKIHEADER_set1_sender( resp->header, X509_get_subject_name((X509*)ctx->cmp_ctx->srvCert));
+  /* filled in with the signature algorithm of the CA key */
+  resp->header->protectionAlg = X509_ALGOR_new();
+  if (!resp->header->protectionAlg || !CMPSRV_PKIMESSAGE_protect(ctx, resp)) {
+    dbgmsg("s", "error creating protection");
+    CMP_PKIMESSAGE_free(resp);
+    return 0;
+  }
+
+  *out = resp;
+  return 1;
+}
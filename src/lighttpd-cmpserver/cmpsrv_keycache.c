@@ -0,0 +1,257 @@
+  /***********************************************************************/
+  /* Copyright 2010-2011 Nokia Siemens Networks Oy. ALL RIGHTS RESERVED. */
+  /* Written by Miikka Viljanen <mviljane@users.sourceforge.net>         */
+  /***********************************************************************/
+
+#include "mod_cmpsrv.h"
+
+/* ############################################################################ *
+ * Public keys of the client certificates we issued, for checking the
+ * signature protection of their requests.
+ *
+ * Entries are found by certificate serial number (oldCertID of a kur) and by
+ * subjectKeyIdentifier (senderKID of the header) together with the subject,
+ * as a cr may certify the same key for another subject. Each holds the parsed
+ * EVP_PKEY together with an EVP_PKEY_CTX already initialized for
+ * verification, so a hit needs neither the database nor d2i_X509. Entries
+ * are added when certificates are issued and when a lookup had to go to the
+ * database. They expire TTL seconds after they were added, oldest first; if
+ * the cache is full the oldest entry is dropped early.
+ *
+ * lighttpd runs the plugin handlers in a single thread, so there is no
+ * locking. Every worker process has its own cache, and a kur or rr handled
+ * by one worker cannot remove the entry from the others. The caller must
+ * therefore check that the certificate of an entry found is still current,
+ * see cert_is_current(), which needs only an indexed lookup.
+ * ############################################################################ */
+
+static unsigned long kid_hash(const ASN1_OCTET_STRING *kid)
+{
+  unsigned long h = 2166136261UL;
+  for (int i = 0; i < kid->length; i++)
+    h = (h ^ kid->data[i]) * 16777619UL;
+  return h;
+}
+
+static size_t serial_bucket(const cmpsrv_keycache *c, long serial)
+{
+  return (unsigned long) serial % c->nbuckets;
+}
+
+static void key_free(cmpsrv_key *key)
+{
+  if (!key) return;
+  ASN1_OCTET_STRING_free(key->kid);
+  X509_NAME_free(key->subject);
+  EVP_PKEY_CTX_free(key->vctx);
+  EVP_PKEY_free(key->pkey);
+  free(key);
+}
+
+/* takes the entry out of both hash chains and the age list, does not free it */
+static void key_unlink(cmpsrv_keycache *c, cmpsrv_key *key)
+{
+  cmpsrv_key **pp = &c->by_serial[serial_bucket(c, key->serial)];
+  for (; *pp; pp = &(*pp)->next_serial)
+    if (*pp == key) {
+      *pp = key->next_serial;
+      break;
+    }
+
+  if (key->kid) {
+    pp = &c->by_kid[kid_hash(key->kid) % c->nbuckets];
+    for (; *pp; pp = &(*pp)->next_kid)
+      if (*pp == key) {
+        *pp = key->next_kid;
+        break;
+      }
+  }
+
+  if (key->prev) key->prev->next = key->next;
+  else c->oldest = key->next;
+  if (key->next) key->next->prev = key->prev;
+  else c->newest = key->prev;
+
+  c->num--;
+}
+
+cmpsrv_keycache *cmpsrv_keycache_new(size_t nbuckets, size_t max, int ttl)
+{
+  cmpsrv_keycache *c = calloc(1, sizeof(cmpsrv_keycache));
+  if (!c) return NULL;
+
+  if (nbuckets == 0) nbuckets = CMPSRV_KEY_BUCKETS;
+  c->by_serial = calloc(nbuckets, sizeof(cmpsrv_key *));
+  c->by_kid = calloc(nbuckets, sizeof(cmpsrv_key *));
+  if (!c->by_serial || !c->by_kid) {
+    cmpsrv_keycache_free(c);
+    return NULL;
+  }
+  c->nbuckets = nbuckets;
+  c->max = max > 0 ? max : CMPSRV_KEY_MAX;
+  c->ttl = ttl > 0 ? ttl : CMPSRV_KEY_TTL;
+
+  return c;
+}
+
+void cmpsrv_keycache_free(cmpsrv_keycache *c)
+{
+  if (!c) return;
+
+  cmpsrv_key *key = c->oldest;
+  while (key) {
+    cmpsrv_key *next = key->next;
+    key_free(key);
+    key = next;
+  }
+  free(c->by_serial);
+  free(c->by_kid);
+  free(c);
+}
+
+/* drops the entry for the certificate with the given serial number, e.g.
+ * when it has been replaced by a kur */
+void cmpsrv_keycache_remove(cmpsrv_keycache *c, long serial)
+{
+  if (!c) return;
+
+  cmpsrv_key *key = c->by_serial[serial_bucket(c, serial)];
+  for (; key; key = key->next_serial) {
+    if (key->serial != serial) continue;
+    key_unlink(c, key);
+    key_free(key);
+    return;
+  }
+}
+
+/* adds the public key of cert, replacing an entry with the same serial.
+ * Returns the new entry, which stays owned by the cache. */
+cmpsrv_key *cmpsrv_keycache_add(cmpsrv_keycache *c, X509 *cert, time_t now)
+{
+  cmpsrv_key *key = NULL;
+
+  if (!c || !cert) return NULL;
+
+  long serial = ASN1_INTEGER_get(X509_get_serialNumber(cert));
+  cmpsrv_keycache_remove(c, serial);
+
+  cmpsrv_keycache_expire(c, now);
+  if (c->num >= c->max && c->oldest) {
+    key = c->oldest;
+    key_unlink(c, key);
+    key_free(key);
+  }
+
+  if (!(key = calloc(1, sizeof(cmpsrv_key)))) return NULL;
+  key->serial = serial;
+  key->expires = now + c->ttl;
+  if (!(key->pkey = X509_get_pubkey(cert))) goto err;
+  if (!(key->vctx = EVP_PKEY_CTX_new(key->pkey, NULL))) goto err;
+  if (EVP_PKEY_verify_init(key->vctx) <= 0) goto err;
+  key->kid = X509_get_ext_d2i(cert, NID_subject_key_identifier, NULL, NULL);
+  if (!(key->subject = X509_NAME_dup(X509_get_subject_name(cert)))) goto err;
+
+  cmpsrv_key **b = &c->by_serial[serial_bucket(c, serial)];
+  key->next_serial = *b;
+  *b = key;
+  if (key->kid) {
+    b = &c->by_kid[kid_hash(key->kid) % c->nbuckets];
+    key->next_kid = *b;
+    *b = key;
+  }
+
+  /* entries are appended in the order they expire */
+  key->prev = c->newest;
+  if (c->newest) c->newest->next = key;
+  else c->oldest = key;
+  c->newest = key;
+  c->num++;
+
+  return key;
+
+err:
+  key_free(key);
+  return NULL;
+}
+
+cmpsrv_key *cmpsrv_keycache_find_serial(cmpsrv_keycache *c, long serial, time_t now)
+{
+  if (!c) return NULL;
+
+  cmpsrv_key *key = c->by_serial[serial_bucket(c, serial)];
+  for (; key; key = key->next_serial)
+    if (key->serial == serial)
+      return key->expires > now ? key : NULL;
+
+  return NULL;
+}
+
+cmpsrv_key *cmpsrv_keycache_find_kid(cmpsrv_keycache *c, const ASN1_OCTET_STRING *kid, X509_NAME *subject, time_t now)
+{
+  if (!c || !kid || !subject) return NULL;
+
+  cmpsrv_key *key = c->by_kid[kid_hash(kid) % c->nbuckets];
+  for (; key; key = key->next_kid)
+    if (!ASN1_OCTET_STRING_cmp(key->kid, kid) && !X509_NAME_cmp(key->subject, subject))
+      return key->expires > now ? key : NULL;
+
+  return NULL;
+}
+
+/* drops all entries older than the TTL, returns their number */
+int cmpsrv_keycache_expire(cmpsrv_keycache *c, time_t now)
+{
+  int n = 0;
+
+  if (!c) return 0;
+
+  while (c->oldest && c->oldest->expires <= now) {
+    cmpsrv_key *key = c->oldest;
+    key_unlink(c, key);
+    key_free(key);
+    n++;
+  }
+
+  return n;
+}
+
+/* ############################################################################ *
+ * Checks the signature protection of msg with pkey. vctx, if given, must be
+ * a verification context for pkey as kept in the cache; otherwise a
+ * temporary one is used. Returns 1 if the signature is valid.
+ * ############################################################################ */
+int cmpsrv_verify_signature(EVP_PKEY *pkey, EVP_PKEY_CTX *vctx, CMP_PKIMESSAGE *msg)
+{
+  EVP_PKEY_CTX *tmp = NULL;
+  unsigned char *protPartDer = NULL;
+  unsigned char md[EVP_MAX_MD_SIZE];
+  unsigned int mdlen = 0;
+  int mdnid = NID_undef, pknid = NID_undef;
+  int ret = 0;
+
+  if (!pkey || !msg->header->protectionAlg || !msg->protection) return 0;
+
+  /* the digest and key type follow from the signature algorithm */
+  int algnid = OBJ_obj2nid(msg->header->protectionAlg->algorithm);
+  if (!OBJ_find_sigid_algs(algnid, &mdnid, &pknid)) return 0;
+  if (EVP_PKEY_type(pknid) != EVP_PKEY_type(pkey->type)) return 0;
+  const EVP_MD *digest = EVP_get_digestbynid(mdnid);
+  if (!digest) return 0;
+
+  if (!vctx) {
+    if (!(vctx = tmp = EVP_PKEY_CTX_new(pkey, NULL))) return 0;
+    if (EVP_PKEY_verify_init(vctx) <= 0) goto err;
+  }
+
+  int protPartDerLen = CMP_PKIMESSAGE_get_protectedPart_der(msg, &protPartDer);
+  if (protPartDerLen <= 0) goto err;
+  if (!EVP_Digest(protPartDer, protPartDerLen, md, &mdlen, digest, NULL)) goto err;
+
+  if (EVP_PKEY_CTX_set_signature_md(vctx, digest) <= 0) goto err;
+  ret = EVP_PKEY_verify(vctx, msg->protection->data, msg->protection->length, md, mdlen) == 1;
+
+err:
+  OPENSSL_free(protPartDer);
+  EVP_PKEY_CTX_free(tmp);
+  return ret;
+}
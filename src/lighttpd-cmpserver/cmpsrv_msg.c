@@ -11,7 +11,7 @@
 
 /* ############################################################################ */
 /* ############################################################################ */
-CMP_PKIMESSAGE * CMP_pollRep_new( CMP_CTX *ctx) {
+CMP_PKIMESSAGE * CMP_pollRep_new( CMP_CTX *ctx, CMP_POLLREQCONTENT *preqs, long checkAfter) {
     CMP_PKIMESSAGE *msg = NULL;
     CMP_POLLREP    *prep = NULL;
     if (!ctx) goto err;
@@ -22,22 +22,78 @@ CMP_PKIMESSAGE * CMP_pollRep_new( CMP_CTX *ctx) {
 
     CMP_PKIMESSAGE_set_bodytype( msg, V_CMP_PKIBODY_POLLREP);
 
-    prep = CMP_POLLREP_new();
-    /* TODO support multiple cert request ids to poll */
-    ASN1_INTEGER_set(prep->certReqId, 0);
-    ASN1_INTEGER_set(prep->checkAfter, 5);
     msg->body->value.pollRep = sk_CMP_POLLREP_new_null();
-    sk_CMP_POLLREP_push(msg->body->value.pollRep, prep);
+
+    /* answer every certReqId polled for, or certReqId 0 if none was given */
+    for (int i = 0; i < sk_CMP_POLLREQ_num(preqs) || i == 0; i++) {
+      CMP_POLLREQ *preq = sk_CMP_POLLREQ_value(preqs, i);
+      prep = CMP_POLLREP_new();
+      ASN1_INTEGER_set(prep->certReqId, preq ? ASN1_INTEGER_get(preq->certReqId) : 0);
+      ASN1_INTEGER_set(prep->checkAfter, checkAfter);
+      sk_CMP_POLLREP_push(msg->body->value.pollRep, prep);
+    }
+
+    return msg;
+
+err:
+    return NULL;
+}
+
+/* ############################################################################ */
+/* Builds a CRLAnn announcing the CRLs. Takes ownership of the CRLs but not of
+ * the stack. */
+/* ############################################################################ */
+CMP_PKIMESSAGE * CMP_crlAnn_new( CMP_CTX *ctx, STACK_OF(X509_CRL) *crls) {
+    CMP_PKIMESSAGE *msg = NULL;
+    if (!ctx || !crls) goto err;
+
+    if (!(msg = CMP_PKIMESSAGE_new())) goto err;
+
+    if( !CMP_PKIHEADER_init(ctx, msg->header)) goto err;
+
+    CMP_PKIMESSAGE_set_bodytype( msg, V_CMP_PKIBODY_CRLANN);
+
+    if (!(msg->body->value.crlann = sk_X509_CRL_dup(crls))) goto err;
 
     return msg;
 
 err:
+    if (msg) CMP_PKIMESSAGE_free(msg);
+    for (int i = 0; i < sk_X509_CRL_num(crls); i++)
+      X509_CRL_free(sk_X509_CRL_value(crls, i));
     return NULL;
 }
 
+/* ############################################################################ */
+/* Builds a CertRepMessage with one accepted response per certificate, answering
+ * the request with certReqId reqIds[i] with certs[i]. Takes ownership of the
+ * certificates but not of the stack. */
+/* ############################################################################ */
+static CMP_CERTREPMESSAGE *certrep_new( STACK_OF(X509) *certs, const long *reqIds)
+{
+	CMP_CERTREPMESSAGE *resp = CMP_CERTREPMESSAGE_new();
+	if (!resp) return NULL;
+
+	resp->response = sk_CMP_CERTRESPONSE_new_null();
+
+	for (int i = 0; i < sk_X509_num(certs); i++) {
+		CMP_CERTRESPONSE *cr = CMP_CERTRESPONSE_new();
+		ASN1_INTEGER_set(cr->certReqId, reqIds ? reqIds[i] : i);
+		ASN1_INTEGER_set(cr->status->status, CMP_PKISTATUS_accepted);
+
+		cr->certifiedKeyPair = CMP_CERTIFIEDKEYPAIR_new();
+		cr->certifiedKeyPair->certOrEncCert->type = CMP_CERTORENCCERT_CERTIFICATE;
+		cr->certifiedKeyPair->certOrEncCert->value.certificate = sk_X509_value(certs, i);
+
+		sk_CMP_CERTRESPONSE_push(resp->response, cr);
+	}
+
+	return resp;
+}
+
 /* ############################################################################ */
 /* ############################################################################ */
-CMP_PKIMESSAGE * CMP_ip_new( CMP_CTX *ctx, X509 *cert)
+CMP_PKIMESSAGE * CMP_ip_new( CMP_CTX *ctx, STACK_OF(X509) *certs, const long *reqIds)
 {
 	CMP_PKIMESSAGE *msg=NULL;
 
@@ -89,18 +145,8 @@ CMP_PKIMESSAGE * CMP_ip_new( CMP_CTX *ctx, X509 *cert)
 	// CRMF_CERTREQMSG *reqmsg = sk_CRMF_CERTREQMSG_value( msg->body->value.ir, 0);
 	// CMP_PKIHEADER_set1_recipient( msg->header, reqmsg->certReq->certTemplate->subject);
 
-	CMP_CERTREPMESSAGE *resp = CMP_CERTREPMESSAGE_new();
-
-	CMP_CERTRESPONSE *cr = CMP_CERTRESPONSE_new();
-	ASN1_INTEGER_set(cr->certReqId, 0);
-	ASN1_INTEGER_set(cr->status->status, CMP_PKISTATUS_accepted);
-
-	cr->certifiedKeyPair = CMP_CERTIFIEDKEYPAIR_new();
-	cr->certifiedKeyPair->certOrEncCert->type = CMP_CERTORENCCERT_CERTIFICATE;
-	cr->certifiedKeyPair->certOrEncCert->value.certificate = cert;
-
-	resp->response = sk_CMP_CERTRESPONSE_new_null();
-	sk_CMP_CERTRESPONSE_push(resp->response, cr);
+	CMP_CERTREPMESSAGE *resp = certrep_new(certs, reqIds);
+	if (!resp) goto err;
 	
 	resp->caPubs = sk_X509_new_null();
 	//todo send cacert
@@ -114,7 +160,7 @@ err:
 }
 
 
-CMP_PKIMESSAGE * CMP_kup_new( CMP_CTX *ctx, X509 *cert)
+CMP_PKIMESSAGE * CMP_kup_new( CMP_CTX *ctx, STACK_OF(X509) *certs, const long *reqIds)
 {
 	UNUSED(ctx);
 
@@ -161,18 +207,8 @@ CMP_PKIMESSAGE * CMP_kup_new( CMP_CTX *ctx, X509 *cert)
 	// CRMF_CERTREQMSG *reqmsg = sk_CRMF_CERTREQMSG_value( msg->body->value.ir, 0);
 	// CMP_PKIHEADER_set1_recipient( msg->header, reqmsg->certReq->certTemplate->subject);
 
-	CMP_CERTREPMESSAGE *resp = CMP_CERTREPMESSAGE_new();
-
-	CMP_CERTRESPONSE *cr = CMP_CERTRESPONSE_new();
-	ASN1_INTEGER_set(cr->certReqId, 0);
-	ASN1_INTEGER_set(cr->status->status, CMP_PKISTATUS_accepted);
-
-	cr->certifiedKeyPair = CMP_CERTIFIEDKEYPAIR_new();
-	cr->certifiedKeyPair->certOrEncCert->type = CMP_CERTORENCCERT_CERTIFICATE;
-	cr->certifiedKeyPair->certOrEncCert->value.certificate = cert;
-
-	resp->response = sk_CMP_CERTRESPONSE_new_null();
-	sk_CMP_CERTRESPONSE_push(resp->response, cr);
+	CMP_CERTREPMESSAGE *resp = certrep_new(certs, reqIds);
+	if (!resp) goto err;
 	
 	// resp->caPubs = sk_X509_new_null();
 
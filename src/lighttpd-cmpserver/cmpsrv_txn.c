@@ -0,0 +1,116 @@
+  /***********************************************************************/
+  /* Copyright 2010-2011 Nokia Siemens Networks Oy. ALL RIGHTS RESERVED. */
+  /* Written by Miikka Viljanen <mviljane@users.sourceforge.net>         */
+  /***********************************************************************/
+
+#include "mod_cmpsrv.h"
+
+/* ############################################################################ *
+ * Open CMP transactions, keyed by transactionID.
+ *
+ * A transaction keeps what later messages of the same transaction need: the
+ * nonces, the sender's public key once it is known, and the certificates that
+ * are waiting to be delivered by pollRep or confirmed by certConf. It is
+ * stored in the txns table of the certificate database, so that a pollReq or
+ * certConf may be handled by another worker than the request that started the
+ * transaction. Each request loads its transaction, and saves or removes it
+ * when the response is ready; a save fails if another worker has moved the
+ * transaction on in between. Transactions expire when they have not been
+ * touched for the configured TTL; the plugin's trigger calls
+ * cmpsrv_txn_expire() once a second.
+ * ############################################################################ */
+
+void cmpsrv_txn_free(cmpsrv_txn *txn)
+{
+  if (!txn) return;
+  ASN1_OCTET_STRING_free(txn->transactionID);
+  ASN1_OCTET_STRING_free(txn->senderNonce);
+  ASN1_OCTET_STRING_free(txn->recipNonce);
+  EVP_PKEY_free(txn->senderKey);
+  if (txn->certs) sk_X509_pop_free(txn->certs, X509_free);
+  free(txn->certReqIds);
+  free(txn);
+}
+
+cmpsrv_txn_table *cmpsrv_txn_table_new(cmpsrv_certstore *store, int ttl)
+{
+  if (!store) return NULL;
+
+  cmpsrv_txn_table *t = calloc(1, sizeof(cmpsrv_txn_table));
+  if (!t) return NULL;
+
+  t->store = store;
+  t->ttl = ttl > 0 ? ttl : CMPSRV_TXN_TTL;
+
+  return t;
+}
+
+void cmpsrv_txn_table_free(cmpsrv_txn_table *t)
+{
+  free(t);
+}
+
+/* loads the open transaction with the given ID, NULL if there is none or it
+ * has expired. the caller owns the returned copy and passes it to
+ * cmpsrv_txn_save(), cmpsrv_txn_remove() or cmpsrv_txn_free() */
+cmpsrv_txn *cmpsrv_txn_find(cmpsrv_txn_table *t, const ASN1_OCTET_STRING *tid, time_t now)
+{
+  if (!t || !tid) return NULL;
+
+  cmpsrv_txn *txn = txn_store_find(t->store, tid, now);
+  if (txn) txn->expires = now + t->ttl;
+  return txn;
+}
+
+/* starts a new transaction, replacing an open one with the same ID. returns
+ * NULL if a transaction with this ID has got beyond the open state, so a
+ * request reusing the ID cannot discard it */
+cmpsrv_txn *cmpsrv_txn_add(cmpsrv_txn_table *t, const ASN1_OCTET_STRING *tid, time_t now)
+{
+  cmpsrv_txn *txn = NULL;
+
+  if (!t || !tid) return NULL;
+
+  if (!(txn = calloc(1, sizeof(cmpsrv_txn)))) return NULL;
+  if (!(txn->transactionID = ASN1_OCTET_STRING_dup(tid))) {
+    free(txn);
+    return NULL;
+  }
+  txn->expires = now + t->ttl;
+  txn->state = txn->savedState = CMPSRV_TXN_OPEN;
+
+  if (!txn_store_insert(t->store, txn, now)) {
+    cmpsrv_txn_free(txn);
+    return NULL;
+  }
+
+  return txn;
+}
+
+/* writes the transaction back. returns 0 if it failed or the transaction was
+ * removed or moved on by another worker since it was loaded */
+int cmpsrv_txn_save(cmpsrv_txn_table *t, cmpsrv_txn *txn)
+{
+  if (!t || !txn) return 0;
+
+  if (!txn_store_update(t->store, txn)) return 0;
+  txn->savedState = txn->state;
+  return 1;
+}
+
+/* deletes the transaction from the database and frees it */
+void cmpsrv_txn_remove(cmpsrv_txn_table *t, cmpsrv_txn *txn)
+{
+  if (!t || !txn) return;
+
+  txn_store_delete(t->store, txn->transactionID);
+  cmpsrv_txn_free(txn);
+}
+
+/* drops all transactions not touched within the TTL, returns their number */
+int cmpsrv_txn_expire(cmpsrv_txn_table *t, time_t now)
+{
+  if (!t) return 0;
+
+  return txn_store_expire(t->store, now);
+}
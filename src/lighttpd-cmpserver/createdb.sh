@@ -1,4 +1,7 @@
 #!/bin/sh
 # simple script to create the sqlite database where certificates are stored
 # usage: createdb.sh <dbfile>
-sqlite3 $1 "create table certs (serial int not null primary key, name varchar not null, cert blob not null);"
+sqlite3 $1 "create table certs (serial int not null primary key, name varchar not null, cert blob not null, issuer varchar);
+create index certs_name on certs (name);
+create index certs_issuer_serial on certs (issuer, serial);
+pragma journal_mode=WAL;"
@@ -0,0 +1,62 @@
+#!/bin/sh
+# runs cmpload against a throwaway instance of the CMP responder on localhost
+# usage: loadtest.sh [cmpload options, e.g. --mix ir=50,kur=30,genm=20 --threads 16]
+#
+# the CA, its certificate database and the lighttpd config are created in a
+# temporary directory which is removed afterwards. environment variables:
+#   PORT       port to run lighttpd on (default 18080)
+#   POLLDELAY  cmpsrv.pollDelay, set it to have ir/cr/kur answered by polling
+#   LIGHTTPD   lighttpd binary (default sbin/lighttpd of the top-level dir)
+#   CMPLOAD    cmpload binary (default bin/cmpload of the top-level dir)
+#   OPENSSL    openssl binary for creating the CA (default openssl)
+
+DIR=$(cd $(dirname $0) && pwd)
+ROOT=$DIR/../..
+PORT=${PORT:-18080}
+POLLDELAY=${POLLDELAY:-0}
+LIGHTTPD=${LIGHTTPD:-$ROOT/sbin/lighttpd}
+CMPLOAD=${CMPLOAD:-$ROOT/bin/cmpload}
+OPENSSL=${OPENSSL:-openssl}
+USER_ID=loadtest
+SECRET=loadtest
+
+TMP=$(mktemp -d /tmp/cmpload.XXXXXX) || exit 1
+PID=
+cleanup() {
+  [ -n "$PID" ] && kill $PID 2>/dev/null && wait $PID 2>/dev/null
+  rm -rf $TMP
+}
+trap cleanup EXIT
+trap "exit 1" INT TERM
+
+$OPENSSL genrsa -out $TMP/cakey.pem 2048 2>/dev/null &&
+$OPENSSL req -new -x509 -key $TMP/cakey.pem -subj "/CN=cmpload CA" -days 30 \
+  -outform DER -out $TMP/cacert.der || exit 1
+sh $DIR/createdb.sh $TMP/certs.db > /dev/null || exit 1
+
+cat > $TMP/lighttpd.conf <<EOF
+cmpsrv.userID    = "$USER_ID"
+cmpsrv.secretKey = "$SECRET"
+cmpsrv.certPath  = "$TMP"
+cmpsrv.caCert    = "$TMP/cacert.der"
+cmpsrv.caKey     = "$TMP/cakey.pem"
+cmpsrv.pollDelay = $POLLDELAY
+
+server.port          = $PORT
+server.bind          = "127.0.0.1"
+server.document-root = "$TMP"
+server.errorlog      = "$TMP/error.log"
+server.modules       = ( "mod_cmpsrv" )
+EOF
+
+$LIGHTTPD -D -f $TMP/lighttpd.conf &
+PID=$!
+sleep 1
+if ! kill -0 $PID 2>/dev/null; then
+  echo "ERROR: lighttpd did not start:"
+  cat $TMP/error.log
+  exit 1
+fi
+
+$CMPLOAD --server 127.0.0.1 --port $PORT --srvcert $TMP/cacert.der \
+  --user $USER_ID --password $SECRET --srvpid $PID "$@"
@@ -6,6 +6,12 @@
 
 #include "mod_cmpsrv.h"
 
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
 #ifdef DEBUG
 static int ossl_error_cb(const char *str, size_t len, void *u)
 {
@@ -34,6 +40,8 @@ INIT_FUNC(mod_cmpsrv_init) {
   p->caKey = buffer_init();
   p->extraCertPath = buffer_init();
   p->rootCertPath = buffer_init();
+  p->raCertPath = buffer_init();
+  p->path = buffer_init();
 
   return p;
 }
@@ -67,6 +75,14 @@ FREE_FUNC(mod_cmpsrv_free) {
   buffer_free(p->caKey);
   array_free(p->extraCertPath);
   array_free(p->rootCertPath);
+  buffer_free(p->raCertPath);
+  buffer_free(p->path);
+
+  cmpsrv_ca_free(p->ca);
+  cmpsrv_txn_table_free(p->txns);
+  certstore_free(p->store);
+  cmpsrv_keycache_free(p->keys);
+  cmpsrv_crl_free(p->crls);
 
   free(p);
 
@@ -87,6 +103,12 @@ SETDEFAULTS_FUNC(mod_cmpsrv_set_defaults) {
     { "cmpsrv.caKey",        NULL, T_CONFIG_STRING, T_CONFIG_SCOPE_SERVER }, /* 4 */
     { "cmpsrv.extraCertPath", NULL, T_CONFIG_STRING, T_CONFIG_SCOPE_SERVER }, /* 5 */
     { "cmpsrv.rootCertPath",  NULL, T_CONFIG_STRING, T_CONFIG_SCOPE_SERVER }, /* 6 */
+    { "cmpsrv.transactionTTL", NULL, T_CONFIG_SHORT, T_CONFIG_SCOPE_SERVER }, /* 7 */
+    { "cmpsrv.pollDelay",     NULL, T_CONFIG_SHORT, T_CONFIG_SCOPE_SERVER }, /* 8 */
+    { "cmpsrv.crlInterval",   NULL, T_CONFIG_INT, T_CONFIG_SCOPE_SERVER }, /* 9 */
+    { "cmpsrv.path",          NULL, T_CONFIG_STRING, T_CONFIG_SCOPE_SERVER }, /* 10 */
+    { "cmpsrv.raCertPath",    NULL, T_CONFIG_STRING, T_CONFIG_SCOPE_SERVER }, /* 11 */
+    { "cmpsrv.raSecret",      NULL, T_CONFIG_BOOLEAN, T_CONFIG_SCOPE_SERVER }, /* 12 */
     { NULL,                  NULL, T_CONFIG_UNSET, T_CONFIG_SCOPE_UNSET }
   };
 
@@ -107,6 +129,12 @@ SETDEFAULTS_FUNC(mod_cmpsrv_set_defaults) {
     cv[4].destination = p->caKey;
     cv[5].destination = p->extraCertPath;
     cv[6].destination = p->rootCertPath;
+    cv[7].destination = &(p->transactionTTL);
+    cv[8].destination = &(p->pollDelay);
+    cv[9].destination = &(p->crlInterval);
+    cv[10].destination = p->path;
+    cv[11].destination = p->raCertPath;
+    cv[12].destination = &(p->raSecret);
 
     p->config_storage[i] = s;
 
@@ -115,6 +143,48 @@ SETDEFAULTS_FUNC(mod_cmpsrv_set_defaults) {
     }
   }
 
+  /* read the CA certificate and key, build the stores and chains and set up
+   * the database once, instead of for every request */
+  p->ca = cmpsrv_ca_new(p);
+  if (!p->ca) {
+    log_error_write(srv, __FILE__, __LINE__, "s", "cmpsrv: failed to load CA state");
+    log_cmperrors(srv);
+    return HANDLER_ERROR;
+  }
+  p->ca->pollDelay = p->pollDelay;
+
+  p->store = certstore_new(p->ca->certPath);
+  if (!p->store) {
+    log_error_write(srv, __FILE__, __LINE__, "ss", "cmpsrv: cannot open certificate database in", p->ca->certPath);
+    return HANDLER_ERROR;
+  }
+
+  p->txns = cmpsrv_txn_table_new(p->store, p->transactionTTL);
+  if (!p->txns) return HANDLER_ERROR;
+
+  p->keys = cmpsrv_keycache_new(CMPSRV_KEY_BUCKETS, CMPSRV_KEY_MAX, CMPSRV_KEY_TTL);
+  if (!p->keys) return HANDLER_ERROR;
+
+  p->crls = cmpsrv_crl_new(p->crlInterval);
+  if (!p->crls) return HANDLER_ERROR;
+
+  return HANDLER_GO_ON;
+}
+
+/* called once a second, drops transactions that were abandoned by the client
+ * and client keys that have been cached for too long, and signs a new base
+ * CRL when the CRL interval is over */
+TRIGGER_FUNC(mod_cmpsrv_trigger) {
+  plugin_data *p = p_d;
+
+  int n = cmpsrv_txn_expire(p->txns, srv->cur_ts);
+  if (n > 0) dbgmsg("sd", "expired transactions:", n);
+
+  cmpsrv_keycache_expire(p->keys, srv->cur_ts);
+
+  if (!cmpsrv_crl_update(p->crls, p->ca, p->store, srv->cur_ts))
+    dbgmsg("s", "ERROR: updating the CRLs failed");
+
   return HANDLER_GO_ON;
 }
 
@@ -132,40 +202,178 @@ static int mod_cmpsrv_patch_connection(server *srv, connection *con, plugin_data
 }
 #endif
 
-static buffer *get_content(chunkqueue *cq) 
+/* ############################################################################ *
+ * Request intake and response output.
+ *
+ * The request body is decoded where lighttpd stored it. Small bodies are in
+ * memory chunks, larger ones in temp-file chunks, which are mapped the same
+ * way mod_cgi does it; chunk_reset() unmaps them again. A body in a single
+ * chunk, the usual case, is decoded in place. A body spread over several
+ * chunks is read by d2i_CMP_PKIMESSAGE_bio() through a BIO over the chunks.
+ *
+ * The response is encoded straight into a buffer of the write queue.
+ * ############################################################################ */
+
+/* returns the unread data of the chunk in *data, mapping temp files */
+static off_t chunk_data(server *srv, chunk *c, const unsigned char **data)
 {
-  if (cq->first && cq->first->mem && cq->first->mem->used > 0)
-    return cq->first->mem;
+  switch (c->type) {
+    case MEM_CHUNK:
+      if (!c->mem || c->mem->used == 0) return 0;
+      *data = (const unsigned char *) c->mem->ptr + c->offset;
+      return (off_t)c->mem->used - 1 - c->offset;
+
+    case FILE_CHUNK:
+      if (c->file.mmap.start == MAP_FAILED) {
+        if (-1 == c->file.fd &&
+            -1 == (c->file.fd = open(c->file.name->ptr, O_RDONLY))) {
+          log_error_write(srv, __FILE__, __LINE__, "ss", "open failed:", strerror(errno));
+          return -1;
+        }
+        c->file.mmap.length = c->file.length;
+        c->file.mmap.start = mmap(0, c->file.mmap.length, PROT_READ, MAP_SHARED, c->file.fd, 0);
+        close(c->file.fd);
+        c->file.fd = -1;
+        if (c->file.mmap.start == MAP_FAILED) {
+          log_error_write(srv, __FILE__, __LINE__, "ssb", "mmap failed:", strerror(errno), c->file.name);
+          return -1;
+        }
+      }
+      *data = (const unsigned char *) c->file.mmap.start + c->offset;
+      return c->file.length - c->offset;
+
+    default:
+      return 0;
+  }
+}
+
+/* source BIO reading len bytes of the body from the chunks, starting at c */
+typedef struct {
+  server *srv;
+  chunk *c;
+  off_t off;  /* read from c, on top of its own offset */
+  off_t left; /* body bytes not read yet */
+} chunk_bio_data;
+
+static int chunk_bio_read(BIO *b, char *out, int outl)
+{
+  chunk_bio_data *d = (chunk_bio_data *) b->ptr;
+  const unsigned char *data = NULL;
+  off_t n = 0;
+  int got = 0;
+
+  while (got < outl && d->left > 0 && d->c) {
+    if ((n = chunk_data(d->srv, d->c, &data)) < 0) return -1;
+    if ((n -= d->off) <= 0) {
+      d->c = d->c->next;
+      d->off = 0;
+      continue;
+    }
+    if (n > outl - got) n = outl - got;
+    if (n > d->left) n = d->left;
+    memcpy(out + got, data + d->off, n);
+    d->off += n;
+    d->left -= n;
+    got += n;
+  }
+  return got;
+}
+
+static long chunk_bio_ctrl(BIO *b, int cmd, long num, void *ptr)
+{
+  UNUSED(num);
+  UNUSED(ptr);
+  if (cmd == BIO_CTRL_EOF) return ((chunk_bio_data *) b->ptr)->left == 0;
   return 0;
 }
 
-static CMP_PKIMESSAGE *decodeMessage(buffer *msg)
+static int chunk_bio_new(BIO *b)
 {
-  const unsigned char *derMsg = (unsigned char *) msg->ptr;
-  size_t derLen = msg->used-1;
-  return d2i_CMP_PKIMESSAGE(NULL, &derMsg, derLen);
+  b->init = 1;
+  b->ptr = NULL;
+  return 1;
 }
 
-static void sendResponse(server *srv, connection *con, CMP_PKIMESSAGE *msg)
+static int chunk_bio_free(BIO *b)
 {
-  unsigned char *derBuf = 0;
-  size_t derLen = 0;
+  return b != NULL;
+}
 
+static BIO_METHOD chunk_bio_method = {
+  BIO_TYPE_SOURCE_SINK | 0x60,
+  "lighttpd chunks",
+  NULL,
+  chunk_bio_read,
+  NULL,
+  NULL,
+  chunk_bio_ctrl,
+  chunk_bio_new,
+  chunk_bio_free,
+  NULL,
+};
+
+static CMP_PKIMESSAGE *decodeMessage(server *srv, chunkqueue *cq, off_t len)
+{
+  CMP_PKIMESSAGE *msg = NULL;
+  const unsigned char *data = NULL, *p = NULL;
+  chunk_bio_data d;
+  BIO *bio = NULL;
+  off_t n = 0;
+  chunk *c = NULL;
+
+  if (len <= 0 || len > INT_MAX) return NULL;
+
+  /* skip leading empty chunks */
+  for (c = cq->first; c; c = c->next) {
+    if ((n = chunk_data(srv, c, &data)) < 0) return NULL;
+    if (n > 0) break;
+  }
+  if (!c) return NULL;
+
+  if (n >= len) {
+    p = data;
+    return d2i_CMP_PKIMESSAGE(NULL, &p, len);
+  }
+
+  dbgmsg("s", "request body spans several chunks");
+  if (!(bio = BIO_new(&chunk_bio_method))) return NULL;
+  d.srv = srv;
+  d.c = c;
+  d.off = 0;
+  d.left = len;
+  bio->ptr = &d;
+  msg = d2i_CMP_PKIMESSAGE_bio(bio, NULL);
+  BIO_free(bio);
+  return msg;
+}
+
+static void sendResponse(server *srv, connection *con, CMP_PKIMESSAGE *msg)
+{
   dbgmsg("s", "attempting to encode message");
-  derLen = i2d_CMP_PKIMESSAGE( msg, &derBuf);
+  int derLen = i2d_CMP_PKIMESSAGE( msg, NULL);
+  if (derLen <= 0) {
+    dbgmsg("s", "ERROR encoding message");
+    return;
+  }
+
+  /* a protected message has its encoding cached, so this is a single copy
+   * into the buffer that lighttpd sends from */
+  buffer *b = chunkqueue_get_append_buffer(con->write_queue);
+  buffer_prepare_copy(b, derLen + 1);
+  unsigned char *p = (unsigned char *) b->ptr;
+  i2d_CMP_PKIMESSAGE( msg, &p);
+  b->ptr[derLen] = '\0';
+  b->used = derLen + 1;
   dbgmsg("sd", "message encoded, sending... len=", derLen);
 
   response_header_overwrite(srv, con, CONST_STR_LEN("Content-Type"), CONST_STR_LEN(CMP_CONTENT_TYPE));
-  http_chunk_append_mem(srv, con, (const char*)derBuf, derLen+1);
 
   dbgmsg("s", "response sent");
-  free(derBuf);
 }
 
 URIHANDLER_FUNC(mod_cmpsrv_uri_handler) {
   plugin_data *p = p_d;
   // int s_len;
-  buffer *msg;
 
   UNUSED(srv);
 
@@ -179,33 +387,43 @@ URIHANDLER_FUNC(mod_cmpsrv_uri_handler) {
 
   dbgmsg("s", "mod_cmpsrv_uri_handler called");
 
+  /* a GET of the responder's path fetches the current CRLs as a CRLAnn,
+   * other GETs are left to the rest of the server */
+  if (con->request.http_method == HTTP_METHOD_GET) {
+    if (buffer_is_empty(p->path) || !buffer_is_equal(con->uri.path, p->path))
+      return HANDLER_GO_ON;
+
+    CMP_PKIMESSAGE *ann = NULL;
+    cmpsrv_ctx *ctx = cmpsrv_ctx_new(p->ca);
+    if (!ctx) return HANDLER_GO_ON;
+    ctx->store = p->store;
+    ctx->crls = p->crls;
+    if (handleCrlAnn(srv, ctx, &ann)) {
+      sendResponse(srv, con, ann);
+      CMP_PKIMESSAGE_free(ann);
+      con->file_finished = 1;
+    }
+    else
+      con->http_status = 404;
+    cmpsrv_ctx_delete(ctx);
+    log_cmperrors(srv);
+    return HANDLER_FINISHED;
+  }
+
   if (0 == con->request.http_content_type ||
       0 != strncmp(con->request.http_content_type, CMP_CONTENT_TYPE, sizeof(CMP_CONTENT_TYPE)-1)) {
     dbgmsg("s", "invalid content type");
     return HANDLER_GO_ON;
   }
 
-
-  /* TODO: handle multiple chunks correctly */
   if (chunkqueue_length(con->request_content_queue) != (off_t)con->request.content_length) {
     dbgmsg("s", "invalid chunkqueue_length");
     return HANDLER_GO_ON;
   }
 
-  msg = get_content(con->request_content_queue);
-  if (!msg) {
-    dbgmsg("s", "error getting message content");
-    return HANDLER_GO_ON;
-  }
-
-  if (msg->used != (off_t)con->request.content_length+1) {
-    dbgmsg("sd", "too many chunks", msg->used);
-    return HANDLER_GO_ON;
-  }
-
   dbgmsg("s", "decoding DER message ...");
 
-  CMP_PKIMESSAGE *pkiMsg = decodeMessage(msg);
+  CMP_PKIMESSAGE *pkiMsg = decodeMessage(srv, con->request_content_queue, con->request.content_length);
   if (!pkiMsg) {
     dbgmsg("s", "ERROR decoding message");
     log_cmperrors(srv);
@@ -214,12 +432,17 @@ URIHANDLER_FUNC(mod_cmpsrv_uri_handler) {
 
   /* handle the received PKI message */
   CMP_PKIMESSAGE *resp = NULL;
-  cmpsrv_ctx *ctx = cmpsrv_ctx_new(p);
+  cmpsrv_ctx *ctx = cmpsrv_ctx_new(p->ca);
   if (!ctx) {
     dbgmsg("s", "ERROR: failed to create CMP context");
     log_cmperrors(srv);
+    CMP_PKIMESSAGE_free(pkiMsg);
     return HANDLER_FINISHED;
   }
+  ctx->txns = p->txns;
+  ctx->store = p->store;
+  ctx->keys = p->keys;
+  ctx->crls = p->crls;
 
   if (handleMessage(srv, con, ctx, pkiMsg, &resp) != 0 && resp != NULL) {
     dbgmsg("s", "sending response");
@@ -232,6 +455,8 @@ URIHANDLER_FUNC(mod_cmpsrv_uri_handler) {
     dbgmsg("s", "ERROR handling message");
   }
 
+  cmpsrv_ctx_delete(ctx);
+  CMP_PKIMESSAGE_free(pkiMsg);
   log_cmperrors(srv);
 
   // con->http_status = 200;
@@ -249,6 +474,7 @@ int mod_cmpsrv_plugin_init(plugin *p) {
   p->init             = mod_cmpsrv_init;
   p->handle_uri_clean = mod_cmpsrv_uri_handler;
   p->set_defaults     = mod_cmpsrv_set_defaults;
+  p->handle_trigger   = mod_cmpsrv_trigger;
   p->cleanup          = mod_cmpsrv_free;
   p->data             = NULL;
 
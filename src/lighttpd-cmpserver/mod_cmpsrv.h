@@ -46,6 +46,115 @@ typedef struct {
   buffer *b;
 } plugin_config;
 
+/* CA state shared by all requests, see cmpsrv_ctx.c */
+typedef struct {
+  int references; /* lighttpd runs the handlers in a single thread */
+
+  char *certPath;
+  char *userID;
+  char *secretKey;
+
+  X509 *caCert;
+  EVP_PKEY *caKey;
+  X509_STORE *untrusted_store;
+  X509_STORE *trusted_store;
+  /* certificates whose holders may revoke any certificate */
+  X509_STORE *ra_store;
+  /* if set, so may the holder of the shared secret */
+  int raSecret;
+
+  STACK_OF(X509) *extraCerts;
+  STACK_OF(X509) *caPubs;
+  /* extraCerts as encoded into every response that carries them */
+  unsigned char *extraCertsDer;
+  int extraCertsDerLen;
+  /* template the per-request CMP_CTXs are created from */
+  CMP_CTX *cmp_tmpl;
+
+  /* if > 0, certificates are delivered by pollRep this many seconds after
+   * the request instead of directly in the response */
+  int pollDelay;
+} cmpsrv_ca;
+
+/* certificate database, see cmpsrv_certstore.c */
+typedef struct cmpsrv_certstore cmpsrv_certstore;
+
+/* open CMP transaction, see cmpsrv_txn.c */
+#define CMPSRV_TXN_OPEN    0 /* request received */
+#define CMPSRV_TXN_WAITING 1 /* certs issued, answered 'waiting' until readyAt */
+#define CMPSRV_TXN_CONFIRM 2 /* certs delivered, waiting for certConf */
+#define CMPSRV_TXN_DONE    3 /* certConf received */
+
+#define CMPSRV_TXN_TTL     300
+
+typedef struct cmpsrv_txn {
+  time_t expires;
+  int savedState;                 /* state of the stored row when loaded */
+
+  ASN1_OCTET_STRING *transactionID;
+  ASN1_OCTET_STRING *senderNonce; /* of our last response */
+  ASN1_OCTET_STRING *recipNonce;  /* of the client's last request */
+  EVP_PKEY *senderKey;            /* client key for checking protection */
+
+  int state;
+  int bodyType;                   /* of the request starting the transaction */
+  time_t readyAt;
+  STACK_OF(X509) *certs;          /* issued certs */
+  long *certReqIds;               /* the certReqId each cert answers */
+} cmpsrv_txn;
+
+typedef struct {
+  cmpsrv_certstore *store;
+  int ttl;
+} cmpsrv_txn_table;
+
+/* public keys of issued client certificates, see cmpsrv_keycache.c */
+#define CMPSRV_KEY_BUCKETS 1024
+#define CMPSRV_KEY_MAX     65536
+#define CMPSRV_KEY_TTL     3600
+
+typedef struct cmpsrv_key {
+  struct cmpsrv_key *next_serial; /* hash chain by serial */
+  struct cmpsrv_key *next_kid;    /* hash chain by subjectKeyIdentifier */
+  struct cmpsrv_key *prev, *next; /* age list, oldest first */
+  long serial;
+  ASN1_OCTET_STRING *kid;         /* NULL if the cert has no SKID */
+  X509_NAME *subject;             /* several certs may share kid and key */
+  EVP_PKEY *pkey;
+  EVP_PKEY_CTX *vctx;             /* initialized for verification with pkey */
+  time_t expires;
+} cmpsrv_key;
+
+typedef struct {
+  cmpsrv_key **by_serial;
+  cmpsrv_key **by_kid;
+  size_t nbuckets;
+  cmpsrv_key *oldest, *newest;
+  size_t num;
+  size_t max;
+  int ttl;
+} cmpsrv_keycache;
+
+/* revoked certificates and the CRLs built from them, see cmpsrv_crl.c */
+#define CMPSRV_CRL_INTERVAL 86400
+
+typedef struct {
+  long serial;
+  time_t date;
+  int reason;                     /* CRLReason, -1 if none was given */
+} cmpsrv_revoked;
+
+typedef struct {
+  int interval;                   /* seconds between two base CRLs */
+  sqlite3_int64 lastRowid;        /* of the last revocation loaded */
+  cmpsrv_revoked *entries;        /* all revocations, sorted by serial */
+  size_t num, max;
+  size_t numDelta;                /* entries revoked since baseTime */
+  time_t baseTime;                /* thisUpdate of base, 0 if none yet */
+  X509_CRL *base;
+  X509_CRL *delta;                /* NULL until needed after a change */
+} cmpsrv_crl;
+
 typedef struct {
   PLUGIN_DATA;
 
@@ -56,25 +165,44 @@ typedef struct {
   buffer *caKey;
   buffer *extraCertPath;
   buffer *rootCertPath;
+  buffer *raCertPath;
+  buffer *path;
 
   plugin_config **config_storage;
 
   plugin_config conf;
+
+  unsigned short transactionTTL;
+  unsigned short pollDelay;
+  unsigned int crlInterval;
+  unsigned short raSecret;
+
+  cmpsrv_ca *ca;
+  cmpsrv_txn_table *txns;
+  cmpsrv_certstore *store;
+  cmpsrv_keycache *keys;
+  cmpsrv_crl *crls;
 } plugin_data;
 
+/* per-request context */
 typedef struct {
-  char *certPath;
-  EVP_PKEY *caKey;
+  cmpsrv_ca *ca;
   CMP_CTX *cmp_ctx;
-  plugin_data *p_d;
   ASN1_OCTET_STRING *transactionID;
 
-  STACK_OF(X509) *extraCerts;
-  STACK_OF(X509) *caPubs;
+  cmpsrv_txn_table *txns;
+  cmpsrv_txn *txn;
+  cmpsrv_certstore *store;
+  cmpsrv_keycache *keys;
+  cmpsrv_crl *crls;
+  long senderSerial;  /* of the certificate the request's signature was checked with */
+  int withExtraCerts; /* set by handlers whose response carries the CA chain */
 } cmpsrv_ctx;
 
 /* cmpsrv_ctx.c */
-cmpsrv_ctx *cmpsrv_ctx_new(plugin_data *p);
+cmpsrv_ca *cmpsrv_ca_new(plugin_data *p);
+void cmpsrv_ca_free(cmpsrv_ca *ca);
+cmpsrv_ctx *cmpsrv_ctx_new(cmpsrv_ca *ca);
 void cmpsrv_ctx_delete(cmpsrv_ctx *ctx);
 
 /* cmpsrv_misc.c */
@@ -83,22 +211,64 @@ EVP_PKEY *HELP_readPrivKey(const char * filename, const char *password);
 int HELP_write_der_cert( X509 *cert, const char *filename);
 void dbgprintf(const char *fmt, ...);
 EVP_PKEY *HELP_generateRSAKey();
+X509_STORE *HELP_create_cert_store(char *dir);
 
 /* cmpsrv_handlers.c */
 void init_handler_table(void);
 int handleMessage(server *srv, connection *con, cmpsrv_ctx *ctx, CMP_PKIMESSAGE *msg, CMP_PKIMESSAGE **out);
+int handleCrlAnn(server *srv, cmpsrv_ctx *ctx, CMP_PKIMESSAGE **out);
 
 /* cmpsrv_msg.c */
-CMP_PKIMESSAGE * CMP_ip_new( CMP_CTX *ctx, X509 *cert);
-CMP_PKIMESSAGE * CMP_kup_new( CMP_CTX *ctx, X509 *cert);
-CMP_PKIMESSAGE * CMP_pollRep_new( CMP_CTX *ctx);
+CMP_PKIMESSAGE * CMP_ip_new( CMP_CTX *ctx, STACK_OF(X509) *certs, const long *reqIds);
+CMP_PKIMESSAGE * CMP_kup_new( CMP_CTX *ctx, STACK_OF(X509) *certs, const long *reqIds);
+CMP_PKIMESSAGE * CMP_pollRep_new( CMP_CTX *ctx, CMP_POLLREQCONTENT *preqs, long checkAfter);
+CMP_PKIMESSAGE * CMP_crlAnn_new( CMP_CTX *ctx, STACK_OF(X509_CRL) *crls);
 
 /* cmpsrv_certstore.c */
+cmpsrv_certstore *certstore_new(const char *certPath);
+void certstore_free(cmpsrv_certstore *store);
 X509 *cert_create(cmpsrv_ctx *ctx, CRMF_CERTTEMPLATE *tpl);
 int cert_save(cmpsrv_ctx *ctx, X509 *cert);
+int cert_save_all(cmpsrv_ctx *ctx, STACK_OF(X509) *certs);
 int cert_remove(cmpsrv_ctx *ctx, int serialNo);
+int cert_revoke_all(cmpsrv_ctx *ctx, X509_NAME **issuers, const int *serials, const int *reasons, int n, int *revoked);
+int cert_revoked_since(cmpsrv_certstore *store, sqlite3_int64 *lastRowid, cmpsrv_revoked **entries);
 X509 *cert_find_by_serial(cmpsrv_ctx *ctx, int serialNo);
 X509 *cert_find_by_name(cmpsrv_ctx *ctx, X509_NAME *name);
-sqlite3 *open_db(cmpsrv_ctx *ctx);
+X509 *cert_find_by_kid(cmpsrv_ctx *ctx, const ASN1_OCTET_STRING *kid, X509_NAME *name);
+int cert_is_current(cmpsrv_ctx *ctx, long serialNo);
+X509 *cert_find_by_issuer_serial(cmpsrv_ctx *ctx, X509_NAME *issuer, int serialNo);
+int txn_store_insert(cmpsrv_certstore *store, cmpsrv_txn *txn, time_t now);
+cmpsrv_txn *txn_store_find(cmpsrv_certstore *store, const ASN1_OCTET_STRING *tid, time_t now);
+int txn_store_update(cmpsrv_certstore *store, cmpsrv_txn *txn);
+int txn_store_delete(cmpsrv_certstore *store, const ASN1_OCTET_STRING *tid);
+int txn_store_expire(cmpsrv_certstore *store, time_t now);
+
+/* cmpsrv_txn.c */
+cmpsrv_txn_table *cmpsrv_txn_table_new(cmpsrv_certstore *store, int ttl);
+void cmpsrv_txn_table_free(cmpsrv_txn_table *t);
+void cmpsrv_txn_free(cmpsrv_txn *txn);
+cmpsrv_txn *cmpsrv_txn_find(cmpsrv_txn_table *t, const ASN1_OCTET_STRING *tid, time_t now);
+cmpsrv_txn *cmpsrv_txn_add(cmpsrv_txn_table *t, const ASN1_OCTET_STRING *tid, time_t now);
+int cmpsrv_txn_save(cmpsrv_txn_table *t, cmpsrv_txn *txn);
+void cmpsrv_txn_remove(cmpsrv_txn_table *t, cmpsrv_txn *txn);
+int cmpsrv_txn_expire(cmpsrv_txn_table *t, time_t now);
+
+/* cmpsrv_keycache.c */
+cmpsrv_keycache *cmpsrv_keycache_new(size_t nbuckets, size_t max, int ttl);
+void cmpsrv_keycache_free(cmpsrv_keycache *c);
+cmpsrv_key *cmpsrv_keycache_add(cmpsrv_keycache *c, X509 *cert, time_t now);
+void cmpsrv_keycache_remove(cmpsrv_keycache *c, long serial);
+cmpsrv_key *cmpsrv_keycache_find_serial(cmpsrv_keycache *c, long serial, time_t now);
+cmpsrv_key *cmpsrv_keycache_find_kid(cmpsrv_keycache *c, const ASN1_OCTET_STRING *kid, X509_NAME *subject, time_t now);
+int cmpsrv_keycache_expire(cmpsrv_keycache *c, time_t now);
+int cmpsrv_verify_signature(EVP_PKEY *pkey, EVP_PKEY_CTX *vctx, CMP_PKIMESSAGE *msg);
+
+/* cmpsrv_crl.c */
+cmpsrv_crl *cmpsrv_crl_new(int interval);
+void cmpsrv_crl_free(cmpsrv_crl *crl);
+int cmpsrv_crl_update(cmpsrv_crl *crl, cmpsrv_ca *ca, cmpsrv_certstore *store, time_t now);
+X509_CRL *cmpsrv_crl_get1_base(cmpsrv_crl *crl);
+X509_CRL *cmpsrv_crl_get1_delta(cmpsrv_crl *crl, cmpsrv_ca *ca, time_t now);
 
 #endif
@@ -0,0 +1,1190 @@
+/* apps/cmpspeed.c */
+/* ====================================================================
+ * Copyright (c) 2007-2014 The OpenSSL Project.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * 3. All advertising materials mentioning features or use of this
+ *    software must display the following acknowledgment:
+ *    "This product includes software developed by the OpenSSL Project
+ *    for use in the OpenSSL Toolkit. (http://www.openssl.org/)"
+ *
+ * 4. The names "OpenSSL Toolkit" and "OpenSSL Project" must not be used to
+ *    endorse or promote products derived from this software without
+ *    prior written permission. For written permission, please contact
+ *    openssl-core@openssl.org.
+ *
+ * 5. Products derived from this software may not be called "OpenSSL"
+ *    nor may "OpenSSL" appear in their names without prior written
+ *    permission of the OpenSSL Project.
+ *
+ * 6. Redistributions of any form whatsoever must retain the following
+ *    acknowledgment:
+ *    "This product includes software developed by the OpenSSL Project
+ *    for use in the OpenSSL Toolkit (http://www.openssl.org/)"
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE OpenSSL PROJECT ``AS IS'' AND ANY
+ * EXPRESSED OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE OpenSSL PROJECT OR
+ * ITS CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ * ====================================================================
+ *
+ * This product includes cryptographic software written by Eric Young
+ * (eay@cryptsoft.com).  This product includes software written by Tim
+ * Hudson (tjh@cryptsoft.com).
+ */
+/* ====================================================================
+ * Copyright 2012-2014 Nokia Oy. ALL RIGHTS RESERVED.
+ * CMP support in OpenSSL originally developed by
+ * Nokia for contribution to the OpenSSL project.
+ */
+
+/* micro-benchmarks for the CMP and CRMF primitives a CMP client or server
+ * spends its time in: DER encoding and decoding of every PKIBody type,
+ * calculating PBMAC and signature protection, validating received messages
+ * and deriving PasswordBasedMac keys. The timing and -multi machinery is the
+ * one of speed.c. */
+
+#if !defined(OPENSSL_NO_SPEED) && !defined(OPENSSL_NO_CMP)
+
+#undef SECONDS
+#define SECONDS		1
+
+#undef PROG
+#define PROG cmpspeed_main
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "apps.h"
+#include <openssl/crypto.h>
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/objects.h>
+#include <openssl/rand.h>
+#include <openssl/rsa.h>
+#include <openssl/sha.h>
+#include <openssl/x509.h>
+#include <openssl/x509v3.h>
+#include <openssl/cmp.h>
+#include <openssl/crmf.h>
+#if !defined(OPENSSL_SYS_MSDOS)
+#include OPENSSL_UNISTD
+#endif
+
+#ifndef OPENSSL_NO_SIGNAL
+#include <signal.h>
+#endif
+
+#define START	0
+#define STOP	1
+
+#define KEY_BITS	2048
+#define SECRET		"cmpspeed"
+
+/* test groups, selected on the command line */
+#define G_ASN1		0
+#define G_PROTECT	1
+#define G_VALIDATE	2
+#define G_PBM		3
+#define G_NUM		4
+
+/* flags of the validate tests, saying what to forget before each run */
+#define V_RESET_SRVCERT	0x01	/* the server cert validated in this transaction */
+#define V_FLUSH_CACHE	0x02	/* the process wide cache of validated server certs */
+
+/* ... and of the pbmac tests */
+#define P_FLUSH_CACHE	0x01	/* the PBM base key cache */
+
+typedef struct cmpspeed_test_st
+	{
+	int group;
+	char name[32];
+	int (*op)(struct cmpspeed_test_st *t);
+	CMP_PKIMESSAGE *msg;	/* decoded message the test works on */
+	unsigned char *der;	/* its DER encoding */
+	long derlen;
+	unsigned char *buf;	/* output buffer for i2d */
+	CMP_CTX *ctx;
+	EVP_PKEY *pkey;
+	ASN1_OCTET_STRING *secret;
+	CRMF_PBMPARAMETER *pbm;
+	int flags;
+	double ops;		/* operations per second, summed over all processes */
+	} CMPSPEED_TEST;
+
+static const char *groups[G_NUM]={"asn1","protect","validate","pbm"};
+
+static const char *body_names[]={
+	"ir","ip","cr","cp","p10cr","popdecc","popdecr","kur","kup","krr",
+	"krp","rr","rp","ccr","ccp","ckuann","cann","rann","crlann","pkiconf",
+	"nested","genm","genp","error","certConf","pollReq","pollRep" };
+#define BODY_NUM	(sizeof(body_names)/sizeof(body_names[0]))
+
+static const long pbm_iterations[]={500,1000,10000};
+#define PBM_NUM		(sizeof(pbm_iterations)/sizeof(pbm_iterations[0]))
+
+#define TEST_MAX	(2*BODY_NUM+4+4+PBM_NUM)
+
+static CMPSPEED_TEST tests[TEST_MAX];
+static int test_num=0;
+
+static int run=0;
+static int mr=0;
+static int usertime=1;
+
+static double Time_F(int s);
+static int bench(CMPSPEED_TEST *t, int secs);
+static void print_results(int multi);
+#ifndef NO_FORK
+static int do_multi(int multi);
+#endif
+
+#ifdef SIGALRM
+#if defined(__STDC__) || defined(sgi) || defined(_AIX)
+#define SIGRETTYPE void
+#else
+#define SIGRETTYPE int
+#endif
+
+static SIGRETTYPE sig_done(int sig);
+static SIGRETTYPE sig_done(int sig)
+	{
+	signal(SIGALRM,sig_done);
+	run=0;
+#ifdef LINT
+	sig=sig;
+#endif
+	}
+/* without alarm() every test is run a fixed number of times */
+#define COND(n)	(run)
+#else
+#define COND(n)	(count < (n))
+#endif
+
+static double Time_F(int s)
+	{
+	return app_tminterval(s,usertime);
+	}
+
+/* ############################################################################ *
+ * the operations being timed; each returns 1 on success, 0 on error
+ * ############################################################################ */
+static int op_i2d(CMPSPEED_TEST *t)
+	{
+	unsigned char *p=t->buf;
+
+	/* do not just copy out the encoding saved by d2i */
+	t->msg->enc.modified=1;
+	return i2d_CMP_PKIMESSAGE(t->msg,&p) > 0;
+	}
+
+static int op_d2i(CMPSPEED_TEST *t)
+	{
+	const unsigned char *p=t->der;
+	CMP_PKIMESSAGE *msg;
+
+	if (!(msg=d2i_CMP_PKIMESSAGE(NULL,&p,t->derlen))) return 0;
+	CMP_PKIMESSAGE_free(msg);
+	return 1;
+	}
+
+static int op_protect_pbmac(CMPSPEED_TEST *t)
+	{
+	ASN1_BIT_STRING *prot;
+
+	if (t->flags & P_FLUSH_CACHE) CRMF_pbm_cache_flush();
+	if (!(prot=CMP_calc_protection_pbmac(t->msg,t->secret))) return 0;
+	ASN1_BIT_STRING_free(prot);
+	return 1;
+	}
+
+static int op_protect_sig(CMPSPEED_TEST *t)
+	{
+	ASN1_BIT_STRING *prot;
+
+	if (!(prot=CMP_calc_protection_sig(t->msg,t->pkey))) return 0;
+	ASN1_BIT_STRING_free(prot);
+	return 1;
+	}
+
+static int op_validate(CMPSPEED_TEST *t)
+	{
+	if ((t->flags & V_RESET_SRVCERT) && t->ctx->validatedSrvCert)
+		{
+		X509_free(t->ctx->validatedSrvCert);
+		t->ctx->validatedSrvCert=NULL;
+		}
+	if (t->flags & V_FLUSH_CACHE) CMP_srvCert_cache_flush();
+	return CMP_validate_msg(t->ctx,t->msg);
+	}
+
+static int op_pbm(CMPSPEED_TEST *t)
+	{
+	unsigned char *mac=NULL;
+	unsigned int macLen=0;
+
+	CRMF_pbm_cache_flush();
+	if (!CRMF_passwordBasedMac_new(t->pbm,t->der,t->derlen,
+			t->secret->data,t->secret->length,&mac,&macLen))
+		return 0;
+	OPENSSL_free(mac);
+	return 1;
+	}
+
+/* ############################################################################ *
+ * test data: a root -> sub CA -> end entity hierarchy and one message of
+ * every body type, sent by the end entity
+ * ############################################################################ */
+static EVP_PKEY *key_new(int bits)
+	{
+	EVP_PKEY *pkey=NULL;
+	RSA *rsa=NULL;
+	BIGNUM *e=NULL;
+
+	if (!(pkey=EVP_PKEY_new()) || !(rsa=RSA_new()) || !(e=BN_new()))
+		goto err;
+	if (!BN_set_word(e,RSA_F4) || !RSA_generate_key_ex(rsa,bits,e,NULL))
+		goto err;
+	if (!EVP_PKEY_assign_RSA(pkey,rsa)) goto err;
+	BN_free(e);
+	return pkey;
+err:
+	if (e) BN_free(e);
+	if (rsa) RSA_free(rsa);
+	if (pkey) EVP_PKEY_free(pkey);
+	return NULL;
+	}
+
+static int cert_add_ext(X509 *cert, X509V3_CTX *v3ctx, int nid, char *value)
+	{
+	X509_EXTENSION *ext;
+	int ok;
+
+	if (!(ext=X509V3_EXT_conf_nid(NULL,v3ctx,nid,value))) return 0;
+	ok=X509_add_ext(cert,ext,-1);
+	X509_EXTENSION_free(ext);
+	return ok;
+	}
+
+/* issues a certificate for pkey, self-signed if issuer is NULL */
+static X509 *cert_new(const char *cn, EVP_PKEY *pkey, X509 *issuer,
+	EVP_PKEY *issuerKey, int ca)
+	{
+	static long serial=1;
+	X509 *cert=NULL;
+	X509_NAME *name=NULL;
+	X509V3_CTX v3ctx;
+
+	if (!(cert=X509_new()) || !(name=X509_NAME_new())) goto err;
+	if (!X509_NAME_add_entry_by_txt(name,"CN",MBSTRING_ASC,
+			(unsigned char *)cn,-1,-1,0))
+		goto err;
+	if (!X509_set_version(cert,2)
+		|| !ASN1_INTEGER_set(X509_get_serialNumber(cert),serial++)
+		|| !X509_set_subject_name(cert,name)
+		|| !X509_set_issuer_name(cert,issuer ? X509_get_subject_name(issuer) : name)
+		|| !X509_gmtime_adj(X509_get_notBefore(cert),0)
+		|| !X509_gmtime_adj(X509_get_notAfter(cert),86400L)
+		|| !X509_set_pubkey(cert,pkey))
+		goto err;
+
+	X509V3_set_ctx(&v3ctx,issuer ? issuer : cert,cert,NULL,NULL,0);
+	if (!cert_add_ext(cert,&v3ctx,NID_basic_constraints,
+			ca ? "critical,CA:TRUE" : "CA:FALSE")
+		|| !cert_add_ext(cert,&v3ctx,NID_subject_key_identifier,"hash")
+		|| !cert_add_ext(cert,&v3ctx,NID_authority_key_identifier,"keyid"))
+		goto err;
+
+	if (!X509_sign(cert,issuerKey ? issuerKey : pkey,EVP_sha256())) goto err;
+	X509_NAME_free(name);
+	return cert;
+err:
+	if (name) X509_NAME_free(name);
+	if (cert) X509_free(cert);
+	return NULL;
+	}
+
+/* a CRL of issuer revoking cert */
+static X509_CRL *crl_new(X509 *issuer, EVP_PKEY *issuerKey, X509 *cert)
+	{
+	X509_CRL *crl=NULL;
+	X509_REVOKED *rev=NULL;
+	ASN1_TIME *tm=NULL;
+
+	if (!(crl=X509_CRL_new()) || !(tm=ASN1_TIME_new())) goto err;
+	if (!X509_CRL_set_version(crl,1)
+		|| !X509_CRL_set_issuer_name(crl,X509_get_subject_name(issuer))
+		|| !X509_gmtime_adj(tm,0)
+		|| !X509_CRL_set_lastUpdate(crl,tm)
+		|| !X509_gmtime_adj(tm,86400L)
+		|| !X509_CRL_set_nextUpdate(crl,tm))
+		goto err;
+
+	if (!(rev=X509_REVOKED_new())) goto err;
+	if (!X509_REVOKED_set_serialNumber(rev,X509_get_serialNumber(cert))
+		|| !X509_gmtime_adj(tm,0)
+		|| !X509_REVOKED_set_revocationDate(rev,tm)
+		|| !X509_CRL_add0_revoked(crl,rev))
+		{
+		X509_REVOKED_free(rev);
+		goto err;
+		}
+	X509_CRL_sort(crl);
+
+	if (!X509_CRL_sign(crl,issuerKey,EVP_sha256())) goto err;
+	ASN1_TIME_free(tm);
+	return crl;
+err:
+	if (tm) ASN1_TIME_free(tm);
+	if (crl) X509_CRL_free(crl);
+	return NULL;
+	}
+
+static CRMF_CERTID *certid_new(X509 *cert)
+	{
+	CRMF_CERTID *certId;
+
+	if (!(certId=CRMF_CERTID_new())) return NULL;
+	GENERAL_NAME_free(certId->issuer);
+	ASN1_INTEGER_free(certId->serialNumber);
+	certId->serialNumber=ASN1_INTEGER_dup(X509_get_serialNumber(cert));
+	if ((certId->issuer=GENERAL_NAME_new()))
+		{
+		certId->issuer->type=GEN_DIRNAME;
+		certId->issuer->d.directoryName=X509_NAME_dup(X509_get_issuer_name(cert));
+		}
+	if (!certId->serialNumber || !certId->issuer || !certId->issuer->d.directoryName)
+		{
+		CRMF_CERTID_free(certId);
+		return NULL;
+		}
+	return certId;
+	}
+
+static CMP_PKISTATUSINFO *status_new(long status)
+	{
+	CMP_PKISTATUSINFO *si;
+
+	if (!(si=CMP_PKISTATUSINFO_new())) return NULL;
+	if (!ASN1_INTEGER_set(si->status,status))
+		{
+		CMP_PKISTATUSINFO_free(si);
+		return NULL;
+		}
+	return si;
+	}
+
+static CMP_CERTREPMESSAGE *certrep_new(X509 *cert, X509 *caCert)
+	{
+	CMP_CERTREPMESSAGE *rep;
+	CMP_CERTRESPONSE *resp;
+
+	if (!(rep=CMP_CERTREPMESSAGE_new())) return NULL;
+	if (!(rep->caPubs=sk_X509_new_null())
+		|| !sk_X509_push(rep->caPubs,X509_dup(caCert)))
+		goto err;
+	if (!(resp=CMP_CERTRESPONSE_new())) goto err;
+	if (!sk_CMP_CERTRESPONSE_push(rep->response,resp))
+		{
+		CMP_CERTRESPONSE_free(resp);
+		goto err;
+		}
+	if (!ASN1_INTEGER_set(resp->certReqId,0)
+		|| !ASN1_INTEGER_set(resp->status->status,CMP_PKISTATUS_accepted))
+		goto err;
+	if (!(resp->certifiedKeyPair=CMP_CERTIFIEDKEYPAIR_new())) goto err;
+	resp->certifiedKeyPair->certOrEncCert->type=CMP_CERTORENCCERT_CERTIFICATE;
+	if (!(resp->certifiedKeyPair->certOrEncCert->value.certificate=X509_dup(cert)))
+		goto err;
+	return rep;
+err:
+	CMP_CERTREPMESSAGE_free(rep);
+	return NULL;
+	}
+
+static CMP_INFOTYPEANDVALUE *itav_crl_new(X509_CRL *crl)
+	{
+	CMP_INFOTYPEANDVALUE *itav;
+
+	if (!(itav=CMP_INFOTYPEANDVALUE_new())) return NULL;
+	itav->infoType=OBJ_nid2obj(NID_id_it_currentCRL);
+	if (crl && !(itav->infoValue.currentCRL=X509_CRL_dup(crl)))
+		{
+		CMP_INFOTYPEANDVALUE_free(itav);
+		return NULL;
+		}
+	return itav;
+	}
+
+static PKCS10_CERTIFICATIONREQUEST *p10cr_new(X509 *cert, EVP_PKEY *pkey)
+	{
+	PKCS10_CERTIFICATIONREQUEST *p10cr=NULL;
+	X509_REQ *req;
+	unsigned char *der=NULL;
+	const unsigned char *p;
+	int len;
+
+	if (!(req=X509_to_X509_REQ(cert,pkey,EVP_sha256()))) return NULL;
+	if ((len=i2d_X509_REQ(req,&der)) > 0)
+		{
+		p=der;
+		p10cr=d2i_PKCS10_CERTIFICATIONREQUEST(NULL,&p,len);
+		}
+	if (der) OPENSSL_free(der);
+	X509_REQ_free(req);
+	return p10cr;
+	}
+
+/* builds a message of the given body type, sent and protected according to ctx */
+static CMP_PKIMESSAGE *body_new(CMP_CTX *ctx, int type, X509 *cert,
+	EVP_PKEY *pkey, X509 *caCert, X509_CRL *crl)
+	{
+	CMP_PKIMESSAGE *msg=NULL;
+	CMP_PKIBODY *body;
+	int i;
+
+	/* the request constructors of the library, others are put together here */
+	switch (type)
+		{
+		case V_CMP_PKIBODY_IR:
+		case V_CMP_PKIBODY_KRR:
+		case V_CMP_PKIBODY_CCR:
+			msg=CMP_ir_new(ctx);
+			break;
+		case V_CMP_PKIBODY_CR:
+			msg=CMP_cr_new(ctx);
+			break;
+		case V_CMP_PKIBODY_KUR:
+			msg=CMP_kur_new(ctx);
+			break;
+		case V_CMP_PKIBODY_RR:
+			msg=CMP_rr_new(ctx);
+			break;
+		case V_CMP_PKIBODY_GENM:
+		case V_CMP_PKIBODY_GENP:
+			msg=CMP_genm_new(ctx, NID_undef, NULL);
+			break;
+		case V_CMP_PKIBODY_CERTCONF:
+			msg=CMP_certConf_new(ctx);
+			break;
+		case V_CMP_PKIBODY_POLLREQ:
+			msg=CMP_pollReq_new(ctx,0);
+			break;
+		default:
+			if (!(msg=CMP_PKIMESSAGE_new())) goto err;
+			if (!CMP_PKIHEADER_init(ctx,msg->header)) goto err;
+			break;
+		}
+	if (!msg) goto err;
+	/* krr and ccr have the body of an ir, genp has that of a genm */
+	CMP_PKIMESSAGE_set_bodytype(msg,type);
+	body=msg->body;
+
+	switch (type)
+		{
+		case V_CMP_PKIBODY_IP:
+		case V_CMP_PKIBODY_CP:
+		case V_CMP_PKIBODY_KUP:
+		case V_CMP_PKIBODY_CCP:
+			if (!(body->value.ip=certrep_new(cert,caCert))) goto err;
+			break;
+		case V_CMP_PKIBODY_P10CR:
+			if (!(body->value.p10cr=p10cr_new(cert,pkey))) goto err;
+			break;
+		case V_CMP_PKIBODY_POPDECC:
+			{
+			CMP_CHALLENGE *chall;
+			unsigned char rnd[128];
+
+			if (!(body->value.popdecc=sk_CMP_CHALLENGE_new_null())) goto err;
+			if (!(chall=CMP_CHALLENGE_new())) goto err;
+			if (!sk_CMP_CHALLENGE_push(body->value.popdecc,chall))
+				{
+				CMP_CHALLENGE_free(chall);
+				goto err;
+				}
+			if (!(chall->owf=X509_ALGOR_new())
+				|| !X509_ALGOR_set0(chall->owf,OBJ_nid2obj(NID_sha1),V_ASN1_NULL,NULL)
+				|| RAND_pseudo_bytes(rnd,sizeof(rnd)) < 0
+				|| !ASN1_OCTET_STRING_set(chall->whitness,rnd,SHA_DIGEST_LENGTH)
+				|| !ASN1_OCTET_STRING_set(chall->challenge,rnd,sizeof(rnd)))
+				goto err;
+			break;
+			}
+		case V_CMP_PKIBODY_POPDECR:
+			{
+			ASN1_INTEGER *resp;
+
+			if (!(body->value.popdecr=sk_ASN1_INTEGER_new_null())) goto err;
+			if (!(resp=ASN1_INTEGER_new())) goto err;
+			if (!sk_ASN1_INTEGER_push(body->value.popdecr,resp))
+				{
+				ASN1_INTEGER_free(resp);
+				goto err;
+				}
+			if (!ASN1_INTEGER_set(resp,0x7fffffffL)) goto err;
+			break;
+			}
+		case V_CMP_PKIBODY_KRP:
+			{
+			CMP_KEYRECREPCONTENT *krp;
+
+			if (!(body->value.krp=krp=CMP_KEYRECREPCONTENT_new())) goto err;
+			if (!ASN1_INTEGER_set(krp->status->status,CMP_PKISTATUS_accepted)
+				|| !(krp->newSigCert=X509_dup(cert))
+				|| !(krp->caCerts=sk_X509_new_null())
+				|| !sk_X509_push(krp->caCerts,X509_dup(caCert)))
+				goto err;
+			break;
+			}
+		case V_CMP_PKIBODY_RP:
+			{
+			CMP_REVREPCONTENT *rp;
+			CMP_PKISTATUSINFO *si;
+			CRMF_CERTID *certId;
+
+			if (!(body->value.rp=rp=CMP_REVREPCONTENT_new())) goto err;
+			if (!rp->status && !(rp->status=sk_CMP_PKISTATUSINFO_new_null())) goto err;
+			if (!(si=status_new(CMP_PKISTATUS_accepted))) goto err;
+			if (!sk_CMP_PKISTATUSINFO_push(rp->status,si))
+				{
+				CMP_PKISTATUSINFO_free(si);
+				goto err;
+				}
+			if (!(rp->certId=sk_CRMF_CERTID_new_null())) goto err;
+			if (!(certId=certid_new(cert))) goto err;
+			if (!sk_CRMF_CERTID_push(rp->certId,certId))
+				{
+				CRMF_CERTID_free(certId);
+				goto err;
+				}
+			break;
+			}
+		case V_CMP_PKIBODY_CKUANN:
+			{
+			CMP_CAKEYUPDANNCONTENT *ann;
+
+			if (!(body->value.ckuann=ann=CMP_CAKEYUPDANNCONTENT_new())) goto err;
+			X509_free(ann->oldWithNew);
+			X509_free(ann->newWithOld);
+			X509_free(ann->newWithNew);
+			ann->oldWithNew=X509_dup(caCert);
+			ann->newWithOld=X509_dup(caCert);
+			ann->newWithNew=X509_dup(caCert);
+			if (!ann->oldWithNew || !ann->newWithOld || !ann->newWithNew) goto err;
+			break;
+			}
+		case V_CMP_PKIBODY_CANN:
+			if (!(body->value.cann=X509_dup(cert))) goto err;
+			break;
+		case V_CMP_PKIBODY_RANN:
+			{
+			CMP_REVANNCONTENT *rann;
+
+			if (!(body->value.rann=rann=CMP_REVANNCONTENT_new())) goto err;
+			CRMF_CERTID_free(rann->certId);
+			if (!(rann->certId=certid_new(cert))) goto err;
+			if (!ASN1_INTEGER_set(rann->status,CMP_PKISTATUS_revocationWarning)
+				|| !ASN1_GENERALIZEDTIME_set(rann->willBeRevokedAt,time(NULL)+86400L)
+				|| !ASN1_GENERALIZEDTIME_set(rann->badSinceDate,time(NULL)))
+				goto err;
+			break;
+			}
+		case V_CMP_PKIBODY_CRLANN:
+			if (!(body->value.crlann=sk_X509_CRL_new_null())
+				|| !sk_X509_CRL_push(body->value.crlann,X509_CRL_dup(crl)))
+				goto err;
+			break;
+		case V_CMP_PKIBODY_PKICONF:
+			if (!(body->value.pkiconf=ASN1_TYPE_new())) goto err;
+			ASN1_TYPE_set(body->value.pkiconf,V_ASN1_NULL,NULL);
+			break;
+		case V_CMP_PKIBODY_NESTED:
+			{
+			CMP_PKIMESSAGE *inner;
+
+			if (!(body->value.nested=sk_CMP_PKIMESSAGE_new_null())) goto err;
+			if (!(inner=CMP_ir_new(ctx))) goto err;
+			if (!sk_CMP_PKIMESSAGE_push(body->value.nested,inner))
+				{
+				CMP_PKIMESSAGE_free(inner);
+				goto err;
+				}
+			break;
+			}
+		case V_CMP_PKIBODY_GENM:
+		case V_CMP_PKIBODY_GENP:
+			{
+			CMP_INFOTYPEANDVALUE *itav;
+
+			/* a genm asks for the current CRL, the genp carries it */
+			if (!(itav=itav_crl_new(type == V_CMP_PKIBODY_GENP ? crl : NULL)))
+				goto err;
+			if (!CMP_ITAV_stack_item_push0(&body->value.genm,itav))
+				{
+				CMP_INFOTYPEANDVALUE_free(itav);
+				goto err;
+				}
+			break;
+			}
+		case V_CMP_PKIBODY_ERROR:
+			{
+			CMP_ERRORMSGCONTENT *error;
+			ASN1_UTF8STRING *detail;
+
+			if (!(body->value.error=error=CMP_ERRORMSGCONTENT_new())) goto err;
+			if (!ASN1_INTEGER_set(error->pKIStatusInfo->status,CMP_PKISTATUS_rejection)
+				|| !(error->errorCode=ASN1_INTEGER_new())
+				|| !ASN1_INTEGER_set(error->errorCode,1)
+				|| !(error->errorDetails=sk_ASN1_UTF8STRING_new_null()))
+				goto err;
+			if (!(detail=ASN1_UTF8STRING_new())) goto err;
+			if (!sk_ASN1_UTF8STRING_push(error->errorDetails,detail))
+				{
+				ASN1_UTF8STRING_free(detail);
+				goto err;
+				}
+			if (!ASN1_STRING_set(detail,"benchmark error",-1)) goto err;
+			break;
+			}
+		case V_CMP_PKIBODY_POLLREP:
+			{
+			CMP_POLLREP *prep;
+
+			if (!(body->value.pollRep=sk_CMP_POLLREP_new_null())) goto err;
+			if (!(prep=CMP_POLLREP_new())) goto err;
+			if (!sk_CMP_POLLREP_push(body->value.pollRep,prep))
+				{
+				CMP_POLLREP_free(prep);
+				goto err;
+				}
+			if (!ASN1_INTEGER_set(prep->certReqId,0)
+				|| !ASN1_INTEGER_set(prep->checkAfter,1))
+				goto err;
+			break;
+			}
+		}
+
+	/* the same extraCerts as the constructors add */
+	if (!msg->extraCerts && ctx->clCert)
+		{
+		if (!(msg->extraCerts=sk_X509_new_null())) goto err;
+		for (i=0; i < sk_X509_num(ctx->extraCertsOut); i++)
+			if (!sk_X509_push(msg->extraCerts,X509_dup(sk_X509_value(ctx->extraCertsOut,i))))
+				goto err;
+		if (!sk_X509_push(msg->extraCerts,X509_dup(ctx->clCert))) goto err;
+		}
+	if (!CMP_PKIMESSAGE_protect(ctx,msg)) goto err;
+	return msg;
+err:
+	if (msg) CMP_PKIMESSAGE_free(msg);
+	return NULL;
+	}
+
+/* sets the test's message to the decoded encoding of msg, which is what the
+ * receiver works on */
+static int msg_receive(CMPSPEED_TEST *t, CMP_PKIMESSAGE *msg)
+	{
+	const unsigned char *p;
+
+	if (!msg) return 0;
+	if ((t->derlen=i2d_CMP_PKIMESSAGE(msg,&t->der)) <= 0) return 0;
+	p=t->der;
+	t->msg=d2i_CMP_PKIMESSAGE(NULL,&p,t->derlen);
+	return t->msg != NULL;
+	}
+
+static CMPSPEED_TEST *test_add(int group, const char *name,
+	int (*op)(CMPSPEED_TEST *))
+	{
+	CMPSPEED_TEST *t=&tests[test_num++];
+
+	memset(t,0,sizeof(*t));
+	t->group=group;
+	BUF_strlcpy(t->name,name,sizeof(t->name));
+	t->op=op;
+	return t;
+	}
+
+/* ############################################################################ *
+ * runs a test for secs seconds and stores the operations per second
+ * ############################################################################ */
+static int bench(CMPSPEED_TEST *t, int secs)
+	{
+	long count;
+	double d;
+
+	/* once outside of the clock, for lazy initialisation and to find errors */
+	if (!t->op(t))
+		{
+		BIO_printf(bio_err,"%s failed\n",t->name);
+		ERR_print_errors(bio_err);
+		return 0;
+		}
+
+	if (!mr)
+		{
+		BIO_printf(bio_err,"Doing %s for %ds: ",t->name,secs);
+		(void)BIO_flush(bio_err);
+		}
+#ifdef SIGALRM
+	alarm(secs);
+#endif
+	Time_F(START);
+	for (count=0,run=1; COND(1000); count++)
+		if (!t->op(t))
+			{
+			BIO_printf(bio_err,"%s failed\n",t->name);
+			ERR_print_errors(bio_err);
+			return 0;
+			}
+	d=Time_F(STOP);
+
+	if (mr)
+		BIO_printf(bio_err,"+R:%d:%ld:%f\n",(int)(t-tests),count,d);
+	else
+		BIO_printf(bio_err,"%ld %s's in %.2fs\n",count,t->name,d);
+	t->ops=count/d;
+	return 1;
+	}
+
+static void print_results(int multi)
+	{
+	int i;
+
+	fprintf(stdout,"%-28s %8s %12s %10s\n","","bytes","ops/s","us/op");
+	for (i=0; i < test_num; i++)
+		{
+		CMPSPEED_TEST *t=&tests[i];
+
+		if (t->ops <= 0) continue;
+		if (t->group != G_PBM)
+			fprintf(stdout,"%-28s %8ld",t->name,t->derlen);
+		else
+			fprintf(stdout,"%-28s %8s",t->name,"");
+		/* with -multi, ops/s is the sum over all processes and us/op
+		 * the mean time a single process takes */
+		fprintf(stdout," %12.1f %10.2f\n",t->ops,1e6*(multi ? multi : 1)/t->ops);
+		}
+	}
+
+int MAIN(int, char **);
+
+int MAIN(int argc, char **argv)
+	{
+	int mret=1;
+	int i,secs=SECONDS;
+	int doit[G_NUM];
+	int doall=1;
+#ifndef NO_FORK
+	int multi=0;
+#else
+	const int multi=0;
+#endif
+	EVP_PKEY *rootKey=NULL,*subKey=NULL,*eeKey=NULL;
+	X509 *root=NULL,*sub=NULL,*ee=NULL;
+	X509_CRL *crl=NULL;
+	STACK_OF(X509) *chain=NULL;
+	X509_STORE *store=NULL;
+	CMP_CTX *sigCtx=NULL,*pbmCtx=NULL,*vfyCtx=NULL,*chainCtx=NULL;
+	CMP_PKIMESSAGE *sigMsg=NULL,*pbmMsg=NULL;
+	CMPSPEED_TEST *t;
+	char name[32];
+
+#ifndef TIMES
+	usertime=-1;
+#endif
+
+	apps_startup();
+
+	if (bio_err == NULL)
+		if ((bio_err=BIO_new(BIO_s_file())) != NULL)
+			BIO_set_fp(bio_err,stderr,BIO_NOCLOSE|BIO_FP_TEXT);
+
+	if (!load_config(bio_err, NULL))
+		goto end;
+
+	for (i=0; i < G_NUM; i++)
+		doit[i]=0;
+
+	argc--;
+	argv++;
+	while (argc)
+		{
+		if (strcmp(*argv,"-elapsed") == 0)
+			usertime=0;
+		else if (strcmp(*argv,"-seconds") == 0 && argc > 1)
+			{
+			argc--;
+			argv++;
+			if ((secs=atoi(*argv)) <= 0)
+				{
+				BIO_printf(bio_err,"bad -seconds value\n");
+				goto end;
+				}
+			}
+#ifndef NO_FORK
+		else if (strcmp(*argv,"-multi") == 0 && argc > 1)
+			{
+			argc--;
+			argv++;
+			if ((multi=atoi(*argv)) <= 0)
+				{
+				BIO_printf(bio_err,"bad -multi value\n");
+				goto end;
+				}
+			}
+#endif
+		else if (strcmp(*argv,"-mr") == 0)
+			mr=1;
+		else
+			{
+			for (i=0; i < G_NUM; i++)
+				if (strcmp(*argv,groups[i]) == 0)
+					break;
+			if (i == G_NUM)
+				{
+				BIO_printf(bio_err,"Error: bad option or value\n");
+				BIO_printf(bio_err,"\n");
+				BIO_printf(bio_err,"usage: cmpspeed [options] [test ...]\n");
+				BIO_printf(bio_err,"Available tests (default all):\n");
+				BIO_printf(bio_err,"asn1      i2d and d2i of a message of every PKIBody type\n");
+				BIO_printf(bio_err,"protect   PBMAC and signature protection of an ir\n");
+				BIO_printf(bio_err,"validate  CMP_validate_msg with and without building the chain\n");
+				BIO_printf(bio_err,"pbm       PasswordBasedMac key derivation at several iteration counts\n");
+				BIO_printf(bio_err,"\n");
+				BIO_printf(bio_err,"Available options:\n");
+				BIO_printf(bio_err,"-seconds n     run each test for n seconds (default %d)\n",SECONDS);
+				BIO_printf(bio_err,"-elapsed       measure time in real time instead of CPU user time.\n");
+#ifndef NO_FORK
+				BIO_printf(bio_err,"-multi n       run n benchmarks in parallel.\n");
+#endif
+				BIO_printf(bio_err,"-mr            produce machine readable output.\n");
+				goto end;
+				}
+			doit[i]=1;
+			doall=0;
+			}
+		argc--;
+		argv++;
+		}
+	if (doall)
+		for (i=0; i < G_NUM; i++)
+			doit[i]=1;
+
+	/* the test data; set up before forking so that all processes share it */
+	if (!mr)
+		BIO_printf(bio_err,"Generating %d bit keys and certificates\n",KEY_BITS);
+	if (!(rootKey=key_new(KEY_BITS)) || !(subKey=key_new(KEY_BITS))
+		|| !(eeKey=key_new(KEY_BITS)))
+		goto err;
+	if (!(root=cert_new("cmpspeed root",rootKey,NULL,NULL,1))
+		|| !(sub=cert_new("cmpspeed sub CA",subKey,root,rootKey,1))
+		|| !(ee=cert_new("cmpspeed end entity",eeKey,sub,subKey,0))
+		|| !(crl=crl_new(sub,subKey,ee)))
+		goto err;
+	if (!(chain=sk_X509_new_null()) || !sk_X509_push(chain,sub))
+		goto err;
+
+	/* the end entity, authenticated by its certificate ... */
+	if (!(sigCtx=CMP_CTX_create())
+		|| !CMP_CTX_set1_clCert(sigCtx,ee)
+		|| !CMP_CTX_set1_pkey(sigCtx,eeKey)
+		|| !CMP_CTX_set1_newPkey(sigCtx,eeKey)
+		|| !CMP_CTX_set1_newClCert(sigCtx,ee)
+		|| !CMP_CTX_set1_extraCertsOut(sigCtx,chain)
+		|| !CMP_CTX_set1_recipient(sigCtx,X509_get_subject_name(sub)))
+		goto err;
+	/* ... or by a shared secret */
+	if (!(pbmCtx=CMP_CTX_create())
+		|| !CMP_CTX_set1_referenceValue(pbmCtx,(unsigned char *)SECRET,strlen(SECRET))
+		|| !CMP_CTX_set1_secretValue(pbmCtx,(unsigned char *)SECRET,strlen(SECRET))
+		|| !CMP_CTX_set1_newPkey(pbmCtx,eeKey)
+		|| !CMP_CTX_set1_recipient(pbmCtx,X509_get_subject_name(sub)))
+		goto err;
+
+	if (doit[G_ASN1])
+		for (i=0; i < (int)BODY_NUM; i++)
+			{
+			CMPSPEED_TEST *d;
+			CMP_PKIMESSAGE *msg;
+
+			BIO_snprintf(name,sizeof(name),"i2d %s",body_names[i]);
+			t=test_add(G_ASN1,name,op_i2d);
+			msg=body_new(sigCtx,i,ee,eeKey,sub,crl);
+			if (!msg_receive(t,msg))
+				{
+				BIO_printf(bio_err,"cannot create %s message\n",body_names[i]);
+				if (msg) CMP_PKIMESSAGE_free(msg);
+				goto err;
+				}
+			CMP_PKIMESSAGE_free(msg);
+			if (!(t->buf=OPENSSL_malloc(t->derlen))) goto err;
+
+			BIO_snprintf(name,sizeof(name),"d2i %s",body_names[i]);
+			d=test_add(G_ASN1,name,op_d2i);
+			d->der=t->der;
+			d->derlen=t->derlen;
+			}
+
+	if (doit[G_PROTECT] || doit[G_VALIDATE])
+		{
+		if (!(sigMsg=body_new(sigCtx,V_CMP_PKIBODY_IR,ee,eeKey,sub,crl))
+			|| !(pbmMsg=body_new(pbmCtx,V_CMP_PKIBODY_IR,ee,eeKey,sub,crl)))
+			goto err;
+		}
+
+	if (doit[G_PROTECT])
+		{
+		t=test_add(G_PROTECT,"protect pbmac",op_protect_pbmac);
+		if (!msg_receive(t,pbmMsg)) goto err;
+		t->secret=pbmCtx->secretValue;
+
+		t=test_add(G_PROTECT,"protect pbmac no cache",op_protect_pbmac);
+		if (!msg_receive(t,pbmMsg)) goto err;
+		t->secret=pbmCtx->secretValue;
+		t->flags=P_FLUSH_CACHE;
+
+		t=test_add(G_PROTECT,"protect sig",op_protect_sig);
+		if (!msg_receive(t,sigMsg)) goto err;
+		t->pkey=eeKey;
+		}
+
+	if (doit[G_VALIDATE])
+		{
+		/* the receiver knows the sender's certificate ... */
+		if (!(vfyCtx=CMP_CTX_create()) || !CMP_CTX_set1_srvCert(vfyCtx,ee)
+			|| !CMP_CTX_set1_secretValue(vfyCtx,(unsigned char *)SECRET,strlen(SECRET)))
+			goto err;
+		/* ... or only the root, and the chain comes in the extraCerts */
+		if (!(store=X509_STORE_new()) || !X509_STORE_add_cert(store,root))
+			goto err;
+		if (!(chainCtx=CMP_CTX_create()) || !CMP_CTX_set0_trustedStore(chainCtx,store))
+			{
+			X509_STORE_free(store);
+			goto err;
+			}
+
+		t=test_add(G_VALIDATE,"validate pbmac",op_validate);
+		if (!msg_receive(t,pbmMsg)) goto err;
+		t->ctx=vfyCtx;
+
+		t=test_add(G_VALIDATE,"validate sig srvCert",op_validate);
+		if (!msg_receive(t,sigMsg)) goto err;
+		t->ctx=vfyCtx;
+
+		t=test_add(G_VALIDATE,"validate sig chain",op_validate);
+		if (!msg_receive(t,sigMsg)) goto err;
+		t->ctx=chainCtx;
+		t->flags=V_RESET_SRVCERT|V_FLUSH_CACHE;
+
+		t=test_add(G_VALIDATE,"validate sig chain cached",op_validate);
+		if (!msg_receive(t,sigMsg)) goto err;
+		t->ctx=chainCtx;
+		t->flags=V_RESET_SRVCERT;
+		}
+
+	if (doit[G_PBM])
+		{
+		unsigned char msg[256];
+
+		if (RAND_pseudo_bytes(msg,sizeof(msg)) < 0) goto err;
+		for (i=0; i < (int)PBM_NUM; i++)
+			{
+			BIO_snprintf(name,sizeof(name),"pbm %ld iterations",pbm_iterations[i]);
+			t=test_add(G_PBM,name,op_pbm);
+			if (!(t->pbm=CRMF_pbm_new_ex(NID_sha1,pbm_iterations[i],NID_hmac_sha1)))
+				goto err;
+			if (!(t->der=BUF_memdup(msg,sizeof(msg)))) goto err;
+			t->derlen=sizeof(msg);
+			t->secret=pbmCtx->secretValue;
+			}
+		}
+
+#ifndef NO_FORK
+	if (multi && do_multi(multi))
+		goto show_res;
+#endif
+
+#ifdef SIGALRM
+	signal(SIGALRM,sig_done);
+#endif
+	for (i=0; i < test_num; i++)
+		if (!bench(&tests[i],secs))
+			goto end;
+
+#ifndef NO_FORK
+show_res:
+#endif
+	if (!mr)
+		print_results(multi);
+	mret=0;
+	goto end;
+
+err:
+	BIO_printf(bio_err,"error setting up the test data\n");
+	ERR_print_errors(bio_err);
+end:
+	for (i=0; i < test_num; i++)
+		{
+		t=&tests[i];
+		if (t->msg) CMP_PKIMESSAGE_free(t->msg);
+		/* the d2i tests share the encoding of the i2d test before them */
+		if (t->der && t->op != op_d2i) OPENSSL_free(t->der);
+		if (t->buf) OPENSSL_free(t->buf);
+		if (t->pbm) CRMF_PBMPARAMETER_free(t->pbm);
+		}
+	if (sigMsg) CMP_PKIMESSAGE_free(sigMsg);
+	if (pbmMsg) CMP_PKIMESSAGE_free(pbmMsg);
+	if (sigCtx) CMP_CTX_delete(sigCtx);
+	if (pbmCtx) CMP_CTX_delete(pbmCtx);
+	if (vfyCtx) CMP_CTX_delete(vfyCtx);
+	if (chainCtx) CMP_CTX_delete(chainCtx);
+	if (chain) sk_X509_free(chain);
+	if (crl) X509_CRL_free(crl);
+	if (ee) X509_free(ee);
+	if (sub) X509_free(sub);
+	if (root) X509_free(root);
+	if (eeKey) EVP_PKEY_free(eeKey);
+	if (subKey) EVP_PKEY_free(subKey);
+	if (rootKey) EVP_PKEY_free(rootKey);
+	apps_shutdown();
+	OPENSSL_EXIT(mret);
+	}
+
+#ifndef NO_FORK
+static char *sstrsep(char **string, const char *delim)
+	{
+	char isdelim[256];
+	char *token = *string;
+
+	if (**string == 0)
+		return NULL;
+
+	memset(isdelim, 0, sizeof isdelim);
+	isdelim[0] = 1;
+
+	while (*delim)
+		{
+		isdelim[(unsigned char)(*delim)] = 1;
+		delim++;
+		}
+
+	while (!isdelim[(unsigned char)(**string)])
+		{
+		(*string)++;
+		}
+
+	if (**string)
+		{
+		**string = 0;
+		(*string)++;
+		}
+
+	return token;
+	}
+
+/* forks multi children running all tests with -mr and adds up their
+ * operations per second; returns 0 in the children, 1 in the parent */
+static int do_multi(int multi)
+	{
+	int n;
+	int fd[2];
+	int *fds;
+	static char sep[]=":";
+
+	fds=malloc(multi*sizeof *fds);
+	for(n=0 ; n < multi ; ++n)
+		{
+		if (pipe(fd) == -1)
+			{
+			fprintf(stderr, "pipe failure\n");
+			exit(1);
+			}
+		fflush(stdout);
+		fflush(stderr);
+		if(fork())
+			{
+			close(fd[1]);
+			fds[n]=fd[0];
+			}
+		else
+			{
+			close(fd[0]);
+			close(2);
+			if (dup(fd[1]) == -1)
+				{
+				fprintf(stderr, "dup failed\n");
+				exit(1);
+				}
+			close(fd[1]);
+			mr=1;
+			usertime=0;
+			free(fds);
+			return 0;
+			}
+		printf("Forked child %d\n",n);
+		}
+
+	/* for now, assume the pipe is long enough to take all the output */
+	for(n=0 ; n < multi ; ++n)
+		{
+		FILE *f;
+		char buf[1024];
+		char *p;
+
+		f=fdopen(fds[n],"r");
+		while(fgets(buf,sizeof buf,f))
+			{
+			p=strchr(buf,'\n');
+			if(p)
+				*p='\0';
+			if(buf[0] != '+')
+				{
+				fprintf(stderr,"Don't understand line '%s' from child %d\n",
+						buf,n);
+				continue;
+				}
+			if(!strncmp(buf,"+R:",3))
+				{
+				int k;
+				long count;
+				double d;
+
+				p=buf+3;
+				k=atoi(sstrsep(&p,sep));
+				count=atol(sstrsep(&p,sep));
+				d=atof(sstrsep(&p,sep));
+				if (k >= 0 && k < test_num && d > 0)
+					tests[k].ops+=count/d;
+				}
+			else
+				fprintf(stderr,"Unknown type '%s' from child %d\n",buf,n);
+			}
+
+		fclose(f);
+		}
+	free(fds);
+	return 1;
+	}
+#endif
+#endif
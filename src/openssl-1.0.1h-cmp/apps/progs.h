@@ -48,6 +48,7 @@ extern int prime_main(int argc,char *argv[]);
 extern int ts_main(int argc,char *argv[]);
 extern int srp_main(int argc,char *argv[]);
 extern int cmp_main(int argc,char *argv[]);
+extern int cmpspeed_main(int argc,char *argv[]);
 
 #define FUNC_TYPE_GENERAL	1
 #define FUNC_TYPE_MD		2
@@ -155,6 +156,9 @@ FUNCTION functions[] = {
 #ifndef OPENSSL_NO_CMP
 	{FUNC_TYPE_GENERAL,"cmp",cmp_main},
 #endif
+#if !defined(OPENSSL_NO_CMP) && !defined(OPENSSL_NO_SPEED)
+	{FUNC_TYPE_GENERAL,"cmpspeed",cmpspeed_main},
+#endif
 #ifndef OPENSSL_NO_MD2
 	{FUNC_TYPE_MD,"md2",dgst_main},
 #endif
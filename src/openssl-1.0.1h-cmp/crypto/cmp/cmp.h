@@ -914,6 +914,10 @@ typedef struct cmp_pkimessage_st
 	ASN1_BIT_STRING				 *protection; /* 0 */
 	/* CMP_CMPCERTIFICATE is effectively X509 so it is used directly */
 	STACK_OF(X509) *extraCerts; /* 1 */
+	/* DER of the message as received, or as built by
+	 * CMP_PKIMESSAGE_set_protection(); i2d_CMP_PKIMESSAGE() returns it as long
+	 * as enc.modified is not set */
+	ASN1_ENCODING enc;
 	} CMP_PKIMESSAGE;
 DECLARE_ASN1_FUNCTIONS(CMP_PKIMESSAGE)
 DECLARE_STACK_OF(CMP_PKIMESSAGE) /* PKIMessages */
@@ -983,6 +987,91 @@ DECLARE_ASN1_FUNCTIONS(CMP_PROTECTEDPART)
 typedef void (*cmp_logfn_t)(const char *msg);
 typedef int (*cmp_certConfFn_t)(int status, const X509 *cert);
 
+/* timings and counters handed to the metrics callback, see
+ * CMP_CTX_set_metrics_callback(): once per request/response exchange
+ * (CMP_METRICS_MESSAGE) and summed up once per transaction
+ * (CMP_METRICS_TRANSACTION). All durations are in microseconds. */
+#define CMP_METRICS_MESSAGE     0
+#define CMP_METRICS_TRANSACTION 1
+typedef struct cmp_metrics_st
+	{
+	int type;
+	/* of the request, for a transaction that of its first request */
+	int bodyType;
+	/* message: valid response received, transaction: successfully completed */
+	int ok;
+	/* number of exchanges and how many of them were pollReqs */
+	int messages;
+	int polls;
+	/* building the message except for protecting it */
+	unsigned long construct;
+	unsigned long protect;
+	/* DER and HTTP encoding of the request */
+	unsigned long encode;
+	/* name lookup and TCP connect, 0 if a kept-alive connection was used */
+	unsigned long connect;
+	unsigned long tlsHandshake;
+	/* from sending the request until the response is read completely */
+	unsigned long serverWait;
+	unsigned long decode;
+	unsigned long validate;
+	/* wall clock, for a transaction including the time waited before polling */
+	unsigned long total;
+	/* size of the DER encoded PKIMessages */
+	unsigned long bytesSent;
+	unsigned long bytesReceived;
+	/* internal: CMP_METRICS_now() when the measurement began */
+	unsigned long start;
+	} CMP_METRICS;
+struct cmp_ctx_st;
+typedef void (*cmp_metricsFn_t)(const struct cmp_ctx_st *ctx, const CMP_METRICS *metrics);
+
+/* one of several certificates requested in the same ir, cr or kur, see
+ * CMP_CTX_certReq_push1(). pkey, subject and extensions are owned by it.
+ * Note: this is not an ASN.1 type */
+typedef struct cmp_certreq_spec_st
+	{
+	EVP_PKEY *pkey;
+	X509_NAME *subject;
+	X509_EXTENSIONS *extensions;
+	int popoMethod;
+	/* PKIStatus of the response, -1 if none has been received */
+	int status;
+	/* the certificate received */
+	X509 *cert;
+	} CMP_CERTREQ_SPEC;
+DECLARE_STACK_OF(CMP_CERTREQ_SPEC)
+
+/* pool of idle HTTP connections for reuse across messages, see cmp_http.c.
+ * Only its reference count is thread safe, a pool must not be used by
+ * several threads at the same time */
+typedef struct cmp_http_pool_st CMP_HTTP_POOL;
+#define CMP_HTTP_POOL_DEFAULT_MAXCONNS     4
+#define CMP_HTTP_POOL_DEFAULT_IDLETIMEOUT 15
+
+/* TLS client context with sessions to resume per server, see cmp_http.c.
+ * Unlike CMP_HTTP_POOL, it may be shared by contexts used in several threads */
+typedef struct cmp_tls_ctx_st CMP_TLS_CTX;
+#define CMP_TLS_MAX_SESSIONS              64
+
+#ifndef HAVE_CURL
+/* single non-blocking HTTP transfer, see cmp_http.c */
+typedef struct cmp_http_req_st CMP_HTTP_REQ;
+#define CMP_HTTP_REQ_WANT_READ  -1
+#define CMP_HTTP_REQ_WANT_WRITE -2
+
+/* non-blocking CMP transaction, see cmp_ses.c */
+typedef struct cmp_session_st CMP_SESSION;
+#define CMP_SESSION_ERROR       0
+#define CMP_SESSION_DONE        1
+#define CMP_SESSION_WANT_READ   CMP_HTTP_REQ_WANT_READ
+#define CMP_SESSION_WANT_WRITE  CMP_HTTP_REQ_WANT_WRITE
+#define CMP_SESSION_WANT_TIMER  -3
+
+/* min-heap of sessions waiting to poll, see cmp_ses.c */
+typedef struct cmp_poll_sched_st CMP_POLL_SCHED;
+#endif
+
 /* this structure is used to store the context for CMP sessions 
  * partly using OpenSSL ASN.1 types in order to ease handling it */
 typedef struct cmp_ctx_st
@@ -1049,15 +1138,33 @@ typedef struct cmp_ctx_st
 	 * reject if necessary */
 	cmp_certConfFn_t certConf_cb;
 
+	/* callback receiving the timings of messages and transactions and the
+	 * measurements in progress, NULL if switched off
+	 * Note: these are not ASN.1 types */
+	cmp_metricsFn_t metrics_cb;
+	CMP_METRICS *msgMetrics;
+	CMP_METRICS *txnMetrics;
+
 	/* stores for trusted and untrusted (intermediate) certificates */
 	X509_STORE *trusted_store;
 	X509_STORE *untrusted_store;
+	/* untrusted certificates received in extraCerts. They are kept apart
+	 * from untrusted_store, which children share with their template */
+	STACK_OF(X509) *untrusted_certs;
 
 	/* include root certs from extracerts when validating? Used for 3GPP-style E.7 */
 	int permitTAInExtraCertsForIR;
 	/* stores the server Cert as soon as it's trust chain has been validated */
 	X509 *validatedSrvCert;
 
+	/* owf, mac and iterationCount used when creating PBM protection */
+	int pbmOwf;
+	int pbmMac;
+	int pbmIterationCount;
+	/* PBMParameter used for all messages of the current transaction, so that
+	 * the base key is only derived once */
+	X509_ALGOR *pbmAlg;
+
 	/* HTTP transfer related settings */
 	char	  *serverName;
 	int		  serverPort;
@@ -1067,9 +1174,26 @@ typedef struct cmp_ctx_st
 	int       lastHTTPCode;
 	int       useTLS;
 	char	  *sourceAddress;
+	/* idle connections kept for reuse, NULL if keep-alive is disabled
+	 * Note: this is not an ASN.1 type */
+	CMP_HTTP_POOL *httpPool;
+	/* SSL_CTX and cached sessions used if useTLS is set
+	 * Note: this is not an ASN.1 type */
+	CMP_TLS_CTX *tlsCtx;
 
 	CERTIFICATEPOLICIES *policies;
 
+	/* certificates to request in one ir, cr or kur instead of the one
+	 * for newPkey, NULL if none are set; certReqId i is the i'th entry
+	 * Note: this is not an ASN.1 type */
+	STACK_OF(CMP_CERTREQ_SPEC) *certReqs;
+
+	/* certificates to revoke in one rr instead of clCert, NULL if none are
+	 * set, and the PKIStatusInfo received for each of them in the rp
+	 * Note: these are not ASN.1 types */
+	CMP_REVREQCONTENT *revDetails;
+	STACK_OF(CMP_PKISTATUSINFO) *revStatus;
+
 	} CMP_CTX;
 
 DECLARE_ASN1_FUNCTIONS(CMP_CTX)
@@ -1084,8 +1208,9 @@ CMP_PKIMESSAGE *CMP_cr_new( CMP_CTX *ctx);
 CMP_PKIMESSAGE *CMP_rr_new( CMP_CTX *ctx);
 CMP_PKIMESSAGE *CMP_certConf_new( CMP_CTX *ctx);
 CMP_PKIMESSAGE *CMP_kur_new( CMP_CTX *ctx);
-CMP_PKIMESSAGE *CMP_genm_new( CMP_CTX *ctx);
+CMP_PKIMESSAGE *CMP_genm_new( CMP_CTX *ctx, int nid, char *value);
 CMP_PKIMESSAGE *CMP_pollReq_new( CMP_CTX *ctx, int reqId);
+CMP_PKIMESSAGE *CMP_pollReqs_new( CMP_CTX *ctx, const long *reqIds, int num);
 
 /* cmp_lib.c */
 long CMP_REVREPCONTENT_PKIStatus_get(CMP_REVREPCONTENT *revRep, long reqId);
@@ -1101,7 +1226,22 @@ int CMP_PKIMESSAGE_check_implicitConfirm(CMP_PKIMESSAGE *msg);
 int CMP_PKIHEADER_push0_freeText( CMP_PKIHEADER *hdr, ASN1_UTF8STRING *text);
 int CMP_PKIHEADER_push1_freeText( CMP_PKIHEADER *hdr, ASN1_UTF8STRING *text);
 int CMP_PKIHEADER_init(CMP_CTX *ctx, CMP_PKIHEADER *hdr);
+/* A decoded or protected message caches its DER in msg->enc, and
+ * i2d_CMP_PKIMESSAGE() and CMP_PKIMESSAGE_get_protectedPart_der() use it
+ * until msg->enc.modified is set. The CMP_PKIMESSAGE_set*() and _push*()
+ * functions set it themselves. The CMP_PKIHEADER_*() functions only see the
+ * header, so after using them, or changing any field directly, on a message
+ * that is already protected or was decoded, set msg->enc.modified (or protect
+ * the message again) before encoding it. */
+int CMP_PKIMESSAGE_get_protectedPart_der(const CMP_PKIMESSAGE *msg, unsigned char **der);
 ASN1_BIT_STRING *CMP_calc_protection_pbmac(CMP_PKIMESSAGE *pkimessage, const ASN1_OCTET_STRING *secret);
+ASN1_BIT_STRING *CMP_calc_protection_sig(CMP_PKIMESSAGE *pkimessage, EVP_PKEY *pkey);
+int CMP_PKIMESSAGE_set_protection(CMP_PKIMESSAGE *msg, EVP_PKEY *pkey, const ASN1_OCTET_STRING *secret);
+int CMP_PKIMESSAGE_set_protection_ex(CMP_PKIMESSAGE *msg, EVP_PKEY *pkey, const ASN1_OCTET_STRING *secret,
+		const unsigned char *extraCertsDer, int extraCertsDerLen);
+int CMP_encode_extraCerts(const STACK_OF(X509) *certs, unsigned char **der);
+X509_ALGOR *CMP_create_pbmac_algor(void);
+X509_ALGOR *CMP_create_pbmac_algor_ex(int owfNid, long iterationCount, int macNid);
 int CMP_PKIMESSAGE_protect(CMP_CTX *ctx, CMP_PKIMESSAGE *msg);
 int CMP_CERTSTATUS_set_certHash( CMP_CERTSTATUS *certStatus, const X509 *cert);
 int CMP_PKIHEADER_generalInfo_item_push0(CMP_PKIHEADER *hdr, const CMP_INFOTYPEANDVALUE *itav);
@@ -1124,10 +1264,30 @@ STACK_OF(X509) *CMP_build_cert_chain(X509_STORE *store, X509 *cert);
 
 /* cmp_vfy.c */
 int CMP_validate_msg(CMP_CTX *ctx, CMP_PKIMESSAGE *msg);
+int CMP_validate_cert_path(X509_STORE *trusted_store, X509_STORE *untrusted_store, X509 *cert);
+void CMP_srvCert_cache_flush(void);
 
 /* from cmp_http.c */
 int CMP_PKIMESSAGE_http_perform(const CMP_CTX *ctx, const CMP_PKIMESSAGE *msg, CMP_PKIMESSAGE **out);
 long CMP_get_http_response_code(const CMP_CTX *ctx);
+CMP_HTTP_POOL *CMP_HTTP_POOL_new(void);
+void CMP_HTTP_POOL_free(CMP_HTTP_POOL *pool);
+int CMP_HTTP_POOL_up_ref(CMP_HTTP_POOL *pool);
+void CMP_HTTP_POOL_flush(CMP_HTTP_POOL *pool);
+int CMP_HTTP_POOL_set_maxConns(CMP_HTTP_POOL *pool, int max);
+int CMP_HTTP_POOL_set_idleTimeOut(CMP_HTTP_POOL *pool, int secs);
+int CMP_HTTP_POOL_num(const CMP_HTTP_POOL *pool);
+CMP_TLS_CTX *CMP_TLS_CTX_new(void);
+void CMP_TLS_CTX_free(CMP_TLS_CTX *tls);
+int CMP_TLS_CTX_up_ref(CMP_TLS_CTX *tls);
+SSL_CTX *CMP_TLS_CTX_get0_SSL_CTX(const CMP_TLS_CTX *tls);
+int CMP_TLS_CTX_get_stats(const CMP_TLS_CTX *tls, unsigned long *handshakes, unsigned long *resumed);
+#ifndef HAVE_CURL
+CMP_HTTP_REQ *CMP_HTTP_REQ_new(const CMP_CTX *ctx, const CMP_PKIMESSAGE *msg);
+void CMP_HTTP_REQ_free(CMP_HTTP_REQ *req);
+int CMP_HTTP_REQ_get_fd(const CMP_HTTP_REQ *req);
+int CMP_HTTP_REQ_perform(CMP_HTTP_REQ *req, CMP_PKIMESSAGE **out);
+#endif
 	
 
 /* from cmp_ses.c */
@@ -1136,16 +1296,38 @@ X509 *CMP_doCertificateRequestSeq(CMP_CTX *ctx);
 int CMP_doRevocationRequestSeq(CMP_CTX *ctx);
 X509 *CMP_doKeyUpdateRequestSeq(CMP_CTX *ctx);
 STACK_OF(CMP_INFOTYPEANDVALUE) *CMP_doGeneralMessageSeq(CMP_CTX *ctx, int nid, char *value);
+#ifndef HAVE_CURL
+CMP_SESSION *CMP_SESSION_new(CMP_CTX *ctx, int type);
+void CMP_SESSION_free(CMP_SESSION *ses);
+int CMP_SESSION_set_genm_itav(CMP_SESSION *ses, int nid, char *value);
+int CMP_SESSION_step(CMP_SESSION *ses);
+int CMP_SESSION_get_fd(const CMP_SESSION *ses);
+time_t CMP_SESSION_get_deadline(const CMP_SESSION *ses);
+int CMP_SESSION_get_status(const CMP_SESSION *ses);
+STACK_OF(CMP_INFOTYPEANDVALUE) *CMP_SESSION_get0_genpItavs(const CMP_SESSION *ses);
+CMP_POLL_SCHED *CMP_POLL_SCHED_new(void);
+void CMP_POLL_SCHED_free(CMP_POLL_SCHED *sched);
+int CMP_POLL_SCHED_add(CMP_POLL_SCHED *sched, CMP_SESSION *ses);
+void CMP_POLL_SCHED_remove(CMP_POLL_SCHED *sched, CMP_SESSION *ses);
+time_t CMP_POLL_SCHED_next(const CMP_POLL_SCHED *sched);
+CMP_SESSION *CMP_POLL_SCHED_pop_due(CMP_POLL_SCHED *sched, time_t now);
+int CMP_POLL_SCHED_num(const CMP_POLL_SCHED *sched);
+#endif
 
 /* from cmp_ctx.c */
 CMP_CTX *CMP_CTX_create(void);
+CMP_CTX *CMP_CTX_create_child(const CMP_CTX *tmpl);
 int CMP_CTX_init( CMP_CTX *ctx);
 int CMP_CTX_set0_trustedStore( CMP_CTX *ctx, X509_STORE *store);
 int CMP_CTX_set0_untrustedStore( CMP_CTX *ctx, X509_STORE *store);
+int CMP_CTX_set1_trustedStore( CMP_CTX *ctx, X509_STORE *store);
+int CMP_CTX_set1_untrustedStore( CMP_CTX *ctx, X509_STORE *store);
 void CMP_CTX_delete(CMP_CTX *ctx);
 int CMP_CTX_set_error_callback( CMP_CTX *ctx, cmp_logfn_t cb);
 int CMP_CTX_set_debug_callback( CMP_CTX *ctx, cmp_logfn_t cb);
 int CMP_CTX_set_certConf_callback( CMP_CTX *ctx, cmp_certConfFn_t cb);
+int CMP_CTX_set_metrics_callback( CMP_CTX *ctx, cmp_metricsFn_t cb);
+unsigned long CMP_METRICS_now(void);
 int CMP_CTX_set1_referenceValue( CMP_CTX *ctx, const unsigned char *ref, size_t len);
 int CMP_CTX_set1_secretValue( CMP_CTX *ctx, const unsigned char *sec, const size_t len);
 int CMP_CTX_set1_regToken( CMP_CTX *ctx, const char *regtoken, const size_t len);
@@ -1157,6 +1339,17 @@ int CMP_CTX_set1_oldClCert( CMP_CTX *ctx, const X509 *cert);
 int CMP_CTX_set1_subjectName( CMP_CTX *ctx, const X509_NAME *name);
 int CMP_CTX_set1_recipient( CMP_CTX *ctx, const X509_NAME *name);
 int CMP_CTX_subjectAltName_push1( CMP_CTX *ctx, const GENERAL_NAME *name);
+int CMP_CTX_certReq_push1( CMP_CTX *ctx, const EVP_PKEY *pkey, const X509_NAME *subject,
+		const X509_EXTENSIONS *extensions, int popoMethod);
+int CMP_CTX_certReqs_num( CMP_CTX *ctx);
+int CMP_CTX_certReq_status_get( CMP_CTX *ctx, int idx);
+X509 *CMP_CTX_certReq_cert_get1( CMP_CTX *ctx, int idx);
+void CMP_CTX_certReqs_clear( CMP_CTX *ctx);
+int CMP_CTX_revCert_push1( CMP_CTX *ctx, const X509 *cert);
+int CMP_CTX_revSerial_push1( CMP_CTX *ctx, const X509_NAME *issuer, const ASN1_INTEGER *serial);
+int CMP_CTX_revDetails_num( CMP_CTX *ctx);
+int CMP_CTX_revStatus_get( CMP_CTX *ctx, int idx);
+void CMP_CTX_revDetails_clear( CMP_CTX *ctx);
 int CMP_CTX_set1_sender( CMP_CTX *ctx, const X509_NAME *name);
 X509_NAME* CMP_CTX_sender_get( CMP_CTX *ctx);
 STACK_OF(X509)* CMP_CTX_caPubs_get1( CMP_CTX *ctx);
@@ -1187,6 +1380,8 @@ int CMP_CTX_set1_serverPort( CMP_CTX *ctx, int port);
 int CMP_CTX_set1_proxyName( CMP_CTX *ctx, const char *name);
 int CMP_CTX_set1_proxyPort( CMP_CTX *ctx, int port);
 int CMP_CTX_set1_sourceAddress( CMP_CTX *ctx, const char *ip);
+int CMP_CTX_set1_httpPool( CMP_CTX *ctx, CMP_HTTP_POOL *pool);
+int CMP_CTX_set1_tlsCtx( CMP_CTX *ctx, CMP_TLS_CTX *tls);
 /* for backwards compatibility, TODO: remove asap */
 #define CMP_CTX_set1_timeOut CMP_CTX_set_HttpTimeOut 
 int CMP_CTX_set1_timeOut( CMP_CTX *ctx, int time);
@@ -1203,6 +1398,12 @@ STACK_OF(ASN1_UTF8STRING) *CMP_CTX_statusString_get( CMP_CTX *ctx);
 #define CMP_CTX_PERMIT_TA_IN_EXTRACERTS_FOR_IR 5
 #define CMP_CTX_SET_SUBJECTALTNAME_CRITICAL    6
 #define CMP_CTX_USE_TLS                        7
+#define CMP_CTX_OPT_HTTP_KEEPALIVE             8
+#define CMP_CTX_OPT_HTTP_MAXCONNS              9
+#define CMP_CTX_OPT_HTTP_IDLETIMEOUT          10
+#define CMP_CTX_OPT_PBM_OWF                   11
+#define CMP_CTX_OPT_PBM_MAC                   12
+#define CMP_CTX_OPT_PBM_ITERATIONCOUNT        13
 int CMP_CTX_set_option( CMP_CTX *ctx, const int opt, const int val);
 #if 0
 int CMP_CTX_push_freeText( CMP_CTX *ctx, const char *text);
@@ -1297,6 +1498,25 @@ void ERR_load_CMP_strings(void);
 #define CMP_F_PKEY_DUP					 168
 #define CMP_F_POLLFORRESPONSE				 169
 #define CMP_F_SENDCERTCONF				 170
+#define CMP_F_CMP_HTTP_POOL_NEW				 171
+#define CMP_F_CMP_CTX_SET1_HTTPPOOL			 172
+#define CMP_F_CMP_TLS_CTX_NEW				 173
+#define CMP_F_CMP_CTX_SET1_TLSCTX			 174
+#define CMP_F_CMP_HTTP_REQ_NEW				 175
+#define CMP_F_CMP_HTTP_REQ_PERFORM			 176
+#define CMP_F_CMP_SESSION_NEW				 177
+#define CMP_F_CMP_SESSION_STEP				 178
+#define CMP_F_CMP_POLL_SCHED_NEW			 179
+#define CMP_F_CMP_POLL_SCHED_ADD			 180
+#define CMP_F_CMP_POLLREQS_NEW				 181
+#define CMP_F_CMP_PKIMESSAGE_SET_PROTECTION		 182
+#define CMP_F_CMP_PKIMESSAGE_GET_PROTECTEDPART_DER	 183
+#define CMP_F_CMP_ENCODE_EXTRACERTS			 184
+#define CMP_F_CMP_CTX_SET_METRICS_CALLBACK		 185
+#define CMP_F_CMP_CTX_CREATE_CHILD			 186
+#define CMP_F_CMP_CTX_CERTREQ_PUSH1			 187
+#define CMP_F_CMP_CTX_REVCERT_PUSH1			 188
+#define CMP_F_CMP_CTX_REVSERIAL_PUSH1			 189
 
 /* Reason codes. */
 #define CMP_R_ALGORITHM_NOT_SUPPORTED			 100
@@ -346,13 +346,15 @@ ASN1_SEQUENCE(CMP_PROTECTEDPART) = {
 } ASN1_SEQUENCE_END(CMP_PROTECTEDPART)
 IMPLEMENT_ASN1_FUNCTIONS(CMP_PROTECTEDPART);
 
-ASN1_SEQUENCE(CMP_PKIMESSAGE) = {
+/* the encoding is kept so that protection is verified over the received bytes
+ * and outgoing messages are not encoded again after protecting them */
+ASN1_SEQUENCE_enc(CMP_PKIMESSAGE, enc, 0) = {
 	ASN1_SIMPLE(CMP_PKIMESSAGE, header, CMP_PKIHEADER),
 	ASN1_SIMPLE(CMP_PKIMESSAGE, body, CMP_PKIBODY),
 	ASN1_EXP_OPT(CMP_PKIMESSAGE, protection, ASN1_BIT_STRING,0),
 	/* CMP_CMPCERTIFICATE is effectively X509 so it is used directly */
 	ASN1_EXP_SEQUENCE_OF_OPT(CMP_PKIMESSAGE, extraCerts, X509,1)
-} ASN1_SEQUENCE_END(CMP_PKIMESSAGE)
+} ASN1_SEQUENCE_END_enc(CMP_PKIMESSAGE, CMP_PKIMESSAGE)
 IMPLEMENT_ASN1_FUNCTIONS(CMP_PKIMESSAGE)
 
 ASN1_ITEM_TEMPLATE(CMP_PKIMESSAGES) =
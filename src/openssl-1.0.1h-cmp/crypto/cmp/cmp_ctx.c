@@ -74,6 +74,7 @@
 #include <openssl/err.h>
 #include <string.h>
 #include <dirent.h>
+#include <sys/time.h>
 
 /* NAMING
  * The 0 version uses the supplied structure pointer directly in the parent and
@@ -99,17 +100,31 @@ ASN1_SEQUENCE(CMP_CTX) = {
 	ASN1_SEQUENCE_OF_OPT(CMP_CTX, caPubs, X509),
 	ASN1_SEQUENCE_OF_OPT(CMP_CTX, extraCertsOut, X509),
 	ASN1_SEQUENCE_OF_OPT(CMP_CTX, extraCertsIn, X509),
+	ASN1_SEQUENCE_OF_OPT(CMP_CTX, untrusted_certs, X509),
 	ASN1_OPT(CMP_CTX, newClCert, X509),
 	ASN1_OPT(CMP_CTX, transactionID, ASN1_OCTET_STRING),
 	ASN1_OPT(CMP_CTX, recipNonce, ASN1_OCTET_STRING),
 	ASN1_OPT(CMP_CTX, validatedSrvCert, X509),
+	ASN1_OPT(CMP_CTX, pbmAlg, X509_ALGOR),
 	ASN1_SEQUENCE_OF_OPT(CMP_CTX, lastStatusString, ASN1_UTF8STRING),
 	ASN1_SEQUENCE_OF_OPT(CMP_CTX, policies, POLICYINFO),
 } ASN1_SEQUENCE_END(CMP_CTX)
 IMPLEMENT_ASN1_FUNCTIONS(CMP_CTX)
 
 /* ############################################################################ *
- * Returns a duplicate of the given stack of X509 certificates.
+ * Shares the given certificate by incrementing its reference count instead
+ * of copying it; certificates are not modified once they are built.
+ * returns the same certificate
+ * ############################################################################ */
+static X509 *cert_up_ref(const X509 *cert)
+	{
+	CRYPTO_add(&((X509*)cert)->references, 1, CRYPTO_LOCK_X509);
+	return (X509*) cert;
+	}
+
+/* ############################################################################ *
+ * Returns a duplicate of the given stack of X509 certificates. The
+ * certificates themselves are shared by incrementing their reference count.
  * ############################################################################ */
 static STACK_OF(X509)* X509_stack_dup(const STACK_OF(X509)* stack)
 	{
@@ -120,7 +135,7 @@ static STACK_OF(X509)* X509_stack_dup(const STACK_OF(X509)* stack)
 	if (!(newsk = sk_X509_new_null())) goto err;
 
 	for (i = 0; i < sk_X509_num(stack); i++)
-		sk_X509_push(newsk, X509_dup(sk_X509_value(stack, i)));
+		sk_X509_push(newsk, cert_up_ref(sk_X509_value(stack, i)));
 
 	return newsk;
 err:
@@ -128,46 +143,13 @@ err:
 	}
 
 /* ############################################################################ *
- * Creates a copy of the given EVP_PKEY.
- * TODO: is there really no other already existing way to do that?
- * returns ptr to duplicated EVP_PKEY on success, NULL on error
+ * Shares the given EVP_PKEY by incrementing its reference count.
+ * returns the same EVP_PKEY
  * ############################################################################ */
-static EVP_PKEY *pkey_dup(const EVP_PKEY *pkey)
+static EVP_PKEY *pkey_up_ref(const EVP_PKEY *pkey)
 	{
-	EVP_PKEY *pkeyDup = EVP_PKEY_new();
-	if (!pkeyDup) goto err;
-	
-	switch (pkey->type)
-		{
-#ifndef OPENSSL_NO_RSA
-		case EVP_PKEY_RSA:
-			EVP_PKEY_set1_RSA(pkeyDup, pkey->pkey.rsa);
-			break;
-#endif
-#ifndef OPENSSL_NO_DSA
-		case EVP_PKEY_DSA: 
-			EVP_PKEY_set1_DSA(pkeyDup, pkey->pkey.dsa);
-			break;
-#endif
-#ifndef OPENSSL_NO_DH
-		case EVP_PKEY_DH:
-			EVP_PKEY_set1_DH(pkeyDup, pkey->pkey.dh);
-			break;
-#endif
-#ifndef OPENSSL_NO_EC
-		case EVP_PKEY_EC:
-			EVP_PKEY_set1_EC_KEY(pkeyDup, pkey->pkey.ec);
-			break;
-#endif
-		default: 
-			CMPerr(CMP_F_PKEY_DUP, CMP_R_UNSUPPORTED_KEY_TYPE);
-			goto err;
-		}
-	return pkeyDup;
-
-err:
-	if (pkeyDup) EVP_PKEY_free(pkeyDup);
-	return NULL;
+	CRYPTO_add(&((EVP_PKEY*)pkey)->references, 1, CRYPTO_LOCK_EVP_PKEY);
+	return (EVP_PKEY*) pkey;
 	}
 
 /* ############################################################################ *
@@ -197,6 +179,53 @@ int CMP_CTX_set0_untrustedStore( CMP_CTX *ctx, X509_STORE *store)
 	return 1;
 	}
 
+/* ############################################################################ *
+ * Share a certificate store containing root CA certs, e.g. one loaded store
+ * between the contexts of many concurrent transactions. The store is up-ref'd,
+ * it must not be modified any more once it is shared.
+ * returns 1 on success, 0 on error
+ * ############################################################################ */
+int CMP_CTX_set1_trustedStore( CMP_CTX *ctx, X509_STORE *store)
+	{
+	if (!store) return 0;
+	CRYPTO_add(&store->references, 1, CRYPTO_LOCK_X509_STORE);
+	return CMP_CTX_set0_trustedStore(ctx, store);
+	}
+
+/* ############################################################################ *
+ * Share a certificate store containing intermediate certificates, see
+ * CMP_CTX_set1_trustedStore().
+ * returns 1 on success, 0 on error
+ * ############################################################################ */
+int CMP_CTX_set1_untrustedStore( CMP_CTX *ctx, X509_STORE *store)
+	{
+	if (!store) return 0;
+	CRYPTO_add(&store->references, 1, CRYPTO_LOCK_X509_STORE);
+	return CMP_CTX_set0_untrustedStore(ctx, store);
+	}
+
+/* ################################################################ *
+ * internal function
+ *
+ * Loads the ciphers, digests and error strings, only the first time it is
+ * called in the process.
+ * ################################################################ */
+static void cmp_lib_init(void)
+	{
+	static volatile int done = 0;
+
+	if (done) return;
+	CRYPTO_w_lock(CRYPTO_LOCK_CMP_INIT);
+	if (!done)
+		{
+		OpenSSL_add_all_ciphers();
+		OpenSSL_add_all_digests();
+		ERR_load_crypto_strings();
+		done = 1;
+		}
+	CRYPTO_w_unlock(CRYPTO_LOCK_CMP_INIT);
+	}
+
 /* ################################################################ *
  * Allocates and initializes a CMP_CTX context structure with some 
  * default values.
@@ -229,10 +258,15 @@ int CMP_CTX_init( CMP_CTX *ctx)
 	ctx->sourceAddress   = NULL;
 	ctx->lastHTTPCode    = 0;
 	ctx->useTLS    = 0;
+	ctx->httpPool  = NULL;
+	ctx->tlsCtx    = NULL;
 
 	ctx->error_cb = NULL;
 	ctx->debug_cb = (cmp_logfn_t) puts;
 	ctx->certConf_cb = NULL;
+	ctx->metrics_cb = NULL;
+	ctx->msgMetrics = NULL;
+	ctx->txnMetrics = NULL;
 
 	ctx->trusted_store	 = X509_STORE_new();
 	ctx->untrusted_store = X509_STORE_new();
@@ -245,10 +279,11 @@ int CMP_CTX_init( CMP_CTX *ctx)
 	ctx->permitTAInExtraCertsForIR = 0;
 	ctx->validatedSrvCert = NULL;
 
-	/* initialize OpenSSL */
-	OpenSSL_add_all_ciphers();
-	OpenSSL_add_all_digests();
-	ERR_load_crypto_strings();
+	ctx->pbmOwf = NID_sha1;
+	ctx->pbmMac = NID_hmac_sha1;
+	ctx->pbmIterationCount = 500;
+
+	cmp_lib_init();
 
 	return 1;
 
@@ -268,8 +303,15 @@ void CMP_CTX_delete(CMP_CTX *ctx)
 	if (ctx->serverName) OPENSSL_free(ctx->serverName);
 	if (ctx->serverPath) OPENSSL_free(ctx->serverPath);
 	if (ctx->proxyName) OPENSSL_free(ctx->proxyName);
+	if (ctx->sourceAddress) OPENSSL_free(ctx->sourceAddress);
 	if (ctx->trusted_store) X509_STORE_free(ctx->trusted_store);
 	if (ctx->untrusted_store) X509_STORE_free(ctx->untrusted_store);
+	if (ctx->httpPool) CMP_HTTP_POOL_free(ctx->httpPool);
+	if (ctx->tlsCtx) CMP_TLS_CTX_free(ctx->tlsCtx);
+	if (ctx->msgMetrics) OPENSSL_free(ctx->msgMetrics);
+	if (ctx->txnMetrics) OPENSSL_free(ctx->txnMetrics);
+	CMP_CTX_certReqs_clear(ctx);
+	CMP_CTX_revDetails_clear(ctx);
 
 	CMP_CTX_free(ctx);
 	}
@@ -292,6 +334,106 @@ err:
 	return NULL;
 	}
 
+/* ################################################################ *
+ * Creates a context for one transaction from tmpl, a context holding the
+ * settings common to many transactions (server, trust stores, credentials,
+ * options and callbacks). Certificates, keys, stores, the HTTP connection
+ * pool and the TLS context are shared with tmpl by reference count, so this
+ * neither copies nor re-encodes anything large. State belonging to a
+ * transaction, e.g. the transactionID, nonces or received certificates, is
+ * not taken over.
+ *
+ * tmpl must not be modified while children are created from it. Several
+ * threads may create children at the same time and tmpl may be freed before
+ * its children, as all reference counts are taken under a lock. The HTTP
+ * connection pool and the TLS context themselves are not thread safe,
+ * though: children used in different threads must each get their own with
+ * CMP_CTX_set1_httpPool() and CMP_CTX_set1_tlsCtx(), or none.
+ * returns pointer to created CMP_CTX on success, NULL on error
+ * ################################################################ */
+CMP_CTX *CMP_CTX_create_child(const CMP_CTX *tmpl)
+	{
+	CMP_CTX *ctx=NULL;
+	int i;
+
+	if (!tmpl)
+		{
+		CMPerr(CMP_F_CMP_CTX_CREATE_CHILD, CMP_R_NULL_ARGUMENT);
+		return NULL;
+		}
+	if (!(ctx = CMP_CTX_new())) goto err;
+	cmp_lib_init();
+
+	/* ASN.1 types, which are freed by CMP_CTX_free() */
+	if (tmpl->referenceValue &&
+		!(ctx->referenceValue = ASN1_OCTET_STRING_dup(tmpl->referenceValue))) goto err;
+	if (tmpl->secretValue &&
+		!(ctx->secretValue = ASN1_OCTET_STRING_dup(tmpl->secretValue))) goto err;
+	if (tmpl->regToken &&
+		!(ctx->regToken = ASN1_STRING_dup(tmpl->regToken))) goto err;
+	if (tmpl->srvCert) ctx->srvCert = cert_up_ref(tmpl->srvCert);
+	if (tmpl->clCert) ctx->clCert = cert_up_ref(tmpl->clCert);
+	if (tmpl->oldClCert) ctx->oldClCert = cert_up_ref(tmpl->oldClCert);
+	if (tmpl->subjectName &&
+		!(ctx->subjectName = X509_NAME_dup(tmpl->subjectName))) goto err;
+	if (tmpl->recipient &&
+		!(ctx->recipient = X509_NAME_dup(tmpl->recipient))) goto err;
+	if (tmpl->subjectAltNames)
+		{
+		if (!(ctx->subjectAltNames = sk_GENERAL_NAME_new_null())) goto err;
+		for (i = 0; i < sk_GENERAL_NAME_num(tmpl->subjectAltNames); i++)
+			if (!sk_GENERAL_NAME_push(ctx->subjectAltNames,
+					GENERAL_NAME_dup(sk_GENERAL_NAME_value(tmpl->subjectAltNames, i)))) goto err;
+		}
+	if (tmpl->extraCertsOut &&
+		!(ctx->extraCertsOut = X509_stack_dup(tmpl->extraCertsOut))) goto err;
+	if (tmpl->policies && !(ctx->policies = ASN1_item_dup(
+			ASN1_ITEM_rptr(CERTIFICATEPOLICIES), tmpl->policies))) goto err;
+
+	/* the rest is freed by CMP_CTX_delete() */
+	if (tmpl->pkey) ctx->pkey = pkey_up_ref(tmpl->pkey);
+	if (tmpl->newPkey) ctx->newPkey = pkey_up_ref(tmpl->newPkey);
+	if (tmpl->trusted_store)
+		{
+		CRYPTO_add(&tmpl->trusted_store->references, 1, CRYPTO_LOCK_X509_STORE);
+		ctx->trusted_store = tmpl->trusted_store;
+		}
+	if (tmpl->untrusted_store)
+		{
+		CRYPTO_add(&tmpl->untrusted_store->references, 1, CRYPTO_LOCK_X509_STORE);
+		ctx->untrusted_store = tmpl->untrusted_store;
+		}
+	if (tmpl->serverName && !(ctx->serverName = BUF_strdup(tmpl->serverName))) goto err;
+	if (!(ctx->serverPath = BUF_strdup(tmpl->serverPath ? tmpl->serverPath : ""))) goto err;
+	if (tmpl->proxyName && !(ctx->proxyName = BUF_strdup(tmpl->proxyName))) goto err;
+	if (tmpl->sourceAddress && !(ctx->sourceAddress = BUF_strdup(tmpl->sourceAddress))) goto err;
+	if (tmpl->httpPool && !CMP_CTX_set1_httpPool(ctx, tmpl->httpPool)) goto err;
+	if (tmpl->tlsCtx && !CMP_CTX_set1_tlsCtx(ctx, tmpl->tlsCtx)) goto err;
+	if (tmpl->metrics_cb && !CMP_CTX_set_metrics_callback(ctx, tmpl->metrics_cb)) goto err;
+
+	ctx->setSubjectAltNameCritical = tmpl->setSubjectAltNameCritical;
+	ctx->implicitConfirm = tmpl->implicitConfirm;
+	ctx->popoMethod = tmpl->popoMethod;
+	ctx->HttpTimeOut = tmpl->HttpTimeOut;
+	ctx->maxPollTime = tmpl->maxPollTime;
+	ctx->error_cb = tmpl->error_cb;
+	ctx->debug_cb = tmpl->debug_cb;
+	ctx->certConf_cb = tmpl->certConf_cb;
+	ctx->permitTAInExtraCertsForIR = tmpl->permitTAInExtraCertsForIR;
+	ctx->pbmOwf = tmpl->pbmOwf;
+	ctx->pbmMac = tmpl->pbmMac;
+	ctx->pbmIterationCount = tmpl->pbmIterationCount;
+	ctx->serverPort = tmpl->serverPort;
+	ctx->proxyPort = tmpl->proxyPort;
+	ctx->useTLS = tmpl->useTLS;
+
+	return ctx;
+err:
+	CMPerr(CMP_F_CMP_CTX_CREATE_CHILD, CMP_R_UNABLE_TO_CREATE_CONTEXT);
+	CMP_CTX_delete(ctx);
+	return NULL;
+	}
+
 /* ################################################################ *
  * returns latest failInfoCode, -1 on error
  * ################################################################ */
@@ -328,6 +470,57 @@ err:
 	return 0;
 	}
 
+/* ################################################################ *
+ * Set a callback function which will receive the timings and counters of
+ * every request/response exchange and of every transaction done with ctx,
+ * see CMP_METRICS. Measuring only happens while a callback is set, pass
+ * NULL to switch it off again. Only one transaction at a time is measured
+ * per context.
+ * returns 1 on success, 0 on error
+ * ################################################################ */
+int CMP_CTX_set_metrics_callback( CMP_CTX *ctx, cmp_metricsFn_t cb)
+	{
+	if (!ctx) goto err;
+
+	if (cb && !ctx->msgMetrics)
+		{
+		ctx->msgMetrics = OPENSSL_malloc(sizeof(CMP_METRICS));
+		ctx->txnMetrics = OPENSSL_malloc(sizeof(CMP_METRICS));
+		if (!ctx->msgMetrics || !ctx->txnMetrics)
+			{
+			CMPerr(CMP_F_CMP_CTX_SET_METRICS_CALLBACK, ERR_R_MALLOC_FAILURE);
+			goto err;
+			}
+		memset(ctx->msgMetrics, 0, sizeof(CMP_METRICS));
+		memset(ctx->txnMetrics, 0, sizeof(CMP_METRICS));
+		}
+	else if (!cb && ctx->msgMetrics)
+		{
+		OPENSSL_free(ctx->msgMetrics);
+		OPENSSL_free(ctx->txnMetrics);
+		ctx->msgMetrics = ctx->txnMetrics = NULL;
+		}
+	ctx->metrics_cb = cb;
+	return 1;
+err:
+	if (ctx && ctx->msgMetrics) OPENSSL_free(ctx->msgMetrics);
+	if (ctx && ctx->txnMetrics) OPENSSL_free(ctx->txnMetrics);
+	if (ctx) ctx->msgMetrics = ctx->txnMetrics = NULL;
+	return 0;
+	}
+
+/* ################################################################ *
+ * returns a timestamp in microseconds, only meaningful for computing the
+ * durations reported in CMP_METRICS
+ * ################################################################ */
+unsigned long CMP_METRICS_now(void)
+	{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return (unsigned long) tv.tv_sec * 1000000UL + tv.tv_usec;
+	}
+
 /* ################################################################ *
  * Set a callback function which will receive debug messages.
  * returns 1 on success, 0 on error
@@ -480,7 +673,7 @@ err:
 	}
 
 /* ################################################################ *
- * Duplicate and push the given X509 certificate to the stack of 
+ * Push the given X509 certificate (up-ref'd) to the stack of
  * outbound certificates to send in the extraCerts field.
  * returns number of pushed certificates on success, 0 on error
  * ################################################################ */
@@ -488,35 +681,63 @@ int CMP_CTX_extraCertsOut_push1( CMP_CTX *ctx, const X509 *val)
 	{
 	if (!ctx) goto err;
 	if (!ctx->extraCertsOut && !(ctx->extraCertsOut = sk_X509_new_null())) return 0;
-	return sk_X509_push(ctx->extraCertsOut, X509_dup((X509*)val));
+	return sk_X509_push(ctx->extraCertsOut, cert_up_ref(val));
 err:
 	CMPerr(CMP_F_CMP_CTX_EXTRACERTSOUT_PUSH1, CMP_R_NULL_ARGUMENT);
 	return 0;
 	}
 
 /* ############################################################################ *
- * load all the intermediate certificates from the given stack into untrusted_store
+ * keep all the intermediate certificates from the given stack, usually the
+ * extraCerts of a received message, for validating later messages. They go to
+ * ctx->untrusted_certs, not to untrusted_store, which may be shared with other
+ * contexts and threads and is only read here.
  * returns 1 on success, 0 on error
  * ############################################################################ */
 int CMP_CTX_loadUntrustedStack(CMP_CTX *ctx, STACK_OF(X509) *stack)
 	{
-	int i;
+	int i, j, known, selfSigned;
 	EVP_PKEY *pubkey;
 	X509 *cert;
+	X509_OBJECT obj;
 	
 	if (!stack) goto err;
-	if (!ctx->untrusted_store && !( ctx->untrusted_store = X509_STORE_new() ))
+	if (!ctx->untrusted_certs && !( ctx->untrusted_certs = sk_X509_new_null() ))
 		goto err;
 
 	for (i = 0; i < sk_X509_num(stack); i++)
 		{
 		if(!(cert = sk_X509_value(stack, i))) goto err;
-		if(!(pubkey = X509_get_pubkey(cert))) continue;
 
-		/* don't add self-signed certs here */
-		if (!X509_verify(cert, pubkey))
-			X509_STORE_add_cert(ctx->untrusted_store, cert);  /* don't fail as adding existing certificate to store would cause error */
-		EVP_PKEY_free(pubkey);
+		/* skip certificates we already have; usually the same CA sends
+		 * the same extraCerts with every message */
+		known = 0;
+		for (j = 0; !known && j < sk_X509_num(ctx->untrusted_certs); j++)
+			known = !X509_cmp(sk_X509_value(ctx->untrusted_certs, j), cert);
+		if (!known && ctx->untrusted_store)
+			{
+			obj.type = X509_LU_X509;
+			obj.data.x509 = cert;
+			CRYPTO_r_lock(CRYPTO_LOCK_X509_STORE);
+			known = X509_OBJECT_retrieve_match(ctx->untrusted_store->objs, &obj) != NULL;
+			CRYPTO_r_unlock(CRYPTO_LOCK_X509_STORE);
+			}
+		if (known) continue;
+
+		/* don't add self-signed certs here; only self-issued ones need to
+		 * have their signature checked */
+		X509_check_purpose(cert, -1, 0);
+		selfSigned = 0;
+		if (cert->ex_flags & EXFLAG_SS)
+			{
+			if(!(pubkey = X509_get_pubkey(cert))) continue;
+			selfSigned = X509_verify(cert, pubkey) != 0;
+			EVP_PKEY_free(pubkey);
+			}
+		if (selfSigned) continue;
+
+		if (!sk_X509_push(ctx->untrusted_certs, cert)) goto err;
+		CRYPTO_add(&cert->references, 1, CRYPTO_LOCK_X509);
 		}
 
 	return 1;
@@ -673,7 +894,7 @@ int CMP_CTX_set1_srvCert( CMP_CTX *ctx, const X509 *cert)
 		ctx->srvCert = NULL;
 		}
 
-	if (!(ctx->srvCert = X509_dup( (X509*)cert))) goto err;
+	ctx->srvCert = cert_up_ref(cert);
 	return 1;
 err:
 	CMPerr(CMP_F_CMP_CTX_SET1_SRVCERT, CMP_R_NULL_ARGUMENT);
@@ -745,6 +966,230 @@ err:
 	return 0;
 	}
 
+/* ################################################################ *
+ * internal function
+ *
+ * frees a CMP_CERTREQ_SPEC including the objects it owns
+ * ################################################################ */
+static void certReq_spec_free(CMP_CERTREQ_SPEC *spec)
+	{
+	if (!spec) return;
+	if (spec->pkey) EVP_PKEY_free(spec->pkey);
+	if (spec->subject) X509_NAME_free(spec->subject);
+	if (spec->extensions) sk_X509_EXTENSION_pop_free(spec->extensions, X509_EXTENSION_free);
+	if (spec->cert) X509_free(spec->cert);
+	OPENSSL_free(spec);
+	}
+
+/* ################################################################ *
+ * Adds a certificate to request in the next ir, cr or kur. Once one is
+ * added, these messages carry one CertReqMsg per call in the order of
+ * the calls, with certReqId 0, 1, ... instead of the single one for
+ * newPkey (or pkey for cr), and a single certConf confirms all
+ * certificates received.
+ *
+ * pkey is the key to certify and shared by incrementing its reference
+ * count. subject and extensions are copied; if NULL, they are taken from
+ * the context as for a single request (subjectName, subjectAltNames and
+ * policies). popoMethod is one of the CRMF_POPO_* values.
+ *
+ * The results are available through CMP_CTX_certReq_status_get() and
+ * CMP_CTX_certReq_cert_get1() after the transaction.
+ * returns 1 on success, 0 on error
+ * ################################################################ */
+int CMP_CTX_certReq_push1( CMP_CTX *ctx, const EVP_PKEY *pkey, const X509_NAME *subject,
+		const X509_EXTENSIONS *extensions, int popoMethod)
+	{
+	CMP_CERTREQ_SPEC *spec = NULL;
+	int i;
+
+	if (!ctx || !pkey)
+		{
+		CMPerr(CMP_F_CMP_CTX_CERTREQ_PUSH1, CMP_R_NULL_ARGUMENT);
+		return 0;
+		}
+
+	if (!(spec = OPENSSL_malloc(sizeof(CMP_CERTREQ_SPEC)))) goto err;
+	memset(spec, 0, sizeof(CMP_CERTREQ_SPEC));
+	spec->popoMethod = popoMethod;
+	spec->status = -1;
+	spec->pkey = pkey_up_ref(pkey);
+	if (subject && !(spec->subject = X509_NAME_dup((X509_NAME*) subject))) goto err;
+	if (extensions)
+		{
+		if (!(spec->extensions = sk_X509_EXTENSION_new_null())) goto err;
+		for (i = 0; i < sk_X509_EXTENSION_num(extensions); i++)
+			if (!sk_X509_EXTENSION_push(spec->extensions,
+					X509_EXTENSION_dup(sk_X509_EXTENSION_value(extensions, i)))) goto err;
+		}
+
+	if (!ctx->certReqs && !(ctx->certReqs = sk_CMP_CERTREQ_SPEC_new_null())) goto err;
+	if (!sk_CMP_CERTREQ_SPEC_push(ctx->certReqs, spec)) goto err;
+	return 1;
+
+err:
+	CMPerr(CMP_F_CMP_CTX_CERTREQ_PUSH1, ERR_R_MALLOC_FAILURE);
+	certReq_spec_free(spec);
+	return 0;
+	}
+
+/* ################################################################ *
+ * returns the number of certificates added with CMP_CTX_certReq_push1()
+ * ################################################################ */
+int CMP_CTX_certReqs_num( CMP_CTX *ctx)
+	{
+	if (!ctx || !ctx->certReqs) return 0;
+	return sk_CMP_CERTREQ_SPEC_num(ctx->certReqs);
+	}
+
+/* ################################################################ *
+ * returns the PKIStatus received for the idx'th certificate requested with
+ * CMP_CTX_certReq_push1(), -1 if there was no response for it
+ * ################################################################ */
+int CMP_CTX_certReq_status_get( CMP_CTX *ctx, int idx)
+	{
+	CMP_CERTREQ_SPEC *spec;
+
+	if (!ctx || !(spec = sk_CMP_CERTREQ_SPEC_value(ctx->certReqs, idx))) return -1;
+	return spec->status;
+	}
+
+/* ################################################################ *
+ * returns the certificate received for the idx'th request added with
+ * CMP_CTX_certReq_push1(), up-ref'd and to be freed by the caller, NULL if
+ * none was received
+ * ################################################################ */
+X509 *CMP_CTX_certReq_cert_get1( CMP_CTX *ctx, int idx)
+	{
+	CMP_CERTREQ_SPEC *spec;
+
+	if (!ctx || !(spec = sk_CMP_CERTREQ_SPEC_value(ctx->certReqs, idx))) return NULL;
+	if (!spec->cert) return NULL;
+	return cert_up_ref(spec->cert);
+	}
+
+/* ################################################################ *
+ * removes all certificates added with CMP_CTX_certReq_push1() together
+ * with their results, so that the next ir, cr or kur requests a single
+ * certificate again
+ * ################################################################ */
+void CMP_CTX_certReqs_clear( CMP_CTX *ctx)
+	{
+	if (!ctx || !ctx->certReqs) return;
+	sk_CMP_CERTREQ_SPEC_pop_free(ctx->certReqs, certReq_spec_free);
+	ctx->certReqs = NULL;
+	}
+
+/* ################################################################ *
+ * internal function
+ *
+ * adds a RevDetails for the certificate given by issuer and serial, and
+ * optionally subject, to the certificates to revoke
+ * returns 1 on success, 0 on error
+ * ################################################################ */
+static int revDetails_push(CMP_CTX *ctx, X509_NAME *issuer, ASN1_INTEGER *serial, X509_NAME *subject)
+	{
+	CMP_REVDETAILS *rd = NULL;
+	CRMF_CERTTEMPLATE *certTpl = NULL;
+
+	if (!(rd = CMP_REVDETAILS_new())) goto err;
+	if (!rd->certDetails && !(rd->certDetails = CRMF_CERTTEMPLATE_new())) goto err;
+	certTpl = rd->certDetails;
+
+	if (!X509_NAME_set(&certTpl->issuer, issuer)) goto err;
+	if (!(certTpl->serialNumber = ASN1_INTEGER_dup(serial))) goto err;
+	if (subject && !X509_NAME_set(&certTpl->subject, subject)) goto err;
+
+	if (!ctx->revDetails && !(ctx->revDetails = sk_CMP_REVDETAILS_new_null())) goto err;
+	if (!sk_CMP_REVDETAILS_push(ctx->revDetails, rd)) goto err;
+	return 1;
+
+err:
+	if (rd) CMP_REVDETAILS_free(rd);
+	return 0;
+	}
+
+/* ################################################################ *
+ * Adds a certificate to revoke with the next rr. Once one is added, the
+ * rr carries one RevDetails per certificate added, in the order of the
+ * calls, instead of the single one for clCert, and the rp is expected to
+ * answer each of them. The certificate may be any issued by the CA, not
+ * only our own, if the server permits it.
+ * returns 1 on success, 0 on error
+ * ################################################################ */
+int CMP_CTX_revCert_push1( CMP_CTX *ctx, const X509 *cert)
+	{
+	if (!ctx || !cert)
+		{
+		CMPerr(CMP_F_CMP_CTX_REVCERT_PUSH1, CMP_R_NULL_ARGUMENT);
+		return 0;
+		}
+
+	if (!revDetails_push(ctx, X509_get_issuer_name((X509*) cert),
+			X509_get_serialNumber((X509*) cert), X509_get_subject_name((X509*) cert)))
+		{
+		CMPerr(CMP_F_CMP_CTX_REVCERT_PUSH1, ERR_R_MALLOC_FAILURE);
+		return 0;
+		}
+	return 1;
+	}
+
+/* ################################################################ *
+ * Like CMP_CTX_revCert_push1(), for a certificate only known by issuer
+ * name and serial number
+ * returns 1 on success, 0 on error
+ * ################################################################ */
+int CMP_CTX_revSerial_push1( CMP_CTX *ctx, const X509_NAME *issuer, const ASN1_INTEGER *serial)
+	{
+	if (!ctx || !issuer || !serial)
+		{
+		CMPerr(CMP_F_CMP_CTX_REVSERIAL_PUSH1, CMP_R_NULL_ARGUMENT);
+		return 0;
+		}
+
+	if (!revDetails_push(ctx, (X509_NAME*) issuer, (ASN1_INTEGER*) serial, NULL))
+		{
+		CMPerr(CMP_F_CMP_CTX_REVSERIAL_PUSH1, ERR_R_MALLOC_FAILURE);
+		return 0;
+		}
+	return 1;
+	}
+
+/* ################################################################ *
+ * returns the number of certificates added with CMP_CTX_revCert_push1()
+ * and CMP_CTX_revSerial_push1()
+ * ################################################################ */
+int CMP_CTX_revDetails_num( CMP_CTX *ctx)
+	{
+	if (!ctx || !ctx->revDetails) return 0;
+	return sk_CMP_REVDETAILS_num(ctx->revDetails);
+	}
+
+/* ################################################################ *
+ * returns the PKIStatus received in the rp for the idx'th certificate to
+ * revoke, -1 if there was no status for it
+ * ################################################################ */
+int CMP_CTX_revStatus_get( CMP_CTX *ctx, int idx)
+	{
+	CMP_PKISTATUSINFO *status;
+
+	if (!ctx || !(status = sk_CMP_PKISTATUSINFO_value(ctx->revStatus, idx))) return -1;
+	return CMP_PKISTATUSINFO_PKIstatus_get(status);
+	}
+
+/* ################################################################ *
+ * removes all certificates to revoke together with their results, so that
+ * the next rr revokes clCert again
+ * ################################################################ */
+void CMP_CTX_revDetails_clear( CMP_CTX *ctx)
+	{
+	if (!ctx) return;
+	if (ctx->revDetails) sk_CMP_REVDETAILS_pop_free(ctx->revDetails, CMP_REVDETAILS_free);
+	if (ctx->revStatus) sk_CMP_PKISTATUSINFO_pop_free(ctx->revStatus, CMP_PKISTATUSINFO_free);
+	ctx->revDetails = NULL;
+	ctx->revStatus = NULL;
+	}
+
 /* ################################################################ *
  * Set our own client certificate, used for example in KUR and when
  * doing the IR with existing certificate.
@@ -761,7 +1206,7 @@ int CMP_CTX_set1_clCert( CMP_CTX *ctx, const X509 *cert)
 		ctx->clCert = NULL;
 		}
 
-	if (!(ctx->clCert = X509_dup( (X509*)cert))) goto err;
+	ctx->clCert = cert_up_ref(cert);
 	return 1;
 err:
 	CMPerr(CMP_F_CMP_CTX_SET1_CLCERT, CMP_R_NULL_ARGUMENT);
@@ -783,7 +1228,7 @@ int CMP_CTX_set1_oldClCert( CMP_CTX *ctx, const X509 *cert)
 		ctx->oldClCert = NULL;
 		}
 
-	if (!(ctx->oldClCert = X509_dup( (X509*)cert))) goto err;
+	ctx->oldClCert = cert_up_ref(cert);
 	return 1;
 err:
 	CMPerr(CMP_F_CMP_CTX_SET1_OLDCLCERT, CMP_R_NULL_ARGUMENT);
@@ -806,7 +1251,7 @@ int CMP_CTX_set1_newClCert( CMP_CTX *ctx, const X509 *cert)
 		ctx->newClCert = NULL;
 		}
 
-	if (!(ctx->newClCert = X509_dup( (X509*)cert))) goto err;
+	ctx->newClCert = cert_up_ref(cert);
 	return 1;
 err:
 	CMPerr(CMP_F_CMP_CTX_SET1_NEWCLCERT, CMP_R_NULL_ARGUMENT);
@@ -814,8 +1259,8 @@ err:
 	}
 
 /* ################################################################ *
- * Set the client's private key. This creates a duplicate of the key
- * so the given pointer is not used directly.
+ * Set the client's private key. The key is shared by incrementing its
+ * reference count, so it must still be freed by the caller.
  * returns 1 on success, 0 on error
  * ################################################################ */
 int CMP_CTX_set1_pkey( CMP_CTX *ctx, const EVP_PKEY *pkey)
@@ -824,7 +1269,7 @@ int CMP_CTX_set1_pkey( CMP_CTX *ctx, const EVP_PKEY *pkey)
 	if (!ctx) goto err;
 	if (!pkey) goto err;
 
-	pkeyDup = pkey_dup(pkey);;
+	pkeyDup = pkey_up_ref(pkey);
 	return CMP_CTX_set0_pkey(ctx, pkeyDup);
 
 err:
@@ -858,7 +1303,7 @@ err:
 
 /* ################################################################ *
  * Set new key pa8r. Used for example when doing Key Update.
- * The key is duplicated so the original pointer is not directly used.
+ * The key is shared by incrementing its reference count.
  * returns 1 on success, 0 on error
  * ################################################################ */
 int CMP_CTX_set1_newPkey( CMP_CTX *ctx, const EVP_PKEY *pkey)
@@ -867,7 +1312,7 @@ int CMP_CTX_set1_newPkey( CMP_CTX *ctx, const EVP_PKEY *pkey)
 	if (!ctx) goto err;
 	if (!pkey) goto err;
 
-	pkeyDup = pkey_dup(pkey);
+	pkeyDup = pkey_up_ref(pkey);
 	return CMP_CTX_set0_newPkey(ctx, pkeyDup);
 
 err:
@@ -916,6 +1361,13 @@ int CMP_CTX_set1_transactionID( CMP_CTX *ctx, const ASN1_OCTET_STRING *id)
 
 	if (!(ctx->transactionID = ASN1_OCTET_STRING_dup((ASN1_OCTET_STRING *)id)))
 		return 0;
+
+	/* a new transaction gets a new PBMParameter (with a fresh salt) */
+	if (ctx->pbmAlg)
+		{
+		X509_ALGOR_free(ctx->pbmAlg);
+		ctx->pbmAlg = NULL;
+		}
 	return 1;
 err:
 	CMPerr(CMP_F_CMP_CTX_SET1_TRANSACTIONID, CMP_R_NULL_ARGUMENT);
@@ -1064,6 +1516,49 @@ err:
 	return 0;	
 	}
 
+/* ################################################################ *
+ * Sets the pool of idle HTTP connections to take connections from and
+ * to return them to after use. The same pool may be set in several
+ * contexts so that they share connections. NULL disables keep-alive.
+ * returns 1 on success, 0 on error
+ * ################################################################ */
+int CMP_CTX_set1_httpPool( CMP_CTX *ctx, CMP_HTTP_POOL *pool)
+	{
+	if (!ctx) goto err;
+
+	if (pool && !CMP_HTTP_POOL_up_ref(pool)) goto err;
+	if (ctx->httpPool)
+		CMP_HTTP_POOL_free(ctx->httpPool);
+	ctx->httpPool = pool;
+
+	return 1;
+err:
+	CMPerr(CMP_F_CMP_CTX_SET1_HTTPPOOL, CMP_R_NULL_ARGUMENT);
+	return 0;
+	}
+
+/* ################################################################ *
+ * Sets the TLS client context holding the SSL_CTX and the sessions to
+ * resume. The same context may be set in several CMP_CTX so that they
+ * share sessions. A context is created automatically when TLS is
+ * enabled with CMP_CTX_set_option(ctx, CMP_CTX_USE_TLS, 1).
+ * returns 1 on success, 0 on error
+ * ################################################################ */
+int CMP_CTX_set1_tlsCtx( CMP_CTX *ctx, CMP_TLS_CTX *tls)
+	{
+	if (!ctx) goto err;
+
+	if (tls && !CMP_TLS_CTX_up_ref(tls)) goto err;
+	if (ctx->tlsCtx)
+		CMP_TLS_CTX_free(ctx->tlsCtx);
+	ctx->tlsCtx = tls;
+
+	return 1;
+err:
+	CMPerr(CMP_F_CMP_CTX_SET1_TLSCTX, CMP_R_NULL_ARGUMENT);
+	return 0;
+	}
+
 /* ################################################################ *
  * sets the (HTTP) server port to be used
  * returns 1 on success, 0 on error
@@ -1169,6 +1664,7 @@ err:
 
 /* ################################################################ * 
  * sets a BOOLEAN option of the context to the "val" arg
+ * (the CMP_CTX_OPT_PBM_* options take a NID or the iteration count)
  * returns 1 on success, 0 on error
  * ################################################################ */
 int CMP_CTX_set_option( CMP_CTX *ctx, const int opt, const int val)
@@ -1193,8 +1689,45 @@ int CMP_CTX_set_option( CMP_CTX *ctx, const int opt, const int val)
 			ctx->setSubjectAltNameCritical = val;
 			break;
 		case CMP_CTX_USE_TLS:
+			if (val && !ctx->tlsCtx && !(ctx->tlsCtx = CMP_TLS_CTX_new())) goto err;
 			ctx->useTLS = val;
 			break;
+		case CMP_CTX_OPT_HTTP_KEEPALIVE:
+			if (!val)
+				{
+				if (!CMP_CTX_set1_httpPool(ctx, NULL)) goto err;
+				}
+			else if (!ctx->httpPool)
+				{
+				if (!(ctx->httpPool = CMP_HTTP_POOL_new())) goto err;
+				}
+			break;
+		case CMP_CTX_OPT_HTTP_MAXCONNS:
+			/* implies keep-alive */
+			if (!ctx->httpPool && !(ctx->httpPool = CMP_HTTP_POOL_new())) goto err;
+			if (!CMP_HTTP_POOL_set_maxConns(ctx->httpPool, val)) goto err;
+			break;
+		case CMP_CTX_OPT_HTTP_IDLETIMEOUT:
+			/* implies keep-alive */
+			if (!ctx->httpPool && !(ctx->httpPool = CMP_HTTP_POOL_new())) goto err;
+			if (!CMP_HTTP_POOL_set_idleTimeOut(ctx->httpPool, val)) goto err;
+			break;
+		case CMP_CTX_OPT_PBM_OWF:
+		case CMP_CTX_OPT_PBM_MAC:
+		case CMP_CTX_OPT_PBM_ITERATIONCOUNT:
+			if (opt == CMP_CTX_OPT_PBM_OWF)
+				ctx->pbmOwf = val;
+			else if (opt == CMP_CTX_OPT_PBM_MAC)
+				ctx->pbmMac = val;
+			else
+				ctx->pbmIterationCount = val;
+			/* takes effect with the next message */
+			if (ctx->pbmAlg)
+				{
+				X509_ALGOR_free(ctx->pbmAlg);
+				ctx->pbmAlg = NULL;
+				}
+			break;
 		default:
 			goto err;
 		}
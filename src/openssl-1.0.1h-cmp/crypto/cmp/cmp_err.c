@@ -84,13 +84,17 @@ static ERR_STRING_DATA CMP_str_functs[]=
 {ERR_FUNC(CMP_F_CMP_CTX_CAPUBS_GET1),	"CMP_CTX_caPubs_get1"},
 {ERR_FUNC(CMP_F_CMP_CTX_CAPUBS_NUM),	"CMP_CTX_caPubs_num"},
 {ERR_FUNC(CMP_F_CMP_CTX_CAPUBS_POP),	"CMP_CTX_caPubs_pop"},
+{ERR_FUNC(CMP_F_CMP_CTX_CERTREQ_PUSH1),	"CMP_CTX_certReq_push1"},
 {ERR_FUNC(CMP_F_CMP_CTX_CREATE),	"CMP_CTX_create"},
+{ERR_FUNC(CMP_F_CMP_CTX_CREATE_CHILD),	"CMP_CTX_create_child"},
 {ERR_FUNC(CMP_F_CMP_CTX_EXTRACERTSIN_GET1),	"CMP_CTX_extraCertsIn_get1"},
 {ERR_FUNC(CMP_F_CMP_CTX_EXTRACERTSIN_NUM),	"CMP_CTX_extraCertsIn_num"},
 {ERR_FUNC(CMP_F_CMP_CTX_EXTRACERTSIN_POP),	"CMP_CTX_extraCertsIn_pop"},
 {ERR_FUNC(CMP_F_CMP_CTX_EXTRACERTSOUT_NUM),	"CMP_CTX_extraCertsOut_num"},
 {ERR_FUNC(CMP_F_CMP_CTX_EXTRACERTSOUT_PUSH1),	"CMP_CTX_extraCertsOut_push1"},
 {ERR_FUNC(CMP_F_CMP_CTX_INIT),	"CMP_CTX_init"},
+{ERR_FUNC(CMP_F_CMP_CTX_REVCERT_PUSH1),	"CMP_CTX_revCert_push1"},
+{ERR_FUNC(CMP_F_CMP_CTX_REVSERIAL_PUSH1),	"CMP_CTX_revSerial_push1"},
 {ERR_FUNC(CMP_F_CMP_CTX_SET0_NEWPKEY),	"CMP_CTX_set0_newPkey"},
 {ERR_FUNC(CMP_F_CMP_CTX_SET0_PKEY),	"CMP_CTX_set0_pkey"},
 {ERR_FUNC(CMP_F_CMP_CTX_SET1_CAPUBS),	"CMP_CTX_set1_caPubs"},
@@ -141,6 +145,21 @@ static ERR_STRING_DATA CMP_str_functs[]=
 {ERR_FUNC(CMP_F_PKEY_DUP),	"PKEY_DUP"},
 {ERR_FUNC(CMP_F_POLLFORRESPONSE),	"POLLFORRESPONSE"},
 {ERR_FUNC(CMP_F_SENDCERTCONF),	"SENDCERTCONF"},
+{ERR_FUNC(CMP_F_CMP_HTTP_POOL_NEW),	"CMP_HTTP_POOL_new"},
+{ERR_FUNC(CMP_F_CMP_CTX_SET1_HTTPPOOL),	"CMP_CTX_set1_httpPool"},
+{ERR_FUNC(CMP_F_CMP_TLS_CTX_NEW),	"CMP_TLS_CTX_new"},
+{ERR_FUNC(CMP_F_CMP_CTX_SET1_TLSCTX),	"CMP_CTX_set1_tlsCtx"},
+{ERR_FUNC(CMP_F_CMP_HTTP_REQ_NEW),	"CMP_HTTP_REQ_new"},
+{ERR_FUNC(CMP_F_CMP_HTTP_REQ_PERFORM),	"CMP_HTTP_REQ_perform"},
+{ERR_FUNC(CMP_F_CMP_SESSION_NEW),	"CMP_SESSION_new"},
+{ERR_FUNC(CMP_F_CMP_SESSION_STEP),	"CMP_SESSION_step"},
+{ERR_FUNC(CMP_F_CMP_POLL_SCHED_NEW),	"CMP_POLL_SCHED_new"},
+{ERR_FUNC(CMP_F_CMP_POLL_SCHED_ADD),	"CMP_POLL_SCHED_add"},
+{ERR_FUNC(CMP_F_CMP_POLLREQS_NEW),	"CMP_pollReqs_new"},
+{ERR_FUNC(CMP_F_CMP_PKIMESSAGE_SET_PROTECTION),	"CMP_PKIMESSAGE_set_protection"},
+{ERR_FUNC(CMP_F_CMP_PKIMESSAGE_GET_PROTECTEDPART_DER),	"CMP_PKIMESSAGE_get_protectedPart_der"},
+{ERR_FUNC(CMP_F_CMP_ENCODE_EXTRACERTS),	"CMP_encode_extraCerts"},
+{ERR_FUNC(CMP_F_CMP_CTX_SET_METRICS_CALLBACK),	"CMP_CTX_set_metrics_callback"},
 {0,NULL}
 	};
 
@@ -84,6 +84,7 @@
 #include <ctype.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <time.h>
 
 #ifdef OPENSSL_SYS_SUNOS
 #define strtoul (unsigned long)strtol
@@ -110,7 +111,16 @@ struct cmp_req_ctx_st {
 	int iobuflen;		/* Line buffer length */
 	BIO *io;		/* BIO to perform I/O with */
 	BIO *mem;		/* Memory BIO response is built into */
+	BIO *body;		/* Memory BIO a chunked response body is decoded into */
 	unsigned long asn1_len;	/* ASN1 length of response */
+	unsigned long chunk_len;	/* Octets left in current chunk */
+	long content_len;	/* Content-Length of response, -1 if not given */
+	int chunked;		/* Response uses chunked transfer coding */
+	int keepalive;		/* -1: not requested, 0: server closes, 1: reusable */
+	int timed;		/* Measure decoding the response */
+	unsigned long req_len;	/* DER length of request */
+	unsigned long resp_len;	/* DER length of response */
+	unsigned long decode_time;	/* Microseconds taken decoding the response */
 	};
 
 #define CMP_MAX_REQUEST_LENGTH	(100 * 1024)
@@ -136,6 +146,14 @@ struct cmp_req_ctx_st {
 #define OHS_ASN1_FLUSH		(7 | OHS_NOREAD)
 /* Completed */
 #define OHS_DONE		(8 | OHS_NOREAD)
+/* Chunk size line being read */
+#define OHS_CHUNK_SIZE		9
+/* Chunk data being read */
+#define OHS_CHUNK_DATA		10
+/* CRLF after chunk data being read */
+#define OHS_CHUNK_CRLF		11
+/* Trailer after last chunk being read */
+#define OHS_CHUNK_TRAILER	12
 
 /* from apps.h */
 #ifndef openssl_fdset
@@ -153,6 +171,8 @@ void CMP_REQ_CTX_free(CMP_REQ_CTX *rctx)
 	{
 	if (rctx->mem)
 		BIO_free(rctx->mem);
+	if (rctx->body)
+		BIO_free(rctx->body);
 	if (rctx->iobuf)
 		OPENSSL_free(rctx->iobuf);
 	OPENSSL_free(rctx);
@@ -163,8 +183,9 @@ int CMP_REQ_CTX_set1_req(CMP_REQ_CTX *rctx, CMP_PKIMESSAGE *req)
 	static const char req_hdr[] =
 	"Content-Type: application/pkixcmp\r\n"
 	"Cache-control: no-cache\r\n"
-	"Content-Length: %d\r\n\r\n";
-        if (BIO_printf(rctx->mem, req_hdr, i2d_CMP_PKIMESSAGE(req, NULL)) <= 0)
+	"Content-Length: %lu\r\n\r\n";
+	rctx->req_len = i2d_CMP_PKIMESSAGE(req, NULL);
+        if (BIO_printf(rctx->mem, req_hdr, rctx->req_len) <= 0)
 		return 0;
         if (i2d_CMP_PKIMESSAGE_bio(rctx->mem, req) <= 0)
 		return 0;
@@ -192,17 +213,35 @@ int CMP_REQ_CTX_add1_header(CMP_REQ_CTX *rctx,
 	return 1;
 	}
 
-CMP_REQ_CTX *CMP_sendreq_new(BIO *io, char *path, CMP_PKIMESSAGE *req,
-								int maxline)
+/* Creates a request context. If host is given, the request is sent as
+ * HTTP/1.1 asking the server to keep the connection open afterwards;
+ * otherwise a plain HTTP/1.0 request is sent.
+ */
+static CMP_REQ_CTX *sendreq_new(BIO *io, char *path, const char *host,
+				CMP_PKIMESSAGE *req, int maxline)
 	{
 	static const char post_hdr[] = "POST %s HTTP/1.0\r\n";
+	static const char post_hdr_ka[] = "POST %s HTTP/1.1\r\n"
+	"Host: %s\r\n"
+	"Connection: keep-alive\r\n";
 
 	CMP_REQ_CTX *rctx;
 	rctx = OPENSSL_malloc(sizeof(CMP_REQ_CTX));
+	if (!rctx)
+		return 0;
 	rctx->state = OHS_ERROR;
 	rctx->mem = BIO_new(BIO_s_mem());
+	rctx->body = NULL;
 	rctx->io = io;
 	rctx->asn1_len = 0;
+	rctx->chunk_len = 0;
+	rctx->content_len = -1;
+	rctx->chunked = 0;
+	rctx->keepalive = host ? 1 : -1;
+	rctx->timed = 0;
+	rctx->req_len = 0;
+	rctx->resp_len = 0;
+	rctx->decode_time = 0;
 	if (maxline > 0)
 		rctx->iobuflen = maxline;
 	else
@@ -213,8 +252,16 @@ CMP_REQ_CTX *CMP_sendreq_new(BIO *io, char *path, CMP_PKIMESSAGE *req,
 	if (!path)
 		path = "/";
 
-        if (BIO_printf(rctx->mem, post_hdr, path) <= 0)
-		return 0;
+	if (host)
+		{
+		if (BIO_printf(rctx->mem, post_hdr_ka, path, host) <= 0)
+			return 0;
+		}
+	else
+		{
+		if (BIO_printf(rctx->mem, post_hdr, path) <= 0)
+			return 0;
+		}
 
 	if (req && !CMP_REQ_CTX_set1_req(rctx, req))
 		return 0;
@@ -222,6 +269,12 @@ CMP_REQ_CTX *CMP_sendreq_new(BIO *io, char *path, CMP_PKIMESSAGE *req,
 	return rctx;
 	}
 
+CMP_REQ_CTX *CMP_sendreq_new(BIO *io, char *path, CMP_PKIMESSAGE *req,
+								int maxline)
+	{
+	return sendreq_new(io, path, NULL, req, maxline);
+	}
+
 /* Parse the HTTP response. This will look like this:
  * "HTTP/1.0 200 OK". We need to obtain the numeric code and
  * (optional) informational message.
@@ -301,6 +354,71 @@ static int parse_http_line1(char *line)
 
 	}
 
+/* Evaluates the response header fields we care about: the body length
+ * or transfer coding, and whether the server keeps the connection open.
+ */
+static void parse_http_header(CMP_REQ_CTX *rctx, char *line)
+	{
+	char *value, *end;
+
+	if (!(value = strchr(line, ':')))
+		return;
+	*value++ = 0;
+	while (*value && isspace((unsigned char)*value))
+		value++;
+	for (end = value + strlen(value); end > value && isspace((unsigned char)end[-1]); end--)
+		*(end-1) = 0;
+
+	if (!strcasecmp(line, "Content-Length"))
+		rctx->content_len = strtol(value, NULL, 10);
+	else if (!strcasecmp(line, "Transfer-Encoding"))
+		{
+		if (!strcasecmp(value, "chunked"))
+			rctx->chunked = 1;
+		}
+	else if (!strcasecmp(line, "Connection") && rctx->keepalive >= 0)
+		{
+		if (!strcasecmp(value, "close"))
+			rctx->keepalive = 0;
+		else if (!strcasecmp(value, "keep-alive"))
+			rctx->keepalive = 1;
+		}
+	}
+
+/* Reads one complete line from the memory BIO into the line buffer.
+ * returns 1 if a line was read, 0 if more data is needed, -1 on error
+ */
+static int read_line(CMP_REQ_CTX *rctx)
+	{
+	const unsigned char *p;
+	int n;
+
+	n = BIO_get_mem_data(rctx->mem, &p);
+	if ((n <= 0) || !memchr(p, '\n', n))
+		{
+		if (n >= rctx->iobuflen)
+			return -1;
+		return 0;
+		}
+	n = BIO_gets(rctx->mem, (char *)rctx->iobuf, rctx->iobuflen);
+	if ((n <= 0) || (n == rctx->iobuflen))
+		return -1;
+	return 1;
+	}
+
+/* Decodes the response body of len octets at p */
+static CMP_PKIMESSAGE *decode_resp(CMP_REQ_CTX *rctx, const unsigned char *p, long len)
+	{
+	CMP_PKIMESSAGE *resp;
+	unsigned long start = rctx->timed ? CMP_METRICS_now() : 0;
+
+	resp = d2i_CMP_PKIMESSAGE(NULL, &p, len);
+	if (rctx->timed)
+		rctx->decode_time = CMP_METRICS_now() - start;
+	rctx->resp_len = len;
+	return resp;
+	}
+
 int CMP_sendreq_nbio(CMP_PKIMESSAGE **presp, CMP_REQ_CTX *rctx)
 	{
 	int i, n;
@@ -408,6 +526,10 @@ int CMP_sendreq_nbio(CMP_PKIMESSAGE **presp, CMP_REQ_CTX *rctx)
 		/* First line */
 		if (rctx->state == OHS_FIRSTLINE)
 			{
+			/* HTTP/1.0 servers close unless told otherwise */
+			if (rctx->keepalive > 0 &&
+				strncmp((char *)rctx->iobuf, "HTTP/1.1", 8))
+				rctx->keepalive = 0;
 			if (parse_http_line1((char *)rctx->iobuf))
 				{
 				rctx->state = OHS_HEADERS;
@@ -428,7 +550,21 @@ int CMP_sendreq_nbio(CMP_PKIMESSAGE **presp, CMP_REQ_CTX *rctx)
 					break;
 				}
 			if (*p)
+				{
+				parse_http_header(rctx, (char *)rctx->iobuf);
 				goto next_line;
+				}
+
+			if (rctx->chunked)
+				{
+				if (!rctx->body && !(rctx->body = BIO_new(BIO_s_mem())))
+					{
+					rctx->state = OHS_ERROR;
+					return 0;
+					}
+				rctx->state = OHS_CHUNK_SIZE;
+				goto next_chunk;
+				}
 
 			rctx->state = OHS_ASN1_HEADER;
 
@@ -497,7 +633,12 @@ int CMP_sendreq_nbio(CMP_PKIMESSAGE **presp, CMP_REQ_CTX *rctx)
 			goto next_io;
 
 
-		*presp = d2i_CMP_PKIMESSAGE(NULL, &p, rctx->asn1_len);
+		/* only reuse the connection if the body is delimited exactly */
+		if (n != (int)rctx->asn1_len
+			|| rctx->content_len != (long)rctx->asn1_len)
+			rctx->keepalive = rctx->keepalive < 0 ? -1 : 0;
+
+		*presp = decode_resp(rctx, p, rctx->asn1_len);
 		if (*presp)
 			{
 			rctx->state = OHS_DONE;
@@ -509,6 +650,84 @@ int CMP_sendreq_nbio(CMP_PKIMESSAGE **presp, CMP_REQ_CTX *rctx)
 
 		break;
 
+		case OHS_CHUNK_SIZE:
+		case OHS_CHUNK_DATA:
+		case OHS_CHUNK_CRLF:
+		case OHS_CHUNK_TRAILER:
+
+		next_chunk:
+		if (rctx->state == OHS_CHUNK_DATA)
+			{
+			n = BIO_get_mem_data(rctx->mem, &p);
+			if (n <= 0)
+				goto next_io;
+			if ((unsigned long)n > rctx->chunk_len)
+				n = rctx->chunk_len;
+			if (n > rctx->iobuflen)
+				n = rctx->iobuflen;
+			if (BIO_read(rctx->mem, rctx->iobuf, n) != n
+				|| BIO_write(rctx->body, rctx->iobuf, n) != n
+				|| BIO_pending(rctx->body) > CMP_MAX_REQUEST_LENGTH)
+				{
+				rctx->state = OHS_ERROR;
+				return 0;
+				}
+			rctx->chunk_len -= n;
+			if (rctx->chunk_len == 0)
+				rctx->state = OHS_CHUNK_CRLF;
+			goto next_chunk;
+			}
+
+		/* all other chunk states consume exactly one line */
+		i = read_line(rctx);
+		if (i == 0)
+			goto next_io;
+		if (i < 0)
+			{
+			rctx->state = OHS_ERROR;
+			return 0;
+			}
+
+		if (rctx->state == OHS_CHUNK_SIZE)
+			{
+			char *end;
+			rctx->chunk_len = strtoul((char *)rctx->iobuf, &end, 16);
+			if (end == (char *)rctx->iobuf
+				|| rctx->chunk_len > CMP_MAX_REQUEST_LENGTH)
+				{
+				rctx->state = OHS_ERROR;
+				return 0;
+				}
+			rctx->state = rctx->chunk_len ? OHS_CHUNK_DATA : OHS_CHUNK_TRAILER;
+			goto next_chunk;
+			}
+
+		if (rctx->state == OHS_CHUNK_CRLF)
+			{
+			rctx->state = OHS_CHUNK_SIZE;
+			goto next_chunk;
+			}
+
+		/* OHS_CHUNK_TRAILER: an empty line ends the body */
+		for (p = rctx->iobuf; *p; p++)
+			{
+			if ((*p != '\r') && (*p != '\n'))
+				break;
+			}
+		if (*p)
+			goto next_chunk;
+
+		n = BIO_get_mem_data(rctx->body, &p);
+		*presp = decode_resp(rctx, p, n);
+		if (*presp)
+			{
+			rctx->state = OHS_DONE;
+			return 1;
+			}
+
+		rctx->state = OHS_ERROR;
+		return 0;
+
 		case OHS_DONE:
 		return 1;
 
@@ -637,6 +856,273 @@ static uint32_t gethostiplong(const char *host)
 	}
 */
 
+/* ########################################################################## *
+ * TLS client context
+ *
+ * Holds the SSL_CTX used for all TLS connections of the CMP_CTX (or of all
+ * contexts it is shared with), so it is set up only once, and the last
+ * session negotiated with each server so that new connections can resume
+ * it instead of doing a full handshake. With libcurl, a curl share handle
+ * keeps the sessions instead, and the handshakes are counted by an info
+ * callback on the SSL_CTX that curl sets up for each connection. The session
+ * list, the statistics and the curl share are protected by
+ * CRYPTO_LOCK_CMP_HTTP, so the context may be used by several threads at once.
+ * ########################################################################## */
+typedef struct cmp_tls_sess_st
+	{
+	char		*key;
+	SSL_SESSION *sess;
+	struct cmp_tls_sess_st *next;
+	} CMP_TLS_SESS;
+
+struct cmp_tls_ctx_st
+	{
+#ifndef HAVE_CURL
+	SSL_CTX *sslCtx;
+	/* sessions to resume, most recently used first */
+	CMP_TLS_SESS *sessions;
+	int numSessions;
+#else
+	CURLSH *share;
+#endif
+	/* number of TLS handshakes done and how many of them were resumed */
+	unsigned long handshakes;
+	unsigned long resumed;
+	int references;
+	};
+
+/* ############################################################################ *
+ * internal function
+ * Counts a finished TLS handshake for the statistics
+ * ############################################################################ */
+static void tls_count_handshake(CMP_TLS_CTX *tls, int resumed)
+	{
+	CRYPTO_w_lock(CRYPTO_LOCK_CMP_HTTP);
+	tls->handshakes++;
+	if (resumed) tls->resumed++;
+	CRYPTO_w_unlock(CRYPTO_LOCK_CMP_HTTP);
+	}
+
+#ifdef HAVE_CURL
+/* ############################################################################ *
+ * internal functions
+ * Lock the curl share for the threads using the context
+ * ############################################################################ */
+static void tls_share_lock(CURL *curl, curl_lock_data data, curl_lock_access access, void *userptr)
+	{
+	CRYPTO_w_lock(CRYPTO_LOCK_CMP_HTTP);
+	}
+
+static void tls_share_unlock(CURL *curl, curl_lock_data data, void *userptr)
+	{
+	CRYPTO_w_unlock(CRYPTO_LOCK_CMP_HTTP);
+	}
+
+/* ############################################################################ *
+ * internal function
+ * Info callback of the SSL_CTX set up by curl, counts the handshakes
+ * ############################################################################ */
+static void tls_info_cb(const SSL *ssl, int where, int ret)
+	{
+	CMP_TLS_CTX *tls;
+
+	if (!(where & SSL_CB_HANDSHAKE_DONE)) return;
+	if ((tls = SSL_CTX_get_app_data(SSL_get_SSL_CTX(ssl))))
+		tls_count_handshake(tls, SSL_session_reused((SSL*) ssl));
+	}
+
+/* ############################################################################ *
+ * internal function
+ * Called by curl with the SSL_CTX of a new connection (CURLOPT_SSL_CTX_FUNCTION)
+ * ############################################################################ */
+static CURLcode tls_ssl_ctx_cb(CURL *curl, void *sslCtx, void *parm)
+	{
+	SSL_CTX_set_app_data((SSL_CTX*) sslCtx, parm);
+	SSL_CTX_set_info_callback((SSL_CTX*) sslCtx, tls_info_cb);
+	return CURLE_OK;
+	}
+#endif
+
+/* ############################################################################ *
+ * Creates a new TLS client context
+ * returns pointer to the context on success, NULL on error
+ * ############################################################################ */
+CMP_TLS_CTX *CMP_TLS_CTX_new(void)
+	{
+	CMP_TLS_CTX *tls = NULL;
+	static int ssl_initialized = 0;
+
+	if (!(tls = OPENSSL_malloc(sizeof(CMP_TLS_CTX)))) goto err;
+	memset(tls, 0, sizeof(CMP_TLS_CTX));
+	tls->references = 1;
+
+#ifndef HAVE_CURL
+	if (!ssl_initialized)
+		{
+		ssl_initialized = 1;
+		OpenSSL_add_ssl_algorithms();
+		}
+
+	/* TODO support all versions of SSL / TLS properly */
+	if (!(tls->sslCtx = SSL_CTX_new(TLSv1_client_method()))) goto err;
+	SSL_CTX_set_mode(tls->sslCtx, SSL_MODE_AUTO_RETRY);
+	/* sessions are kept by us, per server */
+	SSL_CTX_set_session_cache_mode(tls->sslCtx, SSL_SESS_CACHE_CLIENT|SSL_SESS_CACHE_NO_INTERNAL_STORE);
+#else
+	(void)ssl_initialized;
+	if (!(tls->share = curl_share_init())) goto err;
+	curl_share_setopt(tls->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+	curl_share_setopt(tls->share, CURLSHOPT_LOCKFUNC, tls_share_lock);
+	curl_share_setopt(tls->share, CURLSHOPT_UNLOCKFUNC, tls_share_unlock);
+#endif
+
+	return tls;
+
+	err:
+	CMPerr(CMP_F_CMP_TLS_CTX_NEW, ERR_R_MALLOC_FAILURE);
+	CMP_TLS_CTX_free(tls);
+	return NULL;
+	}
+
+/* ############################################################################ *
+ * Drops one reference to the TLS context, freeing it together with all
+ * cached sessions when the last reference is gone.
+ * ############################################################################ */
+void CMP_TLS_CTX_free(CMP_TLS_CTX *tls)
+	{
+	if (!tls) return;
+	if (CRYPTO_add(&tls->references, -1, CRYPTO_LOCK_CMP_HTTP) > 0) return;
+
+#ifndef HAVE_CURL
+	while (tls->sessions)
+		{
+		CMP_TLS_SESS *s = tls->sessions;
+		tls->sessions = s->next;
+		SSL_SESSION_free(s->sess);
+		OPENSSL_free(s->key);
+		OPENSSL_free(s);
+		}
+	if (tls->sslCtx) SSL_CTX_free(tls->sslCtx);
+#else
+	if (tls->share) curl_share_cleanup(tls->share);
+#endif
+	OPENSSL_free(tls);
+	}
+
+/* ############################################################################ *
+ * Takes another reference to the TLS context, used when sharing it between
+ * contexts, which may also be used in different threads.
+ * returns 1 on success, 0 on error
+ * ############################################################################ */
+int CMP_TLS_CTX_up_ref(CMP_TLS_CTX *tls)
+	{
+	if (!tls) return 0;
+	CRYPTO_add(&tls->references, 1, CRYPTO_LOCK_CMP_HTTP);
+	return 1;
+	}
+
+/* ############################################################################ *
+ * Returns the SSL_CTX used for connections, e.g. for setting up verification
+ * of the server certificate. NULL when built with libcurl.
+ * ############################################################################ */
+SSL_CTX *CMP_TLS_CTX_get0_SSL_CTX(const CMP_TLS_CTX *tls)
+	{
+#ifndef HAVE_CURL
+	if (tls) return tls->sslCtx;
+#endif
+	return NULL;
+	}
+
+/* ############################################################################ *
+ * Gets the number of TLS handshakes done and how many of them resumed a
+ * cached session. The resumption hit rate is resumed/handshakes.
+ * returns 1 on success, 0 on error
+ * ############################################################################ */
+int CMP_TLS_CTX_get_stats(const CMP_TLS_CTX *tls, unsigned long *handshakes, unsigned long *resumed)
+	{
+	if (!tls) return 0;
+	CRYPTO_r_lock(CRYPTO_LOCK_CMP_HTTP);
+	if (handshakes) *handshakes = tls->handshakes;
+	if (resumed) *resumed = tls->resumed;
+	CRYPTO_r_unlock(CRYPTO_LOCK_CMP_HTTP);
+	return 1;
+	}
+
+#ifndef HAVE_CURL
+/* ############################################################################ *
+ * internal function
+ * Looks up the session to resume for the server identified by key
+ * returns a new reference to the session, NULL if there is none
+ * ############################################################################ */
+static SSL_SESSION *tls_session_get(CMP_TLS_CTX *tls, const char *key)
+	{
+	CMP_TLS_SESS *s;
+	SSL_SESSION *sess = NULL;
+
+	CRYPTO_r_lock(CRYPTO_LOCK_CMP_HTTP);
+	for (s = tls->sessions; s; s = s->next)
+		if (!strcmp(s->key, key))
+			{
+			sess = s->sess;
+			CRYPTO_add(&sess->references, 1, CRYPTO_LOCK_SSL_SESSION);
+			break;
+			}
+	CRYPTO_r_unlock(CRYPTO_LOCK_CMP_HTTP);
+	return sess;
+	}
+
+/* ############################################################################ *
+ * internal function
+ * After a transfer over a fresh TLS connection, updates the statistics and
+ * remembers the connection's session for the next connection to the server
+ * identified by key.
+ * ############################################################################ */
+static void tls_session_put(CMP_TLS_CTX *tls, const char *key, BIO *cbio)
+	{
+	CMP_TLS_SESS **ps, *s, *ns;
+	SSL *ssl = NULL;
+	SSL_SESSION *sess;
+	int n = 0;
+
+	BIO_get_ssl(cbio, &ssl);
+	if (!ssl) return;
+
+	tls_count_handshake(tls, SSL_session_reused(ssl));
+	if (SSL_session_reused(ssl)) return;
+
+	if (!(sess = SSL_get1_session(ssl))) return;
+
+	if (!(ns = OPENSSL_malloc(sizeof(CMP_TLS_SESS))) || !(ns->key = BUF_strdup(key)))
+		{
+		if (ns) OPENSSL_free(ns);
+		SSL_SESSION_free(sess);
+		return;
+		}
+	ns->sess = sess;
+
+	/* drop the old session for the server and the least recently used ones
+	 * beyond the limit */
+	CRYPTO_w_lock(CRYPTO_LOCK_CMP_HTTP);
+	for (ps = &tls->sessions; (s = *ps); )
+		{
+		if (!strcmp(s->key, key) || ++n >= CMP_TLS_MAX_SESSIONS)
+			{
+			*ps = s->next;
+			SSL_SESSION_free(s->sess);
+			OPENSSL_free(s->key);
+			OPENSSL_free(s);
+			tls->numSessions--;
+			continue;
+			}
+		ps = &s->next;
+		}
+	ns->next = tls->sessions;
+	tls->sessions = ns;
+	tls->numSessions++;
+	CRYPTO_w_unlock(CRYPTO_LOCK_CMP_HTTP);
+	}
+#endif
+
 /* ########################################################################## *
  * internal function
  * Create a new http connection, with a specified source ip/interface
@@ -665,11 +1151,21 @@ static int CMP_new_http_bio( CMPBIO **bio, const CMP_CTX *ctx)
 
 	if (ctx->useTLS)
 		{
-		OpenSSL_add_ssl_algorithms();
-		/* TODO support all versions of SSL / TLS properly */
-		SSL_CTX *ctx = SSL_CTX_new(TLSv1_client_method());
-		SSL_CTX_set_mode(ctx, SSL_MODE_AUTO_RETRY);
-		BIO *sbio = BIO_new_ssl(ctx, 1);
+		BIO *sbio = NULL;
+
+		if (ctx->tlsCtx)
+			sbio = BIO_new_ssl(ctx->tlsCtx->sslCtx, 1);
+		else
+			{
+			/* no cached context, set up a throwaway one */
+			OpenSSL_add_ssl_algorithms();
+			SSL_CTX *ssl_ctx = SSL_CTX_new(TLSv1_client_method());
+			if (!ssl_ctx) goto err;
+			SSL_CTX_set_mode(ssl_ctx, SSL_MODE_AUTO_RETRY);
+			sbio = BIO_new_ssl(ssl_ctx, 1);
+			SSL_CTX_free(ssl_ctx);
+			}
+		if (!sbio) goto err;
 		cbio = BIO_push(sbio, cbio);
 		}
 
@@ -677,6 +1173,7 @@ static int CMP_new_http_bio( CMPBIO **bio, const CMP_CTX *ctx)
 	return 1;
 
 	err:
+	if (cbio) BIO_free_all(cbio);
 	return 0;
 #else
 	struct curl_slist *slist=NULL;
@@ -686,11 +1183,15 @@ static int CMP_new_http_bio( CMPBIO **bio, const CMP_CTX *ctx)
 
 	if (!ctx) goto err;
 
+	/* curl_global_init() is not thread-safe, contexts may be used in
+	 * several threads at once */
+	CRYPTO_w_lock(CRYPTO_LOCK_GETHOSTBYNAME);
 	if (curl_initialized == 0)
 		{
 		curl_initialized =	1;
 		curl_global_init(CURL_GLOBAL_ALL);
 		}
+	CRYPTO_w_unlock(CRYPTO_LOCK_GETHOSTBYNAME);
 
 	if (!(curl=curl_easy_init())) goto err;
 
@@ -707,6 +1208,13 @@ static int CMP_new_http_bio( CMPBIO **bio, const CMP_CTX *ctx)
 
 	curl_easy_setopt(curl, CURLOPT_PROTOCOLS, CURLPROTO_HTTP | CURLPROTO_HTTPS);
 
+	if (ctx->tlsCtx)
+		{
+		curl_easy_setopt(curl, CURLOPT_SHARE, ctx->tlsCtx->share);
+		curl_easy_setopt(curl, CURLOPT_SSL_CTX_FUNCTION, tls_ssl_ctx_cb);
+		curl_easy_setopt(curl, CURLOPT_SSL_CTX_DATA, ctx->tlsCtx);
+		}
+
 	if (ctx->proxyName && ctx->proxyPort)
 		{
 		curl_easy_setopt(curl, CURLOPT_PROXY, ctx->proxyName);
@@ -739,6 +1247,282 @@ static int CMP_delete_http_bio( CMPBIO *cbio)
 	return 1;
 	}
 
+/* ########################################################################## *
+ * internal function
+ * Checks whether an idle connection taken from the pool is still usable.
+ * The server must not send anything on an idle connection, so if the socket
+ * is readable the peer has closed it (or sent garbage we could not handle).
+ * returns 1 if the connection looks usable, 0 otherwise
+ * ########################################################################## */
+static int CMP_http_bio_alive( CMPBIO *cbio)
+	{
+#ifndef HAVE_CURL
+	int fd;
+	fd_set rfds;
+	struct timeval tv;
+
+	if (BIO_get_fd(cbio, &fd) <= 0) return 0;
+
+	FD_ZERO(&rfds);
+	openssl_fdset(fd, &rfds);
+	tv.tv_sec = 0;
+	tv.tv_usec = 0;
+	return select(fd + 1, (void *)&rfds, NULL, NULL, &tv) == 0;
+#else
+	/* libcurl checks its cached connections itself */
+	return cbio != NULL;
+#endif
+	}
+
+/* ########################################################################## *
+ * Connection pool
+ *
+ * Idle connections are kept after a transfer and handed out again to the
+ * next request going to the same server (and proxy), so that all messages
+ * of a transaction, and subsequent transactions, share one TCP/TLS
+ * connection. With the BIO code this means HTTP/1.1 keep-alive, with libcurl
+ * the easy handle (and with it curl's own connection cache) is reused.
+ *
+ * A pool can be shared between several CMP_CTX, but it must not be used from
+ * several threads at the same time.
+ * ########################################################################## */
+typedef struct cmp_http_conn_st
+	{
+	char   *key;
+	CMPBIO *bio;
+	time_t  lastUsed;
+	struct cmp_http_conn_st *next;
+	} CMP_HTTP_CONN;
+
+struct cmp_http_pool_st
+	{
+	/* idle connections, most recently used first */
+	CMP_HTTP_CONN *conns;
+	int numConns;
+	int maxConns;
+	int idleTimeOut;
+	int references;
+	};
+
+static void http_conn_free(CMP_HTTP_CONN *conn)
+	{
+	CMP_delete_http_bio(conn->bio);
+	OPENSSL_free(conn->key);
+	OPENSSL_free(conn);
+	}
+
+/* ############################################################################ *
+ * Creates a new, empty connection pool holding at most
+ * CMP_HTTP_POOL_DEFAULT_MAXCONNS idle connections, each for at most
+ * CMP_HTTP_POOL_DEFAULT_IDLETIMEOUT seconds.
+ * returns pointer to the pool on success, NULL on error
+ * ############################################################################ */
+CMP_HTTP_POOL *CMP_HTTP_POOL_new(void)
+	{
+	CMP_HTTP_POOL *pool = OPENSSL_malloc(sizeof(CMP_HTTP_POOL));
+	if (!pool)
+		{
+		CMPerr(CMP_F_CMP_HTTP_POOL_NEW, ERR_R_MALLOC_FAILURE);
+		return NULL;
+		}
+
+	pool->conns		  = NULL;
+	pool->numConns	  = 0;
+	pool->maxConns	  = CMP_HTTP_POOL_DEFAULT_MAXCONNS;
+	pool->idleTimeOut = CMP_HTTP_POOL_DEFAULT_IDLETIMEOUT;
+	pool->references  = 1;
+
+	return pool;
+	}
+
+/* ############################################################################ *
+ * Drops one reference to the pool, closing all idle connections and freeing
+ * the pool when the last reference is gone.
+ * ############################################################################ */
+void CMP_HTTP_POOL_free(CMP_HTTP_POOL *pool)
+	{
+	if (!pool) return;
+	if (CRYPTO_add(&pool->references, -1, CRYPTO_LOCK_CMP_HTTP) > 0) return;
+
+	CMP_HTTP_POOL_flush(pool);
+	OPENSSL_free(pool);
+	}
+
+/* ############################################################################ *
+ * Takes another reference to the pool, used when sharing it between contexts.
+ * Taking and dropping references is thread safe, using the pool is not:
+ * contexts sharing it must not send at the same time.
+ * returns 1 on success, 0 on error
+ * ############################################################################ */
+int CMP_HTTP_POOL_up_ref(CMP_HTTP_POOL *pool)
+	{
+	if (!pool) return 0;
+	CRYPTO_add(&pool->references, 1, CRYPTO_LOCK_CMP_HTTP);
+	return 1;
+	}
+
+/* ############################################################################ *
+ * Closes all idle connections held by the pool
+ * ############################################################################ */
+void CMP_HTTP_POOL_flush(CMP_HTTP_POOL *pool)
+	{
+	CMP_HTTP_CONN *conn;
+
+	if (!pool) return;
+
+	while ((conn = pool->conns))
+		{
+		pool->conns = conn->next;
+		http_conn_free(conn);
+		}
+	pool->numConns = 0;
+	}
+
+/* ############################################################################ *
+ * Sets the maximum number of idle connections kept; when the pool is full the
+ * least recently used connection is closed. 0 disables keeping connections.
+ * returns 1 on success, 0 on error
+ * ############################################################################ */
+int CMP_HTTP_POOL_set_maxConns(CMP_HTTP_POOL *pool, int max)
+	{
+	if (!pool || max < 0) return 0;
+	pool->maxConns = max;
+	return 1;
+	}
+
+/* ############################################################################ *
+ * Sets the time in seconds after which an idle connection is closed
+ * returns 1 on success, 0 on error
+ * ############################################################################ */
+int CMP_HTTP_POOL_set_idleTimeOut(CMP_HTTP_POOL *pool, int secs)
+	{
+	if (!pool || secs < 0) return 0;
+	pool->idleTimeOut = secs;
+	return 1;
+	}
+
+/* ############################################################################ *
+ * returns the number of idle connections currently held by the pool
+ * ############################################################################ */
+int CMP_HTTP_POOL_num(const CMP_HTTP_POOL *pool)
+	{
+	if (!pool) return 0;
+	return pool->numConns;
+	}
+
+/* ############################################################################ *
+ * internal function
+ * Closes connections which have been idle for longer than idleTimeOut, and
+ * the least recently used ones beyond max.
+ * ############################################################################ */
+static void http_pool_evict(CMP_HTTP_POOL *pool, int max)
+	{
+	CMP_HTTP_CONN **pconn = &pool->conns, *conn;
+	time_t now = time(NULL);
+	int n = 0;
+
+	while ((conn = *pconn))
+		{
+		if (n >= max || now - conn->lastUsed > pool->idleTimeOut)
+			{
+			*pconn = conn->next;
+			http_conn_free(conn);
+			pool->numConns--;
+			continue;
+			}
+		n++;
+		pconn = &conn->next;
+		}
+	}
+
+/* ############################################################################ *
+ * internal function
+ * Builds the key identifying where a connection goes to, used for looking
+ * up both pooled connections and TLS sessions to resume
+ * returns pointer to the key on success, NULL on error
+ * ############################################################################ */
+static char *http_conn_key(const CMP_CTX *ctx)
+	{
+	char *key;
+	size_t len;
+
+	len = strlen(ctx->serverName) + 64;
+	if (ctx->proxyName) len += strlen(ctx->proxyName);
+	if (ctx->sourceAddress) len += strlen(ctx->sourceAddress);
+
+	if (!(key = OPENSSL_malloc(len))) return NULL;
+
+	BIO_snprintf(key, len, "%s:%d|%s:%d|%s|%d",
+			ctx->serverName, ctx->serverPort,
+			ctx->proxyName && ctx->proxyPort ? ctx->proxyName : "",
+			ctx->proxyName ? ctx->proxyPort : 0,
+			ctx->sourceAddress ? ctx->sourceAddress : "",
+			ctx->useTLS);
+	return key;
+	}
+
+/* ############################################################################ *
+ * internal function
+ * Removes an idle connection matching key from the pool.
+ * returns the connection, or NULL if there is none
+ * ############################################################################ */
+static CMPBIO *http_pool_get(CMP_HTTP_POOL *pool, const char *key)
+	{
+	CMP_HTTP_CONN **pconn, *conn;
+	CMPBIO *cbio = NULL;
+
+	http_pool_evict(pool, pool->maxConns);
+
+	again:
+	for (pconn = &pool->conns; (conn = *pconn); pconn = &conn->next)
+		{
+		if (strcmp(conn->key, key)) continue;
+
+		*pconn = conn->next;
+		pool->numConns--;
+		cbio = conn->bio;
+		conn->bio = NULL;
+		http_conn_free(conn);
+
+		if (CMP_http_bio_alive(cbio))
+			return cbio;
+
+		/* closed by the server in the meantime */
+		CMP_delete_http_bio(cbio);
+		goto again;
+		}
+
+	return NULL;
+	}
+
+/* ############################################################################ *
+ * internal function
+ * Hands a connection which is still open back to the pool. If the pool
+ * cannot take it, the connection is closed.
+ * ############################################################################ */
+static void http_pool_put(CMP_HTTP_POOL *pool, const char *key, CMPBIO *cbio)
+	{
+	CMP_HTTP_CONN *conn = NULL;
+
+	if (pool->maxConns <= 0) goto err;
+
+	/* make room for the new connection */
+	http_pool_evict(pool, pool->maxConns - 1);
+
+	if (!(conn = OPENSSL_malloc(sizeof(CMP_HTTP_CONN)))) goto err;
+	if (!(conn->key = BUF_strdup(key))) goto err;
+	conn->bio = cbio;
+	conn->lastUsed = time(NULL);
+	conn->next = pool->conns;
+	pool->conns = conn;
+	pool->numConns++;
+	return;
+
+	err:
+	if (conn) OPENSSL_free(conn);
+	CMP_delete_http_bio(cbio);
+	}
+
 /* ################################################################ *
  * Send the given PKIMessage msg and place the response in *out.
  * returns 1 on success, 0 on error
@@ -746,60 +1530,107 @@ static int CMP_delete_http_bio( CMPBIO *cbio)
  * ################################################################ */
 #ifndef HAVE_CURL
 
-int CMP_PKIMESSAGE_http_perform(const CMP_CTX *ctx, const CMP_PKIMESSAGE *msg, CMP_PKIMESSAGE **out)
+/* ########################################################################## *
+ * Non-blocking transfer of a single message
+ *
+ * CMP_HTTP_REQ_new() sets up the connection (taking it from the pool if
+ * possible) and the request, CMP_HTTP_REQ_perform() is then called whenever
+ * the connection's fd becomes ready until it does not return
+ * CMP_HTTP_REQ_WANT_READ or CMP_HTTP_REQ_WANT_WRITE anymore. Timeouts are up to
+ * the caller.
+ * ########################################################################## */
+struct cmp_http_req_st
 	{
-	int rv, fd;
-	fd_set confds;
-	struct timeval tv;
-	char *path=0;
-	size_t pos=0, pathlen=0;
-	CMPBIO *cbio = 0;
+	const CMP_CTX *ctx;
+	CMPBIO *cbio;
+	CMP_REQ_CTX *rctx;
+	/* connection pool / TLS session key, NULL if neither is used */
+	char *key;
+	/* set while the connection is still being established */
+	int connecting;
+	/* set if the connection was newly created for this request */
+	int fresh;
+	/* set while the TLS handshake is still in progress */
+	int handshaking;
+	/* metrics of the message in progress if they are measured, and when the
+	 * current phase of the transfer began */
+	CMP_METRICS *metrics;
+	unsigned long phaseStart;
+	};
 
-	CMP_new_http_bio(&cbio, ctx);
+/* ############################################################################ *
+ * internal function
+ * Adds the time since the current phase of the transfer began to *phase and
+ * starts the next one, only used if req->metrics is set
+ * ############################################################################ */
+static void http_req_phase_done(CMP_HTTP_REQ *req, unsigned long *phase)
+	{
+	unsigned long now = CMP_METRICS_now();
 
-	if (!cbio || !ctx || !msg || !out)
+	*phase += now - req->phaseStart;
+	req->phaseStart = now;
+	}
+
+/* ############################################################################ *
+ * Creates the transfer of msg to the server configured in ctx
+ * returns pointer to the transfer on success, NULL on error
+ * ############################################################################ */
+CMP_HTTP_REQ *CMP_HTTP_REQ_new(const CMP_CTX *ctx, const CMP_PKIMESSAGE *msg)
+	{
+	CMP_HTTP_REQ *req = NULL;
+	char *path=0, host[256];
+	size_t pos=0, pathlen=0;
+	unsigned long start = 0;
+
+	if (!ctx || !msg)
 		{
-		CMPerr(CMP_F_CMP_PKIMESSAGE_HTTP_PERFORM, CMP_R_NULL_ARGUMENT);
+		CMPerr(CMP_F_CMP_HTTP_REQ_NEW, CMP_R_NULL_ARGUMENT);
 		goto err;
 		}
 
 	if (!ctx->serverName || !ctx->serverPath || !ctx->serverPort)
 		{
-		CMPerr(CMP_F_CMP_PKIMESSAGE_HTTP_PERFORM, CMP_R_NULL_ARGUMENT);
+		CMPerr(CMP_F_CMP_HTTP_REQ_NEW, CMP_R_NULL_ARGUMENT);
 		goto err;
 		}
 
-	if (ctx->HttpTimeOut != 0)
-		BIO_set_nbio(cbio, 1);
-	
-	rv = BIO_do_connect(cbio);
-	if (rv <= 0 && (ctx->HttpTimeOut == -1 || !BIO_should_retry(cbio)))
-		{
-		/* Error connecting */
-		CMPerr(CMP_F_CMP_PKIMESSAGE_HTTP_PERFORM, CMP_R_SERVER_NOT_REACHABLE);
-		goto err;
-		}
+	if (!(req = OPENSSL_malloc(sizeof(CMP_HTTP_REQ)))) goto err;
+	memset(req, 0, sizeof(CMP_HTTP_REQ));
+	req->ctx = ctx;
+	if (ctx->metrics_cb) req->metrics = ctx->msgMetrics;
 
-	if (BIO_get_fd(cbio, &fd) <= 0)
+	if (ctx->httpPool || (ctx->useTLS && ctx->tlsCtx))
+		if (!(req->key = http_conn_key(ctx))) goto err;
+
+	/* try to reuse an idle connection to the same server first */
+	if (ctx->httpPool)
 		{
-		/* XXX Can't get fd, is this the right error to return? */
-		CMPerr(CMP_F_CMP_PKIMESSAGE_HTTP_PERFORM, CMP_R_SERVER_NOT_REACHABLE);
-		goto err;
+		req->cbio = http_pool_get(ctx->httpPool, req->key);
+		BIO_snprintf(host, sizeof(host), "%s:%d", ctx->serverName, ctx->serverPort);
 		}
 
-	if (ctx->HttpTimeOut != -1 && rv <= 0)
+	if (!req->cbio)
 		{
-		FD_ZERO(&confds);
-		openssl_fdset(fd, &confds);
-		tv.tv_usec = 0;
-		tv.tv_sec = ctx->HttpTimeOut;
-		rv = select(fd + 1, NULL, (void *)&confds, NULL, &tv);
-		if (rv == 0)
+		CMP_new_http_bio(&req->cbio, ctx);
+
+		if (!req->cbio)
 			{
-			// Timed out
-			CMPerr(CMP_F_CMP_PKIMESSAGE_HTTP_PERFORM, CMP_R_SERVER_NOT_REACHABLE);
+			CMPerr(CMP_F_CMP_HTTP_REQ_NEW, CMP_R_SERVER_NOT_REACHABLE);
 			goto err;
 			}
+		BIO_set_nbio(req->cbio, 1);
+		req->connecting = 1;
+		req->fresh = 1;
+
+		/* offer the session from the last connection to this server */
+		if (ctx->useTLS && ctx->tlsCtx)
+			{
+			SSL *ssl = NULL;
+			SSL_SESSION *sess = tls_session_get(ctx->tlsCtx, req->key);
+			BIO_get_ssl(req->cbio, &ssl);
+			if (ssl && sess) SSL_set_session(ssl, sess);
+			if (sess) SSL_SESSION_free(sess);
+			}
 		}
 
 	pathlen = strlen(ctx->serverName) + strlen(ctx->serverPath) + 32;
@@ -815,20 +1646,190 @@ int CMP_PKIMESSAGE_http_perform(const CMP_CTX *ctx, const CMP_PKIMESSAGE *msg, C
 
 	BIO_snprintf(path+pos, pathlen-pos-1, "%s", ctx->serverPath);
 
-	*out = CMP_sendreq_bio(cbio, path, (CMP_PKIMESSAGE*) msg);
-
+	if (req->metrics) start = CMP_METRICS_now();
+	req->rctx = sendreq_new(req->cbio, path, ctx->httpPool ? host : NULL,
+			(CMP_PKIMESSAGE*) msg, -1);
 	OPENSSL_free(path);
-	// BIO_reset(cbio);
-	CMP_delete_http_bio(cbio);
-	
-	if (!*out) {
-		CMPerr(CMP_F_CMP_PKIMESSAGE_HTTP_PERFORM, CMP_R_FAILED_TO_DECODE_PKIMESSAGE);
-		goto err;
+	if (!req->rctx) goto err;
+
+	if (req->metrics)
+		{
+		req->rctx->timed = 1;
+		req->phaseStart = CMP_METRICS_now();
+		req->metrics->encode += req->phaseStart - start;
+		req->metrics->bytesSent += req->rctx->req_len;
+		}
+
+	return req;
+
+	err:
+	CMP_HTTP_REQ_free(req);
+	return NULL;
 	}
-	
+
+/* ############################################################################ *
+ * Frees the transfer, closing the connection if it was not handed back to
+ * the pool
+ * ############################################################################ */
+void CMP_HTTP_REQ_free(CMP_HTTP_REQ *req)
+	{
+	if (!req) return;
+	if (req->rctx) CMP_REQ_CTX_free(req->rctx);
+	if (req->cbio) CMP_delete_http_bio(req->cbio);
+	if (req->key) OPENSSL_free(req->key);
+	OPENSSL_free(req);
+	}
+
+/* ############################################################################ *
+ * returns the fd of the transfer's connection to wait on, -1 on error
+ * ############################################################################ */
+int CMP_HTTP_REQ_get_fd(const CMP_HTTP_REQ *req)
+	{
+	int fd = -1;
+
+	if (!req || !req->cbio) return -1;
+	if (BIO_get_fd(req->cbio, &fd) <= 0) return -1;
+	return fd;
+	}
+
+/* ############################################################################ *
+ * Advances the transfer as far as possible without blocking.
+ * returns 1 when the response was received, placing it in *out,
+ *         CMP_HTTP_REQ_WANT_READ or CMP_HTTP_REQ_WANT_WRITE if it has to be
+ *         called again when the fd is readable / writable,
+ *         0 on error
+ * ############################################################################ */
+int CMP_HTTP_REQ_perform(CMP_HTTP_REQ *req, CMP_PKIMESSAGE **out)
+	{
+	int rv;
+
+	if (!req || !req->rctx || !out)
+		{
+		CMPerr(CMP_F_CMP_HTTP_REQ_PERFORM, CMP_R_NULL_ARGUMENT);
+		return 0;
+		}
+
+	if (req->connecting)
+		{
+		/* with TLS, connect the socket below the SSL BIO on its own first,
+		 * so that the handshake can be timed separately */
+		CMPBIO *tcp = BIO_next(req->cbio) ? BIO_next(req->cbio) : req->cbio;
+
+		rv = BIO_do_connect(tcp);
+		if (rv <= 0)
+			{
+			if (BIO_should_retry(tcp))
+				return BIO_should_read(tcp) ? CMP_HTTP_REQ_WANT_READ : CMP_HTTP_REQ_WANT_WRITE;
+			CMPerr(CMP_F_CMP_HTTP_REQ_PERFORM, CMP_R_SERVER_NOT_REACHABLE);
+			return 0;
+			}
+		req->connecting = 0;
+		req->handshaking = tcp != req->cbio;
+		if (req->metrics) http_req_phase_done(req, &req->metrics->connect);
+		}
+
+	if (req->handshaking)
+		{
+		rv = BIO_do_handshake(req->cbio);
+		if (rv <= 0)
+			{
+			if (BIO_should_retry(req->cbio))
+				goto retry;
+			CMPerr(CMP_F_CMP_HTTP_REQ_PERFORM, CMP_R_SERVER_NOT_REACHABLE);
+			return 0;
+			}
+		req->handshaking = 0;
+		if (req->metrics) http_req_phase_done(req, &req->metrics->tlsHandshake);
+		}
+
+	*out = NULL;
+	rv = CMP_sendreq_nbio(out, req->rctx);
+	if (rv == -1)
+		goto retry;
+	if (rv == 0 || !*out)
+		{
+		CMPerr(CMP_F_CMP_HTTP_REQ_PERFORM, CMP_R_FAILED_TO_DECODE_PKIMESSAGE);
+		return 0;
+		}
+
+	if (req->metrics)
+		{
+		http_req_phase_done(req, &req->metrics->serverWait);
+		req->metrics->serverWait -= req->rctx->decode_time;
+		req->metrics->decode += req->rctx->decode_time;
+		req->metrics->bytesReceived += req->rctx->resp_len;
+		}
+
+	if (req->fresh && req->ctx->useTLS && req->ctx->tlsCtx)
+		tls_session_put(req->ctx->tlsCtx, req->key, req->cbio);
+
+	/* keep the connection for the next message if the server allows it */
+	if (req->ctx->httpPool && req->rctx->keepalive > 0)
+		{
+		http_pool_put(req->ctx->httpPool, req->key, req->cbio);
+		req->cbio = NULL;
+		}
+
+	return 1;
+
+	retry:
+	return BIO_should_read(req->cbio) ? CMP_HTTP_REQ_WANT_READ : CMP_HTTP_REQ_WANT_WRITE;
+	}
+
+int CMP_PKIMESSAGE_http_perform(const CMP_CTX *ctx, const CMP_PKIMESSAGE *msg, CMP_PKIMESSAGE **out)
+	{
+	int rv, fd;
+	fd_set fds;
+	struct timeval tv;
+	time_t deadline = 0, now;
+	CMP_HTTP_REQ *req = NULL;
+
+	if (!ctx || !msg || !out)
+		{
+		CMPerr(CMP_F_CMP_PKIMESSAGE_HTTP_PERFORM, CMP_R_NULL_ARGUMENT);
+		goto err;
+		}
+
+	if (!(req = CMP_HTTP_REQ_new(ctx, msg))) goto err;
+
+	if (ctx->HttpTimeOut > 0)
+		deadline = time(NULL) + ctx->HttpTimeOut;
+
+	/* a blocking transfer is just a non-blocking one we wait for */
+	while ((rv = CMP_HTTP_REQ_perform(req, out)) < 0)
+		{
+		if ((fd = CMP_HTTP_REQ_get_fd(req)) < 0)
+			{
+			CMPerr(CMP_F_CMP_PKIMESSAGE_HTTP_PERFORM, CMP_R_SERVER_NOT_REACHABLE);
+			goto err;
+			}
+
+		FD_ZERO(&fds);
+		openssl_fdset(fd, &fds);
+		if (deadline)
+			{
+			now = time(NULL);
+			tv.tv_usec = 0;
+			tv.tv_sec = deadline > now ? deadline - now : 0;
+			}
+
+		rv = select(fd + 1, rv == CMP_HTTP_REQ_WANT_READ ? (void *)&fds : NULL,
+				rv == CMP_HTTP_REQ_WANT_WRITE ? (void *)&fds : NULL,
+				NULL, deadline ? &tv : NULL);
+		if (rv == 0)
+			{
+			// Timed out
+			CMPerr(CMP_F_CMP_PKIMESSAGE_HTTP_PERFORM, CMP_R_SERVER_NOT_REACHABLE);
+			goto err;
+			}
+		}
+	if (!rv) goto err;
+
+	CMP_HTTP_REQ_free(req);
 	return 1;
 
 	err:
+	CMP_HTTP_REQ_free(req);
 	return 0;
 	}
 
@@ -841,15 +1842,17 @@ int CMP_PKIMESSAGE_http_perform(const CMP_CTX *ctx, const CMP_PKIMESSAGE *msg, C
 	int derLen = 0;
 	CURLcode res;
 	rdata_t rdata = {0,0};
+	char *key = NULL;
 	CMPBIO *curl = NULL;
+	CMP_METRICS *m = NULL;
+	unsigned long start = 0;
 
-	CMP_new_http_bio(&curl, ctx);
-
-	if (!curl || !ctx || !msg || !out)
+	if (!ctx || !msg || !out)
 		{
 		CMPerr(CMP_F_CMP_PKIMESSAGE_HTTP_PERFORM, CMP_R_NULL_ARGUMENT);
 		goto err;
 		}
+	if (ctx->metrics_cb) m = ctx->msgMetrics;
 
 	if (!ctx->serverName || !ctx->serverPath || !ctx->serverPort)
 		{
@@ -857,7 +1860,29 @@ int CMP_PKIMESSAGE_http_perform(const CMP_CTX *ctx, const CMP_PKIMESSAGE *msg, C
 		goto err;
 		}
 
+	/* reusing the easy handle lets curl reuse its open connection */
+	if (ctx->httpPool)
+		{
+		if (!(key = http_conn_key(ctx))) goto err;
+		curl = http_pool_get(ctx->httpPool, key);
+		}
+
+	if (!curl)
+		CMP_new_http_bio(&curl, ctx);
+
+	if (!curl)
+		{
+		CMPerr(CMP_F_CMP_PKIMESSAGE_HTTP_PERFORM, CMP_R_NULL_ARGUMENT);
+		goto err;
+		}
+
+	if (m) start = CMP_METRICS_now();
 	derLen = i2d_CMP_PKIMESSAGE( (CMP_PKIMESSAGE*) msg, &derMsg);
+	if (m)
+		{
+		m->encode += CMP_METRICS_now() - start;
+		m->bytesSent += derLen;
+		}
 
 	set_http_path(curl, ctx);
 
@@ -907,8 +1932,27 @@ int CMP_PKIMESSAGE_http_perform(const CMP_CTX *ctx, const CMP_PKIMESSAGE *msg, C
 		goto err;
 		}
 
+	/* curl takes the timings of the transfer itself, all relative to its start */
+	if (m)
+		{
+		double connect = 0, appconnect = 0, pretransfer = 0, total = 0;
+
+		curl_easy_getinfo(curl, CURLINFO_CONNECT_TIME, &connect);
+		curl_easy_getinfo(curl, CURLINFO_APPCONNECT_TIME, &appconnect);
+		curl_easy_getinfo(curl, CURLINFO_PRETRANSFER_TIME, &pretransfer);
+		curl_easy_getinfo(curl, CURLINFO_TOTAL_TIME, &total);
+		m->connect += (unsigned long) (connect * 1e6);
+		if (appconnect > connect)
+			m->tlsHandshake += (unsigned long) ((appconnect - connect) * 1e6);
+		if (total > pretransfer)
+			m->serverWait += (unsigned long) ((total - pretransfer) * 1e6);
+		m->bytesReceived += rdata.size;
+		start = CMP_METRICS_now();
+		}
+
 	pder = (unsigned char*) rdata.memory;
 	*out = d2i_CMP_PKIMESSAGE( NULL, (const unsigned char**) &pder, rdata.size);
+	if (m) m->decode += CMP_METRICS_now() - start;
 	if (*out == 0)
 		{
 		CMPerr(CMP_F_CMP_PKIMESSAGE_HTTP_PERFORM, CMP_R_FAILED_TO_DECODE_PKIMESSAGE);
@@ -917,8 +1961,12 @@ int CMP_PKIMESSAGE_http_perform(const CMP_CTX *ctx, const CMP_PKIMESSAGE *msg, C
 
 	if (CURLE_OK != curl_easy_getinfo((CMPBIO*)curl, CURLINFO_RESPONSE_CODE, &ctx->lastHTTPCode)) goto err;
 
-	CMP_delete_http_bio(curl);
+	if (ctx->httpPool)
+		http_pool_put(ctx->httpPool, key, curl);
+	else
+		CMP_delete_http_bio(curl);
 
+	if (key) OPENSSL_free(key);
 	free(rdata.memory);
 	return 1;
 
@@ -928,6 +1976,7 @@ int CMP_PKIMESSAGE_http_perform(const CMP_CTX *ctx, const CMP_PKIMESSAGE *msg, C
 
 	if (curl)
 		CMP_delete_http_bio(curl);
+	if (key) OPENSSL_free(key);
 	return 0;
 	}
 #endif	/* HAVE_CURL */
@@ -448,27 +448,81 @@ err:
 }
 
 
-/* ############################################################################ * 
- * also used for verification from cmp_vfy
+/* ############################################################################ *
+ * writes the DER encoding of the ProtectedPart (header and body) of the given
+ * message to *der, which is to be freed by the caller with OPENSSL_free().
  *
- * calculate PBM protection for given PKImessage utilizing the given secret and the
- * pbm-parameters set inside the message header's protectionAlg
+ * If the message was decoded, or protected by CMP_PKIMESSAGE_set_protection(),
+ * and was not changed since, header and body are copied from the cached
+ * encoding. This way the protection of a received message is checked over the
+ * bytes the sender actually protected, and nothing is encoded twice.
+ *
+ * returns the length of the encoding, 0 or less on error
+ * ############################################################################ */
+int CMP_PKIMESSAGE_get_protectedPart_der(const CMP_PKIMESSAGE *msg, unsigned char **der)
+	{
+	CMP_PROTECTEDPART protPart;
+	const unsigned char *p=NULL, *start=NULL;
+	unsigned char *q=NULL;
+	long len=0, partLen=0;
+	int tag, xclass, derLen;
+
+	if (!msg || !der) goto err;
+	*der = NULL;
+
+	if (msg->enc.enc && !msg->enc.modified)
+		{
+		/* PKIMessage ::= SEQUENCE { header, body, ... }; anything but
+		 * definite length constructed encodings is left to i2d below */
+		p = msg->enc.enc;
+		if (ASN1_get_object(&p, &len, &tag, &xclass, msg->enc.len) != V_ASN1_CONSTRUCTED
+				|| tag != V_ASN1_SEQUENCE) goto encode;
+		start = p;
+		if (ASN1_get_object(&p, &partLen, &tag, &xclass, len) != V_ASN1_CONSTRUCTED) goto encode;
+		p += partLen;
+		if (ASN1_get_object(&p, &partLen, &tag, &xclass, len - (p - start)) != V_ASN1_CONSTRUCTED) goto encode;
+		p += partLen;
+
+		len = p - start;
+		derLen = ASN1_object_size(1, len, V_ASN1_SEQUENCE);
+		if (!(*der = OPENSSL_malloc(derLen)))
+			{
+			CMPerr(CMP_F_CMP_PKIMESSAGE_GET_PROTECTEDPART_DER, ERR_R_MALLOC_FAILURE);
+			goto err;
+			}
+		q = *der;
+		ASN1_put_object(&q, 1, len, V_ASN1_SEQUENCE, V_ASN1_UNIVERSAL);
+		memcpy(q, start, len);
+		return derLen;
+		}
+
+encode:
+	protPart.header = msg->header;
+	protPart.body	= msg->body;
+	return i2d_CMP_PROTECTEDPART(&protPart, der);
+err:
+	return 0;
+	}
+
+/* ############################################################################ *
+ * internal function
+ *
+ * calculate PBM protection over the given DER utilizing the given secret and
+ * the pbm-parameters inside protectionAlg
  *
  * returns pointer to ASN1_BIT_STRING containing protection on success, NULL on
  * error
  * ############################################################################ */
-ASN1_BIT_STRING *CMP_calc_protection_pbmac(CMP_PKIMESSAGE *pkimessage, const ASN1_OCTET_STRING *secret)
+static ASN1_BIT_STRING *CMP_calc_pbmac_der(X509_ALGOR *protectionAlg, const unsigned char *der,
+		size_t derLen, const ASN1_OCTET_STRING *secret)
 	{
 	ASN1_BIT_STRING *prot=NULL;
-	CMP_PROTECTEDPART protPart;
 	ASN1_STRING *pbmStr=NULL;
 	ASN1_OBJECT *algorOID=NULL;
 
 	CRMF_PBMPARAMETER *pbm=NULL;
 
-	size_t protPartDerLen;
 	unsigned int macLen;
-	unsigned char *protPartDer=NULL;
 	unsigned char *mac=NULL;
 	const unsigned char *pbmStrUchar=NULL;
 
@@ -481,11 +535,7 @@ ASN1_BIT_STRING *CMP_calc_protection_pbmac(CMP_PKIMESSAGE *pkimessage, const ASN
 		goto err;
 		}
 
-	protPart.header = pkimessage->header;
-	protPart.body	= pkimessage->body;
-	protPartDerLen	= i2d_CMP_PROTECTEDPART(&protPart, &protPartDer);
-
-	X509_ALGOR_get0( &algorOID, &pptype, &ppval, pkimessage->header->protectionAlg);
+	X509_ALGOR_get0( &algorOID, &pptype, &ppval, protectionAlg);
 
 	if (NID_id_PasswordBasedMAC == OBJ_obj2nid(algorOID))
 		{
@@ -494,15 +544,14 @@ ASN1_BIT_STRING *CMP_calc_protection_pbmac(CMP_PKIMESSAGE *pkimessage, const ASN
 
 		pbmStr = (ASN1_STRING *)ppval;
 		pbmStrUchar = (unsigned char *)pbmStr->data;
-		pbm = d2i_CRMF_PBMPARAMETER( NULL, &pbmStrUchar, pbmStr->length);
+		if (!(pbm = d2i_CRMF_PBMPARAMETER( NULL, &pbmStrUchar, pbmStr->length))) goto err;
 
-		if(!(CRMF_passwordBasedMac_new(pbm, protPartDer, protPartDerLen, secret->data, secret->length, &mac, &macLen))) goto err;
+		if(!(CRMF_passwordBasedMac_new(pbm, der, derLen, secret->data, secret->length, &mac, &macLen))) goto err;
 		}
 	else {
 		CMPerr(CMP_F_CMP_CALC_PROTECTION_PBMAC, CMP_R_WRONG_ALGORITHM_OID);
 		goto err;
 		}
-	OPENSSL_free(protPartDer);
 
 	if(!(prot = ASN1_BIT_STRING_new())) goto err;
 	ASN1_BIT_STRING_set(prot, mac, macLen);
@@ -512,37 +561,36 @@ ASN1_BIT_STRING *CMP_calc_protection_pbmac(CMP_PKIMESSAGE *pkimessage, const ASN
 	prot->flags |= ASN1_STRING_FLAG_BITS_LEFT;
 
 	/* cleanup */
+	CRMF_PBMPARAMETER_free(pbm);
 	if (mac) OPENSSL_free(mac);
 	return prot;
 
 err:
+	if (pbm) CRMF_PBMPARAMETER_free(pbm);
 	if (mac) OPENSSL_free(mac);
 
 	CMPerr(CMP_F_CMP_CALC_PROTECTION_PBMAC, CMP_R_ERROR_CALCULATING_PROTECTION);
 	if(prot) ASN1_BIT_STRING_free(prot);
-	if(protPartDer) OPENSSL_free(protPartDer);
 	return NULL;
 }
 
-/* ############################################################################ * 
- * only used internally
+/* ############################################################################ *
+ * internal function
  *
- * calculate signature protection for given PKImessage utilizing the given secret key 
- * and the algorithm parameters set inside the message header's protectionAlg
+ * calculate signature protection over the given DER utilizing the given secret
+ * key and the algorithm set in protectionAlg
  *
  * returns pointer to ASN1_BIT_STRING containing protection on success, NULL on
  * error
  * ############################################################################ */
-ASN1_BIT_STRING *CMP_calc_protection_sig(CMP_PKIMESSAGE *pkimessage, EVP_PKEY *pkey)
+static ASN1_BIT_STRING *CMP_calc_sig_der(X509_ALGOR *protectionAlg, const unsigned char *der,
+		size_t derLen, EVP_PKEY *pkey)
 	{
 	ASN1_BIT_STRING *prot=NULL;
-	CMP_PROTECTEDPART protPart;
 	ASN1_OBJECT *algorOID=NULL;
 
-	size_t protPartDerLen;
 	unsigned int macLen;
 	size_t maxMacLen;
-	unsigned char *protPartDer=NULL;
 	unsigned char *mac=NULL;
 
 	void *ppval=NULL;
@@ -558,12 +606,7 @@ ASN1_BIT_STRING *CMP_calc_protection_sig(CMP_PKIMESSAGE *pkimessage, EVP_PKEY *p
 		goto err;
 		}
 
-	/* construct data to be signed */
-	protPart.header = pkimessage->header;
-	protPart.body	= pkimessage->body;
-	protPartDerLen	= i2d_CMP_PROTECTEDPART(&protPart, &protPartDer);
-
-	X509_ALGOR_get0( &algorOID, &pptype, &ppval, pkimessage->header->protectionAlg);
+	X509_ALGOR_get0( &algorOID, &pptype, &ppval, protectionAlg);
 
 	if ((md = EVP_get_digestbynid(OBJ_obj2nid(algorOID))))
 		{
@@ -574,7 +617,7 @@ ASN1_BIT_STRING *CMP_calc_protection_sig(CMP_PKIMESSAGE *pkimessage, EVP_PKEY *p
 		evp_ctx = EVP_MD_CTX_create();
 		if (!evp_ctx) goto err;
 		if (!(EVP_SignInit_ex(evp_ctx, md, NULL))) goto err;
-		if (!(EVP_SignUpdate(evp_ctx, protPartDer, protPartDerLen))) goto err;
+		if (!(EVP_SignUpdate(evp_ctx, der, derLen))) goto err;
 		if (!(EVP_SignFinal(evp_ctx, mac, &macLen, pkey))) goto err;
 		}
 	else {
@@ -592,35 +635,229 @@ ASN1_BIT_STRING *CMP_calc_protection_sig(CMP_PKIMESSAGE *pkimessage, EVP_PKEY *p
 	/* cleanup */
 	if (evp_ctx) EVP_MD_CTX_destroy(evp_ctx);
 	if (mac) OPENSSL_free(mac);
-	if (protPartDer) OPENSSL_free(protPartDer);
 	return prot;
 
 err:
 	if (evp_ctx) EVP_MD_CTX_destroy(evp_ctx);
 	if (mac) OPENSSL_free(mac);
-	if (protPartDer) OPENSSL_free(protPartDer);
 
 	CMPerr(CMP_F_CMP_CALC_PROTECTION_SIG, CMP_R_ERROR_CALCULATING_PROTECTION);
 	if(prot) ASN1_BIT_STRING_free(prot);
 	return NULL;
 }
 
+/* ############################################################################ * 
+ * also used for verification from cmp_vfy
+ *
+ * calculate PBM protection for given PKImessage utilizing the given secret and the
+ * pbm-parameters set inside the message header's protectionAlg
+ *
+ * returns pointer to ASN1_BIT_STRING containing protection on success, NULL on
+ * error
+ * ############################################################################ */
+ASN1_BIT_STRING *CMP_calc_protection_pbmac(CMP_PKIMESSAGE *pkimessage, const ASN1_OCTET_STRING *secret)
+	{
+	ASN1_BIT_STRING *prot=NULL;
+	unsigned char *protPartDer=NULL;
+	int protPartDerLen;
+
+	if ((protPartDerLen = CMP_PKIMESSAGE_get_protectedPart_der(pkimessage, &protPartDer)) <= 0)
+		{
+		CMPerr(CMP_F_CMP_CALC_PROTECTION_PBMAC, CMP_R_ERROR_CALCULATING_PROTECTION);
+		return NULL;
+		}
+	prot = CMP_calc_pbmac_der(pkimessage->header->protectionAlg, protPartDer, protPartDerLen, secret);
+	OPENSSL_free(protPartDer);
+	return prot;
+}
+
+/* ############################################################################ * 
+ * calculate signature protection for given PKImessage utilizing the given secret key 
+ * and the algorithm parameters set inside the message header's protectionAlg
+ *
+ * returns pointer to ASN1_BIT_STRING containing protection on success, NULL on
+ * error
+ * ############################################################################ */
+ASN1_BIT_STRING *CMP_calc_protection_sig(CMP_PKIMESSAGE *pkimessage, EVP_PKEY *pkey)
+	{
+	ASN1_BIT_STRING *prot=NULL;
+	unsigned char *protPartDer=NULL;
+	int protPartDerLen;
+
+	if ((protPartDerLen = CMP_PKIMESSAGE_get_protectedPart_der(pkimessage, &protPartDer)) <= 0)
+		{
+		CMPerr(CMP_F_CMP_CALC_PROTECTION_SIG, CMP_R_ERROR_CALCULATING_PROTECTION);
+		return NULL;
+		}
+	prot = CMP_calc_sig_der(pkimessage->header->protectionAlg, protPartDer, protPartDerLen, pkey);
+	OPENSSL_free(protPartDer);
+	return prot;
+}
+
+/* ############################################################################ *
+ * writes the DER encoding of certs as the extraCerts field of a PKIMessage,
+ * i.e. [1] EXPLICIT SEQUENCE OF Certificate, to *der, which is to be freed by
+ * the caller with OPENSSL_free(). The result can be passed to
+ * CMP_PKIMESSAGE_set_protection_ex() for any number of messages, e.g. by a
+ * server that sends the same certificate chain with every response.
+ *
+ * returns the length of the encoding, 0 on error
+ * ############################################################################ */
+int CMP_encode_extraCerts(const STACK_OF(X509) *certs, unsigned char **der)
+	{
+	unsigned char *q=NULL;
+	int certsLen=0, derLen, n, i;
+
+	if (!certs || !der)
+		{
+		CMPerr(CMP_F_CMP_ENCODE_EXTRACERTS, CMP_R_NULL_ARGUMENT);
+		return 0;
+		}
+
+	for (i = 0; i < sk_X509_num(certs); i++)
+		{
+		if ((n = i2d_X509(sk_X509_value(certs, i), NULL)) <= 0)
+			{
+			CMPerr(CMP_F_CMP_ENCODE_EXTRACERTS, ERR_R_ASN1_LIB);
+			return 0;
+			}
+		certsLen += n;
+		}
+	derLen = ASN1_object_size(1, ASN1_object_size(1, certsLen, V_ASN1_SEQUENCE), 1);
+
+	if (!(*der = q = OPENSSL_malloc(derLen)))
+		{
+		CMPerr(CMP_F_CMP_ENCODE_EXTRACERTS, ERR_R_MALLOC_FAILURE);
+		return 0;
+		}
+	ASN1_put_object(&q, 1, ASN1_object_size(1, certsLen, V_ASN1_SEQUENCE), 1, V_ASN1_CONTEXT_SPECIFIC);
+	ASN1_put_object(&q, 1, certsLen, V_ASN1_SEQUENCE, V_ASN1_UNIVERSAL);
+	for (i = 0; i < sk_X509_num(certs); i++)
+		i2d_X509(sk_X509_value(certs, i), &q);
+
+	return derLen;
+	}
+
+/* ############################################################################ *
+ * protects the given message according to the protectionAlg already set in its
+ * header, with the secret for PasswordBasedMac and with pkey otherwise.
+ *
+ * The ProtectedPart is encoded only once: the same bytes are MACed or signed
+ * and then spliced into the encoding of the whole PKIMessage, together with
+ * the protection and extraCerts. That encoding is cached in the message, so
+ * i2d_CMP_PKIMESSAGE() afterwards just copies it. Any change to the message
+ * after this call must set msg->enc.modified, see cmp.h.
+ *
+ * returns 1 on success, 0 on error
+ * ############################################################################ */
+int CMP_PKIMESSAGE_set_protection(CMP_PKIMESSAGE *msg, EVP_PKEY *pkey, const ASN1_OCTET_STRING *secret)
+	{
+	return CMP_PKIMESSAGE_set_protection_ex(msg, pkey, secret, NULL, 0);
+	}
+
+/* ############################################################################ *
+ * like CMP_PKIMESSAGE_set_protection(), but if extraCertsDer is given, it is
+ * copied into the encoding as it is instead of encoding msg->extraCerts, which
+ * must then be unset. extraCertsDer is the output of CMP_encode_extraCerts().
+ *
+ * The certificates are then only present in the encoding: decoding it again
+ * gives them back, but should msg be changed and encoded anew, they are lost.
+ *
+ * returns 1 on success, 0 on error
+ * ############################################################################ */
+int CMP_PKIMESSAGE_set_protection_ex(CMP_PKIMESSAGE *msg, EVP_PKEY *pkey, const ASN1_OCTET_STRING *secret,
+		const unsigned char *extraCertsDer, int extraCertsDerLen)
+	{
+	ASN1_BIT_STRING *prot=NULL;
+	unsigned char *protPartDer=NULL, *protDer=NULL, *certsDer=NULL, *der=NULL, *q=NULL;
+	const unsigned char *p=NULL;
+	int protPartDerLen, protDerLen=0, certsDerLen=0, contLen, derLen;
+	long partLen=0;
+	int tag, xclass;
+
+	if (!msg || !msg->header || !msg->header->protectionAlg) goto err;
+	if (extraCertsDer && msg->extraCerts) goto err;
+
+	/* the message was changed since it was last encoded */
+	msg->enc.modified = 1;
+
+	if ((protPartDerLen = CMP_PKIMESSAGE_get_protectedPart_der(msg, &protPartDer)) <= 0) goto err;
+
+	if (OBJ_obj2nid(msg->header->protectionAlg->algorithm) == NID_id_PasswordBasedMAC)
+		prot = CMP_calc_pbmac_der(msg->header->protectionAlg, protPartDer, protPartDerLen, secret);
+	else
+		prot = CMP_calc_sig_der(msg->header->protectionAlg, protPartDer, protPartDerLen, pkey);
+	if (!prot) goto err;
+
+	if ((protDerLen = i2d_ASN1_BIT_STRING(prot, &protDer)) <= 0) goto err;
+
+	if (extraCertsDer)
+		certsDerLen = extraCertsDerLen;
+	else if (msg->extraCerts)
+		{
+		if ((certsDerLen = CMP_encode_extraCerts(msg->extraCerts, &certsDer)) <= 0) goto err;
+		extraCertsDer = certsDer;
+		}
+
+	/* the contents of the ProtectedPart SEQUENCE are header and body */
+	p = protPartDer;
+	if (ASN1_get_object(&p, &partLen, &tag, &xclass, protPartDerLen) & 0x80) goto err;
+
+	/* PKIMessage ::= SEQUENCE { header, body, [0] protection, [1] extraCerts } */
+	contLen = partLen + ASN1_object_size(1, protDerLen, 0) + certsDerLen;
+	derLen = ASN1_object_size(1, contLen, V_ASN1_SEQUENCE);
+
+	if (!(der = OPENSSL_malloc(derLen)))
+		{
+		CMPerr(CMP_F_CMP_PKIMESSAGE_SET_PROTECTION, ERR_R_MALLOC_FAILURE);
+		goto err;
+		}
+	q = der;
+	ASN1_put_object(&q, 1, contLen, V_ASN1_SEQUENCE, V_ASN1_UNIVERSAL);
+	memcpy(q, p, partLen);
+	q += partLen;
+	ASN1_put_object(&q, 1, protDerLen, 0, V_ASN1_CONTEXT_SPECIFIC);
+	memcpy(q, protDer, protDerLen);
+	q += protDerLen;
+	if (certsDerLen > 0)
+		memcpy(q, extraCertsDer, certsDerLen);
+
+	if (msg->protection) ASN1_BIT_STRING_free(msg->protection);
+	msg->protection = prot;
+
+	if (msg->enc.enc) OPENSSL_free(msg->enc.enc);
+	msg->enc.enc = der;
+	msg->enc.len = derLen;
+	msg->enc.modified = 0;
+
+	OPENSSL_free(protPartDer);
+	OPENSSL_free(protDer);
+	if (certsDer) OPENSSL_free(certsDer);
+	return 1;
+err:
+	CMPerr(CMP_F_CMP_PKIMESSAGE_SET_PROTECTION, CMP_R_ERROR_PROTECTING_MESSAGE);
+	if (prot) ASN1_BIT_STRING_free(prot);
+	if (protPartDer) OPENSSL_free(protPartDer);
+	if (protDer) OPENSSL_free(protDer);
+	if (certsDer) OPENSSL_free(certsDer);
+	return 0;
+	}
+
 /* ############################################################################ *
  * internal function
- * Create an X509_ALGOR structure for PasswordBasedMAC protection
+ * Create an X509_ALGOR structure for PasswordBasedMAC protection with the
+ * given PBMParameter
  * returns pointer to X509_ALGOR on success, NULL on error
- * TODO: this could take options to configure the pbmac
  * ############################################################################ */
-X509_ALGOR *CMP_create_pbmac_algor(void)
+static X509_ALGOR *pbmac_algor_new(CRMF_PBMPARAMETER *pbm)
 	{
 	X509_ALGOR *alg=NULL;
-	CRMF_PBMPARAMETER *pbm=NULL;
 	unsigned char *pbmDer=NULL;
 	int pbmDerLen;
 	ASN1_STRING *pbmStr=NULL;
 
+	if (!pbm) goto err;
 	if (!(alg = X509_ALGOR_new())) goto err;
-	if (!(pbm = CRMF_pbm_new())) goto err;
 	if (!(pbmStr = ASN1_STRING_new())) goto err;
 
 	pbmDerLen = i2d_CRMF_PBMPARAMETER( pbm, &pbmDer);
@@ -641,6 +878,26 @@ err:
 	return NULL;
 	}
 
+/* ############################################################################ *
+ * Create an X509_ALGOR structure for PasswordBasedMAC protection with the
+ * default parameters (SHA-1, HMAC-SHA1)
+ * returns pointer to X509_ALGOR on success, NULL on error
+ * ############################################################################ */
+X509_ALGOR *CMP_create_pbmac_algor(void)
+	{
+	return pbmac_algor_new(CRMF_pbm_new());
+	}
+
+/* ############################################################################ *
+ * Create an X509_ALGOR structure for PasswordBasedMAC protection using the
+ * given owf, iterationCount and mac, e.g. NID_sha256 and NID_hmacWithSHA256
+ * returns pointer to X509_ALGOR on success, NULL on error
+ * ############################################################################ */
+X509_ALGOR *CMP_create_pbmac_algor_ex(int owfNid, long iterationCount, int macNid)
+	{
+	return pbmac_algor_new(CRMF_pbm_new_ex(owfNid, iterationCount, macNid));
+	}
+
 /* ############################################################################ *
  * determines which kind of protection should be created based on the ctx
  * sets this into the protectionAlg field in the message header
@@ -648,7 +905,7 @@ err:
  *
  * returns 1 on success, 0 on error
  * ############################################################################ */
-int CMP_PKIMESSAGE_protect(CMP_CTX *ctx, CMP_PKIMESSAGE *msg)
+static int protect_msg(CMP_CTX *ctx, CMP_PKIMESSAGE *msg)
 	{
 	if(!ctx) goto err;
 	if(!msg) goto err;
@@ -656,9 +913,14 @@ int CMP_PKIMESSAGE_protect(CMP_CTX *ctx, CMP_PKIMESSAGE *msg)
 	/* use PasswordBasedMac according to 5.1.3.1 if secretValue is given */
 	if (ctx->secretValue)
 		{
-		if(!(msg->header->protectionAlg = CMP_create_pbmac_algor())) goto err;
+		/* all messages of a transaction share one PBMParameter, so that the
+		 * peers can reuse the base key derived for the first one */
+		if (!ctx->pbmAlg && !(ctx->pbmAlg = CMP_create_pbmac_algor_ex(ctx->pbmOwf,
+				ctx->pbmIterationCount, ctx->pbmMac))) goto err;
+		if (msg->header->protectionAlg) X509_ALGOR_free(msg->header->protectionAlg);
+		if(!(msg->header->protectionAlg = X509_ALGOR_dup(ctx->pbmAlg))) goto err;
 		CMP_PKIHEADER_set1_senderKID(msg->header, ctx->referenceValue);
-		if(!(msg->protection = CMP_calc_protection_pbmac( msg, ctx->secretValue))) 
+		if(!CMP_PKIMESSAGE_set_protection( msg, NULL, ctx->secretValue))
 			goto err;
 		}
 	else {
@@ -681,11 +943,16 @@ int CMP_PKIMESSAGE_protect(CMP_CTX *ctx, CMP_PKIMESSAGE *msg)
 				case EVP_PKEY_RSA:
 					algNID = NID_sha1WithRSAEncryption;
 					break;
+				case EVP_PKEY_EC:
+					algNID = NID_ecdsa_with_SHA1;
+					break;
 				default:
 					CMPerr(CMP_F_CMP_PKIMESSAGE_PROTECT, CMP_R_UNSUPPORTED_KEY_TYPE);
 					goto err;
 				}
-			X509_ALGOR_set0(msg->header->protectionAlg, OBJ_nid2obj(algNID), V_ASN1_NULL, NULL);
+			/* parameters are absent for ECDSA (RFC 5758) */
+			X509_ALGOR_set0(msg->header->protectionAlg, OBJ_nid2obj(algNID),
+					algNID == NID_ecdsa_with_SHA1 ? V_ASN1_UNDEF : V_ASN1_NULL, NULL);
 
 			/* set senderKID to  keyIdentifier of the used certificate according
 			 * to section 5.1.1 */
@@ -696,7 +963,7 @@ int CMP_PKIMESSAGE_protect(CMP_CTX *ctx, CMP_PKIMESSAGE *msg)
 				ASN1_OCTET_STRING_free(subjKeyIDStr);
 				}
 			
-			if (!(msg->protection = CMP_calc_protection_sig( msg, ctx->pkey))) 
+			if (!CMP_PKIMESSAGE_set_protection( msg, ctx->pkey, NULL))
 				goto err;
 			}
 		else
@@ -712,6 +979,25 @@ int CMP_PKIMESSAGE_protect(CMP_CTX *ctx, CMP_PKIMESSAGE *msg)
 	return 0;
 	}
 
+/* ############################################################################ *
+ * protects msg as described for protect_msg() and adds the time taken to the
+ * metrics of the message in progress if a metrics callback is set
+ *
+ * returns 1 on success, 0 on error
+ * ############################################################################ */
+int CMP_PKIMESSAGE_protect(CMP_CTX *ctx, CMP_PKIMESSAGE *msg)
+	{
+	unsigned long start;
+	int ret;
+
+	if (!ctx || !ctx->metrics_cb) return protect_msg(ctx, msg);
+
+	start = CMP_METRICS_now();
+	ret = protect_msg(ctx, msg);
+	ctx->msgMetrics->protect += CMP_METRICS_now() - start;
+	return ret;
+	}
+
 /* ############################################################################ * 
  * set certificate Hash in certStatus of certConf messages according to 5.3.18.
  *
@@ -765,6 +1051,7 @@ int CMP_PKIMESSAGE_set_implicitConfirm(CMP_PKIMESSAGE *msg)
 	itav->infoType = OBJ_nid2obj(NID_id_it_implicitConfirm);
 	itav->infoValue.implicitConfirm = ASN1_NULL_new();
 	if (!CMP_PKIHEADER_generalInfo_item_push0( msg->header, itav)) goto err;
+	msg->enc.modified = 1;
 	return 1;
 err:
 	if (itav) CMP_INFOTYPEANDVALUE_free(itav);
@@ -825,6 +1112,7 @@ int CMP_PKIMESSAGE_genm_item_push0(CMP_PKIMESSAGE *msg, const CMP_INFOTYPEANDVAL
 
 	if (!CMP_ITAV_stack_item_push0( &msg->body->value.genm, itav))
 		goto err;
+	msg->enc.modified = 1;
 	return 1;
 err:
 	return 0;
@@ -1273,6 +1561,7 @@ int CMP_PKIMESSAGE_set_bodytype( CMP_PKIMESSAGE *msg, int type)
 	if( !msg) return 0;
 
 	msg->body->type = type;
+	msg->enc.modified = 1;
 
 	return 1;
 	}
@@ -1328,22 +1617,15 @@ char *CMP_PKIMESSAGE_parse_error_msg( CMP_PKIMESSAGE *msg, char *errormsg, int b
 	}
 
 /* ############################################################################ *
- * Retrieve the returned certificate from the given certrepmessage.
+ * Retrieve the certificate returned for certReqId repNum from the given
+ * certrepmessage, decrypting it with pkey if needed. Sets ctx->lastPKIStatus
+ * to the PKIStatus of that response.
  * returns NULL if not found
- * TODO: create another function handing multiple certreps when 2 certificates
- * had been requested
  * ############################################################################ */
-X509 *CMP_CERTREPMESSAGE_get_certificate(CMP_CTX *ctx, CMP_CERTREPMESSAGE *certrep)
+static X509 *certrep_get_cert(CMP_CTX *ctx, CMP_CERTREPMESSAGE *certrep, long repNum, EVP_PKEY *pkey)
 	{
 	X509 *newClCert = NULL;
-	int repNum = 0;
 
-	/* Get the certReqId of the first certresponse. Need to do it this way instead
-	 * of just using certReqId==0, because in error cases the server might reply with a certReqId
-	 * of -1... */
-	if (sk_CMP_CERTRESPONSE_num(certrep->response) > 0)
-		repNum = ASN1_INTEGER_get(sk_CMP_CERTRESPONSE_value(certrep->response, 0)->certReqId);
-	
 	CMP_CTX_set_failInfoCode(ctx, CMP_CERTREPMESSAGE_PKIFailureInfo_get0(certrep, repNum));
 
 	ctx->lastPKIStatus = CMP_CERTREPMESSAGE_PKIStatus_get( certrep, repNum);
@@ -1370,7 +1652,7 @@ X509 *CMP_CERTREPMESSAGE_get_certificate(CMP_CTX *ctx, CMP_CERTREPMESSAGE *certr
 					break;
 					/* certificate encrypted for PoP using indirect method according to section 5.2.8.2 */
 				case CMP_CERTORENCCERT_ENCRYPTEDCERT:
-					if( !(newClCert = CMP_CERTREPMESSAGE_encCert_get1(certrep,repNum,ctx->newPkey)))
+					if( !(newClCert = CMP_CERTREPMESSAGE_encCert_get1(certrep,repNum,pkey)))
 						{
 						CMPerr(CMP_F_CMP_CERTREPMESSAGE_GET_CERTIFICATE, CMP_R_CERTIFICATE_NOT_FOUND);
 						goto err;
@@ -1445,6 +1727,45 @@ err:
 	return NULL;
 	}
 
+/* ############################################################################ *
+ * Retrieve the returned certificate from the given certrepmessage.
+ *
+ * If several certificates were requested with CMP_CTX_certReq_push1(), the
+ * PKIStatus and certificate of every response are stored in the respective
+ * request and the first certificate granted is returned. ctx->lastPKIStatus
+ * is then the status of the first request.
+ * returns NULL if not found
+ * ############################################################################ */
+X509 *CMP_CERTREPMESSAGE_get_certificate(CMP_CTX *ctx, CMP_CERTREPMESSAGE *certrep)
+	{
+	CMP_CERTREQ_SPEC *spec = NULL;
+	X509 *newClCert = NULL;
+	long repNum = 0;
+	int i;
+
+	if (CMP_CTX_certReqs_num(ctx) > 0)
+		{
+		for (i = sk_CMP_CERTREQ_SPEC_num(ctx->certReqs)-1; i >= 0; i--)
+			{
+			spec = sk_CMP_CERTREQ_SPEC_value(ctx->certReqs, i);
+			if (spec->cert) X509_free(spec->cert);
+			spec->cert = certrep_get_cert(ctx, certrep, i, spec->pkey);
+			spec->status = ctx->lastPKIStatus;
+			if (spec->cert) newClCert = spec->cert;
+			}
+		if (newClCert) CRYPTO_add(&newClCert->references, 1, CRYPTO_LOCK_X509);
+		return newClCert;
+		}
+
+	/* Get the certReqId of the first certresponse. Need to do it this way instead
+	 * of just using certReqId==0, because in error cases the server might reply with a certReqId
+	 * of -1... */
+	if (sk_CMP_CERTRESPONSE_num(certrep->response) > 0)
+		repNum = ASN1_INTEGER_get(sk_CMP_CERTRESPONSE_value(certrep->response, 0)->certReqId);
+
+	return certrep_get_cert(ctx, certrep, repNum, ctx->newPkey);
+	}
+
 /* ################################################################ *
  * Builds up the certificate chain of cert as high up as possible using
  * the given X509_STORE containing all possible intermediate certificates and
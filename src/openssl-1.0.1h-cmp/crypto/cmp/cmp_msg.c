@@ -196,33 +196,99 @@ err:
 	return 0;
 	}
 
+/* ############################################################################ *
+ * Adds one CertReqMsg with certReqId i for the i'th certificate requested with
+ * CMP_CTX_certReq_push1() to reqs. Unless the request has its own subject and
+ * extensions, the given ones are used. As for a single request, ir carry the
+ * regToken and kur the oldCertId control. The results of a previous
+ * transaction are cleared.
+ *
+ * returns 1 on success, 0 on error
+ * ############################################################################ */
+static int add_certReqs(CMP_CTX *ctx, STACK_OF(CRMF_CERTREQMSG) *reqs, int bodytype,
+		X509_NAME *subject, X509_EXTENSIONS *extensions)
+	{
+	CMP_CERTREQ_SPEC *spec = NULL;
+	CRMF_CERTREQMSG *certReq = NULL;
+	int i;
+
+	for (i = 0; i < sk_CMP_CERTREQ_SPEC_num(ctx->certReqs); i++)
+		{
+		spec = sk_CMP_CERTREQ_SPEC_value(ctx->certReqs, i);
+		spec->status = -1;
+		if (spec->cert)
+			{
+			X509_free(spec->cert);
+			spec->cert = NULL;
+			}
+
+		if (!(certReq = CRMF_cr_new(i, spec->pkey, spec->subject ? spec->subject : subject,
+				spec->extensions ? spec->extensions : extensions))) goto err;
+		if (!sk_CRMF_CERTREQMSG_push(reqs, certReq))
+			{
+			CRMF_CERTREQMSG_free(certReq);
+			goto err;
+			}
+
+		if (bodytype == V_CMP_PKIBODY_IR && ctx->regToken)
+			if (!CRMF_CERTREQMSG_set1_regInfo_regToken(certReq, ctx->regToken)) goto err;
+		if (bodytype == V_CMP_PKIBODY_KUR)
+			CRMF_CERTREQMSG_set1_control_oldCertId(certReq, ctx->oldClCert ? ctx->oldClCert : ctx->clCert);
+
+		if (!CRMF_CERTREQMSG_calc_and_set_popo(certReq, spec->pkey, spec->popoMethod)) goto err;
+		}
+
+	return 1;
+err:
+	return 0;
+	}
+
 /* ############################################################################ *
  * Creates a new polling request PKIMessage for the given request ID
  * returns a pointer to the PKIMessage on success, NULL on error
  * ############################################################################ */
 CMP_PKIMESSAGE * CMP_pollReq_new( CMP_CTX *ctx, int reqId)
+	{
+	long id = reqId;
+	return CMP_pollReqs_new( ctx, &id, 1);
+	}
+
+/* ############################################################################ *
+ * Creates a new polling request PKIMessage asking for all num given request
+ * IDs at once
+ * returns a pointer to the PKIMessage on success, NULL on error
+ * ############################################################################ */
+CMP_PKIMESSAGE * CMP_pollReqs_new( CMP_CTX *ctx, const long *reqIds, int num)
 	{
 	CMP_PKIMESSAGE *msg = NULL;
 	CMP_POLLREQ    *preq = NULL;
-	if (!ctx) goto err;
+	int i;
+
+	if (!ctx || !reqIds || num <= 0) goto err;
 
 	if (!(msg = CMP_PKIMESSAGE_new())) goto err;
 	if( !CMP_PKIHEADER_init( ctx, msg->header)) goto err;
 	CMP_PKIMESSAGE_set_bodytype( msg, V_CMP_PKIBODY_POLLREQ);
 
-	if(!(preq = CMP_POLLREQ_new())) goto err;
-	/* TODO support multiple cert request ids to poll */
-	ASN1_INTEGER_set(preq->certReqId, reqId);
 	if (!(msg->body->value.pollReq = sk_CMP_POLLREQ_new_null()))
 		goto err;
 
-	sk_CMP_POLLREQ_push(msg->body->value.pollReq, preq);
+	for (i = 0; i < num; i++)
+		{
+		if(!(preq = CMP_POLLREQ_new())) goto err;
+		ASN1_INTEGER_set(preq->certReqId, reqIds[i]);
+		if (!sk_CMP_POLLREQ_push(msg->body->value.pollReq, preq))
+			{
+			CMP_POLLREQ_free(preq);
+			goto err;
+			}
+		}
 
 	if(!CMP_PKIMESSAGE_protect(ctx, msg)) goto err;
 
 	return msg;
 err:
-	CMPerr(CMP_F_CMP_POLLREQ_NEW, CMP_R_ERROR_CREATING_POLLREQ);
+	CMPerr(CMP_F_CMP_POLLREQS_NEW, CMP_R_ERROR_CREATING_POLLREQ);
 	if (msg) CMP_PKIMESSAGE_free(msg);
 	return NULL;
 	}
@@ -244,7 +310,7 @@ CMP_PKIMESSAGE * CMP_ir_new( CMP_CTX *ctx)
 	if (!((ctx->referenceValue && ctx->secretValue) || (ctx->pkey && ctx->clCert))) goto err;
 
 	/* new key pair for new Certificate must be set */
-	if (!ctx->newPkey) goto err;
+	if (!ctx->newPkey && CMP_CTX_certReqs_num(ctx) == 0) goto err;
 
 	if (!(msg = CMP_PKIMESSAGE_new())) goto err;
 	if (!CMP_PKIHEADER_init( ctx, msg->header)) goto err;
@@ -269,16 +335,22 @@ CMP_PKIMESSAGE * CMP_ir_new( CMP_CTX *ctx)
 		add_policy_extensions(&extensions, ctx->policies);
 
 	if (!(msg->body->value.ir = sk_CRMF_CERTREQMSG_new_null())) goto err;
-	if (!(certReq0 = CRMF_cr_new(0L, ctx->newPkey, subject, extensions))) goto err;
-	sk_CRMF_CERTREQMSG_push( msg->body->value.ir, certReq0);
-	/* TODO: here also the optional 2nd certreqmsg could be pushed to the stack */
+	if (CMP_CTX_certReqs_num(ctx) > 0)
+		{
+		if (!add_certReqs(ctx, msg->body->value.ir, V_CMP_PKIBODY_IR, subject, extensions)) goto err;
+		}
+	else
+		{
+		if (!(certReq0 = CRMF_cr_new(0L, ctx->newPkey, subject, extensions))) goto err;
+		sk_CRMF_CERTREQMSG_push( msg->body->value.ir, certReq0);
 
-    /* sets the id-regCtrl-regToken to regInfo (not described in RFC, but EJBCA
-	 * in CA mode might insist on that) */
-	if (ctx->regToken)
-		if (!CRMF_CERTREQMSG_set1_regInfo_regToken(certReq0, ctx->regToken)) goto err;
+		/* sets the id-regCtrl-regToken to regInfo (not described in RFC, but EJBCA
+		 * in CA mode might insist on that) */
+		if (ctx->regToken)
+			if (!CRMF_CERTREQMSG_set1_regInfo_regToken(certReq0, ctx->regToken)) goto err;
 
-	CRMF_CERTREQMSG_calc_and_set_popo( certReq0, ctx->newPkey, ctx->popoMethod);
+		CRMF_CERTREQMSG_calc_and_set_popo( certReq0, ctx->newPkey, ctx->popoMethod);
+		}
 
 	add_extraCerts(ctx, msg);
 	if (!CMP_PKIMESSAGE_protect(ctx, msg)) goto err;
@@ -296,7 +368,10 @@ err:
 	}
 
 /* ############################################################################ *
- * Creates a new Revocation Request PKIMessage based on the settings in ctx
+ * Creates a new Revocation Request PKIMessage based on the settings in ctx.
+ * If certificates to revoke were added with CMP_CTX_revCert_push1() or
+ * CMP_CTX_revSerial_push1(), the rr contains a RevDetails for each of them,
+ * else one for clCert.
  * returns a pointer to the PKIMessage on success, NULL on error
  * ############################################################################ */
 CMP_PKIMESSAGE * CMP_rr_new( CMP_CTX *ctx)
@@ -305,16 +380,43 @@ CMP_PKIMESSAGE * CMP_rr_new( CMP_CTX *ctx)
 	CRMF_CERTTEMPLATE *certTpl=NULL;
 	X509_NAME *subject=NULL;
 	CMP_REVDETAILS *rd=NULL;
+	int i;
 
 	if (!ctx) goto err;
-	if (!ctx->clCert) goto err;
-	if (!ctx->pkey) goto err;
+	if (CMP_CTX_revDetails_num(ctx) == 0)
+		{
+		if (!ctx->clCert) goto err;
+		if (!ctx->pkey) goto err;
+		}
+	else if (!(ctx->pkey && ctx->clCert) && !(ctx->referenceValue && ctx->secretValue))
+		{
+		/* the rr must be protected either with a key or with a PBM secret */
+		CMPerr(CMP_F_CMP_RR_NEW, CMP_R_MISSING_KEY_INPUT_FOR_CREATING_PROTECTION);
+		goto err;
+		}
 
 	if (!(msg = CMP_PKIMESSAGE_new())) goto err;
 	if (!CMP_PKIHEADER_init( ctx, msg->header)) goto err;
 	CMP_PKIMESSAGE_set_bodytype( msg, V_CMP_PKIBODY_RR);
 
 	if (!(msg->body->value.rr = sk_CMP_REVDETAILS_new_null())) goto err;
+
+	if (CMP_CTX_revDetails_num(ctx) > 0)
+		{
+		for (i = 0; i < sk_CMP_REVDETAILS_num(ctx->revDetails); i++)
+			{
+			if (!(rd = ASN1_item_dup(ASN1_ITEM_rptr(CMP_REVDETAILS),
+					sk_CMP_REVDETAILS_value(ctx->revDetails, i)))) goto err;
+			if (!sk_CMP_REVDETAILS_push( msg->body->value.rr, rd))
+				{
+				CMP_REVDETAILS_free(rd);
+				goto err;
+				}
+			}
+		if(!CMP_PKIMESSAGE_protect(ctx, msg)) goto err;
+		return msg;
+		}
+
 	if (!(rd = CMP_REVDETAILS_new())) goto err;
 	sk_CMP_REVDETAILS_push( msg->body->value.rr, rd);
 
@@ -355,7 +457,7 @@ CMP_PKIMESSAGE * CMP_cr_new( CMP_CTX *ctx)
 	/* for authentication we need either a reference value/secret for MSG_MAC_ALG 
 	 * or existing certificate and private key for MSG_SIG_ALG */
 	if (!((ctx->referenceValue && ctx->secretValue) || (ctx->pkey && ctx->clCert))) goto err;
-	if (!ctx->pkey) goto err;
+	if (!ctx->pkey && CMP_CTX_certReqs_num(ctx) == 0) goto err;
 
 	if (ctx->subjectName)
 		subject = ctx->subjectName;
@@ -371,11 +473,17 @@ CMP_PKIMESSAGE * CMP_cr_new( CMP_CTX *ctx)
 	CMP_PKIMESSAGE_set_bodytype( msg, V_CMP_PKIBODY_CR);
 
 	if (!(msg->body->value.cr = sk_CRMF_CERTREQMSG_new_null())) goto err;
-	if (!(certReq0 = CRMF_cr_new(0L, ctx->pkey, subject, NULL))) goto err;
-	sk_CRMF_CERTREQMSG_push( msg->body->value.cr, certReq0);
-	/* TODO: here also the optional 2nd certreqmsg could be pushed to the stack */
+	if (CMP_CTX_certReqs_num(ctx) > 0)
+		{
+		if (!add_certReqs(ctx, msg->body->value.cr, V_CMP_PKIBODY_CR, subject, NULL)) goto err;
+		}
+	else
+		{
+		if (!(certReq0 = CRMF_cr_new(0L, ctx->pkey, subject, NULL))) goto err;
+		sk_CRMF_CERTREQMSG_push( msg->body->value.cr, certReq0);
 
-	CRMF_CERTREQMSG_calc_and_set_popo( certReq0, ctx->pkey, ctx->popoMethod);
+		CRMF_CERTREQMSG_calc_and_set_popo( certReq0, ctx->pkey, ctx->popoMethod);
+		}
 
 	add_extraCerts(ctx, msg);
 	if (!CMP_PKIMESSAGE_protect(ctx, msg)) goto err;
@@ -406,7 +514,7 @@ CMP_PKIMESSAGE * CMP_kur_new( CMP_CTX *ctx)
 	/* for authentication we need either a reference value/secret for MSG_MAC_ALG 
 	 * or existing certificate and private key for MSG_SIG_ALG */
 	if (!((ctx->referenceValue && ctx->secretValue) || (ctx->pkey && ctx->clCert))) goto err;
-	if (!ctx->newPkey) goto err;
+	if (!ctx->newPkey && CMP_CTX_certReqs_num(ctx) == 0) goto err;
 
 	if (!(msg = CMP_PKIMESSAGE_new())) goto err;
 	if (!CMP_PKIHEADER_init( ctx, msg->header)) goto err;
@@ -427,20 +535,24 @@ CMP_PKIMESSAGE * CMP_kur_new( CMP_CTX *ctx)
 		add_policy_extensions(&extensions, ctx->policies);
 
 	if (!(msg->body->value.kur = sk_CRMF_CERTREQMSG_new_null())) goto err;
-	if (!(certReq0 = CRMF_cr_new(0L, ctx->newPkey, subject, extensions))) goto err;
-	sk_CRMF_CERTREQMSG_push( msg->body->value.kur, certReq0);
-	/* TODO: here also the optional 2nd certreqmsg could be pushed to the stack */
-
-	/* setting OldCertId according to D.6:
-	   7.  regCtrl OldCertId SHOULD be used */
-
-	if (ctx->oldClCert)
-		CRMF_CERTREQMSG_set1_control_oldCertId( certReq0, ctx->oldClCert);
+	if (CMP_CTX_certReqs_num(ctx) > 0)
+		{
+		if (!add_certReqs(ctx, msg->body->value.kur, V_CMP_PKIBODY_KUR, subject, extensions)) goto err;
+		}
 	else
-		CRMF_CERTREQMSG_set1_control_oldCertId( certReq0, ctx->clCert);
+		{
+		if (!(certReq0 = CRMF_cr_new(0L, ctx->newPkey, subject, extensions))) goto err;
+		sk_CRMF_CERTREQMSG_push( msg->body->value.kur, certReq0);
 
+		/* setting OldCertId according to D.6:
+		   7.  regCtrl OldCertId SHOULD be used */
+		if (ctx->oldClCert)
+			CRMF_CERTREQMSG_set1_control_oldCertId( certReq0, ctx->oldClCert);
+		else
+			CRMF_CERTREQMSG_set1_control_oldCertId( certReq0, ctx->clCert);
 
-	CRMF_CERTREQMSG_calc_and_set_popo( certReq0, ctx->newPkey, ctx->popoMethod);
+		CRMF_CERTREQMSG_calc_and_set_popo( certReq0, ctx->newPkey, ctx->popoMethod);
+		}
 
 	add_extraCerts(ctx, msg);
 	if (!CMP_PKIMESSAGE_protect(ctx, msg)) goto err;
@@ -457,15 +569,52 @@ err:
 	}
 
 /* ############################################################################ *
- * Creates a new Certificate Confirmation PKIMessage
+ * Adds the CertStatus confirming cert, which was received with the given
+ * PKIStatus for certReqId, to the certConf msg. The certificate is rejected
+ * if the certConf callback set in ctx says so.
+ *
+ * returns 1 on success, 0 on error
+ * ############################################################################ */
+static int add_certStatus(CMP_CTX *ctx, CMP_PKIMESSAGE *msg, long certReqId, X509 *cert, int status)
+	{
+	CMP_CERTSTATUS *certStatus=NULL;
+
+	if (!(certStatus = CMP_CERTSTATUS_new())) goto err;
+	if (!sk_CMP_CERTSTATUS_push( msg->body->value.certConf, certStatus))
+		{
+		CMP_CERTSTATUS_free(certStatus);
+		goto err;
+		}
+	/* set the # of the certReq */
+	ASN1_INTEGER_set(certStatus->certReqId, certReqId);
+	/* -- the hash of the certificate, using the same hash algorithm
+	 * -- as is used to create and verify the certificate signature */
+	CMP_CERTSTATUS_set_certHash( certStatus, cert);
+
+	/* execute the callback function set in ctx which can be used to examine a
+	 * certificate and reject it */
+	if (ctx->certConf_cb && ctx->certConf_cb(status, cert) == 0)
+		{
+		certStatus->statusInfo = CMP_PKISTATUSINFO_new();
+		ASN1_INTEGER_set(certStatus->statusInfo->status, CMP_PKISTATUS_rejection);
+		CMP_printf(ctx, "INFO: rejecting certificate.");
+		}
+
+	return 1;
+err:
+	return 0;
+	}
+
+/* ############################################################################ *
+ * Creates a new Certificate Confirmation PKIMessage, confirming all
+ * certificates received if several were requested with CMP_CTX_certReq_push1()
  * returns a pointer to the PKIMessage on success, NULL on error
- * TODO: handle both possible certificates when signing and encrypting
- * certificates have been requested/received
  * ############################################################################ */
 CMP_PKIMESSAGE * CMP_certConf_new( CMP_CTX *ctx)
 	{
 	CMP_PKIMESSAGE *msg=NULL;
-	CMP_CERTSTATUS *certStatus=NULL;
+	CMP_CERTREQ_SPEC *spec=NULL;
+	int i;
 
 	if (!ctx) goto err;
 	/* for authentication we need either a reference value/secret for MSG_MAC_ALG 
@@ -478,22 +627,15 @@ CMP_PKIMESSAGE * CMP_certConf_new( CMP_CTX *ctx)
 	CMP_PKIMESSAGE_set_bodytype( msg, V_CMP_PKIBODY_CERTCONF);
 	if (!(msg->body->value.certConf = sk_CMP_CERTSTATUS_new_null())) goto err;
 
-	if (!(certStatus = CMP_CERTSTATUS_new())) goto err;
-	if (!sk_CMP_CERTSTATUS_push( msg->body->value.certConf, certStatus)) goto err;
-	/* set the # of the certReq */
-	ASN1_INTEGER_set(certStatus->certReqId,0L);
-	/* -- the hash of the certificate, using the same hash algorithm
-	 * -- as is used to create and verify the certificate signature */
-	CMP_CERTSTATUS_set_certHash( certStatus, ctx->newClCert);
-
-	/* execute the callback function set in ctx which can be used to examine a
-	 * certificate and reject it */
-	if (ctx->certConf_cb && ctx->newClCert && ctx->certConf_cb(ctx->lastPKIStatus, ctx->newClCert) == 0)
+	if (CMP_CTX_certReqs_num(ctx) > 0)
 		{
-		certStatus->statusInfo = CMP_PKISTATUSINFO_new();
-		ASN1_INTEGER_set(certStatus->statusInfo->status, CMP_PKISTATUS_rejection);
-		CMP_printf(ctx, "INFO: rejecting certificate.");
+		for (i = 0; i < sk_CMP_CERTREQ_SPEC_num(ctx->certReqs); i++)
+			{
+			spec = sk_CMP_CERTREQ_SPEC_value(ctx->certReqs, i);
+			if (spec->cert && !add_certStatus(ctx, msg, i, spec->cert, spec->status)) goto err;
+			}
 		}
+	else if (!add_certStatus(ctx, msg, 0L, ctx->newClCert, ctx->lastPKIStatus)) goto err;
 
 	if (!CMP_PKIMESSAGE_protect(ctx, msg)) goto err;
 
@@ -507,12 +649,16 @@ err:
 	}
 
 /* ############################################################################ *
- * Creates a new General Message with an empty itav stack
+ * Creates a new General Message holding one itav of type nid with the given
+ * value, or an empty itav stack if nid is NID_undef. The itav is added before
+ * the message is protected, so it must not be modified afterwards.
+ * On success the message owns value and frees it, on error it stays the caller's.
  * returns a pointer to the PKIMessage on success, NULL on error
  * ############################################################################ */
-CMP_PKIMESSAGE *CMP_genm_new( CMP_CTX *ctx)
+CMP_PKIMESSAGE *CMP_genm_new( CMP_CTX *ctx, int nid, char *value)
 	{
 	CMP_PKIMESSAGE *msg=NULL;
+	CMP_INFOTYPEANDVALUE *itav=NULL;
 
 	if (!ctx) goto err;
 
@@ -521,12 +667,27 @@ CMP_PKIMESSAGE *CMP_genm_new( CMP_CTX *ctx)
 	CMP_PKIMESSAGE_set_bodytype( msg, V_CMP_PKIBODY_GENM);
 	if (!(msg->body->value.genm = sk_CMP_INFOTYPEANDVALUE_new_null())) goto err; /* initialize with empty stack */
 
+	if (nid != NID_undef)
+		{
+		if (!(itav = CMP_INFOTYPEANDVALUE_new())) goto err;
+		itav->infoType = OBJ_nid2obj(nid);
+		itav->infoValue.ptr = value;
+		if (!CMP_PKIMESSAGE_genm_item_push0( msg, itav)) goto err;
+		itav = NULL;
+		}
+
 	if (!CMP_PKIMESSAGE_protect(ctx, msg)) goto err;
 
 	return msg;
 
 err:
 	CMPerr(CMP_F_CMP_GENM_NEW, CMP_R_ERROR_CREATING_GENM);
+	if (itav)
+		{
+		/* the value is the caller's */
+		itav->infoValue.ptr = NULL;
+		CMP_INFOTYPEANDVALUE_free(itav);
+		}
 	if (msg) CMP_PKIMESSAGE_free(msg);
 	return NULL;
 	}
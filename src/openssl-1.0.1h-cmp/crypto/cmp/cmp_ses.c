@@ -167,36 +167,254 @@ static void add_error_data(const char *txt)
 	ERR_add_error_data(3, current_error, ":", txt);
 	}
 
+/* ############################################################################ *
+ * internal function
+ *
+ * Collects the certReqIds of all responses in certrep with 'waiting' status
+ * into a newly allocated array *ids, to be freed by the caller.
+ * returns the number of IDs, 0 if none are waiting, -1 on error
+ * ############################################################################ */
+static int certrep_waiting_ids(CMP_CERTREPMESSAGE *certrep, long **ids)
+	{
+	CMP_CERTRESPONSE *resp = NULL;
+	int i, num = 0;
+
+	*ids = NULL;
+	if (!certrep || !certrep->response) return 0;
+	if (!(*ids = OPENSSL_malloc(sizeof(long) * (sk_CMP_CERTRESPONSE_num(certrep->response) + 1))))
+		return -1;
+
+	for (i = 0; i < sk_CMP_CERTRESPONSE_num(certrep->response); i++)
+		{
+		resp = sk_CMP_CERTRESPONSE_value(certrep->response, i);
+		if (CMP_PKISTATUSINFO_PKIstatus_get(resp->status) == CMP_PKISTATUS_waiting)
+			(*ids)[num++] = ASN1_INTEGER_get(resp->certReqId);
+		}
+
+	if (!num)
+		{
+		OPENSSL_free(*ids);
+		*ids = NULL;
+		}
+	return num;
+	}
+
+/* ############################################################################ *
+ * internal function
+ *
+ * returns 1 if any of the responses in certrep has 'waiting' status, else 0
+ * ############################################################################ */
+static int certrep_waiting(CMP_CERTREPMESSAGE *certrep)
+	{
+	long *ids = NULL;
+	int num = certrep_waiting_ids(certrep, &ids);
+
+	if (ids) OPENSSL_free(ids);
+	return num > 0;
+	}
+
+/* ############################################################################ *
+ * internal function
+ *
+ * Copies the responses of certrep that are no longer 'waiting' to granted. If
+ * ids is given, only responses for the certReqIds in it are taken, and those
+ * are removed from ids, so that only the ones still waiting are polled for.
+ * returns 1 on success, 0 on error
+ * ############################################################################ */
+static int certrep_keep_granted(CMP_CERTREPMESSAGE *certrep, STACK_OF(CMP_CERTRESPONSE) *granted,
+		long *ids, int *numIds)
+	{
+	CMP_CERTRESPONSE *resp = NULL;
+	long id;
+	int i, j;
+
+	if (!certrep || !certrep->response) return 1;
+	for (i = 0; i < sk_CMP_CERTRESPONSE_num(certrep->response); i++)
+		{
+		resp = sk_CMP_CERTRESPONSE_value(certrep->response, i);
+		if (CMP_PKISTATUSINFO_PKIstatus_get(resp->status) == CMP_PKISTATUS_waiting) continue;
+
+		if (ids)
+			{
+			id = ASN1_INTEGER_get(resp->certReqId);
+			for (j = 0; j < *numIds && ids[j] != id; j++);
+			if (j == *numIds) continue;
+			ids[j] = ids[--*numIds];
+			}
+
+		if (!(resp = ASN1_item_dup(ASN1_ITEM_rptr(CMP_CERTRESPONSE), resp))) return 0;
+		if (!sk_CMP_CERTRESPONSE_push(granted, resp))
+			{
+			CMP_CERTRESPONSE_free(resp);
+			return 0;
+			}
+		}
+	return 1;
+	}
+
+/* ############################################################################ *
+ * internal function
+ *
+ * replaces the responses of the final certrep by all the granted ones
+ * ############################################################################ */
+static void certrep_set0_granted(CMP_CERTREPMESSAGE *certrep, STACK_OF(CMP_CERTRESPONSE) *granted)
+	{
+	if (certrep->response) sk_CMP_CERTRESPONSE_pop_free(certrep->response, CMP_CERTRESPONSE_free);
+	certrep->response = granted;
+	}
+
+/* ############################################################################ *
+ * internal function
+ *
+ * returns the smallest checkAfter of all entries in the given pollRep
+ * content, -1 if there is none
+ * ############################################################################ */
+static long pollrep_checkAfter(CMP_CTX *ctx, CMP_POLLREPCONTENT *prc)
+	{
+	CMP_POLLREP *pollRep = NULL;
+	long checkAfter = -1, c;
+	int i;
+
+	for (i = 0; i < sk_CMP_POLLREP_num(prc); i++)
+		{
+		pollRep = sk_CMP_POLLREP_value(prc, i);
+		c = ASN1_INTEGER_get(pollRep->checkAfter);
+		/* TODO: print OPTIONAL reason (PKIFreeText) from message */
+		CMP_printf(ctx, "INFO: Received polling response for certReqId %ld, checkAfter = %ld seconds", ASN1_INTEGER_get(pollRep->certReqId), c);
+		if (c < 0) c = 0;
+		if (checkAfter < 0 || c < checkAfter) checkAfter = c;
+		}
+
+	return checkAfter;
+	}
+
+/* ############################################################################ *
+ * internal functions
+ *
+ * Measuring for the metrics callback, see CMP_CTX_set_metrics_callback(). A
+ * message is measured from starting to build the request until its response
+ * has been checked, CMP_PKIMESSAGE_protect(), the HTTP transfer and
+ * CMP_validate_msg() add their durations to ctx->msgMetrics in the meantime.
+ * Each message is reported when it ends and summed up in ctx->txnMetrics,
+ * which is reported when the transaction ends.
+ * ############################################################################ */
+static void metrics_msg_end(CMP_CTX *ctx, int ok)
+	{
+	CMP_METRICS *m, *t;
+
+	if (!ctx || !ctx->metrics_cb || !ctx->msgMetrics->start) return;
+	m = ctx->msgMetrics;
+	m->ok = ok;
+	m->total = CMP_METRICS_now() - m->start;
+	m->start = 0;
+	ctx->metrics_cb(ctx, m);
+
+	t = ctx->txnMetrics;
+	if (!t->start) return;
+	if (!t->messages) t->bodyType = m->bodyType;
+	t->messages     += m->messages;
+	t->polls        += m->polls;
+	t->construct    += m->construct;
+	t->protect      += m->protect;
+	t->encode       += m->encode;
+	t->connect      += m->connect;
+	t->tlsHandshake += m->tlsHandshake;
+	t->serverWait   += m->serverWait;
+	t->decode       += m->decode;
+	t->validate     += m->validate;
+	t->bytesSent    += m->bytesSent;
+	t->bytesReceived += m->bytesReceived;
+	}
+
+/* to be called before the request is built, ends a message still in progress */
+static void metrics_msg_begin(CMP_CTX *ctx)
+	{
+	if (!ctx || !ctx->metrics_cb) return;
+	metrics_msg_end(ctx, 0);
+	memset(ctx->msgMetrics, 0, sizeof(CMP_METRICS));
+	ctx->msgMetrics->type = CMP_METRICS_MESSAGE;
+	ctx->msgMetrics->start = CMP_METRICS_now();
+	}
+
+/* to be called when the request req is built and about to be sent */
+static void metrics_msg_sending(CMP_CTX *ctx, const CMP_PKIMESSAGE *req)
+	{
+	CMP_METRICS *m;
+	unsigned long elapsed;
+
+	if (!ctx || !ctx->metrics_cb || !ctx->msgMetrics->start) return;
+	m = ctx->msgMetrics;
+	elapsed = CMP_METRICS_now() - m->start;
+	m->construct = elapsed > m->protect ? elapsed - m->protect : 0;
+	m->bodyType = CMP_PKIMESSAGE_get_bodytype((CMP_PKIMESSAGE*) req);
+	m->messages = 1;
+	m->polls = m->bodyType == V_CMP_PKIBODY_POLLREQ;
+	}
+
+static void metrics_txn_begin(CMP_CTX *ctx)
+	{
+	if (!ctx || !ctx->metrics_cb) return;
+	ctx->msgMetrics->start = 0;
+	memset(ctx->txnMetrics, 0, sizeof(CMP_METRICS));
+	ctx->txnMetrics->type = CMP_METRICS_TRANSACTION;
+	ctx->txnMetrics->start = CMP_METRICS_now();
+	}
+
+/* ends the transaction, a message still in progress counts as failed */
+static void metrics_txn_end(CMP_CTX *ctx, int ok)
+	{
+	CMP_METRICS *t;
+
+	if (!ctx || !ctx->metrics_cb || !ctx->txnMetrics->start) return;
+	metrics_msg_end(ctx, 0);
+	t = ctx->txnMetrics;
+	t->ok = ok;
+	t->total = CMP_METRICS_now() - t->start;
+	t->start = 0;
+	ctx->metrics_cb(ctx, t);
+	}
+
 /* ############################################################################ *
  * internal function
  *
  * When a 'waiting' PKIStatus has been received, this function is used to attempt
- * to poll for a response message. 
+ * to poll for a response message. One pollReq asks for all certReqIds that are
+ * waiting, and the next one is sent after the smallest checkAfter in the
+ * pollRep. A certReqId is dropped from the pollReqs once a response grants
+ * it; the certrep finally returned holds the responses for all of them.
  *
  * A maxPollTime timeout can be set in the context.  The function will continue
  * to poll until the timeout is reached and then poll a last time even when that
  * is before the "checkAfter" sent by the server.  If ctx->maxPollTime is 0, the
  * timeout is disabled.
  *
+ * This blocks the calling thread between pollReqs; see CMP_SESSION and
+ * CMP_POLL_SCHED for polling without blocking.
+ *
  * returns 1 on success, returns received PKIMESSAGE in *msg argument
  * returns 0 on error or when timeout is reached without a received messsage
- *
- * TODO handle multiple pollreqs for multiple certificates
  * ############################################################################ */
 static int pollForResponse(CMP_CTX *ctx, CMP_CERTREPMESSAGE *certrep, CMP_PKIMESSAGE **msg)
 	{
 	int maxTimeLeft = ctx->maxPollTime;
 	CMP_PKIMESSAGE *preq = NULL;
 	CMP_PKIMESSAGE *prep = NULL;
-	CMP_POLLREP *pollRep = NULL;
+	STACK_OF(CMP_CERTRESPONSE) *granted = NULL;
+	long *ids = NULL;
+	int numIds, waiting, type;
 
 	CMP_printf(ctx, "INFO: Received 'waiting' PKIStatus, attempting to poll server for response.");
+	if ((numIds = certrep_waiting_ids(certrep, &ids)) <= 0) goto err;
+	if (!(granted = sk_CMP_CERTRESPONSE_new_null())) goto err;
+	if (!certrep_keep_granted(certrep, granted, NULL, NULL)) goto err;
+
 	for (;;)
 		{
-		if(!(preq = CMP_pollReq_new(ctx, 0))) goto err; /* TODO: this only handles one certificate request so far */
-
+		metrics_msg_begin(ctx);
+		if(!(preq = CMP_pollReqs_new(ctx, ids, numIds))) goto err;
 
 		CMP_printf(ctx, "INFO: Sending polling request...");
+		metrics_msg_sending(ctx, preq);
 		/* immediately send the first pollReq */
 		if (! (CMP_PKIMESSAGE_http_perform(ctx, preq, &prep)))
 			{
@@ -204,15 +422,24 @@ static int pollForResponse(CMP_CTX *ctx, CMP_CERTREPMESSAGE *certrep, CMP_PKIMES
 			ADD_HTTP_ERROR_INFO(CMP_F_POLLFORRESPONSE, CMP_R_POLLREP_NOT_RECEIVED, "pollReq");
 			goto err;
 			}
+		metrics_msg_end(ctx, 1);
+
+		/* compare received nonce with the one sent in the pollReq */
+		if (prep->header->recipNonce &&
+			ASN1_OCTET_STRING_cmp(preq->header->senderNonce, prep->header->recipNonce))
+			{
+			CMPerr(CMP_F_POLLFORRESPONSE, CMP_R_ERROR_NONCES_DO_NOT_MATCH);
+			goto err;
+			}
+		/* the next pollReq or certConf answers this message */
+		CMP_CTX_set1_recipNonce(ctx, prep->header->senderNonce);
 
 		/* handle potential pollRep */
 		if (CMP_PKIMESSAGE_get_bodytype(prep) == V_CMP_PKIBODY_POLLREP)
 			{
-			int checkAfter;
-			if(!(pollRep = sk_CMP_POLLREP_value(prep->body->value.pollRep, 0))) goto err; /* TODO: this only handles one certificate request so far */
-			checkAfter = ASN1_INTEGER_get(pollRep->checkAfter);
-			/* TODO: print OPTIONAL reason (PKIFreeText) from message */
-			CMP_printf(ctx, "INFO: Received polling response, waiting checkAfter = %ld seconds before sending another polling request...", checkAfter);
+			long checkAfter;
+			if ((checkAfter = pollrep_checkAfter(ctx, prep->body->value.pollRep)) < 0) goto err;
+			CMP_printf(ctx, "INFO: waiting checkAfter = %ld seconds before sending another polling request...", checkAfter);
 
 			if (ctx->maxPollTime != 0)
 				{        /* timout is set in context */
@@ -230,19 +457,43 @@ static int pollForResponse(CMP_CTX *ctx, CMP_CERTREPMESSAGE *certrep, CMP_PKIMES
 
 			CMP_PKIMESSAGE_free(prep);
 			CMP_PKIMESSAGE_free(preq);
+			prep = preq = NULL;
 			sleep(checkAfter);
+			continue;
 			}
-		else break; /* final success */
+
+		type = CMP_PKIMESSAGE_get_bodytype(prep);
+		if (type != V_CMP_PKIBODY_IP && type != V_CMP_PKIBODY_CP && type != V_CMP_PKIBODY_KUP)
+			break; /* left to the caller, e.g. an error message */
+
+		/* keep what was granted, and poll on right away for the rest */
+		waiting = numIds;
+		if (!certrep_keep_granted(prep->body->value.ip, granted, ids, &numIds)) goto err;
+		if (numIds == waiting) goto err; /* nothing granted, nothing to wait for */
+		if (numIds == 0)
+			{
+			certrep_set0_granted(prep->body->value.ip, granted);
+			granted = NULL;
+			break; /* final success */
+			}
+		CMP_printf(ctx, "INFO: %d certificate(s) still waiting, sending another polling request...", numIds);
+		CMP_PKIMESSAGE_free(prep);
+		CMP_PKIMESSAGE_free(preq);
+		prep = preq = NULL;
 		}
 	if (!prep) goto err;
 
 	CMP_PKIMESSAGE_free(preq);
+	OPENSSL_free(ids);
+	if (granted) sk_CMP_CERTRESPONSE_pop_free(granted, CMP_CERTRESPONSE_free);
 	*msg = prep;
 
 	return 1; 
 err:
 	CMP_PKIMESSAGE_free(preq);
 	CMP_PKIMESSAGE_free(prep);
+	if (ids) OPENSSL_free(ids);
+	if (granted) sk_CMP_CERTRESPONSE_pop_free(granted, CMP_CERTRESPONSE_free);
 	return 0;
 	}
 
@@ -256,9 +507,11 @@ static int sendCertConf( CMP_CTX *ctx)
 	CMP_PKIMESSAGE *PKIconf=NULL;
 
 	/* crate Certificate Confirmation - certConf */
+	metrics_msg_begin(ctx);
 	if (!(certConf = CMP_certConf_new(ctx))) goto err;
 
 	CMP_printf( ctx, "INFO: Sending Certificate Confirm");
+	metrics_msg_sending(ctx, certConf);
 	if (! (CMP_PKIMESSAGE_http_perform(ctx, certConf, &PKIconf)))
 		{
 		ADD_HTTP_ERROR_INFO(CMP_F_SENDCERTCONF, CMP_R_PKICONF_NOT_RECEIVED, "certConf");
@@ -294,6 +547,7 @@ static int sendCertConf( CMP_CTX *ctx)
 			goto err;
 			}
 		} /* it's not clear from the RFC whether recipNonce MUST be set or not */
+	metrics_msg_end(ctx, 1);
 
 	CMP_PKIMESSAGE_free(certConf);
 	CMP_PKIMESSAGE_free(PKIconf);
@@ -308,8 +562,8 @@ err:
  * internal function
  *
  * saves error information from PKIStatus field of a certrepmessage into the ctx
- * TODO: in case we would get multiple certreps, this function would need to be 
- *       extended to save the status from each one
+ * The status of the other responses, if several certificates were requested,
+ * is stored with the requests by CMP_CERTREPMESSAGE_get_certificate()
  * ############################################################################ */
 static void save_certrep_statusInfo(CMP_CTX *ctx, CMP_CERTREPMESSAGE *certrep)
 	{
@@ -337,13 +591,46 @@ static void save_certrep_statusInfo(CMP_CTX *ctx, CMP_CERTREPMESSAGE *certrep)
 		}
 	}
 
+/* ############################################################################ *
+ * internal function
+ *
+ * if several certificates were to be revoked, moves the PKIStatusInfo of
+ * every RevDetails from the rp into ctx->revStatus, where they can be read
+ * with CMP_CTX_revStatus_get()
+ * ############################################################################ */
+static void save_rev_status(CMP_CTX *ctx, CMP_REVREPCONTENT *rp)
+	{
+	int i, accepted = 0;
+
+	if (CMP_CTX_revDetails_num(ctx) == 0) return;
+
+	if (ctx->revStatus) sk_CMP_PKISTATUSINFO_pop_free(ctx->revStatus, CMP_PKISTATUSINFO_free);
+	ctx->revStatus = rp->status;
+	rp->status = NULL;
+
+	for (i = 0; i < sk_CMP_PKISTATUSINFO_num(ctx->revStatus); i++)
+		switch (CMP_CTX_revStatus_get(ctx, i))
+			{
+			case CMP_PKISTATUS_accepted:
+			case CMP_PKISTATUS_grantedWithMods:
+			case CMP_PKISTATUS_revocationWarning:
+			case CMP_PKISTATUS_revocationNotification:
+				accepted++;
+			}
+	CMP_printf(ctx, "INFO: %d of %d revocations accepted", accepted, CMP_CTX_revDetails_num(ctx));
+	if (sk_CMP_PKISTATUSINFO_num(ctx->revStatus) != CMP_CTX_revDetails_num(ctx))
+		CMP_printf(ctx, "WARNING: received %d PKIStatusInfos for %d RevDetails",
+				sk_CMP_PKISTATUSINFO_num(ctx->revStatus), CMP_CTX_revDetails_num(ctx));
+	}
+
 /* ############################################################################ *
  * do the full sequence for IR, including IR, IP, certConf, PKIconf and
  * potential polling
  *
  * All options need to be set in the context.
  *
- * TODO: another function to request two certificates at once should be created
+ * Several certificates can be requested at once with CMP_CTX_certReq_push1(),
+ * the first one granted is returned.
  *
  * returns pointer to received certificate, NULL if none was received
  * ############################################################################ */
@@ -353,7 +640,7 @@ X509 *CMP_doInitialRequestSeq( CMP_CTX *ctx)
 	CMP_PKIMESSAGE *ip=NULL;
 
 	/* check if all necessary options are set */
-	if (!ctx || !ctx->newPkey ||
+	if (!ctx || (!ctx->newPkey && CMP_CTX_certReqs_num(ctx) == 0) ||
 		/* for authentication we need either reference/secret or external 
 		 * identity certificate and private key, the server name/cert might not be
 		 * known here yet especiallaly in case of E.7 */
@@ -364,10 +651,14 @@ X509 *CMP_doInitialRequestSeq( CMP_CTX *ctx)
 		goto err;
 		}
 
+	metrics_txn_begin(ctx);
+
 	/* create Initialization Request - ir */
+	metrics_msg_begin(ctx);
 	if (!(ir = CMP_ir_new(ctx))) goto err;
 
 	CMP_printf(ctx, "INFO: Sending Initialization Request");
+	metrics_msg_sending(ctx, ir);
 	if (! (CMP_PKIMESSAGE_http_perform(ctx, ir, &ip)))
 		{
 		ADD_HTTP_ERROR_INFO(CMP_F_CMP_DOINITIALREQUESTSEQ, CMP_R_IP_NOT_RECEIVED, "ir");
@@ -405,10 +696,10 @@ X509 *CMP_doInitialRequestSeq( CMP_CTX *ctx)
 			}
 		} /* it's not clear from the RFC whether recipNonce MUST be set or not */
 	CMP_CTX_set1_recipNonce(ctx, ip->header->senderNonce); /* store for setting in the next msg */
+	metrics_msg_end(ctx, 1);
 
-	/* make sure the PKIStatus for the *first* CERTrepmessage indicates a certificate was granted */
-	/* TODO handle second CERTrepmessages if two would have sent */
-	if (CMP_CERTREPMESSAGE_PKIStatus_get( ip->body->value.ip, 0) == CMP_PKISTATUS_waiting)
+	/* poll while any of the certificates requested is still being processed */
+	if (certrep_waiting(ip->body->value.ip))
 		if (!pollForResponse(ctx, ip->body->value.ip, &ip))
 			{
 			CMPerr(CMP_F_CMP_DOINITIALREQUESTSEQ, CMP_R_IP_NOT_RECEIVED);
@@ -438,11 +729,13 @@ X509 *CMP_doInitialRequestSeq( CMP_CTX *ctx)
 	if (!CMP_PKIMESSAGE_check_implicitConfirm(ip)) 
 		if (!sendCertConf(ctx)) goto err;
 
+	metrics_txn_end(ctx, 1);
 	CMP_PKIMESSAGE_free(ir);
 	CMP_PKIMESSAGE_free(ip);
 	return ctx->newClCert;
 
 err:
+	metrics_txn_end(ctx, 0);
 	if (ir) CMP_PKIMESSAGE_free(ir);
 	if (ip) CMP_PKIMESSAGE_free(ip);
 
@@ -457,10 +750,10 @@ err:
  *
  * All options need to be set in the context.
  *
- * TODO: this function can only revoke one certifcate so far, should be possible
- * for several according to 5.3.9
- * TODO: this actually revokes the current clCertificate - it might be desired
- * to revoke another certificate the EE posesses.
+ * This revokes the current clCertificate, or all certificates added with
+ * CMP_CTX_revCert_push1() and CMP_CTX_revSerial_push1() in a single rr. In
+ * the latter case the return value is that of the first certificate and the
+ * results of all are available through CMP_CTX_revStatus_get().
  *
  * The RFC is vague in which PKIStatus should be returned by the server, so we
  * take "accepted, grantedWithMods, revocationWaring, revocationNotification"
@@ -481,16 +774,22 @@ int CMP_doRevocationRequestSeq( CMP_CTX *ctx)
 	CMP_PKIMESSAGE *rp=NULL;
 	int pkiStatus = 0;
 
-	if (!ctx || !ctx->serverName || !ctx->pkey ||
-		!ctx->clCert || !(ctx->srvCert || ctx->trusted_store))
+	if (!ctx || !ctx->serverName ||
+		!((ctx->pkey && ctx->clCert) ||
+		  (CMP_CTX_revDetails_num(ctx) > 0 && ctx->referenceValue && ctx->secretValue)) ||
+		!(ctx->srvCert || ctx->trusted_store))
 		{
 		CMPerr(CMP_F_CMP_DOREVOCATIONREQUESTSEQ, CMP_R_INVALID_ARGS);
 		goto err;
 		}
 
+	metrics_txn_begin(ctx);
+
+	metrics_msg_begin(ctx);
 	if (! (rr = CMP_rr_new(ctx))) goto err;
 
 	CMP_printf( ctx, "INFO: Sending Revocation Request");
+	metrics_msg_sending(ctx, rr);
 	if (! (CMP_PKIMESSAGE_http_perform(ctx, rr, &rp)))
 		{
 		ADD_HTTP_ERROR_INFO(CMP_F_CMP_DOREVOCATIONREQUESTSEQ, CMP_R_RP_NOT_RECEIVED, "rr");
@@ -527,10 +826,13 @@ int CMP_doRevocationRequestSeq( CMP_CTX *ctx)
 			goto err;
 			}
 		} /* it's not clear from the RFC whether recipNonce MUST be set or not */
+	metrics_msg_end(ctx, 1);
 	
 
 	/* evaluate PKIStatus field */
-	switch (pkiStatus = CMP_REVREPCONTENT_PKIStatus_get( rp->body->value.rp, 0)) 
+	pkiStatus = CMP_REVREPCONTENT_PKIStatus_get( rp->body->value.rp, 0);
+	save_rev_status(ctx, rp->body->value.rp);
+	switch (pkiStatus)
 		{
 		case CMP_PKISTATUS_accepted:
 			CMP_printf( ctx, "INFO: revocation accepted (PKIStatus=accepted)");
@@ -556,10 +858,12 @@ int CMP_doRevocationRequestSeq( CMP_CTX *ctx)
 			goto err;
 		}
 
+	metrics_txn_end(ctx, 1);
 	CMP_PKIMESSAGE_free(rr);
 	CMP_PKIMESSAGE_free(rp);
 	return (pkiStatus+1);
 err:
+	metrics_txn_end(ctx, 0);
 	if (ctx&&ctx->error_cb) ERR_print_errors_cb(CMP_CTX_error_callback, (void*) ctx);
 	if (rr) CMP_PKIMESSAGE_free(rr);
 	if (rp) CMP_PKIMESSAGE_free(rp);
@@ -573,7 +877,8 @@ err:
  *
  * All options need to be set in the context.
  *
- * TODO: another function to request two certificates at once should be created
+ * Several certificates can be requested at once with CMP_CTX_certReq_push1(),
+ * the first one granted is returned.
  *
  * returns pointer to received certificate, NULL if non was received
  * ############################################################################ */
@@ -592,10 +897,14 @@ X509 *CMP_doCertificateRequestSeq( CMP_CTX *ctx)
 		goto err;
 		}
 
+	metrics_txn_begin(ctx);
+
 	/* create Certificate Request - cr */
+	metrics_msg_begin(ctx);
 	if (! (cr = CMP_cr_new(ctx))) goto err;
 
 	CMP_printf( ctx, "INFO: Sending Certificate Request");
+	metrics_msg_sending(ctx, cr);
 	if (! (CMP_PKIMESSAGE_http_perform(ctx, cr, &cp)))
 		{
 		ADD_HTTP_ERROR_INFO(CMP_F_CMP_DOCERTIFICATEREQUESTSEQ, CMP_R_CP_NOT_RECEIVED, "cr");
@@ -633,9 +942,10 @@ X509 *CMP_doCertificateRequestSeq( CMP_CTX *ctx)
 			}
 		} /* it's not clear from the RFC whether recipNonce MUST be set or not */
 	CMP_CTX_set1_recipNonce(ctx, cp->header->senderNonce); /* store for setting in the next msg */
+	metrics_msg_end(ctx, 1);
 
 	/* evaluate PKIStatus field */
-	if (CMP_CERTREPMESSAGE_PKIStatus_get( cp->body->value.cp, 0) == CMP_PKISTATUS_waiting)
+	if (certrep_waiting(cp->body->value.cp))
 		if (!pollForResponse(ctx, cp->body->value.cp, &cp))
 			{
 			CMPerr(CMP_F_CMP_DOCERTIFICATEREQUESTSEQ, CMP_R_CP_NOT_RECEIVED);
@@ -653,11 +963,13 @@ X509 *CMP_doCertificateRequestSeq( CMP_CTX *ctx)
 	if (!CMP_PKIMESSAGE_check_implicitConfirm(cp)) 
 		if (!sendCertConf(ctx)) goto err;
 
+	metrics_txn_end(ctx, 1);
 	CMP_PKIMESSAGE_free(cr);
 	CMP_PKIMESSAGE_free(cp);
 	return ctx->newClCert;
 
 err:
+	metrics_txn_end(ctx, 0);
 	if (cr) CMP_PKIMESSAGE_free(cr);
 	if (cp) CMP_PKIMESSAGE_free(cp);
 
@@ -679,7 +991,8 @@ err:
  * subject public key (although the latter practice may not be
  * appropriate for some environments).
  *
- * TODO: another function to request two certificates at once should be created
+ * Several certificates can be requested at once with CMP_CTX_certReq_push1(),
+ * the first one granted is returned.
  *
  * returns pointer to received certificate, NULL if non was received
  * ############################################################################ */
@@ -689,7 +1002,7 @@ X509 *CMP_doKeyUpdateRequestSeq( CMP_CTX *ctx)
 	CMP_PKIMESSAGE *kup=NULL;
 
 	/* check if all necessary options are set */
-	if (!ctx ||  !ctx->newPkey ||
+	if (!ctx || (!ctx->newPkey && CMP_CTX_certReqs_num(ctx) == 0) ||
 			(!(ctx->referenceValue && ctx->secretValue) && /* MSG_MAC_ALG */
 			!(ctx->pkey && ctx->clCert && (ctx->srvCert || ctx->trusted_store)))) /* MSG_SIG_ALG */
 		{
@@ -697,10 +1010,14 @@ X509 *CMP_doKeyUpdateRequestSeq( CMP_CTX *ctx)
 		goto err;
 		}
 
+	metrics_txn_begin(ctx);
+
 	/* create Key Update Request - kur */
+	metrics_msg_begin(ctx);
 	if (! (kur = CMP_kur_new(ctx))) goto err;
 
 	CMP_printf( ctx, "INFO: Sending Key Update Request");
+	metrics_msg_sending(ctx, kur);
 	if (! (CMP_PKIMESSAGE_http_perform(ctx, kur, &kup)))
 		{
 		ADD_HTTP_ERROR_INFO(CMP_F_CMP_DOKEYUPDATEREQUESTSEQ, CMP_R_KUP_NOT_RECEIVED, "kur");
@@ -738,9 +1055,10 @@ X509 *CMP_doKeyUpdateRequestSeq( CMP_CTX *ctx)
 			}
 		} /* it's not clear from the RFC whether recipNonce MUST be set or not */
 	CMP_CTX_set1_recipNonce(ctx, kup->header->senderNonce); /* store for setting in the next msg */
+	metrics_msg_end(ctx, 1);
 
 	/* evaluate PKIStatus field */
-	if (CMP_CERTREPMESSAGE_PKIStatus_get( kup->body->value.kup, 0) == CMP_PKISTATUS_waiting)
+	if (certrep_waiting(kup->body->value.kup))
 		{
 		if (!pollForResponse(ctx, kup->body->value.kup, &kup)) {
 			CMPerr(CMP_F_CMP_DOKEYUPDATEREQUESTSEQ, CMP_R_KUP_NOT_RECEIVED);
@@ -763,11 +1081,13 @@ X509 *CMP_doKeyUpdateRequestSeq( CMP_CTX *ctx)
 	if (!CMP_PKIMESSAGE_check_implicitConfirm(kup)) 
 		if (!sendCertConf(ctx)) goto err;
 
+	metrics_txn_end(ctx, 1);
 	CMP_PKIMESSAGE_free(kur);
 	CMP_PKIMESSAGE_free(kup);
 	return ctx->newClCert;
 
 err:
+	metrics_txn_end(ctx, 0);
 	if (kur) CMP_PKIMESSAGE_free(kur);
 	if (kup) CMP_PKIMESSAGE_free(kup);
 
@@ -791,7 +1111,6 @@ STACK_OF(CMP_INFOTYPEANDVALUE) *CMP_doGeneralMessageSeq( CMP_CTX *ctx, int nid,
 	{
 	CMP_PKIMESSAGE *genm=NULL;
 	CMP_PKIMESSAGE *genp=NULL;
-	CMP_INFOTYPEANDVALUE *itav=NULL;
 	STACK_OF(CMP_INFOTYPEANDVALUE) *rcvdItavs=NULL;
 
 	/* check if all necessary options are set */
@@ -802,16 +1121,15 @@ STACK_OF(CMP_INFOTYPEANDVALUE) *CMP_doGeneralMessageSeq( CMP_CTX *ctx, int nid,
 		goto err;
 		}
 
-	/* crate GenMsgContent - genm*/
-	if (! (genm = CMP_genm_new(ctx))) goto err;
+	metrics_txn_begin(ctx);
 
-	/* set itav - TODO: let this function take a STACK of ITAV as arguments */
-	itav = CMP_INFOTYPEANDVALUE_new();
-	itav->infoType = OBJ_nid2obj(nid);
-	itav->infoValue.ptr = value;
-	CMP_PKIMESSAGE_genm_item_push0( genm, itav);
+	/* crate GenMsgContent - genm*/
+	metrics_msg_begin(ctx);
+	/* TODO: let this function take a STACK of ITAV as arguments */
+	if (! (genm = CMP_genm_new(ctx, nid, value))) goto err;
 
 	CMP_printf( ctx, "INFO: Sending General Message");
+	metrics_msg_sending(ctx, genm);
 	if (! (CMP_PKIMESSAGE_http_perform(ctx, genm, &genp)))
 		{
 		ADD_HTTP_ERROR_INFO(CMP_F_CMP_DOGENERALMESSAGESEQ, CMP_R_GENP_NOT_RECEIVED, "genm");
@@ -845,17 +1163,20 @@ STACK_OF(CMP_INFOTYPEANDVALUE) *CMP_doGeneralMessageSeq( CMP_CTX *ctx, int nid,
 			goto err;
 			}
 		} /* it's not clear from the RFC whether recipNonce MUST be set or not */
+	metrics_msg_end(ctx, 1);
 	
 	/* the received stack of itavs shouldn't be freed with the message */
 	rcvdItavs = genp->body->value.genp;
 	genp->body->value.genp = NULL;
 
+	metrics_txn_end(ctx, 1);
 	CMP_PKIMESSAGE_free(genm);
 	CMP_PKIMESSAGE_free(genp);
 
 	return rcvdItavs;
 
 err:
+	metrics_txn_end(ctx, 0);
 	if (genm) CMP_PKIMESSAGE_free(genm);
 	if (genp) CMP_PKIMESSAGE_free(genp);
 
@@ -864,3 +1185,754 @@ err:
 	return NULL;
 	}
 
+
+#ifndef HAVE_CURL
+/* ############################################################################ *
+ * Non-blocking transactions
+ *
+ * A CMP_SESSION runs one IR, CR, KUR, RR or GENM transaction, including
+ * polling and certConf, as a state machine on top of CMP_HTTP_REQ. Instead
+ * of waiting, CMP_SESSION_step() returns CMP_SESSION_WANT_READ or
+ * CMP_SESSION_WANT_WRITE together with the fd from CMP_SESSION_get_fd(), or
+ * CMP_SESSION_WANT_TIMER while waiting for the time to send the next pollReq.
+ * It has to be called again when the fd is ready or when the time returned
+ * by CMP_SESSION_get_deadline() is reached, whichever comes first. This way
+ * many transactions, each with its own CMP_CTX, can be driven from a single
+ * event loop.
+ * ############################################################################ */
+
+/* session states */
+#define SES_START		0
+#define SES_XFER		1
+#define SES_POLL_WAIT	2
+#define SES_DONE		3
+#define SES_ERROR		4
+
+struct cmp_session_st
+	{
+	CMP_CTX *ctx;
+	/* body type of the request starting the transaction */
+	int type;
+	int state;
+	/* last message sent, and its transfer while in progress */
+	CMP_PKIMESSAGE *req;
+	CMP_HTTP_REQ *http;
+	/* end of the transfer (if HttpTimeOut is set) or time to send the next
+	 * pollReq, 0 if there is none */
+	time_t deadline;
+	/* when polling gives up, 0 if maxPollTime is not set */
+	time_t pollEnd;
+	/* certReqIds to poll for, and the responses granted so far */
+	long *pollIds;
+	int numPollIds;
+	STACK_OF(CMP_CERTRESPONSE) *granted;
+	/* scheduler holding the session while it waits, and its heap index */
+	CMP_POLL_SCHED *sched;
+	int schedIdx;
+	/* GENM: the ITAV to send and the ones received */
+	int genmNid;
+	char *genmValue;
+	STACK_OF(CMP_INFOTYPEANDVALUE) *genpItavs;
+	/* RR: the PKIStatus received */
+	int pkiStatus;
+	};
+
+/* ############################################################################ *
+ * Creates a new transaction of the given type (V_CMP_PKIBODY_IR, _CR, _KUR,
+ * _RR or _GENM) using the settings in ctx. The transaction only starts with
+ * the first call of CMP_SESSION_step(). ctx must not be used for anything
+ * else until the session is freed.
+ * returns pointer to the session on success, NULL on error
+ * ############################################################################ */
+CMP_SESSION *CMP_SESSION_new(CMP_CTX *ctx, int type)
+	{
+	CMP_SESSION *ses = NULL;
+
+	if (!ctx)
+		{
+		CMPerr(CMP_F_CMP_SESSION_NEW, CMP_R_NULL_ARGUMENT);
+		goto err;
+		}
+
+	switch (type)
+		{
+		case V_CMP_PKIBODY_IR:
+		case V_CMP_PKIBODY_CR:
+		case V_CMP_PKIBODY_KUR:
+		case V_CMP_PKIBODY_RR:
+		case V_CMP_PKIBODY_GENM:
+			break;
+		default:
+			CMPerr(CMP_F_CMP_SESSION_NEW, CMP_R_INVALID_ARGS);
+			goto err;
+		}
+
+	if (!(ses = OPENSSL_malloc(sizeof(CMP_SESSION))))
+		{
+		CMPerr(CMP_F_CMP_SESSION_NEW, ERR_R_MALLOC_FAILURE);
+		goto err;
+		}
+	memset(ses, 0, sizeof(CMP_SESSION));
+	ses->ctx = ctx;
+	ses->type = type;
+	ses->state = SES_START;
+	ses->pkiStatus = -1;
+	ses->schedIdx = -1;
+
+	return ses;
+err:
+	return NULL;
+	}
+
+/* ############################################################################ *
+ * internal function
+ *
+ * frees an ITAV value that has not been put into a genm yet
+ * ############################################################################ */
+static void ses_free_genm_value(CMP_SESSION *ses)
+	{
+	CMP_INFOTYPEANDVALUE *itav = NULL;
+
+	if (!ses->genmValue) return;
+	/* let the ASN.1 template free the value according to its type */
+	if ((itav = CMP_INFOTYPEANDVALUE_new()))
+		{
+		itav->infoType = OBJ_nid2obj(ses->genmNid);
+		itav->infoValue.ptr = ses->genmValue;
+		CMP_INFOTYPEANDVALUE_free(itav);
+		}
+	ses->genmValue = NULL;
+	}
+
+/* ############################################################################ *
+ * Frees the session. A transfer still in progress is aborted.
+ * ############################################################################ */
+void CMP_SESSION_free(CMP_SESSION *ses)
+	{
+	if (!ses) return;
+	if (ses->sched) CMP_POLL_SCHED_remove(ses->sched, ses);
+	if (ses->http) CMP_HTTP_REQ_free(ses->http);
+	if (ses->pollIds) OPENSSL_free(ses->pollIds);
+	if (ses->granted) sk_CMP_CERTRESPONSE_pop_free(ses->granted, CMP_CERTRESPONSE_free);
+	if (ses->req) CMP_PKIMESSAGE_free(ses->req);
+	ses_free_genm_value(ses);
+	if (ses->genpItavs) sk_CMP_INFOTYPEANDVALUE_pop_free(ses->genpItavs, CMP_INFOTYPEANDVALUE_free);
+	OPENSSL_free(ses);
+	}
+
+/* ############################################################################ *
+ * Sets the ITAV to send in a GENM transaction, see CMP_doGeneralMessageSeq()
+ * The genm is built and protected together with the ITAV in the first
+ * CMP_SESSION_step(). value belongs to the session and is freed with it.
+ * returns 1 on success, 0 on error
+ * ############################################################################ */
+int CMP_SESSION_set_genm_itav(CMP_SESSION *ses, int nid, char *value)
+	{
+	if (!ses || ses->type != V_CMP_PKIBODY_GENM || ses->state != SES_START) return 0;
+	ses_free_genm_value(ses);
+	ses->genmNid = nid;
+	ses->genmValue = value;
+	return 1;
+	}
+
+/* ############################################################################ *
+ * returns the fd to wait on while the session wants to read or write,
+ * -1 otherwise
+ * ############################################################################ */
+int CMP_SESSION_get_fd(const CMP_SESSION *ses)
+	{
+	if (!ses || ses->state != SES_XFER) return -1;
+	return CMP_HTTP_REQ_get_fd(ses->http);
+	}
+
+/* ############################################################################ *
+ * returns the time at which CMP_SESSION_step() has to be called even if the
+ * fd did not become ready, 0 if there is no such time
+ * ############################################################################ */
+time_t CMP_SESSION_get_deadline(const CMP_SESSION *ses)
+	{
+	if (!ses) return 0;
+	return ses->deadline;
+	}
+
+/* ############################################################################ *
+ * returns the PKIStatus received in the RP of a finished RR transaction,
+ * -1 if there is none
+ * ############################################################################ */
+int CMP_SESSION_get_status(const CMP_SESSION *ses)
+	{
+	if (!ses) return -1;
+	return ses->pkiStatus;
+	}
+
+/* ############################################################################ *
+ * returns the ITAVs received in the GENP of a finished GENM transaction,
+ * they are freed together with the session
+ * ############################################################################ */
+STACK_OF(CMP_INFOTYPEANDVALUE) *CMP_SESSION_get0_genpItavs(const CMP_SESSION *ses)
+	{
+	if (!ses) return NULL;
+	return ses->genpItavs;
+	}
+
+/* ############################################################################ *
+ * internal function
+ *
+ * Starts the transfer of msg, taking ownership of it.
+ * returns 1 on success, 0 on error
+ * ############################################################################ */
+static int ses_send(CMP_SESSION *ses, CMP_PKIMESSAGE *msg)
+	{
+	if (ses->req) CMP_PKIMESSAGE_free(ses->req);
+	ses->req = msg;
+	if (!msg) return 0;
+	metrics_msg_sending(ses->ctx, msg);
+
+	if (!(ses->http = CMP_HTTP_REQ_new(ses->ctx, msg))) return 0;
+
+	ses->deadline = ses->ctx->HttpTimeOut > 0 ? time(NULL) + ses->ctx->HttpTimeOut : 0;
+	ses->state = SES_XFER;
+	return 1;
+	}
+
+/* ############################################################################ *
+ * internal function
+ *
+ * returns the reason code for not getting an answer to the given request
+ * ############################################################################ */
+static int ses_no_response_reason(int type)
+	{
+	switch (type)
+		{
+		case V_CMP_PKIBODY_IR:		 return CMP_R_IP_NOT_RECEIVED;
+		case V_CMP_PKIBODY_CR:		 return CMP_R_CP_NOT_RECEIVED;
+		case V_CMP_PKIBODY_KUR:		 return CMP_R_KUP_NOT_RECEIVED;
+		case V_CMP_PKIBODY_RR:		 return CMP_R_RP_NOT_RECEIVED;
+		case V_CMP_PKIBODY_GENM:	 return CMP_R_GENP_NOT_RECEIVED;
+		case V_CMP_PKIBODY_POLLREQ:	 return CMP_R_POLLREP_NOT_RECEIVED;
+		default:					 return CMP_R_PKICONF_NOT_RECEIVED;
+		}
+	}
+
+/* ############################################################################ *
+ * internal function
+ *
+ * Checks that rep is of the expected type, validates its protection and
+ * compares the nonces with the message sent last.
+ * returns 1 on success, 0 on error
+ * ############################################################################ */
+static int ses_check_response(CMP_SESSION *ses, CMP_PKIMESSAGE *rep, int expected)
+	{
+	CMP_CTX *ctx = ses->ctx;
+
+	if (CMP_PKIMESSAGE_get_bodytype(rep) != expected)
+		{
+		char errmsg[256];
+		CMPerr(CMP_F_CMP_SESSION_STEP, CMP_R_PKIBODY_ERROR);
+		ERR_add_error_data(1, PKIError_data(rep, errmsg, sizeof(errmsg)));
+		return 0;
+		}
+
+	if (expected == V_CMP_PKIBODY_IP || expected == V_CMP_PKIBODY_CP
+		|| expected == V_CMP_PKIBODY_KUP)
+		save_certrep_statusInfo(ctx, rep->body->value.ip);
+
+	/* validate message protection */
+	if (!CMP_validate_msg(ctx, rep))
+		{
+		CMPerr(CMP_F_CMP_SESSION_STEP, CMP_R_ERROR_VALIDATING_PROTECTION);
+		return 0;
+		}
+	CMP_printf(ctx, "SUCCESS: validating protection of incoming message");
+
+	/* compare received nonce with the one we sent */
+	if (rep->header->recipNonce &&
+		ASN1_OCTET_STRING_cmp(ses->req->header->senderNonce, rep->header->recipNonce))
+		{
+		CMPerr(CMP_F_CMP_SESSION_STEP, CMP_R_ERROR_NONCES_DO_NOT_MATCH);
+		return 0;
+		}
+	CMP_CTX_set1_recipNonce(ctx, rep->header->senderNonce); /* store for setting in the next msg */
+	metrics_msg_end(ctx, 1);
+
+	return 1;
+	}
+
+/* ############################################################################ *
+ * internal function
+ *
+ * Processes an already checked IP, CP or KUP: either starts or continues polling
+ * for the certReqIds still waiting, or takes the certificates and sends
+ * certConf if needed.
+ * returns 1 on success, 0 on error
+ * ############################################################################ */
+static int ses_handle_certrep(CMP_SESSION *ses, CMP_PKIMESSAGE *rep)
+	{
+	CMP_CTX *ctx = ses->ctx;
+	CMP_CERTREPMESSAGE *certrep = rep->body->value.ip;
+	int waiting;
+
+	if (ses->pollIds)
+		{
+		/* answer to a pollReq: keep what was granted, poll on for the rest */
+		waiting = ses->numPollIds;
+		if (!certrep_keep_granted(certrep, ses->granted, ses->pollIds, &ses->numPollIds)) return 0;
+		if (ses->numPollIds == waiting)
+			{
+			CMPerr(CMP_F_CMP_SESSION_STEP, ses_no_response_reason(ses->type));
+			ERR_add_error_data(1, "received 'waiting' pkistatus but polling failed");
+			return 0;
+			}
+		}
+	else if ((ses->numPollIds = certrep_waiting_ids(certrep, &ses->pollIds)) < 0)
+		return 0;
+	else if (ses->numPollIds > 0)
+		{
+		if (!(ses->granted = sk_CMP_CERTRESPONSE_new_null())) return 0;
+		if (!certrep_keep_granted(certrep, ses->granted, NULL, NULL)) return 0;
+		}
+
+	if (ses->numPollIds > 0)
+		{
+		CMP_printf(ctx, "INFO: Received 'waiting' PKIStatus, attempting to poll server for response.");
+		if (ctx->maxPollTime != 0 && !ses->pollEnd)
+			ses->pollEnd = time(NULL) + ctx->maxPollTime;
+		/* immediately send the first pollReq */
+		ses->deadline = time(NULL);
+		ses->state = SES_POLL_WAIT;
+		return 1;
+		}
+
+	if (ses->granted)
+		{
+		certrep_set0_granted(certrep, ses->granted);
+		ses->granted = NULL;
+		}
+
+	if (!(ctx->newClCert = CMP_CERTREPMESSAGE_get_certificate(ctx, certrep))) return 0;
+
+	if (certrep->caPubs)
+		CMP_CTX_set1_caPubs(ctx, certrep->caPubs);
+
+	/* copy any received extraCerts to ctx->extraCertsIn so they can be retrieved */
+	if (rep->extraCerts)
+		CMP_CTX_set1_extraCertsIn(ctx, rep->extraCerts);
+
+	/* check if implicit confirm is set in generalInfo and send certConf if not */
+	if (!CMP_PKIMESSAGE_check_implicitConfirm(rep))
+		{
+		CMP_printf(ctx, "INFO: Sending Certificate Confirm");
+		metrics_msg_begin(ctx);
+		return ses_send(ses, CMP_certConf_new(ctx));
+		}
+
+	ses->state = SES_DONE;
+	return 1;
+	}
+
+/* ############################################################################ *
+ * internal function
+ *
+ * Processes the response to the message sent last, taking ownership of it.
+ * returns 1 on success, 0 on error
+ * ############################################################################ */
+static int ses_handle_response(CMP_SESSION *ses, CMP_PKIMESSAGE *rep)
+	{
+	CMP_CTX *ctx = ses->ctx;
+	int sent = CMP_PKIMESSAGE_get_bodytype(ses->req);
+
+	switch (sent)
+		{
+		case V_CMP_PKIBODY_POLLREQ:
+			if (CMP_PKIMESSAGE_get_bodytype(rep) == V_CMP_PKIBODY_POLLREP)
+				{
+				long checkAfter;
+				time_t now = time(NULL);
+
+				if (!ses_check_response(ses, rep, V_CMP_PKIBODY_POLLREP)) goto err;
+				if ((checkAfter = pollrep_checkAfter(ctx, rep->body->value.pollRep)) < 0) goto err;
+				CMP_printf(ctx, "INFO: waiting checkAfter = %ld seconds before sending another polling request...", checkAfter);
+
+				if (ses->pollEnd && now >= ses->pollEnd)
+					{
+					CMPerr(CMP_F_CMP_SESSION_STEP, ses_no_response_reason(ses->type));
+					ERR_add_error_data(1, "received 'waiting' pkistatus but polling failed");
+					goto err;
+					}
+				ses->deadline = now + checkAfter;
+				/* poll a last time just when the set timeout will be reached */
+				if (ses->pollEnd && ses->deadline > ses->pollEnd)
+					ses->deadline = ses->pollEnd;
+				ses->state = SES_POLL_WAIT;
+				break;
+				}
+			/* the final response has arrived */
+			/* fall through */
+		case V_CMP_PKIBODY_IR:
+		case V_CMP_PKIBODY_CR:
+		case V_CMP_PKIBODY_KUR:
+			/* the response types are the request types + 1 */
+			if (!ses_check_response(ses, rep, ses->type + 1)) goto err;
+			if (!ses_handle_certrep(ses, rep)) goto err;
+			break;
+
+		case V_CMP_PKIBODY_CERTCONF:
+			if (!ses_check_response(ses, rep, V_CMP_PKIBODY_PKICONF)) goto err;
+			ses->state = SES_DONE;
+			break;
+
+		case V_CMP_PKIBODY_RR:
+			if (!ses_check_response(ses, rep, V_CMP_PKIBODY_RP)) goto err;
+			ses->pkiStatus = CMP_REVREPCONTENT_PKIStatus_get(rep->body->value.rp, 0);
+			save_rev_status(ctx, rep->body->value.rp);
+			switch (ses->pkiStatus)
+				{
+				case CMP_PKISTATUS_accepted:
+				case CMP_PKISTATUS_grantedWithMods:
+				case CMP_PKISTATUS_revocationWarning:
+				case CMP_PKISTATUS_revocationNotification:
+					CMP_printf(ctx, "INFO: revocation accepted (PKIStatus=%d)", ses->pkiStatus);
+					break;
+				case CMP_PKISTATUS_rejection:
+					CMP_printf(ctx, "INFO: revocation rejected (PKIStatus=rejection)");
+					break;
+				case CMP_PKISTATUS_waiting:
+				case CMP_PKISTATUS_keyUpdateWarning:
+					CMPerr(CMP_F_CMP_SESSION_STEP, CMP_R_UNEXPECTED_PKISTATUS);
+					goto err;
+				default:
+					CMPerr(CMP_F_CMP_SESSION_STEP, CMP_R_UNKNOWN_PKISTATUS);
+					goto err;
+				}
+			ses->state = SES_DONE;
+			break;
+
+		case V_CMP_PKIBODY_GENM:
+			if (!ses_check_response(ses, rep, V_CMP_PKIBODY_GENP)) goto err;
+			/* the received stack of itavs shouldn't be freed with the message */
+			ses->genpItavs = rep->body->value.genp;
+			rep->body->value.genp = NULL;
+			ses->state = SES_DONE;
+			break;
+
+		default:
+			goto err;
+		}
+
+	CMP_PKIMESSAGE_free(rep);
+	return 1;
+err:
+	CMP_PKIMESSAGE_free(rep);
+	return 0;
+	}
+
+/* ############################################################################ *
+ * Advances the transaction as far as possible without blocking.
+ *
+ * returns CMP_SESSION_DONE when the transaction completed successfully; for
+ *             IR, CR and KUR the new certificate is in ctx->newClCert
+ *         CMP_SESSION_WANT_READ or CMP_SESSION_WANT_WRITE when waiting for
+ *             the fd, see CMP_SESSION_get_fd() and CMP_SESSION_get_deadline()
+ *         CMP_SESSION_WANT_TIMER when waiting until CMP_SESSION_get_deadline()
+ *         CMP_SESSION_ERROR on error
+ * ############################################################################ */
+int CMP_SESSION_step(CMP_SESSION *ses)
+	{
+	CMP_CTX *ctx = NULL;
+	CMP_PKIMESSAGE *rep = NULL;
+	int rv;
+
+	if (!ses)
+		{
+		CMPerr(CMP_F_CMP_SESSION_STEP, CMP_R_NULL_ARGUMENT);
+		return CMP_SESSION_ERROR;
+		}
+	ctx = ses->ctx;
+
+	for (;;)
+		switch (ses->state)
+			{
+			case SES_START:
+				metrics_txn_begin(ctx);
+				metrics_msg_begin(ctx);
+				switch (ses->type)
+					{
+					case V_CMP_PKIBODY_IR:
+						CMP_printf(ctx, "INFO: Sending Initialization Request");
+						if (!ses_send(ses, CMP_ir_new(ctx))) goto err;
+						break;
+					case V_CMP_PKIBODY_CR:
+						CMP_printf(ctx, "INFO: Sending Certificate Request");
+						if (!ses_send(ses, CMP_cr_new(ctx))) goto err;
+						break;
+					case V_CMP_PKIBODY_KUR:
+						CMP_printf(ctx, "INFO: Sending Key Update Request");
+						if (!ses_send(ses, CMP_kur_new(ctx))) goto err;
+						break;
+					case V_CMP_PKIBODY_RR:
+						CMP_printf(ctx, "INFO: Sending Revocation Request");
+						if (!ses_send(ses, CMP_rr_new(ctx))) goto err;
+						break;
+					case V_CMP_PKIBODY_GENM:
+						{
+						CMP_PKIMESSAGE *genm = CMP_genm_new(ctx, ses->genmNid, ses->genmValue);
+						if (!genm) goto err;
+						ses->genmValue = NULL; /* now owned by genm */
+						CMP_printf(ctx, "INFO: Sending General Message");
+						if (!ses_send(ses, genm)) goto err;
+						}
+						break;
+					}
+				break;
+
+			case SES_XFER:
+				rv = CMP_HTTP_REQ_perform(ses->http, &rep);
+				if (rv < 0)
+					{
+					if (ses->deadline && time(NULL) >= ses->deadline)
+						{
+						CMPerr(CMP_F_CMP_SESSION_STEP, CMP_R_SERVER_NOT_REACHABLE);
+						goto err_send;
+						}
+					return rv == CMP_HTTP_REQ_WANT_READ ? CMP_SESSION_WANT_READ : CMP_SESSION_WANT_WRITE;
+					}
+
+				CMP_HTTP_REQ_free(ses->http);
+				ses->http = NULL;
+				ses->deadline = 0;
+
+				if (!rv) goto err_send;
+				if (!ses_handle_response(ses, rep)) goto err;
+				break;
+
+			case SES_POLL_WAIT:
+				if (time(NULL) < ses->deadline)
+					return CMP_SESSION_WANT_TIMER;
+				if (ses->sched) CMP_POLL_SCHED_remove(ses->sched, ses);
+				CMP_printf(ctx, "INFO: Sending polling request...");
+				metrics_msg_begin(ctx);
+				if (!ses_send(ses, CMP_pollReqs_new(ctx, ses->pollIds, ses->numPollIds))) goto err;
+				break;
+
+			case SES_DONE:
+				/* reports the transaction only the first time */
+				metrics_txn_end(ctx, 1);
+				return CMP_SESSION_DONE;
+
+			default:
+				return CMP_SESSION_ERROR;
+			}
+
+err_send:
+	{
+	char msgtype[64];
+	BIO_snprintf(msgtype, sizeof(msgtype), "unable to send %s",
+			MSG_TYPE_STR(CMP_PKIMESSAGE_get_bodytype(ses->req)));
+	CMPerr(CMP_F_CMP_SESSION_STEP, ses_no_response_reason(CMP_PKIMESSAGE_get_bodytype(ses->req)));
+	ERR_add_error_data(1, msgtype);
+	}
+err:
+	metrics_txn_end(ctx, 0);
+	ses->state = SES_ERROR;
+	ses->deadline = 0;
+	if (ses->http)
+		{
+		CMP_HTTP_REQ_free(ses->http);
+		ses->http = NULL;
+		}
+
+	/* print out openssl and cmp errors to error_cb if it's set */
+	if (ctx->error_cb) ERR_print_errors_cb(CMP_CTX_error_callback, (void*) ctx);
+	return CMP_SESSION_ERROR;
+	}
+
+/* ############################################################################ *
+ * Polling scheduler
+ *
+ * A CMP_POLL_SCHED keeps sessions which returned CMP_SESSION_WANT_TIMER in a
+ * binary min-heap ordered by CMP_SESSION_get_deadline(), i.e. by the
+ * checkAfter of their last pollRep, cut short by maxPollTime. An event loop
+ * uses CMP_POLL_SCHED_next() to bound its wait for I/O on other sessions and
+ * then steps every session returned by CMP_POLL_SCHED_pop_due(). Many
+ * transactions waiting on a slow CA or RA can so be multiplexed in a single
+ * thread. The scheduler does not own the sessions; a session removes itself
+ * when it is freed.
+ * ############################################################################ */
+
+struct cmp_poll_sched_st
+	{
+	CMP_SESSION **heap;
+	int num;
+	int size;
+	};
+
+/* ############################################################################ *
+ * returns pointer to a new, empty scheduler on success, NULL on error
+ * ############################################################################ */
+CMP_POLL_SCHED *CMP_POLL_SCHED_new(void)
+	{
+	CMP_POLL_SCHED *sched = NULL;
+
+	if (!(sched = OPENSSL_malloc(sizeof(CMP_POLL_SCHED))))
+		{
+		CMPerr(CMP_F_CMP_POLL_SCHED_NEW, ERR_R_MALLOC_FAILURE);
+		return NULL;
+		}
+	memset(sched, 0, sizeof(CMP_POLL_SCHED));
+	return sched;
+	}
+
+/* ############################################################################ *
+ * Frees the scheduler, the sessions still in it are only detached
+ * ############################################################################ */
+void CMP_POLL_SCHED_free(CMP_POLL_SCHED *sched)
+	{
+	int i;
+
+	if (!sched) return;
+	for (i = 0; i < sched->num; i++)
+		{
+		sched->heap[i]->sched = NULL;
+		sched->heap[i]->schedIdx = -1;
+		}
+	if (sched->heap) OPENSSL_free(sched->heap);
+	OPENSSL_free(sched);
+	}
+
+/* ############################################################################ *
+ * internal functions maintaining the heap order
+ * ############################################################################ */
+static void sched_set(CMP_POLL_SCHED *sched, int i, CMP_SESSION *ses)
+	{
+	sched->heap[i] = ses;
+	ses->schedIdx = i;
+	}
+
+static void sched_up(CMP_POLL_SCHED *sched, int i)
+	{
+	CMP_SESSION *ses = sched->heap[i];
+	int parent;
+
+	while (i > 0)
+		{
+		parent = (i - 1) / 2;
+		if (sched->heap[parent]->deadline <= ses->deadline) break;
+		sched_set(sched, i, sched->heap[parent]);
+		i = parent;
+		}
+	sched_set(sched, i, ses);
+	}
+
+static void sched_down(CMP_POLL_SCHED *sched, int i)
+	{
+	CMP_SESSION *ses = sched->heap[i];
+	int child;
+
+	while ((child = 2 * i + 1) < sched->num)
+		{
+		if (child + 1 < sched->num
+			&& sched->heap[child + 1]->deadline < sched->heap[child]->deadline)
+			child++;
+		if (ses->deadline <= sched->heap[child]->deadline) break;
+		sched_set(sched, i, sched->heap[child]);
+		i = child;
+		}
+	sched_set(sched, i, ses);
+	}
+
+/* ############################################################################ *
+ * Adds a session waiting to poll, or moves it to its new deadline if it is
+ * already in the scheduler. A session can be in one scheduler only.
+ * returns 1 on success, 0 on error
+ * ############################################################################ */
+int CMP_POLL_SCHED_add(CMP_POLL_SCHED *sched, CMP_SESSION *ses)
+	{
+	if (!sched || !ses || ses->state != SES_POLL_WAIT
+		|| (ses->sched && ses->sched != sched))
+		{
+		CMPerr(CMP_F_CMP_POLL_SCHED_ADD, CMP_R_INVALID_ARGS);
+		return 0;
+		}
+
+	if (ses->sched)
+		{
+		sched_up(sched, ses->schedIdx);
+		sched_down(sched, ses->schedIdx);
+		return 1;
+		}
+
+	if (sched->num == sched->size)
+		{
+		int size = sched->size ? 2 * sched->size : 16;
+		CMP_SESSION **heap = OPENSSL_realloc(sched->heap, size * sizeof(CMP_SESSION *));
+		if (!heap)
+			{
+			CMPerr(CMP_F_CMP_POLL_SCHED_ADD, ERR_R_MALLOC_FAILURE);
+			return 0;
+			}
+		sched->heap = heap;
+		sched->size = size;
+		}
+
+	ses->sched = sched;
+	sched_set(sched, sched->num++, ses);
+	sched_up(sched, ses->schedIdx);
+	return 1;
+	}
+
+/* ############################################################################ *
+ * Removes the session from the scheduler if it is in it
+ * ############################################################################ */
+void CMP_POLL_SCHED_remove(CMP_POLL_SCHED *sched, CMP_SESSION *ses)
+	{
+	int i;
+
+	if (!sched || !ses || ses->sched != sched) return;
+
+	i = ses->schedIdx;
+	ses->sched = NULL;
+	ses->schedIdx = -1;
+
+	if (i != --sched->num)
+		{
+		sched_set(sched, i, sched->heap[sched->num]);
+		sched_up(sched, i);
+		sched_down(sched, sched->heap[i]->schedIdx);
+		}
+	}
+
+/* ############################################################################ *
+ * returns the earliest deadline of all sessions in the scheduler, 0 if it is
+ * empty
+ * ############################################################################ */
+time_t CMP_POLL_SCHED_next(const CMP_POLL_SCHED *sched)
+	{
+	if (!sched || !sched->num) return 0;
+	return sched->heap[0]->deadline;
+	}
+
+/* ############################################################################ *
+ * Removes and returns the session with the earliest deadline if that is not
+ * later than now, to be passed to CMP_SESSION_step()
+ * returns NULL if no session is due
+ * ############################################################################ */
+CMP_SESSION *CMP_POLL_SCHED_pop_due(CMP_POLL_SCHED *sched, time_t now)
+	{
+	CMP_SESSION *ses = NULL;
+
+	if (!sched || !sched->num || sched->heap[0]->deadline > now) return NULL;
+
+	ses = sched->heap[0];
+	CMP_POLL_SCHED_remove(sched, ses);
+	return ses;
+	}
+
+/* ############################################################################ *
+ * returns the number of sessions in the scheduler
+ * ############################################################################ */
+int CMP_POLL_SCHED_num(const CMP_POLL_SCHED *sched)
+	{
+	if (!sched) return 0;
+	return sched->num;
+	}
+#endif /* HAVE_CURL */
@@ -71,6 +71,17 @@
 #include <openssl/crmf.h>
 #include <openssl/cmp.h>
 #include <openssl/err.h>
+#include <openssl/sha.h>
+#include <openssl/x509v3.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* number of validated server certificates remembered across CMP_CTXs */
+#define SRVCERT_CACHE_SIZE	32
+/* validated certificates are checked again at least this often (seconds), so
+ * e.g. CRLs added to the trust store are not ignored forever */
+#define SRVCERT_CACHE_TTL	3600
 
 /* ############################################################################ *
  * internal function
@@ -82,12 +93,11 @@
 static int CMP_verify_signature( CMP_PKIMESSAGE *msg, X509 *cert)
 	{
 	EVP_MD_CTX *ctx=NULL;
-	CMP_PROTECTEDPART protPart;
 	int ret=0;
 	EVP_MD *digest=NULL;
 	EVP_PKEY *pubkey=NULL;
 
-	size_t protPartDerLen=0;
+	int protPartDerLen=0;
 	unsigned char *protPartDer=NULL;
 
 	if (!msg || !cert) return 0;
@@ -95,10 +105,12 @@ static int CMP_verify_signature( CMP_PKIMESSAGE *msg, X509 *cert)
 	pubkey = X509_get_pubkey((X509*) cert);
 	if (!pubkey) return 0;
 
-	/* create the DER representation of protected part */
-	protPart.header = msg->header;
-	protPart.body	= msg->body;
-	protPartDerLen	= i2d_CMP_PROTECTEDPART(&protPart, &protPartDer);
+	/* the DER representation of protected part, as received if possible */
+	if ((protPartDerLen = CMP_PKIMESSAGE_get_protectedPart_der(msg, &protPartDer)) <= 0)
+		{
+		EVP_PKEY_free(pubkey);
+		return 0;
+		}
 
 	/* verify prtotection of protected part */
 	ctx = EVP_MD_CTX_create();
@@ -114,6 +126,9 @@ static int CMP_verify_signature( CMP_PKIMESSAGE *msg, X509 *cert)
 	return ret;
 notsup:
 	CMPerr(CMP_F_CMP_VERIFY_SIGNATURE, CMP_R_ALGORITHM_NOT_SUPPORTED);
+	EVP_MD_CTX_destroy(ctx);
+	OPENSSL_free(protPartDer);
+	EVP_PKEY_free(pubkey);
 	return 0;
 	}
 
@@ -138,17 +153,146 @@ err:
 	return 0;
 	}
 
+/* ############################################################################ *
+ * Index of the extraCerts of a message, built once per message and used both
+ * for finding the sender's certificate and for collecting the chain above it.
+ * The certificates are sorted by the hash of their canonical subject name, and
+ * duplicates are left out. The index does not own the certificates.
+ * ############################################################################ */
+typedef struct
+	{
+	unsigned long nameHash;
+	X509 *cert;
+	} CERT_INDEX_ENTRY;
+
+typedef struct
+	{
+	int num;
+	CERT_INDEX_ENTRY *entries;
+	} CERT_INDEX;
+
+static int cert_index_entry_cmp(const void *a, const void *b)
+	{
+	unsigned long ha = ((const CERT_INDEX_ENTRY *)a)->nameHash;
+	unsigned long hb = ((const CERT_INDEX_ENTRY *)b)->nameHash;
+
+	return ha < hb ? -1 : ha > hb;
+	}
+
+/* returns 1 on success, 0 on error */
+static int cert_index_init(CERT_INDEX *idx, STACK_OF(X509) *certs)
+	{
+	int i, j;
+
+	idx->num = 0;
+	idx->entries = NULL;
+	if (sk_X509_num(certs) <= 0) return 1;
+
+	if (!(idx->entries = OPENSSL_malloc(sk_X509_num(certs) * sizeof(*idx->entries))))
+		return 0;
+
+	for (i = 0; i < sk_X509_num(certs); i++)
+		{
+		X509 *cert = sk_X509_value(certs, i);
+		if (!cert) continue;
+
+		/* decodes SKID and AKID and sets EXFLAG_SS once per certificate */
+		X509_check_purpose(cert, -1, 0);
+
+		for (j = 0; j < idx->num; j++)
+			if (!X509_cmp(idx->entries[j].cert, cert)) break;
+		if (j < idx->num) continue;
+
+		idx->entries[idx->num].nameHash = X509_NAME_hash(X509_get_subject_name(cert));
+		idx->entries[idx->num].cert = cert;
+		idx->num++;
+		}
+	qsort(idx->entries, idx->num, sizeof(*idx->entries), cert_index_entry_cmp);
+
+	return 1;
+	}
+
+static void cert_index_cleanup(CERT_INDEX *idx)
+	{
+	if (idx->entries) OPENSSL_free(idx->entries);
+	idx->entries = NULL;
+	idx->num = 0;
+	}
+
+/* returns a certificate with the given subject, preferably the one with the
+ * given subject key identifier, NULL if there is none */
+static X509 *cert_index_find(const CERT_INDEX *idx, X509_NAME *name, const ASN1_OCTET_STRING *keyid)
+	{
+	unsigned long h;
+	int lo = 0, hi = idx->num, mid;
+	X509 *first = NULL;
+
+	if (!name || idx->num == 0) return NULL;
+	h = X509_NAME_hash(name);
+
+	/* first entry with that hash */
+	while (lo < hi)
+		{
+		mid = (lo + hi) / 2;
+		if (idx->entries[mid].nameHash < h) lo = mid + 1;
+		else hi = mid;
+		}
+
+	for (; lo < idx->num && idx->entries[lo].nameHash == h; lo++)
+		{
+		X509 *cert = idx->entries[lo].cert;
+
+		if (X509_NAME_cmp(X509_get_subject_name(cert), name)) continue;
+		if (!keyid || (cert->skid && !ASN1_OCTET_STRING_cmp(cert->skid, keyid)))
+			return cert;
+		if (!first) first = cert;
+		}
+
+	return first;
+	}
+
+/* returns the issuer of cert, its issuer and so on as far as they are in the
+ * index, up to but excluding a self-signed certificate, which is only taken
+ * from the trusted store. *complete is set if the last one found was issued by
+ * a self-signed certificate */
+static STACK_OF(X509) *cert_index_get_chain(const CERT_INDEX *idx, X509 *cert, int *complete)
+	{
+	STACK_OF(X509) *chain = NULL;
+	X509 *issuer = NULL;
+
+	*complete = 0;
+	if (!(chain = sk_X509_new_null())) return NULL;
+
+	X509_check_purpose(cert, -1, 0);
+	while (!(cert->ex_flags & EXFLAG_SS) && sk_X509_num(chain) < idx->num)
+		{
+		issuer = cert_index_find(idx, X509_get_issuer_name(cert), cert->akid ? cert->akid->keyid : NULL);
+		if (!issuer || X509_check_issued(issuer, cert) != X509_V_OK) break;
+		if (issuer->ex_flags & EXFLAG_SS)
+			{
+			*complete = 1;
+			break;
+			}
+		sk_X509_push(chain, issuer);
+		cert = issuer;
+		}
+
+	return chain;
+	}
+
 /* ############################################################################ *
  * internal function
  *
  * Attempt to validate certificate path. returns 1 if the path was
  * validated successfully and 0 if not.
  * ############################################################################ */
-int CMP_validate_cert_path(X509_STORE *trusted_store, X509_STORE *untrusted_store, X509 *cert)
+static int validate_cert_path(X509_STORE *trusted_store, X509_STORE *untrusted_store,
+		STACK_OF(X509) *untrusted_certs, const CERT_INDEX *idx, X509 *cert, STACK_OF(X509) **chain)
 	{
-	int ret=0,valid=0;
+	int ret=0,valid=0,complete=0,i;
 	X509_STORE_CTX *csc=NULL;
 	STACK_OF(X509) *untrusted_stack=NULL;
+	STACK_OF(X509) *stored_chain=NULL;
 
 	if (!cert) goto end;
 
@@ -163,11 +307,32 @@ int CMP_validate_cert_path(X509_STORE *trusted_store, X509_STORE *untrusted_stor
 
 	if (!(csc = X509_STORE_CTX_new())) goto end;
 
+	/* the intermediate certificates are first taken from the message */
+	if (idx && !(untrusted_stack = cert_index_get_chain(idx, cert, &complete)))
+		goto end;
+
 	/* note: there doesn't seem to be a good way to get a stack of all
 	 * the certs in an X509_STORE, so we need to try and find the chain
 	 * of intermediate certs here. */
-	if (untrusted_store)
-		untrusted_stack = CMP_build_cert_chain(untrusted_store, cert);
+	if (!complete && untrusted_store)
+		{
+		X509 *last = sk_X509_num(untrusted_stack) > 0 ?
+			sk_X509_value(untrusted_stack, sk_X509_num(untrusted_stack)-1) : cert;
+		if ((stored_chain = CMP_build_cert_chain(untrusted_store, last)))
+			{
+			if (!untrusted_stack && !(untrusted_stack = sk_X509_new_null())) goto end;
+			for (i = 0; i < sk_X509_num(stored_chain); i++)
+				sk_X509_push(untrusted_stack, sk_X509_value(stored_chain, i));
+			}
+		}
+
+	/* and those kept from earlier messages, see CMP_CTX_loadUntrustedStack() */
+	if (!complete && sk_X509_num(untrusted_certs) > 0)
+		{
+		if (!untrusted_stack && !(untrusted_stack = sk_X509_new_null())) goto end;
+		for (i = 0; i < sk_X509_num(untrusted_certs); i++)
+			sk_X509_push(untrusted_stack, sk_X509_value(untrusted_certs, i));
+		}
 
 	X509_STORE_set_flags(trusted_store, 0);
 	if(!X509_STORE_CTX_init(csc, trusted_store, cert, untrusted_stack))
@@ -178,13 +343,18 @@ int CMP_validate_cert_path(X509_STORE *trusted_store, X509_STORE *untrusted_stor
 
 	valid=X509_verify_cert(csc);
 
-	X509_STORE_CTX_free(csc);
+	if (valid > 0 && chain)
+		*chain = X509_STORE_CTX_get1_chain(csc);
 
 	ret=0;
 
 	end:
+	if (csc) X509_STORE_CTX_free(csc);
+	/* only the certificates from the store are copies */
 	if (untrusted_stack)
-		sk_X509_pop_free(untrusted_stack, X509_free);
+		sk_X509_free(untrusted_stack);
+	if (stored_chain)
+		sk_X509_pop_free(stored_chain, X509_free);
 	
 	if (valid > 0)
 		{
@@ -194,6 +364,207 @@ int CMP_validate_cert_path(X509_STORE *trusted_store, X509_STORE *untrusted_stor
 	return(ret);
 	}
 
+/* ############################################################################ *
+ * Attempt to validate certificate path. returns 1 if the path was
+ * validated successfully and 0 if not.
+ * ############################################################################ */
+int CMP_validate_cert_path(X509_STORE *trusted_store, X509_STORE *untrusted_store, X509 *cert)
+	{
+	return validate_cert_path(trusted_store, untrusted_store, NULL, NULL, cert, NULL);
+	}
+
+/* ############################################################################ *
+ * Cache of server certificates whose path was validated, shared by all CMP_CTXs
+ * of the process so that repeated transactions with the same CA do not build
+ * and check the path again.
+ *
+ * An entry is keyed by the SHA-1 fingerprint of the certificate, the trust
+ * anchor its chain ended in and a digest of the verification parameters of
+ * the trusted store, so independently built stores with the same anchor share
+ * it. A hit requires that anchor to be in the trusted store the lookup is
+ * made with. Paths checked against CRLs are not cached, as the CRLs change. An
+ * entry is used until the first certificate of the validated chain expires,
+ * and at most SRVCERT_CACHE_TTL seconds. Entries are kept in least recently
+ * used order, protected by CRYPTO_LOCK_CMP_SRVCERT.
+ * ############################################################################ */
+typedef struct
+	{
+	unsigned char fingerprint[SHA_DIGEST_LENGTH];
+	unsigned char params[SHA_DIGEST_LENGTH];
+	X509 *anchor;
+	STACK_OF(X509) *chain;
+	time_t expires;
+	} SRVCERT_CACHE_ENTRY;
+
+static SRVCERT_CACHE_ENTRY srvcert_cache[SRVCERT_CACHE_SIZE]; /* most recently used first */
+static int srvcert_cache_num=0;
+
+/* must be called with CRYPTO_LOCK_CMP_SRVCERT held */
+static void srvcert_cache_remove(int i)
+	{
+	sk_X509_pop_free(srvcert_cache[i].chain, X509_free);
+	srvcert_cache_num--;
+	memmove(&srvcert_cache[i], &srvcert_cache[i+1], (srvcert_cache_num-i) * sizeof(*srvcert_cache));
+	}
+
+/* digest of the verification parameters of the store, 0 if paths validated
+ * with them may not be cached */
+static int srvcert_cache_params(X509_STORE *store, unsigned char *md)
+	{
+	X509_VERIFY_PARAM *param = store->param;
+	EVP_MD_CTX mctx;
+	long v[5];
+	int i, ok;
+
+	if (param->flags & (X509_V_FLAG_CRL_CHECK|X509_V_FLAG_CRL_CHECK_ALL))
+		return 0;
+	v[0] = param->flags;
+	v[1] = param->purpose;
+	v[2] = param->trust;
+	v[3] = param->depth;
+	v[4] = param->inh_flags;
+
+	EVP_MD_CTX_init(&mctx);
+	ok = EVP_DigestInit_ex(&mctx, EVP_sha1(), NULL) &&
+		EVP_DigestUpdate(&mctx, v, sizeof(v));
+	for (i = 0; ok && i < sk_ASN1_OBJECT_num(param->policies); i++)
+		{
+		ASN1_OBJECT *policy = sk_ASN1_OBJECT_value(param->policies, i);
+		ok = EVP_DigestUpdate(&mctx, policy->data, policy->length);
+		}
+	ok = ok && EVP_DigestFinal_ex(&mctx, md, NULL);
+	EVP_MD_CTX_cleanup(&mctx);
+	return ok;
+	}
+
+/* returns 1 if the trust anchor is in the store */
+static int srvcert_cache_has_anchor(X509_STORE *store, X509 *anchor)
+	{
+	X509_STORE_CTX *csc;
+	X509_OBJECT obj;
+	int found = 0;
+
+	if (!(csc = X509_STORE_CTX_new())) return 0;
+	/* the lookup loads the certificates with that name, e.g. from a hash dir */
+	if (X509_STORE_CTX_init(csc, store, NULL, NULL) &&
+			X509_STORE_get_by_subject(csc, X509_LU_X509, X509_get_subject_name(anchor), &obj))
+		{
+		found = !X509_cmp(obj.data.x509, anchor);
+		X509_OBJECT_free_contents(&obj);
+		}
+	X509_STORE_CTX_free(csc);
+
+	/* there may be more than one anchor with the name */
+	if (!found)
+		{
+		obj.type = X509_LU_X509;
+		obj.data.x509 = anchor;
+		CRYPTO_r_lock(CRYPTO_LOCK_X509_STORE);
+		found = X509_OBJECT_retrieve_match(store->objs, &obj) != NULL;
+		CRYPTO_r_unlock(CRYPTO_LOCK_X509_STORE);
+		}
+	return found;
+	}
+
+/* returns 1 if the path of cert was validated against a store with the same
+ * anchor and parameters as trusted_store before and is still valid */
+static int srvcert_cache_lookup(X509_STORE *trusted_store, X509 *cert)
+	{
+	unsigned char md[SHA_DIGEST_LENGTH], params[SHA_DIGEST_LENGTH];
+	SRVCERT_CACHE_ENTRY e;
+	X509 *anchor = NULL;
+	time_t now = time(NULL);
+	int i, j, ret=0;
+
+	if (!trusted_store || !cert) return 0;
+	if (!X509_digest(cert, EVP_sha1(), md, NULL)) return 0;
+	if (!srvcert_cache_params(trusted_store, params)) return 0;
+
+	CRYPTO_w_lock(CRYPTO_LOCK_CMP_SRVCERT);
+	for (i = 0; i < srvcert_cache_num; i++)
+		{
+		if (memcmp(srvcert_cache[i].fingerprint, md, sizeof(md))) continue;
+		if (memcmp(srvcert_cache[i].params, params, sizeof(params))) continue;
+
+		if (srvcert_cache[i].expires <= now)
+			{
+			srvcert_cache_remove(i);
+			break;
+			}
+		for (j = 0; j < sk_X509_num(srvcert_cache[i].chain); j++)
+			if (X509_cmp_time(X509_get_notAfter(sk_X509_value(srvcert_cache[i].chain, j)), &now) <= 0)
+				break;
+		if (j < sk_X509_num(srvcert_cache[i].chain))
+			{
+			srvcert_cache_remove(i);
+			break;
+			}
+
+		e = srvcert_cache[i];
+		memmove(&srvcert_cache[1], &srvcert_cache[0], i * sizeof(*srvcert_cache));
+		srvcert_cache[0] = e;
+		anchor = e.anchor;
+		CRYPTO_add(&anchor->references, 1, CRYPTO_LOCK_X509);
+		break;
+		}
+	CRYPTO_w_unlock(CRYPTO_LOCK_CMP_SRVCERT);
+
+	/* checked outside of the lock, the store may have to load it */
+	if (anchor)
+		{
+		ret = srvcert_cache_has_anchor(trusted_store, anchor);
+		X509_free(anchor);
+		}
+	return ret;
+	}
+
+/* remembers that the path of cert was validated against trusted_store, takes
+ * over chain, which ends in the trust anchor */
+static void srvcert_cache_add(X509_STORE *trusted_store, X509 *cert, STACK_OF(X509) *chain)
+	{
+	SRVCERT_CACHE_ENTRY e;
+	int i;
+
+	if (!trusted_store || !cert || sk_X509_num(chain) <= 0) goto err;
+	if (!X509_digest(cert, EVP_sha1(), e.fingerprint, NULL)) goto err;
+	if (!srvcert_cache_params(trusted_store, e.params)) goto err;
+	e.anchor = sk_X509_value(chain, sk_X509_num(chain)-1);
+	e.chain = chain;
+	e.expires = time(NULL) + SRVCERT_CACHE_TTL;
+
+	CRYPTO_w_lock(CRYPTO_LOCK_CMP_SRVCERT);
+	/* replace what another thread may have added meanwhile */
+	for (i = 0; i < srvcert_cache_num; i++)
+		if (!memcmp(srvcert_cache[i].fingerprint, e.fingerprint, sizeof(e.fingerprint)) &&
+				!memcmp(srvcert_cache[i].params, e.params, sizeof(e.params)) &&
+				!X509_cmp(srvcert_cache[i].anchor, e.anchor))
+			{
+			srvcert_cache_remove(i);
+			break;
+			}
+	if (srvcert_cache_num == SRVCERT_CACHE_SIZE)
+		srvcert_cache_remove(SRVCERT_CACHE_SIZE-1);
+	memmove(&srvcert_cache[1], &srvcert_cache[0], srvcert_cache_num * sizeof(*srvcert_cache));
+	srvcert_cache[0] = e;
+	srvcert_cache_num++;
+	CRYPTO_w_unlock(CRYPTO_LOCK_CMP_SRVCERT);
+	return;
+err:
+	if (chain) sk_X509_pop_free(chain, X509_free);
+	}
+
+/* ############################################################################ *
+ * forgets all server certificates validated so far, e.g. after the CA's
+ * certificate was revoked
+ * ############################################################################ */
+void CMP_srvCert_cache_flush(void)
+	{
+	CRYPTO_w_lock(CRYPTO_LOCK_CMP_SRVCERT);
+	while (srvcert_cache_num > 0)
+		srvcert_cache_remove(srvcert_cache_num-1);
+	CRYPTO_w_unlock(CRYPTO_LOCK_CMP_SRVCERT);
+	}
+
 #if 0
 /* ############################################################################ *
  * NOTE: This is only needed if/when we want to do additional checking on the certificates!
@@ -252,95 +623,54 @@ int CMP_cert_callback(int ok, X509_STORE_CTX *ctx)
  *
  * Find server certificate by:
  * - first see if we can find it in trusted store
+ * - then search for certs with matching name in the extraCerts of the message,
+ *	 preferring the one with the matching senderKID if available
+ * - then in the extraCerts kept from earlier messages
  * - then try to find it in untrusted store
- * - then search for certs with matching name in extraCerts
- *	 - if only one match found, return that
- *	 - if more than one, try to find a cert with the matching senderKID if available
- *	 - if keyID is not available, return first cert found
- * returns pointer to found server Certificate on success
+ * returns pointer to found server Certificate on success, to be freed by the
+ * caller
  * returns NULL on error or when no certificate could be found
  * ############################################################################ */
-static X509 *findSrvCert(CMP_CTX *ctx, CMP_PKIMESSAGE *msg)
+static X509 *findSrvCert(CMP_CTX *ctx, CMP_PKIMESSAGE *msg, const CERT_INDEX *idx)
 	{
 	X509 *srvCert = NULL;
 	X509_STORE_CTX *csc = NULL;
 	X509_OBJECT obj;
-	STACK_OF(X509) *found_certs = NULL;
-	int n;
+	X509_NAME *sender = msg->header->sender->d.directoryName;
+	int i;
 
 	if(!(csc = X509_STORE_CTX_new())) return NULL;
 
 	/* first attempt lookup in trusted_store */
 	if (X509_STORE_CTX_init(csc, ctx->trusted_store, NULL, NULL))
 		{
-		if (X509_STORE_get_by_subject(csc, X509_LU_X509, msg->header->sender->d.directoryName, &obj))
-			{
-			srvCert = obj.data.x509;
-			X509_STORE_CTX_free(csc);
-			return srvCert;
-			}
-		}
-	
-	/* attempt lookup in untrusted_store */
-	if (X509_STORE_CTX_init(csc, ctx->untrusted_store, NULL, NULL))
-		{
-		if (X509_STORE_get_by_subject(csc, X509_LU_X509, msg->header->sender->d.directoryName, &obj))
-			{
+		if (X509_STORE_get_by_subject(csc, X509_LU_X509, sender, &obj))
 			srvCert = obj.data.x509;
-			X509_STORE_CTX_free(csc);
-			return srvCert;
-			}
-		}
-
-	/* not found in trusted_store, so look through extraCerts */
-	if(!(found_certs = sk_X509_new_null())) return NULL;
-
-	for (n = 0; n < sk_X509_num(msg->extraCerts); n++)
-		{
-		X509 *cert = sk_X509_value(msg->extraCerts, n);
-		X509_NAME *name = NULL;
-		if (!cert) continue;
-		name = X509_get_subject_name(cert);
-
-		if (name && !X509_NAME_cmp(name, msg->header->sender->d.directoryName))
-			sk_X509_push(found_certs, cert);
+		X509_STORE_CTX_cleanup(csc);
 		}
 
-	/* if found exactly one cert, we'll use that */
-	if (sk_X509_num(found_certs) == 1)
-		srvCert = sk_X509_pop(found_certs);
-
-	/* found more than one with a matching name, so try to search
-	   through the found certs by key ID if we have it.  if not,
-	   just return first one. */
-	else if (sk_X509_num(found_certs) > 1)
-		{
-		if (msg->header->senderKID) {
-			for (n = 0; n < sk_X509_num(found_certs); n++)
-				{
-				X509 *cert = sk_X509_value(found_certs, n);
-				ASN1_OCTET_STRING *cert_keyid = NULL;
+	/* look through extraCerts */
+	if (!srvCert && (srvCert = cert_index_find(idx, sender, msg->header->senderKID)))
+		/* the certificates from the stores are returned with their reference
+		 * count increased, so do the same for one from extraCerts */
+		CRYPTO_add(&srvCert->references, 1, CRYPTO_LOCK_X509);
 
-				if (!(cert_keyid = CMP_get_cert_subject_key_id(cert))) return NULL;
-
-				if (!ASN1_OCTET_STRING_cmp(cert_keyid, msg->header->senderKID))
-					{
-					srvCert = cert;
-					break;
-					}
-				}
-			}
-
-		if (!srvCert)
+	/* then in the certificates kept from earlier messages */
+	for (i = 0; !srvCert && i < sk_X509_num(ctx->untrusted_certs); i++)
+		if (!X509_NAME_cmp(X509_get_subject_name(sk_X509_value(ctx->untrusted_certs, i)), sender))
 			{
-			/* key id not available or we didn't find a cert with matching keyID.
-			 * -> return the first one with matching name */
-			srvCert = sk_X509_pop(found_certs);
+			srvCert = sk_X509_value(ctx->untrusted_certs, i);
+			CRYPTO_add(&srvCert->references, 1, CRYPTO_LOCK_X509);
 			}
-		}
 
-	sk_X509_free(found_certs);
+	/* attempt lookup in untrusted_store */
+	if (!srvCert && X509_STORE_CTX_init(csc, ctx->untrusted_store, NULL, NULL))
+		{
+		if (X509_STORE_get_by_subject(csc, X509_LU_X509, sender, &obj))
+			srvCert = obj.data.x509;
+		}
 
+	X509_STORE_CTX_free(csc);
 	return srvCert;
 	}
 
@@ -389,7 +719,7 @@ static X509_STORE *createTempTrustedStore(STACK_OF(X509) *stack)
  *
  * returns 1 on success, 0 on error or validation failed
  * ############################################################################ */
-int CMP_validate_msg(CMP_CTX *ctx, CMP_PKIMESSAGE *msg)
+static int validate_msg(CMP_CTX *ctx, CMP_PKIMESSAGE *msg)
 	{
 	X509 *srvCert = ctx->srvCert;
 	int srvCert_valid = 0;
@@ -430,14 +760,32 @@ int CMP_validate_msg(CMP_CTX *ctx, CMP_PKIMESSAGE *msg)
 					}
 				else
 					{
-					/* load the provided extraCerts to help with cert path validation */
-					CMP_CTX_loadUntrustedStack(ctx, msg->extraCerts);
+					CERT_INDEX idx;
+
+					if (!cert_index_init(&idx, msg->extraCerts))
+						{
+						CMPerr(CMP_F_CMP_VALIDATE_MSG, ERR_R_MALLOC_FAILURE);
+						return 0;
+						}
 
-					/* try to find the server certificate from 1) trusted_store 2) untrusted_store 3) extaCerts*/
-					srvCert = findSrvCert(ctx, msg);
+					/* try to find the server certificate from 1) trusted_store 2) extaCerts
+					 * 3) earlier extraCerts 4) untrusted_store */
+					srvCert = findSrvCert(ctx, msg, &idx);
 
-					/* validate the that the found server Certificate is trusted */
-					srvCert_valid = CMP_validate_cert_path(ctx->trusted_store, ctx->untrusted_store, srvCert);
+					/* keep the provided extraCerts for later messages */
+					CMP_CTX_loadUntrustedStack(ctx, msg->extraCerts);
+
+					/* validate the that the found server Certificate is trusted,
+					 * unless that was already done in an earlier transaction */
+					if (srvCert && !(srvCert_valid = srvcert_cache_lookup(ctx->trusted_store, srvCert)))
+						{
+						STACK_OF(X509) *chain = NULL;
+						srvCert_valid = validate_cert_path(ctx->trusted_store, ctx->untrusted_store,
+								ctx->untrusted_certs, &idx, srvCert, &chain);
+						if (srvCert_valid)
+							srvcert_cache_add(ctx->trusted_store, srvCert, chain);
+						}
+					cert_index_cleanup(&idx);
 
 					/* do an exceptional handling for 3GPP */	
 					if (!srvCert_valid)
@@ -451,7 +799,7 @@ int CMP_validate_msg(CMP_CTX *ctx, CMP_PKIMESSAGE *msg)
 							X509_STORE *tempStore = createTempTrustedStore(msg->extraCerts);
 							/* TODO: check that issued certificates can validate against
 							 * trust achnor - and then exclusively use this CA */
-							srvCert_valid = CMP_validate_cert_path(tempStore, ctx->untrusted_store, srvCert);
+							srvCert_valid = validate_cert_path(tempStore, ctx->untrusted_store, ctx->untrusted_certs, NULL, srvCert, NULL);
 
 							if (srvCert_valid)
 								{
@@ -459,7 +807,7 @@ int CMP_validate_msg(CMP_CTX *ctx, CMP_PKIMESSAGE *msg)
 								 * trusted store as srvCert */
 								X509 *newClCert = CMP_CERTREPMESSAGE_get_certificate(ctx, msg->body->value.ip);
 								if (newClCert)
-									srvCert_valid = CMP_validate_cert_path(tempStore, ctx->untrusted_store, newClCert);
+									srvCert_valid = validate_cert_path(tempStore, ctx->untrusted_store, ctx->untrusted_certs, NULL, newClCert, NULL);
 								}
 							
 							X509_STORE_free(tempStore);
@@ -470,15 +818,39 @@ int CMP_validate_msg(CMP_CTX *ctx, CMP_PKIMESSAGE *msg)
 				/* verification failed if no valid server cert was found */
 				if (!srvCert_valid)
 					{
+					if (srvCert != ctx->validatedSrvCert) X509_free(srvCert);
 					CMPerr(CMP_F_CMP_VALIDATE_MSG, CMP_R_NO_VALID_SRVCERT_FOUND);
 					return 0; 
 					}
 
 				/* store trusted server cert for future messages in this interaction */
-				ctx->validatedSrvCert = srvCert;
+				if (srvCert != ctx->validatedSrvCert)
+					{
+					if (ctx->validatedSrvCert) X509_free(ctx->validatedSrvCert);
+					ctx->validatedSrvCert = srvCert;
+					}
 				}
 			return CMP_verify_signature(msg, srvCert);
 		}
 	return 0;
 	}
 
+/* ############################################################################
+ * validates msg as described for validate_msg() and adds the time taken to
+ * the metrics of the message in progress if a metrics callback is set
+ *
+ * returns 1 on success, 0 on error or validation failed
+ * ############################################################################ */
+int CMP_validate_msg(CMP_CTX *ctx, CMP_PKIMESSAGE *msg)
+	{
+	unsigned long start;
+	int ret;
+
+	if (!ctx || !ctx->metrics_cb) return validate_msg(ctx, msg);
+
+	start = CMP_METRICS_now();
+	ret = validate_msg(ctx, msg);
+	ctx->msgMetrics->validate += CMP_METRICS_now() - start;
+	return ret;
+	}
+
@@ -533,6 +533,9 @@ CRMF_CERTREQMSG * CRMF_cr_new( const long certReqId, const EVP_PKEY *pkey, const
 
 /* crmf_pbm.c */
 CRMF_PBMPARAMETER * CRMF_pbm_new(void);
+CRMF_PBMPARAMETER * CRMF_pbm_new_ex(int owfNid, long iterationCount, int macNid);
+int CRMF_pbm_set_cache_size(int num);
+void CRMF_pbm_cache_flush(void);
 int CRMF_passwordBasedMac_new( const CRMF_PBMPARAMETER *pbm, const unsigned char* msg, size_t msgLen, const unsigned char* secret, size_t secretLen, unsigned char** mac, unsigned int* macLen);
 
 /* crmf_lib.c */
@@ -588,6 +591,7 @@ void ERR_load_CRMF_strings(void);
 #define CRMF_F_CRMF_CERTREQMSG_SET_VERSION2		 130
 #define CRMF_F_CRMF_CR_NEW				 105
 #define CRMF_F_CRMF_PASSWORDBASEDMAC_NEW		 106
+#define CRMF_F_CRMF_PBM_NEW_EX				 132
 #define CRMF_F_CRMF_POPOSIGNINGKEY_NEW			 109
 #define CRMF_F_CRMF_SET1_CONTROL_AUTHENTICATOR		 110
 #define CRMF_F_CRMF_SET1_CONTROL_OLDCERTID		 111
@@ -616,6 +620,7 @@ void ERR_load_CRMF_strings(void);
 #define CRMF_R_ERROR_SETTING_REGTOKEN_ATAV		 112
 #define CRMF_R_ERROR_SETTING_REGTOKEN_CERTREQ_ATAV	 113
 #define CRMF_R_ERROR_SETTING_VERSION_2			 114
+#define CRMF_R_ITERATIONCOUNT_BELOW_100			 117
 #define CRMF_R_UNSUPPORTED_ALGORITHM			 102
 #define CRMF_R_UNSUPPORTED_ALG_FOR_POPSIGNINGKEY	 115
 #define CRMF_R_UNSUPPORTED_METHOD_FOR_CREATING_POPO	 116
@@ -90,6 +90,7 @@ static ERR_STRING_DATA CRMF_str_functs[]=
 {ERR_FUNC(CRMF_F_CRMF_CERTREQMSG_SET_VERSION2),	"CRMF_CERTREQMSG_set_version2"},
 {ERR_FUNC(CRMF_F_CRMF_CR_NEW),	"CRMF_cr_new"},
 {ERR_FUNC(CRMF_F_CRMF_PASSWORDBASEDMAC_NEW),	"CRMF_passwordBasedMac_new"},
+{ERR_FUNC(CRMF_F_CRMF_PBM_NEW_EX),	"CRMF_pbm_new_ex"},
 {ERR_FUNC(CRMF_F_CRMF_POPOSIGNINGKEY_NEW),	"CRMF_poposigningkey_new"},
 {ERR_FUNC(CRMF_F_CRMF_SET1_CONTROL_AUTHENTICATOR),	"CRMF_SET1_CONTROL_AUTHENTICATOR"},
 {ERR_FUNC(CRMF_F_CRMF_SET1_CONTROL_OLDCERTID),	"CRMF_SET1_CONTROL_OLDCERTID"},
@@ -121,6 +122,7 @@ static ERR_STRING_DATA CRMF_str_reasons[]=
 {ERR_REASON(CRMF_R_ERROR_SETTING_REGTOKEN_ATAV),"error setting regtoken atav"},
 {ERR_REASON(CRMF_R_ERROR_SETTING_REGTOKEN_CERTREQ_ATAV),"error setting regtoken certreq atav"},
 {ERR_REASON(CRMF_R_ERROR_SETTING_VERSION_2),"error setting version 2"},
+{ERR_REASON(CRMF_R_ITERATIONCOUNT_BELOW_100),"iterationcount below 100"},
 {ERR_REASON(CRMF_R_UNSUPPORTED_ALGORITHM),"unsupported algorithm"},
 {ERR_REASON(CRMF_R_UNSUPPORTED_ALG_FOR_POPSIGNINGKEY),"unsupported alg for popsigningkey"},
 {ERR_REASON(CRMF_R_UNSUPPORTED_METHOD_FOR_CREATING_POPO),"unsupported method for creating popo"},
@@ -66,6 +66,7 @@
  * Nokia for contribution to the OpenSSL project.
  */
 
+#include <string.h>
 #include <openssl/asn1.h>
 #include <openssl/asn1t.h>
 #include <openssl/crmf.h>
@@ -76,17 +77,239 @@
 
 #define SALT_LEN		 16
 #define ITERATION_COUNT 500
+/* default number of derived base keys kept by CRMF_passwordBasedMac_new() */
+#define PBM_CACHE_SIZE	 64
 
 /* ############################################################################ *
- * creates and initializes CRMF_PBMPARAMETER (section 4.4)
+ * Cache of the base keys derived from secret and salt.
+ *
+ * Deriving the base key costs iterationCount hash rounds while the MAC itself
+ * is a single HMAC. As long as both ends keep the same PBMParameter for all
+ * messages of a transaction, the key is derived once per transaction and side.
+ * The entries are kept in least recently used order, protected by
+ * CRYPTO_LOCK_CRMF_PBM.
+ * ############################################################################ */
+typedef struct crmf_pbm_cache_entry_st
+	{
+	unsigned char *secret;
+	size_t secretLen;
+	unsigned char *salt;
+	int saltLen;
+	int owf;
+	long iterations;
+	unsigned char basekey[EVP_MAX_MD_SIZE];
+	unsigned int basekeyLen;
+	} CRMF_PBM_CACHE_ENTRY;
+
+static CRMF_PBM_CACHE_ENTRY **pbm_cache=NULL; /* most recently used first */
+static int pbm_cache_num=0;
+static int pbm_cache_max=PBM_CACHE_SIZE;
+
+static void pbm_cache_entry_free(CRMF_PBM_CACHE_ENTRY *e)
+	{
+	if (!e) return;
+	if (e->secret)
+		{
+		OPENSSL_cleanse(e->secret, e->secretLen);
+		OPENSSL_free(e->secret);
+		}
+	if (e->salt) OPENSSL_free(e->salt);
+	OPENSSL_cleanse(e->basekey, sizeof(e->basekey));
+	OPENSSL_free(e);
+	}
+
+/* must be called with CRYPTO_LOCK_CRMF_PBM held, returns the index or -1 */
+static int pbm_cache_find(const unsigned char *secret, size_t secretLen,
+		const ASN1_OCTET_STRING *salt, int owf, long iterations)
+	{
+	int i;
+	CRMF_PBM_CACHE_ENTRY *e;
+
+	for (i = 0; i < pbm_cache_num; i++)
+		{
+		e = pbm_cache[i];
+		if (e->owf != owf || e->iterations != iterations) continue;
+		if (e->secretLen != secretLen || e->saltLen != salt->length) continue;
+		if (memcmp(e->salt, salt->data, salt->length)) continue;
+		if (CRYPTO_memcmp(e->secret, secret, secretLen)) continue;
+		return i;
+		}
+	return -1;
+	}
+
+/* must be called with CRYPTO_LOCK_CRMF_PBM held */
+static void pbm_cache_to_front(int i)
+	{
+	CRMF_PBM_CACHE_ENTRY *e = pbm_cache[i];
+
+	memmove(&pbm_cache[1], &pbm_cache[0], i * sizeof(*pbm_cache));
+	pbm_cache[0] = e;
+	}
+
+/* copies a cached base key to basekey, returns 1 if there is one */
+static int pbm_cache_get(const unsigned char *secret, size_t secretLen,
+		const ASN1_OCTET_STRING *salt, int owf, long iterations,
+		unsigned char *basekey, unsigned int *basekeyLen)
+	{
+	int i, ret=0;
+
+	CRYPTO_w_lock(CRYPTO_LOCK_CRMF_PBM);
+	if ((i = pbm_cache_find(secret, secretLen, salt, owf, iterations)) >= 0)
+		{
+		pbm_cache_to_front(i);
+		memcpy(basekey, pbm_cache[0]->basekey, pbm_cache[0]->basekeyLen);
+		*basekeyLen = pbm_cache[0]->basekeyLen;
+		ret = 1;
+		}
+	CRYPTO_w_unlock(CRYPTO_LOCK_CRMF_PBM);
+	return ret;
+	}
+
+/* adds a derived base key, dropping the least recently used one if full */
+static void pbm_cache_put(const unsigned char *secret, size_t secretLen,
+		const ASN1_OCTET_STRING *salt, int owf, long iterations,
+		const unsigned char *basekey, unsigned int basekeyLen)
+	{
+	CRMF_PBM_CACHE_ENTRY *e=NULL;
+
+	if (pbm_cache_max <= 0) return;
+
+	if (!(e = OPENSSL_malloc(sizeof(*e)))) return;
+	memset(e, 0, sizeof(*e));
+	if (!(e->secret = OPENSSL_malloc(secretLen ? secretLen : 1))) goto err;
+	if (!(e->salt = OPENSSL_malloc(salt->length ? salt->length : 1))) goto err;
+	memcpy(e->secret, secret, secretLen);
+	e->secretLen = secretLen;
+	memcpy(e->salt, salt->data, salt->length);
+	e->saltLen = salt->length;
+	e->owf = owf;
+	e->iterations = iterations;
+	memcpy(e->basekey, basekey, basekeyLen);
+	e->basekeyLen = basekeyLen;
+
+	CRYPTO_w_lock(CRYPTO_LOCK_CRMF_PBM);
+	/* another thread may have derived the same key meanwhile */
+	if (pbm_cache_find(secret, secretLen, salt, owf, iterations) >= 0)
+		goto unlock;
+	if (!pbm_cache && !(pbm_cache = OPENSSL_malloc(pbm_cache_max * sizeof(*pbm_cache))))
+		goto unlock;
+	if (pbm_cache_num == pbm_cache_max)
+		pbm_cache_entry_free(pbm_cache[--pbm_cache_num]);
+	pbm_cache[pbm_cache_num++] = e;
+	pbm_cache_to_front(pbm_cache_num-1);
+	e = NULL;
+unlock:
+	CRYPTO_w_unlock(CRYPTO_LOCK_CRMF_PBM);
+err:
+	pbm_cache_entry_free(e);
+	}
+
+/* ############################################################################ *
+ * drops all cached base keys, e.g. after secrets were changed
+ * ############################################################################ */
+void CRMF_pbm_cache_flush(void)
+	{
+	CRYPTO_w_lock(CRYPTO_LOCK_CRMF_PBM);
+	while (pbm_cache_num > 0)
+		pbm_cache_entry_free(pbm_cache[--pbm_cache_num]);
+	if (pbm_cache) OPENSSL_free(pbm_cache);
+	pbm_cache = NULL;
+	CRYPTO_w_unlock(CRYPTO_LOCK_CRMF_PBM);
+	}
+
+/* ############################################################################ *
+ * sets the number of base keys kept in the cache, 0 disables caching
+ * returns 1 on success, 0 on error
+ * ############################################################################ */
+int CRMF_pbm_set_cache_size(int num)
+	{
+	if (num < 0) return 0;
+
+	CRMF_pbm_cache_flush();
+	CRYPTO_w_lock(CRYPTO_LOCK_CRMF_PBM);
+	pbm_cache_max = num;
+	CRYPTO_w_unlock(CRYPTO_LOCK_CRMF_PBM);
+	return 1;
+	}
+
+/* ############################################################################ *
+ * returns the hash function for the given owf, NULL if it is not available
+ * ############################################################################ */
+static const EVP_MD *pbm_owf_md(int owfNid)
+	{
+	const EVP_MD *m=NULL;
+
+	if (!(m = EVP_get_digestbynid(owfNid)))
+		{
+		/* the application may not have loaded the digests */
+		OpenSSL_add_all_digests();
+		m = EVP_get_digestbynid(owfNid);
+		}
+	return m;
+	}
+
+/* ############################################################################ *
+ * returns the hash function used by the given PBM MAC algorithm, NULL if the
+ * algorithm is not supported
+ * ############################################################################ */
+static const EVP_MD *pbm_mac_md(int macNid)
+	{
+	switch (macNid)
+		{
+		case NID_hmac_sha1:
+		case NID_hmacWithSHA1:
+			return EVP_sha1();
+#ifndef OPENSSL_NO_SHA256
+		case NID_hmacWithSHA224:
+			return EVP_sha224();
+		case NID_hmacWithSHA256:
+			return EVP_sha256();
+#endif
+#ifndef OPENSSL_NO_SHA512
+		case NID_hmacWithSHA384:
+			return EVP_sha384();
+		case NID_hmacWithSHA512:
+			return EVP_sha512();
+#endif
+		/* optional TODO: DES-MAC, Triple DES-MAC */
+		default:
+			return NULL;
+		}
+	}
+
+/* ############################################################################ *
+ * creates and initializes CRMF_PBMPARAMETER (section 4.4) with SHA-1 as owf,
+ * ITERATION_COUNT iterations and HMAC-SHA1 as mac
  * returns pointer to CRMF_PBMPARAMETER on success, NULL on error
- * TODO: this should take the parameters to be set via the arguments
  * ############################################################################ */
 CRMF_PBMPARAMETER * CRMF_pbm_new(void)
+	{
+	return CRMF_pbm_new_ex(NID_sha1, ITERATION_COUNT, NID_hmac_sha1);
+	}
+
+/* ############################################################################ *
+ * creates and initializes CRMF_PBMPARAMETER (section 4.4) with a fresh salt
+ * @owfNid NID of the one-way function, e.g. NID_sha1 or NID_sha256
+ * @iterationCount number of times the owf is applied, at least 100
+ * @macNid NID of the MAC, e.g. NID_hmac_sha1 or NID_hmacWithSHA256
+ * returns pointer to CRMF_PBMPARAMETER on success, NULL on error
+ * ############################################################################ */
+CRMF_PBMPARAMETER * CRMF_pbm_new_ex(int owfNid, long iterationCount, int macNid)
 	{
 	CRMF_PBMPARAMETER *pbm=NULL;
 	unsigned char salt[SALT_LEN];
 
+	if (!pbm_owf_md(owfNid) || !pbm_mac_md(macNid))
+		{
+		CRMFerr(CRMF_F_CRMF_PBM_NEW_EX, CRMF_R_UNSUPPORTED_ALGORITHM);
+		goto err;
+		}
+	if (iterationCount < 100)
+		{
+		CRMFerr(CRMF_F_CRMF_PBM_NEW_EX, CRMF_R_ITERATIONCOUNT_BELOW_100);
+		goto err;
+		}
+
 	if(!(pbm = CRMF_PBMPARAMETER_new())) goto err;
 
 	/* salt contains a randomly generated value used in computing the key
@@ -100,8 +323,7 @@ CRMF_PBMPARAMETER * CRMF_pbm_new(void)
 	 * compute the key used in the MAC process.  All implementations MUST
 	 * support SHA-1.
 	 */
-	/* TODO right now SHA-1 is hardcoded */
-	X509_ALGOR_set0(pbm->owf, OBJ_nid2obj(NID_sha1), V_ASN1_UNDEF, NULL);
+	X509_ALGOR_set0(pbm->owf, OBJ_nid2obj(owfNid), V_ASN1_UNDEF, NULL);
 
 	/*
 	   iterationCount identifies the number of times the hash is applied
@@ -113,16 +335,14 @@ CRMF_PBMPARAMETER * CRMF_pbm_new(void)
 	   passwords.  Hashing is generally considered a cheap operation but
 	   this may not be true with all hash functions in the future.
 	   */
-	ASN1_INTEGER_set(pbm->iterationCount, ITERATION_COUNT);
+	ASN1_INTEGER_set(pbm->iterationCount, iterationCount);
 
 	/* mac identifies the algorithm and associated parameters of the MAC
 	   function to be used.  All implementations MUST support HMAC-SHA1
 	   [HMAC].	All implementations SHOULD support DES-MAC and Triple-
 	   DES-MAC [PKCS11].
 	   */
-	/* TODO right now HMAC-SHA1 is hardcoded */
-	/* X509_ALGOR_set0(mac, OBJ_nid2obj(NID_id_alg_dh_sig_hmac_sha1), V_ASN1_UNDEF, NULL); */
-	X509_ALGOR_set0(pbm->mac, OBJ_nid2obj(NID_hmac_sha1), V_ASN1_UNDEF, NULL);
+	X509_ALGOR_set0(pbm->mac, OBJ_nid2obj(macNid), V_ASN1_UNDEF, NULL);
 
 	return pbm;
 err:
@@ -142,6 +362,8 @@ err:
  *		pointing to NULL
  * @macLen pointer to the length of the mac, will be set
  *
+ * The base key derived from secret and salt is cached, see above.
+ *
  * returns 1 at success, 0 at error
  * ############################################################################ */
 int CRMF_passwordBasedMac_new( const CRMF_PBMPARAMETER *pbm,
@@ -150,48 +372,28 @@ int CRMF_passwordBasedMac_new( const CRMF_PBMPARAMETER *pbm,
 			   unsigned char** mac, unsigned int* macLen
 			   )
 	{
-	const EVP_MD *m=NULL;
+	const EVP_MD *m=NULL, *macMd=NULL;
 	EVP_MD_CTX *ctx=NULL;
 	unsigned char basekey[EVP_MAX_MD_SIZE];
 	unsigned int basekeyLen;
-	long iterations;
+	long iterations, i;
+	int owf;
 
 	if (!mac) goto err;
 	if( *mac) OPENSSL_free(*mac);
+	*mac = NULL;
 
 	if (!pbm) goto err;
 	if (!msg) goto err;
 	if (!secret) goto err;
 
-	*mac = OPENSSL_malloc(EVP_MAX_MD_SIZE);
-
-	OpenSSL_add_all_digests();
-
 	/*
 	 * owf identifies the algorithm and associated parameters used to
 	 * compute the key used in the MAC process.  All implementations MUST
 	 * support SHA-1.
 	 */
-	if (!(m = EVP_get_digestbyobj(pbm->owf->algorithm))) goto err;
-
-	ctx=EVP_MD_CTX_create();
-
-	/* compute the basekey of the salted secret */
-	if (!(EVP_DigestInit_ex(ctx, m, NULL))) goto err;
-	/* first the secret */
-	EVP_DigestUpdate(ctx, secret, secretLen);
-	/* then the salt */
-	EVP_DigestUpdate(ctx, pbm->salt->data, pbm->salt->length);
-	if (!(EVP_DigestFinal_ex(ctx, basekey, &basekeyLen))) goto err;
-
-	/* the first iteration is already done above -> -1 */
-	iterations = ASN1_INTEGER_get(pbm->iterationCount)-1;
-	while( iterations--)
-		{
-		if (!(EVP_DigestInit_ex(ctx, m, NULL))) goto err;
-		EVP_DigestUpdate(ctx, basekey, basekeyLen);
-		if (!(EVP_DigestFinal_ex(ctx, basekey, &basekeyLen))) goto err;
-		}
+	owf = OBJ_obj2nid(pbm->owf->algorithm);
+	if (!(m = pbm_owf_md(owf))) goto err;
 
 	/*
 	 * mac identifies the algorithm and associated parameters of the MAC
@@ -199,24 +401,55 @@ int CRMF_passwordBasedMac_new( const CRMF_PBMPARAMETER *pbm,
 	 * [HMAC].	All implementations SHOULD support DES-MAC and Triple-
 	 * DES-MAC [PKCS11].
 	 */
-	switch (OBJ_obj2nid(pbm->mac->algorithm))
+	if (!(macMd = pbm_mac_md(OBJ_obj2nid(pbm->mac->algorithm))))
 		{
-		case NID_hmac_sha1:
-			HMAC(EVP_sha1(), basekey, basekeyLen, msg, msgLen, *mac, macLen);
-			break;
-			/* optional TODO: DES-MAC, Triple DES-MAC */
-			/* which NIDs to use for these algorithms??? */
-		default:
-			CRMFerr(CRMF_F_CRMF_PASSWORDBASEDMAC_NEW, CRMF_R_UNSUPPORTED_ALGORITHM);
-			goto err;
+		CRMFerr(CRMF_F_CRMF_PASSWORDBASEDMAC_NEW, CRMF_R_UNSUPPORTED_ALGORITHM);
+		goto err;
 		}
 
+	iterations = ASN1_INTEGER_get(pbm->iterationCount);
+	if (iterations < 1) goto err;
+
+	if (!pbm_cache_get(secret, secretLen, pbm->salt, owf, iterations, basekey, &basekeyLen))
+		{
+		if (!(ctx = EVP_MD_CTX_create())) goto err;
+
+		/* compute the basekey of the salted secret */
+		if (!(EVP_DigestInit_ex(ctx, m, NULL))) goto err;
+		/* first the secret */
+		EVP_DigestUpdate(ctx, secret, secretLen);
+		/* then the salt */
+		EVP_DigestUpdate(ctx, pbm->salt->data, pbm->salt->length);
+		if (!(EVP_DigestFinal_ex(ctx, basekey, &basekeyLen))) goto err;
+
+		/* the first iteration is already done above -> -1 */
+		for (i = 1; i < iterations; i++)
+			{
+			if (!(EVP_DigestInit_ex(ctx, m, NULL))) goto err;
+			EVP_DigestUpdate(ctx, basekey, basekeyLen);
+			if (!(EVP_DigestFinal_ex(ctx, basekey, &basekeyLen))) goto err;
+			}
+
+		EVP_MD_CTX_destroy(ctx);
+		ctx = NULL;
+		pbm_cache_put(secret, secretLen, pbm->salt, owf, iterations, basekey, basekeyLen);
+		}
+
+	if (!(*mac = OPENSSL_malloc(EVP_MAX_MD_SIZE))) goto err;
+	if (!HMAC(macMd, basekey, basekeyLen, msg, msgLen, *mac, macLen)) goto err;
+
 	/* cleanup */
-	EVP_MD_CTX_destroy(ctx);
+	OPENSSL_cleanse(basekey, sizeof(basekey));
 
 	return 1;
 err:
-	if( mac && *mac) OPENSSL_free(*mac);
+	OPENSSL_cleanse(basekey, sizeof(basekey));
+	if (ctx) EVP_MD_CTX_destroy(ctx);
+	if( mac && *mac)
+		{
+		OPENSSL_free(*mac);
+		*mac = NULL;
+		}
 	CRMFerr(CRMF_F_CRMF_PASSWORDBASEDMAC_NEW, CRMF_R_CRMFERROR);
 	return 0;
 	}
@@ -167,7 +167,11 @@ static const char* const lock_names[CRYPTO_NUM_LOCKS] =
 	"comp",
 	"fips",
 	"fips2",
-#if CRYPTO_NUM_LOCKS != 41
+	"crmf_pbm",
+	"cmp_srvcert",
+	"cmp_init",
+	"cmp_http",
+#if CRYPTO_NUM_LOCKS != 45
 # error "Inconsistency between crypto.h and cryptlib.c"
 #endif
 	};
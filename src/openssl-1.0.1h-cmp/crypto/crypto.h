@@ -221,7 +221,11 @@ typedef struct openssl_item_st
 #define CRYPTO_LOCK_COMP		38
 #define CRYPTO_LOCK_FIPS		39
 #define CRYPTO_LOCK_FIPS2		40
-#define CRYPTO_NUM_LOCKS		41
+#define CRYPTO_LOCK_CRMF_PBM		41
+#define CRYPTO_LOCK_CMP_SRVCERT		42
+#define CRYPTO_LOCK_CMP_INIT		43
+#define CRYPTO_LOCK_CMP_HTTP		44
+#define CRYPTO_NUM_LOCKS		45
 
 #define CRYPTO_LOCK		1
 #define CRYPTO_UNLOCK		2
@@ -75,6 +75,9 @@
 #include <stdlib.h>
 #include <getopt.h>
 #include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/time.h>
 
 #include <openssl/asn1.h>
 #include <openssl/asn1t.h>
@@ -91,6 +94,7 @@
 
 #include <cmpclient.h>
 #include <cmpclient_help.h>
+#include <cmpclient_keypool.h>
 
 #define OPENSSL_LOAD_CONF     1
 
@@ -119,6 +123,14 @@ static char* opt_engine=NULL;
 static char* opt_extCertsOutDir=NULL;
 static char* opt_rootCerts=NULL;
 static char* opt_extraCertsIn=NULL;
+static char* opt_batchFile=NULL;
+static char* opt_revokeFile=NULL;
+static char* opt_crlOutFile=NULL;
+static int opt_threads=4;
+static char* opt_newKeyType=NULL;
+static int opt_keyPool=-1;
+static char* opt_pbmDigest=NULL;
+static int opt_pbmIterationCount=0;
 static int opt_hex=0;
 static int opt_proxy=0;
 static int opt_sequenceSet=0;
@@ -142,6 +154,8 @@ static X509 *srvCert=NULL;
 static ENGINE *engine=NULL;
 
 static STACK_OF(X509) *extraCerts = NULL;
+static X509_STORE *trustedStore = NULL;
+static X509_STORE *untrustedStore = NULL;
 
 /* ############################################################################ */
 /* ############################################################################ */
@@ -212,6 +226,8 @@ void printUsage( const char* cmdName) {
   printf("                       if file does not exist for IR, CR or KUR, this will be created with standard parameters\n");
   printf(" --newkeypass PASSWORD password of the client's new private key given in --newkey\n");
   printf("                       this is overwritten at KUR\n");
+  printf(" --newkeytype TYPE     type of the keys created for --newkey: rsa:BITS, dsa:BITS\n");
+  printf("                       or ec:CURVE, e.g. ec:prime256v1 (default rsa:1024)\n");
 /* XXX TODO: the following should be added */
 #if 0
   printf(" --newkeypass PASSWORD    password of the client's new private key given in --newkey\n");
@@ -219,6 +235,31 @@ void printUsage( const char* cmdName) {
   printf(" --extracert FILE      certificate that will be added to the extraCerts field\n");
   printf("                       when sending any PKIMessage.  Can be given multiple times\n");
   printf("                       in order to specify several certificates.\n");
+  printf(" --pbmdigest NAME      hash used for PasswordBasedMac protection: sha1 (default),\n");
+  printf("                       sha224, sha256, sha384 or sha512 (owf and HMAC)\n");
+  printf(" --pbmiter NUM         iterationCount for PasswordBasedMac protection (default 500)\n");
+  printf("\n");
+  printf("Bulk enrollment with the --ir CMD:\n");
+  printf(" --batch FILE          enroll all identities listed in FILE, one per line as\n");
+  printf("                       USER PASSWORD NEWKEY NEWCLCERT SUBJECT\n");
+  printf("                       --user, --password, --newkey, --newclcert and --subject\n");
+  printf("                       are taken from there; '#' starts a comment line\n");
+  printf(" --threads NUM         number of enrollments run in parallel (default 4)\n");
+  printf(" --newkeytype TYPE,... keys which have to be created are of these types in turn\n");
+  printf(" --keypool NUM         keep NUM keys of every --newkeytype pregenerated by background\n");
+  printf("                       threads (default twice --threads, 0 generates them on demand)\n");
+  printf("\n");
+  printf("Bulk revocation with the --rr CMD:\n");
+  printf(" --revoke FILE         revoke all certificates listed in FILE in a single rr instead\n");
+  printf("                       of --clcert, one per line as certificate FILE or as SERIAL\n");
+  printf("                       number (hex with 0x prefix) of a certificate issued by --srvcert.\n");
+  printf("                       The rr is protected with --clcert/--key or --user/--password.\n");
+  printf("                       The server may only accept the certificates issued to the\n");
+  printf("                       subject of --clcert, unless it is configured as an RA\n");
+  printf("\n");
+  printf("Optional options only for --genm currentcrl:\n");
+  printf(" --crlout FILE         save the base CRL received to FILE in DER format, and the\n");
+  printf("                       delta CRL, if the server sent one, to FILE.delta\n");
   printf("\n");
   printf("Optional options only for IR with the --ir CMD:\n");
   printf(" --capubs DIRECTORY the directory where received CA certificates will be saved\n");
@@ -310,6 +351,64 @@ err:
   return 0;
 }
 
+/* ############################################################################ */
+/* load key to be certificated from file or generate new if file is not there */
+/* the new key is taken from pool if given */
+/* returns NULL on error */
+/* ############################################################################ */
+EVP_PKEY *loadNewKey(const char *keyFile, KEYPOOL *pool) {
+  EVP_PKEY *newPkey=NULL;
+  FILE *key = fopen(keyFile, "r");
+
+  if (key != NULL) {
+    fclose(key);
+    printf("INFO: Using existing key file \"%s\"\n", keyFile);
+    if (opt_engine) {
+      if (!(newPkey = ENGINE_load_private_key (engine, keyFile, NULL, opt_newClKeyPass)))
+        printf("FATAL: could not read private key /w engine\n");
+    } else { // no engine specified reading private key from file
+      if(!(newPkey = HELP_readPrivKey(keyFile, opt_newClKeyPass)))
+        printf("FATAL: could not read private client key!\n");
+    }
+  } else {
+    /* generate new private key */
+    newPkey = pool ? KEYPOOL_get(pool) : HELP_generateKey(opt_newKeyType);
+    if (newPkey && !HELP_savePrivKey(newPkey, keyFile, opt_newClKeyPass)) {
+      printf("FATAL: could not save private client key to %s!\n", keyFile);
+      EVP_PKEY_free(newPkey);
+      newPkey = NULL;
+    }
+  }
+
+  return newPkey;
+}
+
+/* ############################################################################ */
+/* applies --pbmdigest and --pbmiter to the given context, returns 0 on error */
+/* ############################################################################ */
+static int setPbmOptions(CMP_CTX *cmp_ctx) {
+  if (opt_pbmDigest) {
+    const EVP_MD *md = EVP_get_digestbyname(opt_pbmDigest);
+    int macNid;
+
+    switch (md ? EVP_MD_type(md) : NID_undef) {
+      case NID_sha1:   macNid = NID_hmac_sha1; break;
+      case NID_sha224: macNid = NID_hmacWithSHA224; break;
+      case NID_sha256: macNid = NID_hmacWithSHA256; break;
+      case NID_sha384: macNid = NID_hmacWithSHA384; break;
+      case NID_sha512: macNid = NID_hmacWithSHA512; break;
+      default:
+        printf("ERROR: unsupported --pbmdigest %s\n", opt_pbmDigest);
+        return 0;
+    }
+    CMP_CTX_set_option( cmp_ctx, CMP_CTX_OPT_PBM_OWF, EVP_MD_type(md));
+    CMP_CTX_set_option( cmp_ctx, CMP_CTX_OPT_PBM_MAC, macNid);
+  }
+  if (opt_pbmIterationCount)
+    CMP_CTX_set_option( cmp_ctx, CMP_CTX_OPT_PBM_ITERATIONCOUNT, opt_pbmIterationCount);
+  return 1;
+}
+
 /* ############################################################################ */
 /* ############################################################################ */
 void doIr(CMP_CTX *cmp_ctx) {
@@ -355,29 +454,9 @@ void doIr(CMP_CTX *cmp_ctx) {
     CMP_CTX_set1_clCert( cmp_ctx, extIdCert);
   }
 
-/* TODO: make this a generic function and use for IR, CR and KUR */
-  /* load key to be certificated from file or generate new if file is not there*/
-  FILE *key = fopen(opt_newClKeyFile, "r");
-  if (key != NULL) {
-    fclose(key);
-    printf("INFO: Using existing key file \"%s\"\n", opt_newClKeyFile);
-    if (opt_engine) {
-      if (!(newPkey = ENGINE_load_private_key (engine, opt_newClKeyFile, NULL, opt_newClKeyPass))) {
-        printf("FATAL: could not read private key /w engine\n");
-        exit(1);
-      }
-    } else { // no engine specified reading private key from file
-      if(!(newPkey = HELP_readPrivKey(opt_newClKeyFile, opt_newClKeyPass))) {
-        printf("FATAL: could not read private client key!\n");
-        exit(1);
-      }
-    }
-  } else {
-    /* generate new private key */
-    newPkey = HELP_generateRSAKey();
-    /* newPkey = HELP_generateDSAKey(); */
-    HELP_savePrivKey(newPkey, opt_newClKeyFile, opt_newClKeyPass);
-  }
+/* TODO: use for CR and KUR as well */
+  if (!(newPkey = loadNewKey(opt_newClKeyFile, NULL)))
+    exit(1);
 
   CMP_CTX_set0_newPkey( cmp_ctx, newPkey);
 
@@ -416,26 +495,84 @@ void doIr(CMP_CTX *cmp_ctx) {
   return;
 }
 
+/* ############################################################################ */
+/* adds the certificates listed in fileName, one per line, to the ones to */
+/* revoke: either a certificate FILE or the SERIAL number, decimal or hex with */
+/* 0x prefix, of a certificate issued by the CA given with --srvcert */
+/* returns the number of certificates added, -1 on error */
+/* ############################################################################ */
+static int readRevokeFile(CMP_CTX *cmp_ctx, const char *fileName) {
+  FILE *fp;
+  char line[2048];
+  int num = 0, lineNo = 0;
+
+  if (!(fp = fopen(fileName, "r"))) {
+    printf("FATAL: could not open revocation file %s\n", fileName);
+    return -1;
+  }
+
+  while (fgets(line, sizeof(line), fp)) {
+    char *p = line;
+    BIGNUM *bn = NULL;
+    int ok = 0;
+
+    lineNo++;
+    line[strcspn(line, "\r\n")] = '\0';
+    p += strspn(p, " \t");
+    p[strcspn(p, " \t")] = '\0';
+    if (*p == '\0' || *p == '#') continue;
+
+    if (strncmp(p, "0x", 2) == 0 ? BN_hex2bn(&bn, p+2) == (int) strlen(p+2)
+                                 : BN_dec2bn(&bn, p) == (int) strlen(p)) {
+      ASN1_INTEGER *serial = BN_to_ASN1_INTEGER(bn, NULL);
+      if (!srvCert)
+        printf("FATAL: %s line %d: revoking by serial number needs --srvcert\n", fileName, lineNo);
+      else
+        ok = serial && CMP_CTX_revSerial_push1(cmp_ctx, X509_get_subject_name(srvCert), serial);
+      ASN1_INTEGER_free(serial);
+    } else {
+      X509 *cert = HELP_read_cert(p);
+      if (!cert)
+        printf("FATAL: %s line %d: could not read certificate %s\n", fileName, lineNo, p);
+      else
+        ok = CMP_CTX_revCert_push1(cmp_ctx, cert);
+      X509_free(cert);
+    }
+    BN_free(bn);
+
+    if (!ok) {
+      fclose(fp);
+      return -1;
+    }
+    num++;
+  }
+
+  fclose(fp);
+  return num;
+}
+
 /* ############################################################################ */
 /* ############################################################################ */
 void doRr(CMP_CTX *cmp_ctx) {
   EVP_PKEY *initialPkey=NULL; /* TODO: s/intitialPkey/pkey/ */
   X509 *initialClCert=NULL;   /* TODO: s/initialClCert/clCert/ */
+  int i, num = 0, accepted = 0;
 
   // ENGINE_load_private_key(e, path, NULL, "password"); 
 
-  if (opt_engine) {
+  /* without --clcert, the rr for --revoke is protected with --user/--password */
+  if (opt_clCertFile && opt_engine) {
     if (!(initialPkey = ENGINE_load_private_key (engine, opt_clKeyFile, NULL, opt_clKeyPass))) {
       printf("FATAL: could not read private key /w engine\n");
       exit(1);
     }
-  } else { // no engine specified reading private key from file
+  } else if (opt_clCertFile) { // no engine specified reading private key from file
     if(!(initialPkey = HELP_readPrivKey(opt_clKeyFile, opt_clKeyPass))) {
       printf("FATAL: could not read private client key!\n");
       exit(1);
     }
   }
-  if(!(initialClCert = HELP_read_cert(opt_clCertFile))) {
+  if(opt_clCertFile && !(initialClCert = HELP_read_cert(opt_clCertFile))) {
     printf("FATAL: could not read client certificate!\n");
     exit(1);
   }
@@ -443,12 +580,17 @@ void doRr(CMP_CTX *cmp_ctx) {
   CMP_CTX_set1_serverName( cmp_ctx, opt_serverName);
   CMP_CTX_set1_serverPath( cmp_ctx, opt_serverPath);
   CMP_CTX_set1_serverPort( cmp_ctx, opt_serverPort);
-  CMP_CTX_set0_pkey( cmp_ctx, initialPkey);
+  if (initialPkey)
+    CMP_CTX_set0_pkey( cmp_ctx, initialPkey);
   CMP_CTX_set1_srvCert( cmp_ctx, srvCert);
-  CMP_CTX_set1_clCert( cmp_ctx, initialClCert);
+  if (initialClCert)
+    CMP_CTX_set1_clCert( cmp_ctx, initialClCert);
   CMP_CTX_set1_referenceValue( cmp_ctx, idString, idStringLen);
   CMP_CTX_set1_secretValue( cmp_ctx, password, passwordLen);
 
+  if (opt_revokeFile && (num = readRevokeFile(cmp_ctx, opt_revokeFile)) < 0)
+    exit(1);
+
   if (opt_nExtraCerts > 0)
     CMP_CTX_set1_extraCertsOut( cmp_ctx, extraCerts);
 
@@ -456,7 +598,24 @@ void doRr(CMP_CTX *cmp_ctx) {
    * CMP_CTX_set_option( cmp_ctx, CMP_CTX_OPT_IMPLICITCONFIRM, CMP_CTX_OPT_SET);
    */
 
-  CMP_doRevocationRequestSeq( cmp_ctx);
+  if (!CMP_doRevocationRequestSeq( cmp_ctx)) {
+    printf( "ERROR: revocation request failed. FILE %s, LINE %d\n", __FILE__, __LINE__);
+    ERR_load_crypto_strings();
+    ERR_print_errors_fp(stderr);
+    exit(1);
+  }
+
+  if (num > 0) {
+    for (i = 0; i < num; i++) {
+      int status = CMP_CTX_revStatus_get(cmp_ctx, i);
+      if (status == CMP_PKISTATUS_accepted || status == CMP_PKISTATUS_grantedWithMods ||
+          status == CMP_PKISTATUS_revocationWarning || status == CMP_PKISTATUS_revocationNotification)
+        accepted++;
+      else
+        printf("REVOKE: entry %d not revoked (PKIStatus %d)\n", i+1, status);
+    }
+    printf("REVOKE: %d of %d certificates revoked\n", accepted, num);
+  }
 
   return;
 }
@@ -548,9 +707,8 @@ void doKur(CMP_CTX *cmp_ctx) {
     exit(1);
   }
 
-  /* generate RSA key */
-  updatedPkey = HELP_generateRSAKey();
-  /* updatedPkey = HELP_generateDSAKey(); */
+  /* generate new key */
+  if(!(updatedPkey = HELP_generateKey(opt_newKeyType))) exit(1);
   if(!HELP_savePrivKey( updatedPkey, opt_newClKeyFile, opt_newClKeyPass)) {
     printf("FATAL: could not save private client key!");
     exit(1);
@@ -613,6 +771,28 @@ void doInfo(CMP_CTX *cmp_ctx) {
   return;
 }
 
+/* ############################################################################ */
+/* writes crl in DER format to the file named file followed by suffix */
+/* ############################################################################ */
+static int writeCrl(X509_CRL *crl, const char *file, const char *suffix) {
+  char *name = malloc(strlen(file) + strlen(suffix) + 1);
+  BIO *bio = NULL;
+  int ok = 0;
+
+  if (!name) return 0;
+  sprintf(name, "%s%s", file, suffix);
+  printf("INFO: Saving CRL to File %s\n", name);
+
+  if (!(bio = BIO_new(BIO_s_file())) || !BIO_write_filename(bio, name))
+    printf("ERROR: could not open file \"%s\" for writing.\n", name);
+  else
+    ok = i2d_X509_CRL_bio(bio, crl);
+
+  BIO_free(bio);
+  free(name);
+  return ok;
+}
+
 /* ############################################################################ */
 /* ############################################################################ */
 void doGenM(CMP_CTX *cmp_ctx, int genm_type, void *value) {
@@ -640,15 +820,20 @@ void doGenM(CMP_CTX *cmp_ctx, int genm_type, void *value) {
 
       case NID_id_it_currentCRL:
         {
-          /* TODO write out the received CRL! */
-#if 0
-          X509_CRL *crl = (X509_CRL*) resp;
-          BIO  *bio;
-          bio=BIO_new(BIO_s_file());
-          BIO_write_filename(bio, "/tmp/crl.der");
-          i2d_X509_CRL_bio(bio, crl);
-          BIO_free(bio);
-#endif
+          /* the base CRL, possibly followed by a delta CRL */
+          int i, n = 0;
+          for (i = 0; i < sk_CMP_INFOTYPEANDVALUE_num(resp); i++) {
+            CMP_INFOTYPEANDVALUE *itav = sk_CMP_INFOTYPEANDVALUE_value(resp, i);
+            X509_CRL *crl;
+            int num;
+            if (OBJ_obj2nid(itav->infoType) != NID_id_it_currentCRL) continue;
+            if (!(crl = itav->infoValue.currentCRL)) continue;
+            /* an empty list of revoked certificates is left out */
+            if ((num = sk_X509_REVOKED_num(X509_CRL_get_REVOKED(crl))) < 0) num = 0;
+            printf("INFO: received %s CRL with %d entries\n",
+                   X509_CRL_get_ext_by_NID(crl, NID_delta_crl, -1) >= 0 ? "delta" : "base", num);
+            if (opt_crlOutFile && !writeCrl(crl, opt_crlOutFile, n++ > 0 ? ".delta" : "")) exit(1);
+          }
         }
         break;
 
@@ -666,6 +851,327 @@ void doGenM(CMP_CTX *cmp_ctx, int genm_type, void *value) {
   return;
 }
 
+/* ############################################################################ *
+ * Bulk enrollment
+ *
+ * The identities of a manifest are enrolled by a pool of threads. Each
+ * enrollment gets its own CMP_CTX, all of them share the server certificate
+ * and the trusted/untrusted stores loaded once by main().
+ * ############################################################################ */
+typedef struct {
+  char *user;
+  char *password;
+  char *newKeyFile;
+  char *newCertFile;
+  char *subject;
+  int ok;
+  double latency; /* ms */
+} BATCH_ENTRY;
+
+typedef struct {
+  BATCH_ENTRY *entries;
+  int num;
+  int next;
+  int done;
+  char *proxyName;
+  int proxyPort;
+  pthread_mutex_t lock;
+  /* settings shared by all entries, read-only once the workers run */
+  CMP_CTX *tmpl;
+  /* new keys, NULL if they are generated on demand */
+  KEYPOOL *keyPool;
+} BATCH;
+
+static pthread_mutex_t *sslLocks = NULL;
+
+static void sslLockCb(int mode, int n, const char *file, int line) {
+  if (mode & CRYPTO_LOCK)
+    pthread_mutex_lock(&sslLocks[n]);
+  else
+    pthread_mutex_unlock(&sslLocks[n]);
+}
+
+static void sslThreadIdCb(CRYPTO_THREADID *id) {
+  CRYPTO_THREADID_set_numeric(id, (unsigned long) pthread_self());
+}
+
+/* OpenSSL needs to be told how to lock before it is used by several threads */
+static void setupSslLocking(void) {
+  int i;
+
+  sslLocks = OPENSSL_malloc(CRYPTO_num_locks() * sizeof(pthread_mutex_t));
+  for (i = 0; i < CRYPTO_num_locks(); i++)
+    pthread_mutex_init(&sslLocks[i], NULL);
+  CRYPTO_THREADID_set_callback(sslThreadIdCb);
+  CRYPTO_set_locking_callback(sslLockCb);
+}
+
+static double elapsedMs(const struct timeval *start) {
+  struct timeval now;
+  gettimeofday(&now, NULL);
+  return (now.tv_sec - start->tv_sec) * 1000.0 + (now.tv_usec - start->tv_usec) / 1000.0;
+}
+
+/* ############################################################################ */
+/* returns the number of entries read, -1 on error */
+/* ############################################################################ */
+int readBatchFile(const char *fileName, BATCH_ENTRY **entries) {
+  FILE *fp;
+  char line[2048];
+  int num = 0, lineNo = 0;
+
+  *entries = NULL;
+  if (!(fp = fopen(fileName, "r"))) {
+    printf("FATAL: could not open batch file %s\n", fileName);
+    return -1;
+  }
+
+  while (fgets(line, sizeof(line), fp)) {
+    char *fields[5], *p = line;
+    int n;
+
+    lineNo++;
+    line[strcspn(line, "\r\n")] = '\0';
+    p += strspn(p, " \t");
+    if (*p == '\0' || *p == '#') continue;
+
+    /* the subject is the rest of the line, it may contain blanks */
+    for (n = 0; n < 5 && *p; n++) {
+      fields[n] = p;
+      if (n == 4) break;
+      p += strcspn(p, " \t");
+      if (*p) *p++ = '\0';
+      p += strspn(p, " \t");
+    }
+    if (n != 4) {
+      printf("FATAL: %s line %d: expected USER PASSWORD NEWKEY NEWCLCERT SUBJECT\n", fileName, lineNo);
+      fclose(fp);
+      return -1;
+    }
+
+    *entries = realloc(*entries, (num+1) * sizeof(BATCH_ENTRY));
+    memset(&(*entries)[num], 0, sizeof(BATCH_ENTRY));
+    (*entries)[num].user = strdup(fields[0]);
+    (*entries)[num].password = strdup(fields[1]);
+    (*entries)[num].newKeyFile = strdup(fields[2]);
+    (*entries)[num].newCertFile = strdup(fields[3]);
+    (*entries)[num].subject = strdup(fields[4]);
+    num++;
+  }
+
+  fclose(fp);
+  return num;
+}
+
+/* ############################################################################ */
+/* returns the template holding the settings shared by all IRs of a batch */
+/* ############################################################################ */
+static CMP_CTX *newBatchTemplate(BATCH *batch) {
+  CMP_CTX *tmpl;
+
+  if (!(tmpl = CMP_CTX_create())) return NULL;
+  if (!setPbmOptions(tmpl)) goto err;
+  CMP_CTX_set1_serverName( tmpl, opt_serverName);
+  CMP_CTX_set1_serverPath( tmpl, opt_serverPath);
+  CMP_CTX_set1_serverPort( tmpl, opt_serverPort);
+  if (batch->proxyName) {
+    CMP_CTX_set1_proxyName(tmpl, batch->proxyName);
+    CMP_CTX_set1_proxyPort(tmpl, batch->proxyPort);
+  }
+  if (srvCert)
+    CMP_CTX_set1_srvCert( tmpl, srvCert);
+  if (trustedStore)
+    CMP_CTX_set1_trustedStore( tmpl, trustedStore);
+  if (untrustedStore)
+    CMP_CTX_set1_untrustedStore( tmpl, untrustedStore);
+  CMP_CTX_set1_timeOut( tmpl, 60);
+  if (opt_recipient) {
+    X509_NAME *recipient = HELP_create_X509_NAME(opt_recipient);
+    CMP_CTX_set1_recipient( tmpl, recipient);
+    X509_NAME_free(recipient);
+  }
+  if (opt_nExtraCerts > 0)
+    CMP_CTX_set1_extraCertsOut( tmpl, extraCerts);
+
+  return tmpl;
+err:
+  CMP_CTX_delete(tmpl);
+  return NULL;
+}
+
+/* ############################################################################ */
+/* runs one IR, returns 1 if the new certificate was received and written */
+/* ############################################################################ */
+int doBatchIr(BATCH *batch, BATCH_ENTRY *entry) {
+  CMP_CTX *cmp_ctx = NULL;
+  EVP_PKEY *newPkey = NULL;
+  X509 *newClCert = NULL;
+  X509_NAME *subject = NULL;
+  unsigned char *user = NULL, *pass = NULL;
+  size_t userLen, passLen;
+  int ok = 0;
+
+  if (!(cmp_ctx = CMP_CTX_create_child(batch->tmpl))) {
+    printf("ERROR: could not create CMP_CTX\n");
+    goto err;
+  }
+
+  if (opt_hex) {
+    userLen = HELP_hex2str(entry->user, &user);
+    passLen = HELP_hex2str(entry->password, &pass);
+  } else {
+    userLen = strlen(entry->user);
+    user = (unsigned char*) entry->user;
+    passLen = strlen(entry->password);
+    pass = (unsigned char*) entry->password;
+  }
+  CMP_CTX_set1_referenceValue( cmp_ctx, user, userLen);
+  CMP_CTX_set1_secretValue( cmp_ctx, pass, passLen);
+  if (!(subject = HELP_create_X509_NAME(entry->subject))) {
+    printf("ERROR: could not parse subject \"%s\"\n", entry->subject);
+    goto err;
+  }
+  CMP_CTX_set1_subjectName( cmp_ctx, subject);
+
+  if (!(newPkey = loadNewKey(entry->newKeyFile, batch->keyPool))) goto err;
+  CMP_CTX_set0_newPkey( cmp_ctx, newPkey);
+
+  if (!(newClCert = CMP_doInitialRequestSeq( cmp_ctx))) {
+    ERR_print_errors_fp(stderr);
+    goto err;
+  }
+  if(!HELP_write_cert(newClCert, entry->newCertFile)) {
+    printf("ERROR: could not write new client certificate to %s!\n", entry->newCertFile);
+    goto err;
+  }
+  ok = 1;
+
+err:
+  if (opt_hex) {
+    free(user);
+    free(pass);
+  }
+  X509_NAME_free(subject);
+  CMP_CTX_delete(cmp_ctx);
+  ERR_clear_error();
+  return ok;
+}
+
+/* ############################################################################ */
+/* ############################################################################ */
+static void *batchWorker(void *arg) {
+  BATCH *batch = (BATCH*) arg;
+
+  while (1) {
+    BATCH_ENTRY *entry;
+    struct timeval start;
+    int done;
+
+    pthread_mutex_lock(&batch->lock);
+    if (batch->next == batch->num) {
+      pthread_mutex_unlock(&batch->lock);
+      break;
+    }
+    entry = &batch->entries[batch->next++];
+    pthread_mutex_unlock(&batch->lock);
+
+    gettimeofday(&start, NULL);
+    entry->ok = doBatchIr(batch, entry);
+    entry->latency = elapsedMs(&start);
+
+    pthread_mutex_lock(&batch->lock);
+    done = ++batch->done;
+    pthread_mutex_unlock(&batch->lock);
+    printf("BATCH: [%d/%d] %s %s %.1f ms\n", done, batch->num,
+        entry->ok ? "OK    " : "FAILED", entry->subject, entry->latency);
+  }
+
+  return NULL;
+}
+
+/* ############################################################################ */
+/* returns the number of failed enrollments */
+/* ############################################################################ */
+int doBatch(const char *fileName, int nThreads, char *proxyName, int proxyPort) {
+  BATCH batch;
+  pthread_t *threads;
+  struct timeval start;
+  double total, sum = 0, max = 0;
+  int i, failed = 0, demand = 0;
+
+  memset(&batch, 0, sizeof(batch));
+  batch.proxyName = proxyName;
+  batch.proxyPort = proxyPort;
+  if ((batch.num = readBatchFile(fileName, &batch.entries)) < 0)
+    exit(1);
+  if (batch.num == 0) {
+    printf("INFO: nothing to do in %s\n", fileName);
+    return 0;
+  }
+  if (nThreads > batch.num) nThreads = batch.num;
+
+  pthread_mutex_init(&batch.lock, NULL);
+  setupSslLocking();
+  if (!(batch.tmpl = newBatchTemplate(&batch))) {
+    printf("FATAL: could not create CMP context\n");
+    exit(1);
+  }
+  /* only the entries without a key file take keys out of the pool */
+  for (i = 0; i < batch.num; i++)
+    if (access(batch.entries[i].newKeyFile, F_OK) != 0) demand++;
+  if (opt_keyPool < 0) opt_keyPool = 2 * nThreads;
+  if (opt_keyPool > demand) opt_keyPool = demand;
+  if (opt_keyPool > 0) {
+    long nCpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (nCpus < 1) nCpus = 1;
+    printf("INFO: pregenerating up to %d keys of type %s with %ld threads\n",
+        opt_keyPool, opt_newKeyType, nCpus);
+    if (!(batch.keyPool = KEYPOOL_new(opt_newKeyType, opt_keyPool, demand, (int) nCpus))) {
+      printf("FATAL: could not create key pool\n");
+      exit(1);
+    }
+  }
+
+  printf("INFO: enrolling %d identities with %d threads\n", batch.num, nThreads);
+  gettimeofday(&start, NULL);
+
+  threads = malloc(nThreads * sizeof(pthread_t));
+  for (i = 0; i < nThreads; i++)
+    if (pthread_create(&threads[i], NULL, batchWorker, &batch) != 0) {
+      printf("FATAL: could not start thread %d\n", i);
+      exit(1);
+    }
+  for (i = 0; i < nThreads; i++)
+    pthread_join(threads[i], NULL);
+  free(threads);
+
+  total = elapsedMs(&start);
+  for (i = 0; i < batch.num; i++) {
+    BATCH_ENTRY *e = &batch.entries[i];
+    if (!e->ok) failed++;
+    sum += e->latency;
+    if (e->latency > max) max = e->latency;
+    free(e->user);
+    free(e->password);
+    free(e->newKeyFile);
+    free(e->newCertFile);
+    free(e->subject);
+  }
+  free(batch.entries);
+  CMP_CTX_delete(batch.tmpl);
+  if (batch.keyPool) {
+    printf("KEYPOOL: %d keys left, %d enrollments waited for key generation\n",
+        KEYPOOL_depth(batch.keyPool), KEYPOOL_waits(batch.keyPool));
+    KEYPOOL_free(batch.keyPool);
+  }
+
+  printf("BATCH: %d enrolled, %d failed in %.1f s, %.1f certs/s, latency avg %.1f ms, max %.1f ms\n",
+      batch.num - failed, failed, total / 1000.0, (batch.num - failed) * 1000.0 / total,
+      sum / batch.num, max);
+
+  return failed;
+}
+
 /* ############################################################################ */
 /* allocate appropriate space for CLI argument strings and copy them */
 /* ############################################################################ */
@@ -728,12 +1234,20 @@ void parseCLA( int argc, char **argv) {
     {"extcertsout",required_argument,  0, 'O'},
     {"rootcerts",required_argument,    0, 'T'},
     {"extcertsin ",required_argument,  0, 'N'},
+    {"batch",    required_argument,    0, 'B'},
+    {"threads",  required_argument,    0, 'H'},
+    {"pbmdigest",required_argument,    0, 'D'},
+    {"pbmiter",  required_argument,    0, 'K'},
+    {"newkeytype",required_argument,   0, 'Y'},
+    {"keypool",  required_argument,    0, 'Z'},
+    {"revoke",   required_argument,    0, 'W'},
+    {"crlout",   required_argument,    0, 'L'},
     {0, 0, 0, 0}
   };
 
   while (1)
   {
-    c = getopt_long (argc, argv, "a:b:cde:f:g:G:h:iIj:J:k:l:mno:O:p::P:rR:sS:tT:N:u:U:X:", long_options, &option_index);
+    c = getopt_long (argc, argv, "a:b:B:cdD:e:f:g:G:h:H:iIj:J:k:K:l:L:mno:O:p::P:rR:sS:tT:N:u:U:W:X:Y:Z:", long_options, &option_index);
 
     /* Detect the end of the options. */
     if (c == -1)
@@ -755,6 +1269,30 @@ void parseCLA( int argc, char **argv) {
         createOptStr( &opt_extraCertsIn);
         break;
 
+      case 'B':
+        createOptStr( &opt_batchFile);
+        break;
+
+      case 'H':
+        opt_threads = atoi(optarg);
+        if (opt_threads < 1) {
+          fprintf( stderr, "ERROR: --threads must be at least 1\n");
+          exit(1);
+        }
+        break;
+
+      case 'D':
+        createOptStr( &opt_pbmDigest);
+        break;
+
+      case 'K':
+        opt_pbmIterationCount = atoi(optarg);
+        if (opt_pbmIterationCount < 100) {
+          fprintf( stderr, "ERROR: --pbmiter must be at least 100\n");
+          exit(1);
+        }
+        break;
+
       case 'T':
         createOptStr( &opt_rootCerts);
         break;
@@ -823,7 +1361,7 @@ void parseCLA( int argc, char **argv) {
           if (!strcmp(genm_type, "ckuann")) {
             opt_doGenM = NID_id_it_caKeyUpdateInfo;
           }
-          else if (!strcmp(genm_type, "curcrl")) {
+          else if (!strcmp(genm_type, "currentcrl") || !strcmp(genm_type, "curcrl")) {
             opt_doGenM = NID_id_it_currentCRL;
           }
           else {
@@ -908,6 +1446,26 @@ void parseCLA( int argc, char **argv) {
         createOptStr( &opt_extCertsOutDir);
         break;
 
+      case 'Y':
+        createOptStr( &opt_newKeyType);
+        break;
+
+      case 'W':
+        createOptStr( &opt_revokeFile);
+        break;
+
+      case 'L':
+        createOptStr( &opt_crlOutFile);
+        break;
+
+      case 'Z':
+        opt_keyPool = atoi(optarg);
+        if (opt_keyPool < 0) {
+          fprintf( stderr, "ERROR: --keypool must not be negative\n");
+          exit(1);
+        }
+        break;
+
       case '?':
         /* getopt_long already printed an error message. */
         break;
@@ -950,7 +1508,16 @@ void parseCLA( int argc, char **argv) {
     }
   }
 
-  if( opt_doIr) {
+  if( opt_batchFile) {
+    if (!opt_doIr) {
+      printf("ERROR: --batch is only supported for IR\n\n");
+      printUsage( argv[0]);
+    }
+    if (!opt_srvCertFile && !opt_recipient) {
+      printf("ERROR: setting srvcert or recipient is mandatory for IR\n\n");
+      printUsage( argv[0]);
+    }
+  } else if( opt_doIr) {
     /* for IR, a mean for signing the CMP message has to be supplied */
     /* TODO ? in case both would be given, the user/password will be preferred */
     if (!((opt_user && opt_password) || (opt_clCertFile && opt_clKeyFile))) {
@@ -975,11 +1542,15 @@ void parseCLA( int argc, char **argv) {
       printf("ERROR: setting srvcert or recipient is mandatory for RR\n\n");
       printUsage( argv[0]);
     }
-    if (!(opt_clCertFile && opt_clKeyFile)) {
-      printf("ERROR: clcert and key is mandatory for RR\n\n");
+    if (!(opt_clCertFile && opt_clKeyFile) && !(opt_revokeFile && opt_user && opt_password)) {
+      printf("ERROR: clcert and key, or --revoke with user and password, is mandatory for RR\n\n");
       printUsage( argv[0]);
     }
   }
+  if (opt_revokeFile && !opt_doRr) {
+    printf("ERROR: --revoke is only supported for RR\n\n");
+    printUsage( argv[0]);
+  }
 
   if( opt_doInfo) {
     if (!(opt_user && opt_password )) {
@@ -995,7 +1566,21 @@ void parseCLA( int argc, char **argv) {
     }
   }
 
-  if( opt_doIr || opt_doKur) {
+  if (!opt_newKeyType)
+    opt_newKeyType = "rsa:1024";
+  if (!opt_batchFile) {
+    int id, param;
+    if (strchr(opt_newKeyType, ',')) {
+      printf("ERROR: several --newkeytype are only supported with --batch\n\n");
+      printUsage( argv[0]);
+    }
+    if (!HELP_parseKeyType(opt_newKeyType, &id, &param)) {
+      printf("ERROR: unsupported --newkeytype %s\n\n", opt_newKeyType);
+      printUsage( argv[0]);
+    }
+  }
+
+  if( (opt_doIr && !opt_batchFile) || opt_doKur) {
     /* for IR,CR,Kur a a place to store the new certificate and the location for the
      * (new) key and its password have to be supplied */
     if (!(opt_newClCertFile && opt_newClKeyFile)) {
@@ -1145,17 +1730,22 @@ int main(int argc, char **argv) {
     printf("FATAL: could not create CMP_CTX\n");
     exit(1);
   }
+  if (!setPbmOptions(cmp_ctx)) exit(1);
 
   /* TODO move the handling of all common options such as server ip, port etc. here */
 
   if (opt_rootCerts) {
-    X509_STORE *trusted_store = HELP_create_cert_store(opt_rootCerts);
-    CMP_CTX_set0_trustedStore(cmp_ctx, trusted_store);
+    trustedStore = HELP_create_cert_store(opt_rootCerts);
+    CMP_CTX_set1_trustedStore(cmp_ctx, trustedStore);
   }
 
   if (opt_extraCertsIn) {
-    X509_STORE *untrusted_store = HELP_create_cert_store(opt_extraCertsIn);
-    CMP_CTX_set0_untrustedStore(cmp_ctx, untrusted_store);
+    untrustedStore = HELP_create_cert_store(opt_extraCertsIn);
+    CMP_CTX_set1_untrustedStore(cmp_ctx, untrustedStore);
+  }
+
+  if( opt_batchFile) {
+    return doBatch(opt_batchFile, opt_threads, httpProxyName, httpProxyPort) ? 1 : 0;
   }
 
   if (opt_user && opt_password) {
@@ -160,6 +160,7 @@
 #include <cmpclient_help.h>
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include <openssl/bio.h>
@@ -167,6 +168,7 @@
 #include <openssl/pem.h>
 #include <openssl/rsa.h>
 #include <openssl/dsa.h>
+#include <openssl/ec.h>
 #include <openssl/x509.h>
 #include <openssl/x509v3.h>
 #include <openssl/err.h>
@@ -443,6 +445,78 @@ EVP_PKEY *HELP_generateRSAKey() {
 	return pkey;
 }
 
+/* ############################################################################ */
+/* parses a key type given as "rsa:BITS", "dsa:BITS" or "ec:CURVE", where CURVE */
+/* is the short name of a named curve, e.g. prime256v1 or secp384r1 */
+/* sets *id to the EVP_PKEY type and *param to the bits or the curve's NID */
+/* returns 0 on error */
+/* ############################################################################ */
+int HELP_parseKeyType(const char *type, int *id, int *param) {
+	const char *arg = strchr(type, ':');
+
+	if (!arg || !arg[1]) return 0;
+	arg++;
+	if (!strncmp(type, "rsa:", 4) || !strncmp(type, "dsa:", 4)) {
+		*id = type[0] == 'r' ? EVP_PKEY_RSA : EVP_PKEY_DSA;
+		*param = atoi(arg);
+		return *param >= 512;
+	}
+	if (!strncmp(type, "ec:", 3)) {
+		EC_GROUP *group;
+		*id = EVP_PKEY_EC;
+		if ((*param = OBJ_sn2nid(arg)) == NID_undef) return 0;
+		/* check that it is a curve and not just any object */
+		if (!(group = EC_GROUP_new_by_curve_name(*param))) return 0;
+		EC_GROUP_free(group);
+		return 1;
+	}
+	return 0;
+}
+
+/* ############################################################################ */
+/* generates a key of the given type, see HELP_parseKeyType() */
+/* returns NULL on error */
+/* ############################################################################ */
+EVP_PKEY *HELP_generateKey(const char *type) {
+	EVP_PKEY_CTX *ctx = NULL;
+	EVP_PKEY *params = NULL, *pkey = NULL;
+	int id, param;
+
+	if (!HELP_parseKeyType(type, &id, &param)) {
+		printf("ERROR: unsupported key type \"%s\"\n", type);
+		return NULL;
+	}
+
+	/* DSA and EC keys are generated from domain parameters, for DSA they are
+	 * generated for every key here, for EC they just name the curve */
+	if (id != EVP_PKEY_RSA) {
+		if (!(ctx = EVP_PKEY_CTX_new_id(id, NULL))) goto err;
+		if (EVP_PKEY_paramgen_init(ctx) <= 0) goto err;
+		if (id == EVP_PKEY_DSA && EVP_PKEY_CTX_set_dsa_paramgen_bits(ctx, param) <= 0) goto err;
+		if (id == EVP_PKEY_EC && EVP_PKEY_CTX_set_ec_paramgen_curve_nid(ctx, param) <= 0) goto err;
+		if (EVP_PKEY_paramgen(ctx, &params) <= 0) goto err;
+		EVP_PKEY_CTX_free(ctx);
+		if (!(ctx = EVP_PKEY_CTX_new(params, NULL))) goto err;
+	} else if (!(ctx = EVP_PKEY_CTX_new_id(id, NULL))) goto err;
+
+	if (EVP_PKEY_keygen_init(ctx) <= 0) goto err;
+	if (id == EVP_PKEY_RSA && EVP_PKEY_CTX_set_rsa_keygen_bits(ctx, param) <= 0) goto err;
+	if (EVP_PKEY_keygen(ctx, &pkey) <= 0) goto err;
+
+	/* identify the curve by its OID in the certificate, not by its parameters */
+	if (id == EVP_PKEY_EC)
+		EC_KEY_set_asn1_flag(pkey->pkey.ec, OPENSSL_EC_NAMED_CURVE);
+
+err:
+	if (!pkey) {
+		printf("ERROR: generating %s key.\n", type);
+		ERR_print_errors_fp(stderr);
+	}
+	EVP_PKEY_CTX_free(ctx);
+	EVP_PKEY_free(params);
+	return pkey;
+}
+
 /* ############################################################################ */
 /* returns 0 on error */
 /* ############################################################################ */
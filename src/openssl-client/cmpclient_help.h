@@ -188,6 +188,8 @@ int HELP_write_der_cert( X509 *cert, const char *file);
 int HELP_write_cert( X509 *cert, const char *filename);
 EVP_PKEY *HELP_generateRSAKey();
 EVP_PKEY *HELP_generateDSAKey();
+int HELP_parseKeyType(const char *type, int *id, int *param);
+EVP_PKEY *HELP_generateKey(const char *type);
 int HELP_savePrivKey(EVP_PKEY *pkey, const char *filename, const char *password);
 EVP_PKEY *HELP_readPrivKey(const char *filename, const char *password);
 X509_NAME* HELP_create_X509_NAME(char *string);
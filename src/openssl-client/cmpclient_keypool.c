@@ -0,0 +1,265 @@
+/* vim: set ts=2 sts=2 sw=2 expandtab: */
+/* cmpclient_keypool.c
+ * Pool of key pairs pregenerated in the background for cmpclient
+ */
+
+/* ====================================================================
+ * Copyright 2007-2010 Nokia Siemens Networks Oy. ALL RIGHTS RESERVED.
+ * CMP support in OpenSSL originally developed by
+ * Nokia Siemens Networks for contribution to the OpenSSL project.
+ */
+
+/* ############################################################################ *
+ * Generating an RSA key of 2048 bits or more takes hundreds of milliseconds,
+ * longer than a whole enrollment with a local CA. For bulk enrollment, keys
+ * are therefore generated by background threads while the enrollments run.
+ *
+ * The pool holds keys of one or more types, e.g. "rsa:2048,ec:prime256v1",
+ * see HELP_parseKeyType(). The generator threads keep up to SIZE keys of
+ * every type ready; whenever a key is taken out, the type is refilled to
+ * this watermark, the type with the fewest keys first. KEYPOOL_get() hands
+ * out the types in turn and only blocks if the pool has run dry, which is
+ * counted by KEYPOOL_waits().
+ *
+ * If the number of keys the batch will take is known, the pool never holds
+ * more than are still wanted of a type, so towards the end of the batch it
+ * runs down instead of generating keys nobody takes, and KEYPOOL_free() has
+ * no generations left to wait for.
+ *
+ * The generator threads use OpenSSL concurrently, so the locking callbacks
+ * have to be set before KEYPOOL_new() is called.
+ * ############################################################################ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include <openssl/evp.h>
+
+#include <cmpclient_help.h>
+#include <cmpclient_keypool.h>
+
+typedef struct {
+  char *name;
+  /* keys ready to be handed out, used as a stack */
+  EVP_PKEY **keys;
+  int num;
+  /* keys currently being generated */
+  int pending;
+  /* keys which will still be taken out, -1 if unknown */
+  int wanted;
+  /* set if generating a key of this type failed, the type is not refilled
+   * any more */
+  int failed;
+} KEYPOOL_TYPE;
+
+struct keypool_st {
+  KEYPOOL_TYPE *types;
+  int numTypes;
+  int size;
+  /* the type handed out next */
+  int next;
+  /* number of KEYPOOL_get() calls which found the pool empty */
+  int waits;
+  int stop;
+  /* protects everything above, need is signalled when a key was taken out,
+   * ready when one was added or a type failed */
+  pthread_mutex_t lock;
+  pthread_cond_t need;
+  pthread_cond_t ready;
+  pthread_t *threads;
+  int numThreads;
+};
+
+/* ############################################################################ */
+/* returns the type which is furthest below the watermark, NULL if all are full */
+/* called with pool->lock held */
+/* ############################################################################ */
+static KEYPOOL_TYPE *typeToFill(KEYPOOL *pool) {
+  KEYPOOL_TYPE *type = NULL;
+  int i;
+
+  for (i = 0; i < pool->numTypes; i++) {
+    KEYPOOL_TYPE *t = &pool->types[i];
+    if (t->failed || t->num + t->pending >= pool->size) continue;
+    if (t->wanted >= 0 && t->num + t->pending >= t->wanted) continue;
+    if (!type || t->num + t->pending < type->num + type->pending)
+      type = t;
+  }
+  return type;
+}
+
+/* ############################################################################ */
+/* ############################################################################ */
+static void *generator(void *arg) {
+  KEYPOOL *pool = (KEYPOOL*) arg;
+  KEYPOOL_TYPE *type;
+  EVP_PKEY *pkey;
+
+  pthread_mutex_lock(&pool->lock);
+  while (!pool->stop) {
+    if (!(type = typeToFill(pool))) {
+      pthread_cond_wait(&pool->need, &pool->lock);
+      continue;
+    }
+    type->pending++;
+    pthread_mutex_unlock(&pool->lock);
+
+    pkey = HELP_generateKey(type->name);
+
+    pthread_mutex_lock(&pool->lock);
+    type->pending--;
+    if (pkey)
+      type->keys[type->num++] = pkey;
+    else
+      type->failed = 1;
+    pthread_cond_broadcast(&pool->ready);
+  }
+  pthread_mutex_unlock(&pool->lock);
+
+  return NULL;
+}
+
+/* ############################################################################ */
+/* creates a pool for the comma separated list of key types and starts */
+/* nThreads generator threads filling it with size keys of each type. demand */
+/* is the number of keys that will be taken out in total, 0 if unknown */
+/* returns NULL on error, e.g. if one of the types is not supported */
+/* ############################################################################ */
+KEYPOOL *KEYPOOL_new(const char *types, int size, int demand, int nThreads) {
+  KEYPOOL *pool;
+  char *list, *name, *save = NULL;
+  int id, param, i;
+
+  if (size < 1 || nThreads < 1) return NULL;
+  if (!(pool = calloc(1, sizeof(KEYPOOL)))) return NULL;
+  pool->size = size;
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->need, NULL);
+  pthread_cond_init(&pool->ready, NULL);
+
+  if (!(list = strdup(types))) goto err;
+  for (name = strtok_r(list, ",", &save); name; name = strtok_r(NULL, ",", &save)) {
+    KEYPOOL_TYPE *t;
+    if (!HELP_parseKeyType(name, &id, &param)) {
+      printf("ERROR: unsupported key type \"%s\"\n", name);
+      free(list);
+      goto err;
+    }
+    pool->types = realloc(pool->types, (pool->numTypes + 1) * sizeof(KEYPOOL_TYPE));
+    t = &pool->types[pool->numTypes++];
+    memset(t, 0, sizeof(KEYPOOL_TYPE));
+    t->name = strdup(name);
+    t->keys = calloc(size, sizeof(EVP_PKEY*));
+  }
+  free(list);
+  if (pool->numTypes == 0) goto err;
+
+  /* KEYPOOL_get() hands out the types in turn, starting with the first */
+  for (i = 0; i < pool->numTypes; i++)
+    pool->types[i].wanted = demand > 0 ?
+        demand / pool->numTypes + (i < demand % pool->numTypes) : -1;
+
+  pool->threads = calloc(nThreads, sizeof(pthread_t));
+  for (i = 0; i < nThreads; i++) {
+    if (pthread_create(&pool->threads[i], NULL, generator, pool) != 0) break;
+    pool->numThreads++;
+  }
+  if (pool->numThreads == 0) goto err;
+
+  return pool;
+
+err:
+  KEYPOOL_free(pool);
+  return NULL;
+}
+
+/* ############################################################################ */
+/* takes the next key out of the pool, waiting for it to be generated if the */
+/* pool ran dry. The caller owns the returned key. */
+/* returns NULL if keys of the type due cannot be generated */
+/* ############################################################################ */
+EVP_PKEY *KEYPOOL_get(KEYPOOL *pool) {
+  KEYPOOL_TYPE *type;
+  EVP_PKEY *pkey = NULL;
+
+  pthread_mutex_lock(&pool->lock);
+  type = &pool->types[pool->next];
+  pool->next = (pool->next + 1) % pool->numTypes;
+  if (type->num == 0) {
+    pool->waits++;
+    /* more keys are taken than announced, generate them on demand */
+    if (type->wanted == 0) {
+      type->wanted = 1;
+      pthread_cond_signal(&pool->need);
+    }
+  }
+  while (type->num == 0 && !type->failed)
+    pthread_cond_wait(&pool->ready, &pool->lock);
+  if (type->num > 0) {
+    pkey = type->keys[--type->num];
+    if (type->wanted > 0) type->wanted--;
+    pthread_cond_signal(&pool->need);
+  }
+  pthread_mutex_unlock(&pool->lock);
+
+  return pkey;
+}
+
+/* ############################################################################ */
+/* returns the number of keys ready to be handed out */
+/* ############################################################################ */
+int KEYPOOL_depth(KEYPOOL *pool) {
+  int i, depth = 0;
+
+  pthread_mutex_lock(&pool->lock);
+  for (i = 0; i < pool->numTypes; i++)
+    depth += pool->types[i].num;
+  pthread_mutex_unlock(&pool->lock);
+
+  return depth;
+}
+
+/* ############################################################################ */
+/* returns how often KEYPOOL_get() had to wait for a key to be generated */
+/* ############################################################################ */
+int KEYPOOL_waits(KEYPOOL *pool) {
+  int waits;
+
+  pthread_mutex_lock(&pool->lock);
+  waits = pool->waits;
+  pthread_mutex_unlock(&pool->lock);
+
+  return waits;
+}
+
+/* ############################################################################ */
+/* stops the generator threads, waiting for keys in progress, and frees the */
+/* pool including the keys not handed out */
+/* ############################################################################ */
+void KEYPOOL_free(KEYPOOL *pool) {
+  int i, j;
+
+  if (!pool) return;
+
+  pthread_mutex_lock(&pool->lock);
+  pool->stop = 1;
+  pthread_cond_broadcast(&pool->need);
+  pthread_mutex_unlock(&pool->lock);
+  for (i = 0; i < pool->numThreads; i++)
+    pthread_join(pool->threads[i], NULL);
+  free(pool->threads);
+
+  for (i = 0; i < pool->numTypes; i++) {
+    for (j = 0; j < pool->types[i].num; j++)
+      EVP_PKEY_free(pool->types[i].keys[j]);
+    free(pool->types[i].keys);
+    free(pool->types[i].name);
+  }
+  free(pool->types);
+  pthread_cond_destroy(&pool->ready);
+  pthread_cond_destroy(&pool->need);
+  pthread_mutex_destroy(&pool->lock);
+  free(pool);
+}
@@ -0,0 +1,25 @@
+/* vim: set ts=2 sts=2 sw=2 expandtab: */
+/* cmpclient_keypool.h
+ * Pool of key pairs pregenerated in the background for cmpclient
+ */
+
+/* ====================================================================
+ * Copyright 2007-2010 Nokia Siemens Networks Oy. ALL RIGHTS RESERVED.
+ * CMP support in OpenSSL originally developed by
+ * Nokia Siemens Networks for contribution to the OpenSSL project.
+ */
+
+#ifndef CMPCLIENT_KEYPOOL_H
+#define CMPCLIENT_KEYPOOL_H
+
+#include <openssl/evp.h>
+
+typedef struct keypool_st KEYPOOL;
+
+KEYPOOL *KEYPOOL_new(const char *types, int size, int demand, int nThreads);
+EVP_PKEY *KEYPOOL_get(KEYPOOL *pool);
+int KEYPOOL_depth(KEYPOOL *pool);
+int KEYPOOL_waits(KEYPOOL *pool);
+void KEYPOOL_free(KEYPOOL *pool);
+
+#endif /* CMPCLIENT_KEYPOOL_H */
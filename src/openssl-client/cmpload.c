@@ -0,0 +1,748 @@
+/* vim: set ts=2 sts=2 sw=2 expandtab: */
+/* cmpload.c
+ * Load generator for CMP responders, e.g. lighttpd's mod_cmpsrv
+ */
+
+/* ====================================================================
+ * Copyright 2007-2010 Nokia Siemens Networks Oy. ALL RIGHTS RESERVED.
+ * CMP support in OpenSSL originally developed by
+ * Nokia Siemens Networks for contribution to the OpenSSL project.
+ */
+
+/* ############################################################################ *
+ * cmpload runs a mix of IR, CR, KUR, RR and GENM transactions against a CMP
+ * server with a fixed number of threads, each keeping exactly one transaction
+ * in flight. For every transaction type it reports the number of
+ * transactions per second, the 50th and 99th percentile and the maximum of
+ * the latency and the client CPU time spent per transaction. If the PID of
+ * the server is given, the server's CPU time per transaction is reported as
+ * well (read from /proc, so only on Linux).
+ *
+ * Before the measurement starts, every thread enrolls an identity with a PBM
+ * protected IR. Signature protected transactions, CR, KUR and RR use this
+ * identity; a KUR replaces it by the updated one, after an RR it is enrolled
+ * again. KUR and RR are always signature protected, as the server only
+ * accepts them from the holder of the certificate. New keys for IR and KUR are taken round-robin from a pool generated
+ * at startup, so key generation is not part of the measurement.
+ *
+ * pollReq is exercised by starting the server with cmpsrv.pollDelay set; the
+ * latencies of IR, CR and KUR then include the polling.
+ *
+ * With --phases, the library's metrics callback is used to break the latency
+ * of the successful transactions down into building, protecting and encoding
+ * the messages, connecting, the TLS handshake, waiting for the server,
+ * decoding and validating the responses.
+ * ############################################################################ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <getopt.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#include <openssl/x509.h>
+#include <openssl/err.h>
+#include <openssl/cmp.h>
+#include <openssl/rsa.h>
+
+#include <cmpclient_help.h>
+
+/* set by CLA */
+static char* opt_serverName="127.0.0.1";
+static int   opt_serverPort=8080;
+static char* opt_serverPath="";
+static char* opt_srvCertFile=NULL;
+static char* opt_rootCerts=NULL;
+static char* opt_user=NULL;
+static char* opt_password=NULL;
+static char* opt_mix="ir";
+static int   opt_sig=0;
+static int   opt_threads=4;
+static int   opt_count=0;
+static int   opt_duration=0;
+static int   opt_keys=8;
+static int   opt_keyBits=2048;
+static int   opt_srvPid=0;
+static int   opt_verbose=0;
+static int   opt_phases=0;
+/* used by cmpclient_help.c */
+int opt_pem=0;
+
+static X509 *srvCert=NULL;
+static X509_STORE *trustedStore=NULL;
+
+/* ############################################################################ */
+/* ############################################################################ */
+typedef struct {
+  const char *name;
+  int bodyType;
+  int weight;
+  /* results, protected by LOAD.lock */
+  double *latency; /* ms */
+  int num;
+  int max;
+  int failed;
+  double cpu; /* ms of client CPU time */
+  /* sums over the successful transactions, protected by phasesLock */
+  CMP_METRICS phases;
+  int phasesNum;
+} LOAD_TYPE;
+
+static LOAD_TYPE loadTypes[] = {
+  { "ir",   V_CMP_PKIBODY_IR },
+  { "cr",   V_CMP_PKIBODY_CR },
+  { "kur",  V_CMP_PKIBODY_KUR },
+  { "rr",   V_CMP_PKIBODY_RR },
+  { "genm", V_CMP_PKIBODY_GENM },
+};
+#define NUM_LOAD_TYPES (int) (sizeof(loadTypes)/sizeof(loadTypes[0]))
+
+static pthread_mutex_t phasesLock = PTHREAD_MUTEX_INITIALIZER;
+
+typedef struct {
+  int weightSum;
+  /* transactions started so far, and the limits set by --count / --duration */
+  int started;
+  struct timeval start;
+  struct timeval end;
+  pthread_mutex_t lock;
+  /* settings shared by all transactions, read-only once the workers run */
+  CMP_CTX *tmpl;
+  EVP_PKEY **keys;
+  int numKeys;
+  int nextKey;
+} LOAD;
+
+/* the identity a worker uses for signature protection, CR, KUR and RR */
+typedef struct {
+  LOAD *load;
+  int id;
+  int serial; /* number of subjects used so far */
+  unsigned int seed;
+  EVP_PKEY *pkey;
+  X509 *cert;
+} WORKER;
+
+/* ############################################################################ */
+/* ############################################################################ */
+void printUsage( const char* cmdName) {
+  printf("Usage: %s [OPTIONS]\n", cmdName);
+  printf("Generate load on a CMP server and report latency, throughput and CPU usage\n");
+  printf("\n");
+  printf(" --server SERVER    the IP address of the CMP server (default 127.0.0.1)\n");
+  printf(" --port PORT        the port of the CMP server (default 8080)\n");
+  printf(" --path PATH        the path location inside the HTTP CMP server\n");
+  printf(" --srvcert FILE     location of the CMP server's certificate\n");
+  printf(" --rootcerts DIR    directory of trusted certificates, instead of --srvcert\n");
+  printf(" --user USER        the user (reference) for PBM protection\n");
+  printf(" --password PASS    the password (secret) for PBM protection\n");
+  printf("\n");
+  printf(" --mix MIX          the transactions to run and their weights, e.g.\n");
+  printf("                    \"ir=40,cr=10,kur=20,rr=10,genm=20\" (default \"ir\")\n");
+  printf(" --protection PROT  \"pbm\" (default) or \"sig\" to protect the\n");
+  printf("                    messages with the enrolled identities. KUR and RR\n");
+  printf("                    are always signed\n");
+  printf(" --threads NUM      the number of transactions in flight (default 4)\n");
+  printf(" --count NUM        the number of transactions to run\n");
+  printf(" --duration SEC     run for this many seconds (default 10 if no --count)\n");
+  printf(" --keys NUM         the number of pregenerated keys (default 8)\n");
+  printf(" --keybits NUM      the size of the pregenerated RSA keys (default 2048)\n");
+  printf(" --srvpid PID       the server process, to report its CPU time per transaction\n");
+  printf(" --phases           break the latency down into the phases of the transactions\n");
+  printf(" --verbose          print every failed transaction's errors\n");
+  printf("\n");
+  printf("pollReq is exercised by setting cmpsrv.pollDelay in the server's config.\n");
+}
+
+/* ############################################################################ */
+/* ############################################################################ */
+void parseCLA( int argc, char **argv) {
+  int c;
+  int option_index = 0;
+
+  static struct option long_options[] =
+  {
+    {"server",    required_argument, 0, 'a'},
+    {"port",      required_argument, 0, 'b'},
+    {"path",      required_argument, 0, 'o'},
+    {"srvcert",   required_argument, 0, 'g'},
+    {"rootcerts", required_argument, 0, 'T'},
+    {"user",      required_argument, 0, 'e'},
+    {"password",  required_argument, 0, 'f'},
+    {"mix",       required_argument, 0, 'm'},
+    {"protection",required_argument, 0, 'P'},
+    {"threads",   required_argument, 0, 'H'},
+    {"count",     required_argument, 0, 'n'},
+    {"duration",  required_argument, 0, 'd'},
+    {"keys",      required_argument, 0, 'k'},
+    {"keybits",   required_argument, 0, 'K'},
+    {"srvpid",    required_argument, 0, 's'},
+    {"phases",    no_argument,       0, 'p'},
+    {"verbose",   no_argument,       0, 'v'},
+    {"help",      no_argument,       0, 'h'},
+    {0, 0, 0, 0}
+  };
+
+  while ((c = getopt_long (argc, argv, "a:b:d:e:f:g:hH:k:K:m:n:o:pP:s:T:v", long_options, &option_index)) != -1)
+  {
+    switch (c)
+    {
+      case 'a': opt_serverName = optarg; break;
+      case 'b': opt_serverPort = atoi(optarg); break;
+      case 'o': opt_serverPath = optarg; break;
+      case 'g': opt_srvCertFile = optarg; break;
+      case 'T': opt_rootCerts = optarg; break;
+      case 'e': opt_user = optarg; break;
+      case 'f': opt_password = optarg; break;
+      case 'm': opt_mix = optarg; break;
+      case 'P':
+        if (!strcmp(optarg, "sig"))
+          opt_sig = 1;
+        else if (!strcmp(optarg, "pbm"))
+          opt_sig = 0;
+        else {
+          fprintf( stderr, "ERROR: --protection must be \"pbm\" or \"sig\"\n");
+          exit(1);
+        }
+        break;
+      case 'H': opt_threads = atoi(optarg); break;
+      case 'n': opt_count = atoi(optarg); break;
+      case 'd': opt_duration = atoi(optarg); break;
+      case 'k': opt_keys = atoi(optarg); break;
+      case 'K': opt_keyBits = atoi(optarg); break;
+      case 's': opt_srvPid = atoi(optarg); break;
+      case 'p': opt_phases = 1; break;
+      case 'v': opt_verbose = 1; break;
+      case 'h':
+        printUsage( argv[0]);
+        exit(0);
+      default:
+        printUsage( argv[0]);
+        exit(1);
+    }
+  }
+
+  if (opt_threads < 1 || opt_keys < 1 || opt_count < 0 || opt_duration < 0) {
+    fprintf( stderr, "ERROR: --threads and --keys must be at least 1\n");
+    exit(1);
+  }
+  if (!opt_user || !opt_password) {
+    fprintf( stderr, "ERROR: --user and --password are needed to enroll the identities\n");
+    exit(1);
+  }
+  if (!opt_srvCertFile && !opt_rootCerts) {
+    fprintf( stderr, "ERROR: one of --srvcert and --rootcerts is needed\n");
+    exit(1);
+  }
+  if (opt_count == 0 && opt_duration == 0)
+    opt_duration = 10;
+}
+
+/* ############################################################################ */
+/* parses "type=weight,..." into loadTypes, returns the sum of the weights */
+/* ############################################################################ */
+static int parseMix(const char *mix) {
+  char *buf = strdup(mix), *tok, *save = NULL;
+  int sum = 0, i;
+
+  for (tok = strtok_r(buf, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+    char *eq = strchr(tok, '=');
+    int weight = 1;
+
+    if (eq) {
+      *eq = '\0';
+      weight = atoi(eq+1);
+    }
+    for (i = 0; i < NUM_LOAD_TYPES; i++)
+      if (!strcmp(tok, loadTypes[i].name)) break;
+    if (i == NUM_LOAD_TYPES || weight < 0) {
+      fprintf( stderr, "ERROR: invalid --mix entry \"%s\"\n", tok);
+      exit(1);
+    }
+    loadTypes[i].weight = weight;
+    sum += weight;
+  }
+  free(buf);
+
+  if (sum == 0) {
+    fprintf( stderr, "ERROR: --mix selects no transactions\n");
+    exit(1);
+  }
+  return sum;
+}
+
+/* ############################################################################ */
+/* ############################################################################ */
+static pthread_mutex_t *sslLocks = NULL;
+
+static void sslLockCb(int mode, int n, const char *file, int line) {
+  if (mode & CRYPTO_LOCK)
+    pthread_mutex_lock(&sslLocks[n]);
+  else
+    pthread_mutex_unlock(&sslLocks[n]);
+}
+
+static void sslThreadIdCb(CRYPTO_THREADID *id) {
+  CRYPTO_THREADID_set_numeric(id, (unsigned long) pthread_self());
+}
+
+static void setupSslLocking(void) {
+  int i;
+
+  sslLocks = OPENSSL_malloc(CRYPTO_num_locks() * sizeof(pthread_mutex_t));
+  for (i = 0; i < CRYPTO_num_locks(); i++)
+    pthread_mutex_init(&sslLocks[i], NULL);
+  CRYPTO_THREADID_set_callback(sslThreadIdCb);
+  CRYPTO_set_locking_callback(sslLockCb);
+}
+
+static double elapsedMs(const struct timeval *start, const struct timeval *end) {
+  return (end->tv_sec - start->tv_sec) * 1000.0 + (end->tv_usec - start->tv_usec) / 1000.0;
+}
+
+static double threadCpuMs(void) {
+  struct timespec ts;
+  if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) != 0) return 0;
+  return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+/* returns the CPU time used by process pid in ms, -1 if it can't be read */
+static double procCpuMs(int pid) {
+  char path[64], buf[1024], *p;
+  unsigned long utime, stime;
+  FILE *fp;
+  size_t n;
+
+  snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+  if (!(fp = fopen(path, "r"))) return -1;
+  n = fread(buf, 1, sizeof(buf)-1, fp);
+  fclose(fp);
+  buf[n] = '\0';
+
+  /* the command name may contain blanks, the fields after it don't */
+  if (!(p = strrchr(buf, ')'))) return -1;
+  if (sscanf(p+1, " %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime, &stime) != 2)
+    return -1;
+  return (utime + stime) * 1000.0 / sysconf(_SC_CLK_TCK);
+}
+
+static EVP_PKEY *generateKey(int bits) {
+  EVP_PKEY *pkey = EVP_PKEY_new();
+  RSA *rsa = RSA_new();
+  BIGNUM *e = BN_new();
+
+  if (!pkey || !rsa || !e || !BN_set_word(e, RSA_F4) ||
+      !RSA_generate_key_ex(rsa, bits, e, NULL) || !EVP_PKEY_assign_RSA(pkey, rsa)) {
+    EVP_PKEY_free(pkey);
+    RSA_free(rsa);
+    pkey = NULL;
+  }
+  BN_free(e);
+  return pkey;
+}
+
+/* ############################################################################ */
+/* returns the template holding the settings shared by all transactions */
+/* ############################################################################ */
+static CMP_CTX *newTemplate(void) {
+  CMP_CTX *tmpl;
+
+  if (!(tmpl = CMP_CTX_create())) return NULL;
+  CMP_CTX_set1_serverName( tmpl, opt_serverName);
+  CMP_CTX_set1_serverPath( tmpl, opt_serverPath);
+  CMP_CTX_set1_serverPort( tmpl, opt_serverPort);
+  if (srvCert)
+    CMP_CTX_set1_srvCert( tmpl, srvCert);
+  if (trustedStore)
+    CMP_CTX_set1_trustedStore( tmpl, trustedStore);
+  CMP_CTX_set1_timeOut( tmpl, 60);
+
+  return tmpl;
+}
+
+/* ############################################################################ */
+/* returns a context for one transaction of worker w */
+/* ############################################################################ */
+static CMP_CTX *newCtx(LOAD *load, WORKER *w, int pbm) {
+  CMP_CTX *cmp_ctx;
+
+  if (!(cmp_ctx = CMP_CTX_create_child(load->tmpl))) return NULL;
+
+  if (pbm) {
+    CMP_CTX_set1_referenceValue( cmp_ctx, (unsigned char*) opt_user, strlen(opt_user));
+    CMP_CTX_set1_secretValue( cmp_ctx, (unsigned char*) opt_password, strlen(opt_password));
+  }
+  if (w->cert) {
+    CMP_CTX_set1_pkey( cmp_ctx, w->pkey);
+    CMP_CTX_set1_clCert( cmp_ctx, w->cert);
+  }
+
+  return cmp_ctx;
+}
+
+static EVP_PKEY *nextKey(LOAD *load) {
+  EVP_PKEY *pkey;
+
+  pthread_mutex_lock(&load->lock);
+  pkey = load->keys[load->nextKey++ % load->numKeys];
+  pthread_mutex_unlock(&load->lock);
+  return pkey;
+}
+
+static int setSubject(CMP_CTX *cmp_ctx, WORKER *w) {
+  char subject[64];
+  X509_NAME *name;
+
+  /* the server may look up certificates by subject, so it must not repeat
+   * across runs either */
+  snprintf(subject, sizeof(subject), "CN=cmpload %ld.%d.%d", (long) getpid(), w->id, w->serial++);
+  if (!(name = HELP_create_X509_NAME(subject))) return 0;
+  CMP_CTX_set1_subjectName( cmp_ctx, name);
+  X509_NAME_free(name);
+  return 1;
+}
+
+/* takes over the key and a copy of the certificate as the worker's identity */
+static int setIdentity(WORKER *w, EVP_PKEY *pkey, X509 *cert) {
+  X509 *dup = X509_dup(cert);
+
+  if (!dup) return 0;
+  X509_free(w->cert);
+  EVP_PKEY_free(w->pkey);
+  w->cert = dup;
+  CRYPTO_add(&pkey->references, 1, CRYPTO_LOCK_EVP_PKEY);
+  w->pkey = pkey;
+  return 1;
+}
+
+/* ############################################################################ */
+/* enrolls a new identity for the worker with a PBM protected IR */
+/* ############################################################################ */
+static int enroll(WORKER *w) {
+  CMP_CTX *cmp_ctx;
+  EVP_PKEY *pkey = nextKey(w->load);
+  X509 *cert;
+  int ok = 0;
+
+  X509_free(w->cert);
+  w->cert = NULL;
+  if (!(cmp_ctx = newCtx(w->load, w, 1))) return 0;
+  if (!setSubject(cmp_ctx, w)) goto err;
+  CMP_CTX_set1_newPkey( cmp_ctx, pkey);
+  if ((cert = CMP_doInitialRequestSeq( cmp_ctx)))
+    ok = setIdentity(w, pkey, cert);
+
+err:
+  if (!ok && opt_verbose) ERR_print_errors_fp(stderr);
+  CMP_CTX_delete(cmp_ctx);
+  ERR_clear_error();
+  return ok;
+}
+
+/* ############################################################################ */
+/* adds up the metrics of the successful transactions per type, for --phases */
+/* ############################################################################ */
+static void metricsCb(const CMP_CTX *ctx, const CMP_METRICS *m) {
+  int i;
+
+  if (m->type != CMP_METRICS_TRANSACTION || !m->ok) return;
+
+  pthread_mutex_lock(&phasesLock);
+  for (i = 0; i < NUM_LOAD_TYPES; i++) {
+    CMP_METRICS *sum = &loadTypes[i].phases;
+
+    if (loadTypes[i].bodyType != m->bodyType) continue;
+    sum->messages += m->messages;
+    sum->polls += m->polls;
+    sum->construct += m->construct;
+    sum->protect += m->protect;
+    sum->encode += m->encode;
+    sum->connect += m->connect;
+    sum->tlsHandshake += m->tlsHandshake;
+    sum->serverWait += m->serverWait;
+    sum->decode += m->decode;
+    sum->validate += m->validate;
+    sum->bytesSent += m->bytesSent;
+    sum->bytesReceived += m->bytesReceived;
+    loadTypes[i].phasesNum++;
+  }
+  pthread_mutex_unlock(&phasesLock);
+}
+
+/* ############################################################################ */
+/* runs one transaction of the given type, returns 1 on success */
+/* ############################################################################ */
+static int runTransaction(WORKER *w, LOAD_TYPE *t) {
+  CMP_CTX *cmp_ctx;
+  EVP_PKEY *newPkey = NULL;
+  X509 *cert = NULL;
+  int ok = 0;
+  int pbm = !opt_sig && t->bodyType != V_CMP_PKIBODY_KUR && t->bodyType != V_CMP_PKIBODY_RR;
+
+  if (!(cmp_ctx = newCtx(w->load, w, pbm))) return 0;
+  if (opt_phases)
+    CMP_CTX_set_metrics_callback( cmp_ctx, metricsCb);
+
+  switch (t->bodyType) {
+    case V_CMP_PKIBODY_IR:
+      if (!setSubject(cmp_ctx, w)) break;
+      CMP_CTX_set1_newPkey( cmp_ctx, nextKey(w->load));
+      ok = CMP_doInitialRequestSeq( cmp_ctx) != NULL;
+      break;
+
+    case V_CMP_PKIBODY_CR:
+      /* a new subject, otherwise the identity's name would belong to two
+       * certificates and the server's lookup by name becomes ambiguous */
+      if (!setSubject(cmp_ctx, w)) break;
+      ok = CMP_doCertificateRequestSeq( cmp_ctx) != NULL;
+      break;
+
+    case V_CMP_PKIBODY_KUR:
+      newPkey = nextKey(w->load);
+      CMP_CTX_set1_newPkey( cmp_ctx, newPkey);
+      if ((cert = CMP_doKeyUpdateRequestSeq( cmp_ctx)))
+        ok = setIdentity(w, newPkey, cert);
+      break;
+
+    case V_CMP_PKIBODY_RR:
+      /* returns the PKIStatus + 1, a rejection is no error to the library */
+      {
+        int status = CMP_doRevocationRequestSeq( cmp_ctx);
+        ok = status && status != CMP_PKISTATUS_rejection + 1;
+      }
+      break;
+
+    case V_CMP_PKIBODY_GENM:
+      {
+        /* the cheapest request mod_cmpsrv answers */
+        STACK_OF(CMP_INFOTYPEANDVALUE) *itavs = CMP_doGeneralMessageSeq( cmp_ctx, NID_id_it_currentCRL, NULL);
+        if (itavs) {
+          sk_CMP_INFOTYPEANDVALUE_pop_free(itavs, CMP_INFOTYPEANDVALUE_free);
+          ok = 1;
+        }
+      }
+      break;
+  }
+
+  if (!ok && opt_verbose) {
+    fprintf(stderr, "ERROR: %s failed\n", t->name);
+    ERR_print_errors_fp(stderr);
+  }
+  CMP_CTX_delete(cmp_ctx);
+  ERR_clear_error();
+  return ok;
+}
+
+/* ############################################################################ */
+/* ############################################################################ */
+static LOAD_TYPE *pickType(LOAD *load, WORKER *w) {
+  int r = rand_r(&w->seed) % load->weightSum, i;
+
+  for (i = 0; i < NUM_LOAD_TYPES - 1; i++) {
+    if (r < loadTypes[i].weight) break;
+    r -= loadTypes[i].weight;
+  }
+  return &loadTypes[i];
+}
+
+static void record(LOAD *load, LOAD_TYPE *t, int ok, double latency, double cpu) {
+  pthread_mutex_lock(&load->lock);
+  if (ok) {
+    if (t->num == t->max) {
+      t->max = t->max ? 2*t->max : 1024;
+      t->latency = realloc(t->latency, t->max * sizeof(double));
+    }
+    t->latency[t->num++] = latency;
+    t->cpu += cpu;
+  } else
+    t->failed++;
+  pthread_mutex_unlock(&load->lock);
+}
+
+static void *loadWorker(void *arg) {
+  WORKER *w = (WORKER*) arg;
+  LOAD *load = w->load;
+
+  while (1) {
+    struct timeval start, end;
+    double cpu;
+    LOAD_TYPE *t;
+    int ok;
+
+    pthread_mutex_lock(&load->lock);
+    gettimeofday(&start, NULL);
+    if (opt_count ? load->started == opt_count : elapsedMs(&load->end, &start) >= 0) {
+      pthread_mutex_unlock(&load->lock);
+      break;
+    }
+    load->started++;
+    pthread_mutex_unlock(&load->lock);
+
+    t = pickType(load, w);
+    cpu = threadCpuMs();
+    ok = runTransaction(w, t);
+    cpu = threadCpuMs() - cpu;
+    gettimeofday(&end, NULL);
+    record(load, t, ok, elapsedMs(&start, &end), cpu);
+
+    /* the server may have revoked the identity, get a fresh one */
+    if (t->bodyType == V_CMP_PKIBODY_RR && !enroll(w)) {
+      fprintf(stderr, "ERROR: worker %d could not enroll a new identity\n", w->id);
+      break;
+    }
+  }
+
+  return NULL;
+}
+
+static int cmpDouble(const void *a, const void *b) {
+  double x = *(const double*) a, y = *(const double*) b;
+  return x < y ? -1 : x > y;
+}
+
+static double percentile(const double *sorted, int num, int p) {
+  int i = (num * p + 99) / 100 - 1;
+  return num == 0 ? 0 : sorted[i < 0 ? 0 : i];
+}
+
+/* ############################################################################ */
+/* ############################################################################ */
+int main(int argc, char **argv) {
+  LOAD load;
+  WORKER *workers;
+  pthread_t *threads;
+  struct timeval end;
+  struct rusage usage;
+  double total, srvCpu = -1, cpuTotal = 0;
+  int i, num = 0, failed = 0;
+
+  parseCLA(argc, argv);
+
+  memset(&load, 0, sizeof(load));
+  load.weightSum = parseMix(opt_mix);
+  pthread_mutex_init(&load.lock, NULL);
+  setupSslLocking();
+  ERR_load_crypto_strings();
+
+  if (opt_srvCertFile && !(srvCert = HELP_read_cert(opt_srvCertFile))) {
+    printf("FATAL: could not read server certificate!\n");
+    exit(1);
+  }
+  if (opt_rootCerts)
+    trustedStore = HELP_create_cert_store(opt_rootCerts);
+  if (!(load.tmpl = newTemplate())) {
+    printf("FATAL: could not create CMP context\n");
+    exit(1);
+  }
+
+  printf("INFO: generating %d RSA keys of %d bits\n", opt_keys, opt_keyBits);
+  load.numKeys = opt_keys;
+  load.keys = malloc(opt_keys * sizeof(EVP_PKEY*));
+  for (i = 0; i < opt_keys; i++)
+    if (!(load.keys[i] = generateKey(opt_keyBits))) {
+      printf("FATAL: could not generate key\n");
+      exit(1);
+    }
+
+  printf("INFO: enrolling %d identities\n", opt_threads);
+  workers = calloc(opt_threads, sizeof(WORKER));
+  for (i = 0; i < opt_threads; i++) {
+    workers[i].load = &load;
+    workers[i].id = i;
+    workers[i].seed = (unsigned int) (i + 1) * 2654435761U;
+    if (!enroll(&workers[i])) {
+      printf("FATAL: could not enroll identity %d\n", i);
+      ERR_print_errors_fp(stderr);
+      exit(1);
+    }
+  }
+
+  if (opt_count)
+    printf("INFO: running %d transactions with %d threads, mix %s, %s protection\n",
+        opt_count, opt_threads, opt_mix, opt_sig ? "signature" : "PBM");
+  else
+    printf("INFO: running for %d s with %d threads, mix %s, %s protection\n",
+        opt_duration, opt_threads, opt_mix, opt_sig ? "signature" : "PBM");
+
+  if (opt_srvPid && (srvCpu = procCpuMs(opt_srvPid)) < 0)
+    printf("WARNING: could not read the CPU time of process %d\n", opt_srvPid);
+  gettimeofday(&load.start, NULL);
+  load.end = load.start;
+  load.end.tv_sec += opt_duration;
+
+  threads = malloc(opt_threads * sizeof(pthread_t));
+  for (i = 0; i < opt_threads; i++)
+    if (pthread_create(&threads[i], NULL, loadWorker, &workers[i]) != 0) {
+      printf("FATAL: could not start thread %d\n", i);
+      exit(1);
+    }
+  for (i = 0; i < opt_threads; i++)
+    pthread_join(threads[i], NULL);
+  free(threads);
+
+  gettimeofday(&end, NULL);
+  total = elapsedMs(&load.start, &end) / 1000.0;
+  if (srvCpu >= 0) {
+    double now = procCpuMs(opt_srvPid);
+    srvCpu = now >= 0 ? now - srvCpu : -1;
+  }
+
+  printf("\n%-6s %8s %7s %9s %9s %9s %9s %11s\n",
+      "type", "count", "failed", "tps", "p50 ms", "p99 ms", "max ms", "cpu ms/txn");
+  for (i = 0; i < NUM_LOAD_TYPES; i++) {
+    LOAD_TYPE *t = &loadTypes[i];
+
+    if (t->weight == 0) continue;
+    qsort(t->latency, t->num, sizeof(double), cmpDouble);
+    printf("%-6s %8d %7d %9.1f %9.2f %9.2f %9.2f %11.2f\n", t->name, t->num, t->failed,
+        t->num / total, percentile(t->latency, t->num, 50), percentile(t->latency, t->num, 99),
+        t->num ? t->latency[t->num-1] : 0, t->num ? t->cpu / t->num : 0);
+    num += t->num;
+    failed += t->failed;
+    cpuTotal += t->cpu;
+    free(t->latency);
+  }
+  printf("%-6s %8d %7d %9.1f %29s %11.2f\n", "total", num, failed, num / total, "",
+      num ? cpuTotal / num : 0);
+
+  if (opt_phases) {
+    printf("\n%-6s %7s %7s %7s %7s %7s %7s %7s %7s %5s %5s %8s %8s\n", "ms/txn", "build",
+        "protect", "encode", "connect", "tls", "server", "decode", "verify",
+        "msgs", "polls", "B sent", "B rcvd");
+    for (i = 0; i < NUM_LOAD_TYPES; i++) {
+      LOAD_TYPE *t = &loadTypes[i];
+      CMP_METRICS *m = &t->phases;
+      double n = t->phasesNum;
+
+      if (t->phasesNum == 0) continue;
+      printf("%-6s %7.2f %7.2f %7.2f %7.2f %7.2f %7.2f %7.2f %7.2f %5.1f %5.1f %8.0f %8.0f\n",
+          t->name, m->construct / n / 1000, m->protect / n / 1000, m->encode / n / 1000,
+          m->connect / n / 1000, m->tlsHandshake / n / 1000, m->serverWait / n / 1000,
+          m->decode / n / 1000, m->validate / n / 1000, m->messages / n, m->polls / n,
+          m->bytesSent / n, m->bytesReceived / n);
+    }
+  }
+
+  getrusage(RUSAGE_SELF, &usage);
+  printf("\nINFO: %.2f s, client process CPU %.2f s\n", total,
+      usage.ru_utime.tv_sec + usage.ru_stime.tv_sec + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6);
+  if (srvCpu >= 0)
+    printf("INFO: server CPU %.2f s, %.2f ms/txn\n", srvCpu / 1000.0, num + failed ? srvCpu / (num + failed) : 0);
+
+  for (i = 0; i < opt_threads; i++) {
+    X509_free(workers[i].cert);
+    EVP_PKEY_free(workers[i].pkey);
+  }
+  free(workers);
+  for (i = 0; i < opt_keys; i++)
+    EVP_PKEY_free(load.keys[i]);
+  free(load.keys);
+  CMP_CTX_delete(load.tmpl);
+  X509_free(srvCert);
+
+  return failed ? 1 : 0;
+}